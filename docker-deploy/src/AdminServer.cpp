@@ -0,0 +1,111 @@
+#include "AdminServer.h"
+#include "CoarseClock.h"
+#include "Listener.h"
+#include "Metrics.h"
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <cerrno>
+
+AdminServer::AdminServer(int port, std::function<std::string()> extra_metrics)
+    : listening_sockfd(-1), port(port), stopping(false), extra_metrics(extra_metrics) {
+    listening_sockfd = create_listening_socket(port, false);
+    if (listen(listening_sockfd, 16) < 0) {
+        close(listening_sockfd);
+        throw std::runtime_error("Failed to listen on admin port");
+    }
+
+    sockaddr_in address;
+    socklen_t length = sizeof(address);
+    if (getsockname(listening_sockfd, (sockaddr*)&address, &length) == 0) {
+        this->port = ntohs(address.sin_port);
+    }
+}
+
+AdminServer::~AdminServer() {
+    stop();
+    close(listening_sockfd);
+}
+
+void AdminServer::start() {
+    server_thread = std::thread(&AdminServer::serve, this);
+}
+
+void AdminServer::stop() {
+    stopping = true;
+    shutdown(listening_sockfd, SHUT_RDWR); //makes a blocked accept() return
+    if (server_thread.joinable()) {
+        server_thread.join();
+    }
+}
+
+int AdminServer::get_port() const {
+    return port;
+}
+
+void AdminServer::serve() {
+    while (!stopping) {
+        int sockfd = accept(listening_sockfd, nullptr, nullptr);
+        if (sockfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break; //shut down
+        }
+        handle_connection(sockfd);
+        close(sockfd);
+    }
+}
+
+void AdminServer::handle_connection(int sockfd) {
+    //a scraper that never finishes its request mustn't hold the only admin thread
+    struct timeval tv = {2, 0};
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    std::string head;
+    char buffer[1024];
+    while (head.find("\r\n\r\n") == std::string::npos && head.length() < 8192) {
+        int bytes_read = recv(sockfd, buffer, sizeof(buffer), 0);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            return;
+        }
+        head.append(buffer, bytes_read);
+    }
+
+    std::string response = respond(head);
+    //not RequestHandler::reliable_send, that would count the scrape as proxied bytes
+    size_t sent = 0;
+    while (sent < response.length()) {
+        ssize_t res = send(sockfd, response.data() + sent, response.length() - sent, MSG_NOSIGNAL);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            return;
+        }
+        sent += res;
+    }
+}
+
+std::string AdminServer::respond(const std::string& request_head) const {
+    std::string request_line = request_head.substr(0, request_head.find("\r\n"));
+    std::string date = CoarseClock::get_instance().http_date().str();
+
+    if (request_line.compare(0, 13, "GET /metrics ") != 0 && request_line.compare(0, 13, "GET /metrics?") != 0) {
+        std::string body = "Not found, try GET /metrics\n";
+        return "HTTP/1.1 404 Not Found\r\nDate: " + date + "\r\nContent-Type: text/plain\r\nContent-Length: " +
+               std::to_string(body.length()) + "\r\nConnection: close\r\n\r\n" + body;
+    }
+
+    std::string body = Metrics::to_prometheus(Metrics::collect());
+    if (extra_metrics) {
+        body += extra_metrics();
+    }
+    return "HTTP/1.1 200 OK\r\nDate: " + date + "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+           std::to_string(body.length()) + "\r\nConnection: close\r\n\r\n" + body;
+}
@@ -0,0 +1,35 @@
+#ifndef ADMIN_SERVER_H
+#define ADMIN_SERVER_H
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+//serves GET /metrics (Prometheus text format) on its own port, away from proxied traffic.
+//One thread answers one scrape at a time, each on a connection of its own (Connection: close)
+class AdminServer {
+private:
+    int listening_sockfd;
+    int port;
+    std::thread server_thread;
+    std::atomic<bool> stopping;
+    std::function<std::string()> extra_metrics; //appended to Metrics' own, e.g. cache sizes
+
+    void serve();
+    void handle_connection(int sockfd);
+
+public:
+    //binds port (0 = any free port), throws std::runtime_error if it can't
+    AdminServer(int port, std::function<std::string()> extra_metrics);
+    ~AdminServer();
+
+    void start();
+    void stop(); //safe to call more than once
+    int get_port() const; //the bound port, useful with 0
+
+    //the full response for a request head
+    std::string respond(const std::string& request_head) const;
+};
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+//fixed-capacity lock-free multi-producer multi-consumer queue (Dmitry Vyukov's bounded MPMC design).
+//every slot carries a sequence number telling producers/consumers whether it is free or filled
+//for their lap around the ring, so push/pop are a single CAS on the tail/head index.
+//capacity is rounded up to a power of two.
+template <typename T>
+class BoundedQueue {
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    size_t mask;
+    std::unique_ptr<Slot[]> slots;
+
+    //producers and consumers hammer different indices, keep them on separate cache lines
+    alignas(64) std::atomic<size_t> tail; //next position to push
+    alignas(64) std::atomic<size_t> head; //next position to pop
+
+    static size_t round_up_pow2(size_t n) {
+        size_t result = 1;
+        while (result < n) {
+            result <<= 1;
+        }
+        return result;
+    }
+
+public:
+    explicit BoundedQueue(size_t capacity) : mask(round_up_pow2(capacity < 2 ? 2 : capacity) - 1), slots(new Slot[mask + 1]), tail(0), head(0) {
+        for (size_t i = 0; i <= mask; i++) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    //returns false if the queue is full (value is left untouched)
+    bool try_push(T& value) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots[pos & mask];
+            size_t seq = slot.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+            if (diff == 0) { //slot free for this lap, try to claim it
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.value = std::move(value);
+                    slot.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) { //consumer hasn't freed this slot yet, queue is full
+                return false;
+            } else { //another producer got here first
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    //returns false if the queue is empty
+    bool try_pop(T& out) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots[pos & mask];
+            size_t seq = slot.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+            if (diff == 0) { //slot filled for this lap, try to claim it
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    out = std::move(slot.value);
+                    slot.value = T();
+                    slot.sequence.store(pos + mask + 1, std::memory_order_release); //free for the producer's next lap
+                    return true;
+                }
+            } else if (diff < 0) { //producer hasn't filled this slot yet, queue is empty
+                return false;
+            } else { //another consumer got here first
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    size_t capacity() const {
+        return mask + 1;
+    }
+};
+
+#endif
@@ -0,0 +1,181 @@
+#include "CacheControl.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+
+//delta-seconds = 1*DIGIT, too big a value counts as "forever". Anything else is not a number, -2
+static long parse_seconds(const char* begin, const char* end) {
+    if (begin < end && *begin == '"' && end[-1] == '"' && end - begin >= 2) { //max-age="60" is seen in the wild
+        begin++;
+        end--;
+    }
+    if (begin == end) {
+        return -2;
+    }
+    long value = 0;
+    for (const char* p = begin; p < end; p++) {
+        if (*p < '0' || *p > '9') {
+            return -2;
+        }
+        value = value > 0x7fffffffL / 10 ? 0x7fffffffL : std::min(value * 10 + (*p - '0'), 0x7fffffffL);
+    }
+    return value;
+}
+
+static bool directive_is(const char* begin, const char* end, const char* name) {
+    size_t length = strlen(name);
+    return (size_t)(end - begin) == length && strncasecmp(begin, name, length) == 0;
+}
+
+//Cache-Control = #( token [ "=" ( token / quoted-string ) ] ), directives are case-insensitive.
+//an invalid number for max-age or s-maxage is treated as 0 (stale) rather than ignored
+static void parse_directives(const std::string& value, CacheControl& cc) {
+    const char* p = value.c_str();
+    const char* end = p + value.length();
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        const char* name = p;
+        while (p < end && *p != '=' && *p != ',' && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        const char* name_end = p;
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        const char* arg = p;
+        const char* arg_end = p;
+        if (p < end && *p == '=') {
+            p++;
+            while (p < end && (*p == ' ' || *p == '\t')) {
+                p++;
+            }
+            arg = p;
+            if (p < end && *p == '"') { //quoted-string, may hold commas (no-cache="Set-Cookie, Foo")
+                p++;
+                while (p < end && *p != '"') {
+                    p++;
+                }
+                if (p < end) {
+                    p++;
+                }
+            } else {
+                while (p < end && *p != ',' && *p != ' ' && *p != '\t') {
+                    p++;
+                }
+            }
+            arg_end = p;
+        }
+        while (p < end && *p != ',') { //skip junk up to the next directive
+            p++;
+        }
+        if (name == name_end) {
+            continue;
+        }
+
+        if (directive_is(name, name_end, "max-age")) {
+            long seconds = parse_seconds(arg, arg_end);
+            cc.max_age = seconds < 0 ? 0 : seconds;
+        } else if (directive_is(name, name_end, "s-maxage")) {
+            long seconds = parse_seconds(arg, arg_end);
+            cc.s_maxage = seconds < 0 ? 0 : seconds;
+        } else if (directive_is(name, name_end, "stale-while-revalidate")) {
+            cc.stale_while_revalidate = std::max(parse_seconds(arg, arg_end), -1L);
+        } else if (directive_is(name, name_end, "stale-if-error")) {
+            cc.stale_if_error = std::max(parse_seconds(arg, arg_end), -1L);
+        } else if (directive_is(name, name_end, "no-store")) {
+            cc.no_store = true;
+        } else if (directive_is(name, name_end, "no-cache")) {
+            //no-cache="field" only forbids reusing those fields, we don't strip fields so treat it like plain no-cache
+            cc.no_cache = true;
+        } else if (directive_is(name, name_end, "private")) {
+            cc.is_private = true;
+        } else if (directive_is(name, name_end, "must-revalidate")) {
+            cc.must_revalidate = true;
+        } else if (directive_is(name, name_end, "proxy-revalidate")) {
+            cc.proxy_revalidate = true;
+        }
+    }
+}
+
+CacheControl CacheControl::parse(const std::unordered_map<std::string, std::string>& headers) {
+    CacheControl cc;
+    bool has_cache_control = false;
+    bool pragma_no_cache = false;
+    //one pass over the fields, the map is keyed by the name as the origin spelled it
+    for (const auto& header : headers) {
+        const std::string& name = header.first;
+        const std::string& value = header.second;
+        if (strcasecmp(name.c_str(), "Cache-Control") == 0) {
+            parse_directives(value, cc);
+            has_cache_control = true;
+        } else if (strcasecmp(name.c_str(), "Pragma") == 0) {
+            pragma_no_cache = strcasestr(value.c_str(), "no-cache") != nullptr;
+        } else if (strcasecmp(name.c_str(), "Expires") == 0) {
+            cc.expires = parse_http_date(value);
+            cc.expires_invalid = cc.expires == -1;
+        } else if (strcasecmp(name.c_str(), "Date") == 0) {
+            cc.date = parse_http_date(value);
+        } else if (strcasecmp(name.c_str(), "Age") == 0) {
+            long seconds = parse_seconds(value.data(), value.data() + value.length());
+            cc.age = seconds < 0 ? -1 : seconds;
+        } else if (strcasecmp(name.c_str(), "ETag") == 0) {
+            cc.has_etag = !value.empty();
+        } else if (strcasecmp(name.c_str(), "Last-Modified") == 0) {
+            cc.has_last_modified = !value.empty();
+        }
+    }
+    if (pragma_no_cache && !has_cache_control) { //HTTP/1.0 "Pragma: no-cache" is only heeded without Cache-Control
+        cc.no_cache = true;
+    }
+    return cc;
+}
+
+time_t CacheControl::parse_http_date(const std::string& value) {
+    static const char* const FORMATS[] = {
+        "%a, %d %b %Y %H:%M:%S GMT", //IMF-fixdate: Sun, 06 Nov 1994 08:49:37 GMT
+        "%A, %d-%b-%y %H:%M:%S GMT", //RFC 850:     Sunday, 06-Nov-94 08:49:37 GMT
+        "%a %b %d %H:%M:%S %Y",      //asctime:     Sun Nov  6 08:49:37 1994
+    };
+    for (const char* format : FORMATS) {
+        struct tm tm = {};
+        const char* end = strptime(value.c_str(), format, &tm);
+        if (end && *end == '\0') {
+            return timegm(&tm);
+        }
+    }
+    return -1;
+}
+
+long CacheControl::freshness_lifetime(time_t now, long default_lifetime) const {
+    if (no_cache) {
+        return 0;
+    }
+    if (s_maxage >= 0) {
+        return s_maxage;
+    }
+    if (max_age >= 0) {
+        return max_age;
+    }
+    if (expires_invalid) {
+        return 0;
+    }
+    if (expires != -1) {
+        return std::max<long>(expires - (date != -1 ? date : now), 0);
+    }
+    return default_lifetime;
+}
+
+time_t CacheControl::expiry_time(time_t now) const {
+    long current_age = std::max<long>(age, 0);
+    if (date != -1 && now > date) {
+        current_age = std::max<long>(current_age, now - date); //apparent age, clock skew only counts one way
+    }
+    return now + std::max<long>(freshness_lifetime(now) - current_age, 0);
+}
+
+bool CacheControl::may_serve_stale() const {
+    return !must_revalidate && !proxy_revalidate && s_maxage < 0;
+}
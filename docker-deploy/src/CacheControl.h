@@ -0,0 +1,48 @@
+#ifndef CACHE_CONTROL_H
+#define CACHE_CONTROL_H
+
+#include <string>
+#include <unordered_map>
+#include <ctime>
+
+//everything a cache decision needs from a response's header fields, parsed once when the
+//header section is complete (see ResponseParser::finish_headers) so nothing on the request path
+//searches Cache-Control or parses dates again. Numbers are seconds, -1 where the field or
+//directive is missing; dates are unix times, -1 where missing or unparsable
+struct CacheControl {
+    //Cache-Control directives
+    long max_age = -1;
+    long s_maxage = -1;
+    long stale_while_revalidate = -1;
+    long stale_if_error = -1;
+    bool no_store = false;
+    bool no_cache = false;
+    bool is_private = false;
+    bool must_revalidate = false;
+    bool proxy_revalidate = false;
+
+    time_t date = -1;
+    time_t expires = -1;
+    bool expires_invalid = false; //Expires was there but not a date, which means already expired
+    long age = -1;
+
+    //validators a conditional request can use
+    bool has_etag = false;
+    bool has_last_modified = false;
+
+    //fill one in from header fields, names are matched case-insensitively
+    static CacheControl parse(const std::unordered_map<std::string, std::string>& headers);
+    //IMF-fixdate, the obsolete RFC 850 form or asctime, -1 for anything else
+    static time_t parse_http_date(const std::string& value);
+
+    //seconds the response stays fresh from when it was generated: s-maxage, else max-age,
+    //else Expires - Date, else default_lifetime. no-cache makes it 0, every use has to go to the origin
+    long freshness_lifetime(time_t now, long default_lifetime = 86400) const;
+    //when a response received at now goes stale, the lifetime minus the Age it already had
+    time_t expiry_time(time_t now) const;
+    //must-revalidate, proxy-revalidate and s-maxage forbid a shared cache to serve it once stale
+    bool may_serve_stale() const;
+    bool has_validators() const { return has_etag || has_last_modified; }
+};
+
+#endif
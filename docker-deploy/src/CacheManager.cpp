@@ -1,68 +1,285 @@
 #include "CacheManager.h"
+#include "CoarseClock.h"
+#include "Metrics.h"
 #include <iostream>
+#include <fstream>
+#include <functional>
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+#include <algorithm>
+#include <string_view>
+#include <cctype>
+#include <cstdlib>
+
+//snapshot file: SnapshotHeader, then per entry a SnapshotRecord followed by the key, ETag,
+//Last-Modified and the response's wire bytes, then a record with key_length 0 and the entry count
+static const char SNAPSHOT_MAGIC[8] = {'P', 'X', 'C', 'S', 'N', 'A', 'P', '\0'};
+static const uint32_t SNAPSHOT_VERSION = 1;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    int64_t created;
+};
+
+struct SnapshotRecord {
+    uint32_t key_length;
+    uint32_t data_length;
+    int64_t expiry_time;
+    uint16_t etag_length;
+    uint16_t last_modified_length;
+    uint32_t reserved;
+};
 
 // Constructor
-CacheManager::CacheManager(size_t capacity) : cache_capacity(capacity), logger(Logger::get_instance()) {}
+CacheManager::CacheManager(size_t capacity, size_t num_shards, size_t max_object_size, const std::string& policy)
+    : cache_capacity(capacity), max_object_size(max_object_size), policy_name(policy), max_variants(8), disk(nullptr), logger(Logger::get_instance()),
+      stop_loading(false), snapshot_loaded(0), coalesce_timeout(10000), coalesced(0), coalesce_timeouts(0),
+      stop_refresh(false), refresh_ahead(0), refresh_min_hits(2), refreshes(0), stale_served(0),
+      stale_if_error_grace(0), stale_if_error_served(0) {
+    if (this->max_object_size > capacity) {
+        this->max_object_size = capacity;
+    }
+    //every shard has to be able to hold the biggest object we accept
+    if (this->max_object_size > 0 && num_shards > capacity / this->max_object_size) {
+        num_shards = capacity / this->max_object_size;
+    }
+    if (num_shards == 0) {
+        num_shards = 1;
+    }
+    for (size_t i = 0; i < num_shards; i++) {
+        shards.push_back(std::make_unique<Shard>());
+        //spread the remainder so the shard capacities add up to the total
+        shards.back()->capacity = capacity / num_shards + (i < capacity % num_shards ? 1 : 0);
+        shards.back()->bytes_used = 0;
+        shards.back()->policy = EvictionPolicy::create(policy, shards.back()->capacity);
+    }
+}
 
-// Check if an entry is expired
-bool CacheManager::is_expired(const CacheEntry& entry) const {
-    return std::time(nullptr) >= entry.expiry_time;
+size_t CacheManager::entry_size(const std::string& key, const HttpResponse& response) {
+    //list node, map node and the HttpResponse object itself, roughly
+    size_t size = sizeof(HttpResponse) + sizeof(CacheEntry) + 128;
+    size += 2 * key.length() + 2 * response.status_line.length() + response.body_bytes().length();
+    for (const auto& header : response.headers) {
+        size += 2 * (header.first.length() + header.second.length()) + 64;
+    }
+    return size;
 }
 
-// Check if an entry requires validation (ETag / Last-Modified)
-bool CacheManager::requires_validation(const CacheEntry& entry) const {
-    return !entry.response->get_header("ETag").empty() || !entry.response->get_header("Last-Modified").empty();
+//the log's EXPIRES / EXPIREDTIME, in UTC like the rest of the log
+CacheEntry CacheManager::make_entry(const std::string& key, std::shared_ptr<HttpResponse> response, time_t expiry_time) {
+    size_t size = entry_size(key, *response);
+    std::shared_ptr<const std::string> head = std::make_shared<const std::string>(response->serialize_head());
+
+    time_t stale_until = expiry_time;
+    time_t stale_if_error_until = expiry_time;
+    const CacheControl& cc = response->cache_control;
+    if (cc.may_serve_stale()) {
+        stale_until += std::max(cc.stale_while_revalidate, 0L);
+        stale_if_error_until += std::max(cc.stale_if_error, 0L);
+    }
+    return CacheEntry{response, head, expiry_time, stale_until, stale_if_error_until, size};
 }
 
-// Calculate expiry time from response headers
-time_t CacheManager::get_expiry_time(const HttpResponse& response) const {
-    time_t expiry_time = std::time(nullptr);
+CacheManager::~CacheManager() {
+    stop_refreshing();
+    stop_loading = true;
+    wait_for_snapshot();
+}
+
+void CacheManager::set_disk_cache(DiskCache* disk_cache) {
+    disk = disk_cache;
+}
 
-    std::string cache_control = response.get_header("Cache-Control");
-    if (!cache_control.empty()) {
-        size_t pos = cache_control.find("max-age=");
-        if (pos != std::string::npos) {
-            int max_age = std::stoi(cache_control.substr(pos + 8));
-            expiry_time += max_age;
+CacheManager::Shard& CacheManager::get_shard(const std::string& key) {
+    std::string_view url(key);
+    url = url.substr(0, url.find(' ')); //a variant key is "url field=value...", urls have no spaces
+    return *shards[std::hash<std::string_view>()(url) % shards.size()];
+}
+
+std::vector<std::string> CacheManager::vary_fields(const std::string& vary) {
+    std::vector<std::string> fields;
+    size_t pos = 0;
+    while (pos <= vary.length()) {
+        size_t comma = vary.find(',', pos);
+        if (comma == std::string::npos) {
+            comma = vary.length();
         }
-    } else {
-        expiry_time += 86400;
+        std::string field;
+        for (size_t i = pos; i < comma; i++) {
+            if (!isspace((unsigned char)vary[i])) {
+                field += tolower((unsigned char)vary[i]);
+            }
+        }
+        if (!field.empty()) {
+            fields.push_back(field);
+        }
+        pos = comma + 1;
     }
+    std::sort(fields.begin(), fields.end());
+    fields.erase(std::unique(fields.begin(), fields.end()), fields.end());
+    return fields;
+}
 
-    std::string expires_header = response.get_header("Expires");
-    if (!expires_header.empty()) {
-        struct tm expiry_tm = {};
-        if (strptime(expires_header.c_str(), "%a %b %d %H:%M:%S %Y", &expiry_tm)) {
-            time_t expires_at = timegm(&expiry_tm);
-            expiry_time = std::max(expiry_time, expires_at);
-        } else {
-            logger.log_warning(0, "Failed to parse Expires header: " + expires_header);
+std::string CacheManager::variant_key(const std::string& url, const std::vector<std::string>& fields, const HttpRequest* request) {
+    std::string key = url;
+    for (const std::string& field : fields) {
+        key += " " + field + "=";
+        //"gzip,  br" and " gzip, br" select the same variant: no space around a comma, none at the ends
+        std::string value = request ? request->get_field(field) : "";
+        bool after_comma = true;
+        for (char c : value) {
+            if (isspace((unsigned char)c) && after_comma) {
+                continue;
+            }
+            after_comma = c == ',';
+            if (after_comma) {
+                while (!key.empty() && isspace((unsigned char)key.back())) {
+                    key.pop_back();
+                }
+            }
+            key += c;
+        }
+        while (isspace((unsigned char)key.back())) {
+            key.pop_back();
         }
-    } else {
-        expiry_time += 86400;
     }
+    return key;
+}
 
-    return expiry_time;
+size_t CacheManager::get_shard_count() const {
+    return shards.size();
+}
+
+// Number of entries over all shards
+size_t CacheManager::size() {
+    size_t total = 0;
+    for (auto& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        total += shard->entries.size();
+    }
+    return total;
+}
+
+// Bytes charged over all shards
+size_t CacheManager::get_bytes_used() {
+    size_t total = 0;
+    for (auto& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        total += shard->bytes_used;
+    }
+    return total;
+}
+
+size_t CacheManager::get_capacity() const {
+    return cache_capacity;
+}
+
+size_t CacheManager::get_max_object_size() const {
+    return max_object_size;
+}
+
+const std::string& CacheManager::get_policy_name() const {
+    return policy_name;
+}
+
+// Check if an entry is expired
+bool CacheManager::is_expired(const CacheEntry& entry) const {
+    return CoarseClock::get_instance().now() >= entry.expiry_time;
+}
+
+// Check if an entry requires validation (no-cache, or validators to revalidate with)
+bool CacheManager::requires_validation(const CacheEntry& entry) const {
+    return entry.response->cache_control.no_cache || entry.response->cache_control.has_validators();
 }
 
 // Check if a URL is in the cache
 bool CacheManager::is_in_cache(const std::string& url) {
-    std::lock_guard<std::mutex> lock(cache_mutex);
-    return cache_map.find(url) != cache_map.end();
+    Shard& shard = get_shard(url);
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.entries.find(url) != shard.entries.end()) {
+            return true;
+        }
+        auto vary = shard.vary.find(url);
+        if (vary != shard.vary.end() && !vary->second.variants.empty()) {
+            return true;
+        }
+    }
+    return disk && disk->contains(url);
 }
 
 // Retrieve a cached response if it's still valid
-std::shared_ptr<HttpResponse> CacheManager::get_cached_response(int request_id, const std::string& url) {
-    std::lock_guard<std::mutex> lock(cache_mutex);
-    auto it = cache_map.find(url);
+std::shared_ptr<HttpResponse> CacheManager::get_cached_response(int request_id, const std::string& url, const HttpRequest* request,
+                                                                std::shared_ptr<const std::string>* head) {
+    Shard& shard = get_shard(url);
+    std::string variant;
+    const std::string* key_ptr = &url;
+    CacheEntry entry;
+    bool expired;
+    bool stale = false; //expired, but served while a background refresh runs
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto vary = shard.vary.find(url);
+        if (vary != shard.vary.end()) { //cached per variant, look for the one matching this request
+            variant = variant_key(url, vary->second.fields, request);
+            key_ptr = &variant;
+        }
+        const std::string& key = *key_ptr;
 
-    if (it == cache_map.end()) {
-        return nullptr;
+        shard.policy->record_access(key); //misses count too, they decide what gets admitted later
+        auto it = shard.entries.find(key);
+
+        if (it != shard.entries.end()) {
+            entry = it->second; //copy out, the status is logged after the lock is released
+            expired = is_expired(entry);
+            time_t now = CoarseClock::get_instance().now();
+            bool can_refresh = refresh_pool && request && !stop_refresh;
+            if (!expired) {
+                shard.policy->on_hit(key);
+                //a hot entry about to expire is refetched now, so its next hits don't have to wait for the origin
+                if (++it->second.hits >= refresh_min_hits && can_refresh && refresh_ahead.count() > 0 &&
+                    entry.expiry_time - now <= refresh_ahead.count()) {
+                    schedule_refresh(shard, key, url, *request, entry.response);
+                }
+            } else if (can_refresh && now < entry.stale_until && schedule_refresh(shard, key, url, *request, entry.response)) {
+                shard.policy->on_hit(key);
+                stale = true;
+            }
+        }
     }
 
-    CacheEntry& entry = it->second->second;
-    if (is_expired(entry)) {
-        logger.log_cache_status(request_id, "in cache, but expired at " + entry.response->get_header("Expires"));
+    const std::string& key = *key_ptr;
+    if (!entry.response) {
+        //not in memory, try the disk tier and bring a hit back into memory
+        std::shared_ptr<HttpResponse> response;
+        time_t expiry_time;
+        if (!disk || !disk->lookup(key, response, expiry_time)) {
+            Metrics::add(METRIC_CACHE_MISSES);
+            return nullptr;
+        }
+        entry = make_entry(key, response, expiry_time);
+        expired = false;
+        std::vector<std::pair<std::string, CacheEntry>> evicted;
+        insert(key, entry, evicted);
+        demote(evicted, key);
+    }
+
+    if (stale) {
+        stale_served++;
+        Metrics::add(METRIC_CACHE_HITS);
+        logger.log_cache_status(request_id, "in cache, but expired at ", entry.expiry_time, ", served while it is revalidated");
+        if (head) {
+            *head = entry.head;
+        }
+        return entry.response;
+    }
+
+    if (expired) {
+        logger.log_cache_status(request_id, "in cache, but expired at ", entry.expiry_time);
+        Metrics::add(METRIC_CACHE_MISSES);
         return nullptr;
     }
 
@@ -71,64 +288,531 @@ std::shared_ptr<HttpResponse> CacheManager::get_cached_response(int request_id,
     } else {
         logger.log_cache_status(request_id, "in cache, valid");
     }
+    Metrics::add(METRIC_CACHE_HITS);
+    if (head) {
+        *head = entry.head;
+    }
+    return entry.response;
+}
 
-    // Move accessed entry to the front (LRU policy)
-    cache_list.splice(cache_list.begin(), cache_list, it->second);
+std::shared_ptr<HttpResponse> CacheManager::get_stale_response(int request_id, const std::string& url, const HttpRequest* request,
+                                                               std::shared_ptr<const std::string>* head) {
+    Shard& shard = get_shard(url);
+    CacheEntry entry;
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        std::string key = url;
+        auto vary = shard.vary.find(url);
+        if (vary != shard.vary.end()) {
+            key = variant_key(url, vary->second.fields, request);
+        }
+        auto it = shard.entries.find(key);
+        if (it == shard.entries.end()) {
+            return nullptr;
+        }
+        entry = it->second;
+    }
+
+    time_t usable_until = entry.stale_if_error_until;
+    if (entry.response->cache_control.may_serve_stale()) { //must-revalidate rules out the grace window too
+        usable_until = std::max(usable_until, entry.expiry_time + (time_t)stale_if_error_grace.count());
+    }
+    if (CoarseClock::get_instance().now() >= usable_until) {
+        return nullptr;
+    }
+
+    stale_if_error_served++;
+    logger.log_cache_status(request_id, "in cache, but expired at ", entry.expiry_time, ", served because the origin failed");
+    if (head) {
+        *head = entry.head;
+    }
     return entry.response;
 }
 
+void CacheManager::set_stale_if_error_grace(std::chrono::seconds grace) {
+    stale_if_error_grace = grace;
+}
+
+uint64_t CacheManager::get_stale_if_error_served() const {
+    return stale_if_error_served;
+}
+
 // Store a response in cache
-void CacheManager::store_response(int request_id, const std::string& url, std::shared_ptr<HttpResponse> response) {
+void CacheManager::store_response(int request_id, const std::string& url, std::shared_ptr<HttpResponse> response, const HttpRequest* request) {
     if (!response->is_cacheable()) {
-        std::string reason = "not cacheable because status is " + response->get_status_line();
-        if (!response->get_header("Cache-Control").empty() && response->get_header("Cache-Control").find("no-store") != std::string::npos) {
-            reason = "not cacheable because Cache-Control: no-store";
+        if (response->cache_control.no_store) {
+            logger.log_cache_status(request_id, "not cacheable because Cache-Control: no-store");
+        } else if (response->cache_control.is_private) {
+            logger.log_cache_status(request_id, "not cacheable because Cache-Control: private");
+        } else {
+            logger.log_cache_status(request_id, "not cacheable because status is ", response->status_line);
         }
-        logger.log_cache_status(request_id, reason);
         return;
     }
 
-    std::lock_guard<std::mutex> lock(cache_mutex);
-
-    // Handle "Vary" header by using a composite cache key
+    // Handle "Vary" header: each combination of the named request fields is its own entry
     std::string cache_key = url;
-    if (!response->get_header("Vary").empty()) {
-        cache_key += "|" + response->get_header("Vary"); // Use a delimiter for safety
+    std::vector<std::string> fields = vary_fields(response->get_header("Vary"));
+    if (std::find(fields.begin(), fields.end(), "*") != fields.end()) {
+        logger.log_cache_status(request_id, "not cacheable because Vary: *");
+        return;
+    }
+    if (!fields.empty()) {
+        cache_key = variant_key(url, fields, request);
     }
 
-    evict_if_needed();  // Ensure cache capacity
+    //everything that only looks at the response is done before taking the shard lock
+    size_t size = entry_size(cache_key, *response);
+    if (size > max_object_size) {
+        logger.log_cache_status(request_id, "not cacheable because it is " + std::to_string(size) + " bytes, over the " +
+                                            std::to_string(max_object_size) + " byte object limit");
+        return;
+    }
+
+    time_t expiry_time = response->cache_control.expiry_time(CoarseClock::get_instance().now());
+    std::vector<std::pair<std::string, CacheEntry>> evicted;
+    insert(cache_key, make_entry(cache_key, response, expiry_time), evicted);
+    demote(evicted, cache_key);
+
+    bool admitted = true;
+    for (const auto& evicted_entry : evicted) {
+        if (evicted_entry.first == cache_key) {
+            admitted = false;
+        }
+    }
+    if (!admitted && !disk) {
+        logger.log_cache_status(request_id, "not cached, requested less often than the entries it would replace");
+        return;
+    }
+    logger.log_cache_status(request_id, admitted ? "cached, expires at " : "cached on disk, expires at ", expiry_time);
+}
+
+CacheManager::FetchRole CacheManager::begin_fetch(const std::string& url, std::shared_ptr<HttpResponse>& response) {
+    if (coalesce_timeout.count() <= 0) {
+        return FETCH_ALONE;
+    }
+
+    Shard& shard = get_shard(url);
+    std::unique_lock<std::mutex> lock(shard.mutex);
+
+    //a fetch may have finished and stored the response since the caller's miss
+    auto entry = shard.entries.find(url);
+    if (entry != shard.entries.end() && !is_expired(entry->second)) {
+        shard.policy->on_hit(url);
+        response = entry->second.response;
+        coalesced++;
+        return FETCH_SHARED;
+    }
 
-    time_t expiry_time = get_expiry_time(*response);
-    cache_list.emplace_front(cache_key, CacheEntry{response, expiry_time});
-    cache_map[cache_key] = cache_list.begin();
+    auto it = shard.fetches.find(url);
+    if (it == shard.fetches.end()) {
+        shard.fetches[url] = std::make_shared<Fetch>();
+        return FETCH_LEADER;
+    }
 
-    std::string expires = response->get_header("Expires");
-    if (expires.empty()) {
-        char buf[100];
-        time_t expiry = get_expiry_time(*response); 
-        strftime(buf, sizeof(buf), "%a %b %d %H:%M:%S %Y", gmtime(&expiry)); 
-        expires = std::string(buf);
+    std::shared_ptr<Fetch> fetch = it->second;
+    if (!fetch->cv.wait_for(lock, coalesce_timeout, [&]{ return fetch->done; })) {
+        coalesce_timeouts++; //the leader stalled, don't keep this request waiting any longer
+        return FETCH_ALONE;
+    }
+    if (!fetch->response) {
+        return FETCH_ALONE;
+    }
+    response = fetch->response;
+    coalesced++;
+    return FETCH_SHARED;
+}
 
+void CacheManager::finish_fetch(const std::string& url, std::shared_ptr<HttpResponse> response) {
+    Shard& shard = get_shard(url);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.fetches.find(url);
+    if (it == shard.fetches.end()) {
+        return;
     }
-    logger.log_cache_status(request_id, "cached, expires at " + expires);
+    it->second->done = true;
+    it->second->response = response;
+    it->second->cv.notify_all();
+    shard.fetches.erase(it);
+}
+
+void CacheManager::set_coalesce_timeout(std::chrono::milliseconds timeout) {
+    coalesce_timeout = timeout;
 }
 
-// Evict least recently used item if cache is full
-void CacheManager::evict_if_needed() {
-    if (!cache_list.empty() && cache_list.size() >= cache_capacity) {
-        auto last = std::prev(cache_list.end());
-        std::string evicted_url = last->first;
-        logger.log_note(0, "Evicting " + evicted_url + " from cache");
-        cache_map.erase(evicted_url);
-        cache_list.pop_back();
+void CacheManager::start_refreshing(Refresher refresher, size_t workers, std::chrono::seconds refresh_ahead) {
+    this->refresher = refresher;
+    this->refresh_ahead = refresh_ahead;
+    stop_refresh = false;
+    refresh_pool = std::make_unique<WorkerPool>(workers, 64);
+}
+
+void CacheManager::stop_refreshing() {
+    stop_refresh = true;
+    if (refresh_pool) {
+        refresh_pool->shutdown(); //queued refreshes see stop_refresh and return right away
     }
 }
 
-void CacheManager::print_cache_list(const std::list<std::pair<std::string, CacheEntry>>& cache_list) {
-    std::cout << "Cache List Contents (LRU order):\n";
-    for (const auto& entry : cache_list) {
-        const std::string& url = entry.first;
-        const CacheEntry& cache_entry = entry.second;
-        std::cout << "URL: " << url << " | Expires at: " << cache_entry.expiry_time << "\n";
+bool CacheManager::schedule_refresh(Shard& shard, const std::string& key, const std::string& url, const HttpRequest& request,
+                                    std::shared_ptr<HttpResponse> cached) {
+    if (shard.refreshing.count(key)) {
+        return true; //one is on its way already, no stampede on the origin
     }
-}
\ No newline at end of file
+
+    bool queued = refresh_pool->submit([this, key, url, request, cached]() {
+        std::shared_ptr<HttpResponse> fresh;
+        if (!stop_refresh) {
+            try {
+                fresh = refresher(request, cached);
+            } catch (const std::exception& e) {
+                logger.log_error(0, "Background refresh of " + url + " failed: " + e.what());
+            }
+        }
+        if (fresh) {
+            store_response(0, url, fresh, &request);
+            refreshes++;
+        }
+
+        //the shard lock was held when this was queued, so the key is in the set by now
+        Shard& shard = get_shard(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.refreshing.erase(key);
+    });
+    if (queued) {
+        shard.refreshing.insert(key);
+    }
+    return queued;
+}
+
+uint64_t CacheManager::get_refreshes() const {
+    return refreshes;
+}
+
+uint64_t CacheManager::get_stale_served() const {
+    return stale_served;
+}
+
+void CacheManager::set_max_variants(size_t max) {
+    max_variants = std::max<size_t>(max, 1);
+}
+
+uint64_t CacheManager::get_coalesced() const {
+    return coalesced;
+}
+
+uint64_t CacheManager::get_coalesce_timeouts() const {
+    return coalesce_timeouts;
+}
+
+// Put an entry into its shard (replacing an older copy) and evict what no longer fits
+bool CacheManager::insert(const std::string& key, const CacheEntry& entry, std::vector<std::pair<std::string, CacheEntry>>& evicted, bool only_if_absent) {
+    Shard& shard = get_shard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end() && only_if_absent) {
+        return false;
+    }
+    if (it != shard.entries.end()) { //replace the old copy
+        shard.bytes_used -= it->second.size;
+        shard.entries.erase(it);
+        shard.policy->on_erase(key);
+    }
+    index_variant(shard, key, *entry.response, evicted);
+    shard.entries[key] = entry;
+    shard.bytes_used += entry.size;
+    shard.policy->on_insert(key, entry.size);
+    evict_if_needed(shard, evicted);  // Ensure cache capacity
+    return true;
+}
+
+void CacheManager::index_variant(Shard& shard, const std::string& key, const HttpResponse& response, std::vector<std::pair<std::string, CacheEntry>>& evicted) {
+    size_t space = key.find(' ');
+    std::string url = key.substr(0, space);
+    auto it = shard.vary.find(url);
+
+    if (space == std::string::npos) { //no Vary (any more): the url's variants are out of date
+        if (it != shard.vary.end()) {
+            std::deque<std::string> variants = it->second.variants;
+            for (const std::string& variant : variants) {
+                erase(shard, variant, evicted);
+            }
+            shard.vary.erase(url);
+        }
+        return;
+    }
+
+    std::vector<std::string> fields = vary_fields(response.get_header("Vary"));
+    if (it == shard.vary.end() || it->second.fields != fields) {
+        //first variant, or the origin now varies on other fields: older variants were picked by the wrong ones
+        if (it != shard.vary.end()) {
+            std::deque<std::string> variants = it->second.variants;
+            for (const std::string& variant : variants) {
+                erase(shard, variant, evicted);
+            }
+        }
+        if (shard.entries.count(url)) {
+            erase(shard, url, evicted);
+        }
+        VaryIndex& index = shard.vary[url];
+        index.fields = fields;
+        index.variants.clear();
+        it = shard.vary.find(url);
+    }
+
+    std::deque<std::string>& variants = it->second.variants;
+    if (std::find(variants.begin(), variants.end(), key) == variants.end()) {
+        variants.push_back(key);
+    }
+    while (variants.size() > max_variants && variants.front() != key) {
+        std::string oldest = variants.front();
+        erase(shard, oldest, evicted); //also takes it off the list
+    }
+}
+
+void CacheManager::forget_variant(Shard& shard, const std::string& key) {
+    size_t space = key.find(' ');
+    if (space == std::string::npos) {
+        return;
+    }
+    auto it = shard.vary.find(key.substr(0, space));
+    if (it == shard.vary.end()) {
+        return;
+    }
+    std::deque<std::string>& variants = it->second.variants;
+    auto variant = std::find(variants.begin(), variants.end(), key);
+    if (variant != variants.end()) {
+        variants.erase(variant);
+    }
+    if (variants.empty()) {
+        shard.vary.erase(it);
+    }
+}
+
+void CacheManager::erase(Shard& shard, const std::string& key, std::vector<std::pair<std::string, CacheEntry>>& evicted) {
+    forget_variant(shard, key);
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end()) {
+        shard.bytes_used -= it->second.size;
+        shard.policy->on_erase(key);
+        evicted.emplace_back(key, std::move(it->second));
+        shard.entries.erase(it);
+    }
+}
+
+// Log what was evicted from memory and hand the still fresh entries to the disk tier.
+// new_key (the entry just inserted, if the policy refused it) is reported by the caller
+void CacheManager::demote(const std::vector<std::pair<std::string, CacheEntry>>& evicted, const std::string& new_key) {
+    for (const auto& evicted_entry : evicted) {
+        bool to_disk = disk && !is_expired(evicted_entry.second);
+        if (to_disk) {
+            disk->store(evicted_entry.first, evicted_entry.second.response, evicted_entry.second.expiry_time);
+        }
+        if (evicted_entry.first != new_key) {
+            logger.log_note(0, "Evicting ", evicted_entry.first, to_disk ? " from memory to disk cache" : " from cache");
+        }
+    }
+}
+
+// Drop the entries the policy picks until the shard fits its budget
+void CacheManager::evict_if_needed(Shard& shard, std::vector<std::pair<std::string, CacheEntry>>& evicted) {
+    std::vector<std::string> victims;
+    shard.policy->evict(shard.bytes_used, shard.capacity, victims);
+    for (const std::string& victim : victims) {
+        forget_variant(shard, victim);
+        auto it = shard.entries.find(victim);
+        if (it != shard.entries.end()) {
+            shard.bytes_used -= it->second.size;
+            Metrics::add(METRIC_EVICTIONS);
+            evicted.emplace_back(victim, std::move(it->second));
+            shard.entries.erase(it);
+        }
+    }
+}
+
+void CacheManager::print_cache_list() {
+    std::cout << "Cache Contents (" << policy_name << " eviction, per shard):\n";
+    for (size_t i = 0; i < shards.size(); i++) {
+        std::lock_guard<std::mutex> lock(shards[i]->mutex);
+        for (const auto& entry : shards[i]->entries) {
+            const std::string& url = entry.first;
+            const CacheEntry& cache_entry = entry.second;
+            std::cout << "shard " << i << " URL: " << url << " | Expires at: " << cache_entry.expiry_time << "\n";
+        }
+    }
+}
+
+size_t CacheManager::save_snapshot(const std::string& path) {
+    //a load still running would only add back what is being written out
+    stop_loading = true;
+    wait_for_snapshot();
+
+    std::string tmp_path = path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error("Failed to open cache snapshot " + tmp_path);
+    }
+
+    SnapshotHeader header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.created = std::time(nullptr);
+    out.write((const char*)&header, sizeof(header));
+
+    uint64_t count = 0;
+    for (auto& shard : shards) {
+        std::vector<std::pair<std::string, CacheEntry>> entries;
+        {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            entries.assign(shard->entries.begin(), shard->entries.end());
+        }
+
+        for (const auto& entry : entries) {
+            if (is_expired(entry.second)) {
+                continue;
+            }
+            std::string etag = entry.second.response->get_header("ETag");
+            std::string last_modified = entry.second.response->get_header("Last-Modified");
+            std::string data = entry.second.response->serialize();
+            if (etag.length() > UINT16_MAX || last_modified.length() > UINT16_MAX || data.length() > UINT32_MAX) {
+                continue;
+            }
+
+            SnapshotRecord record = {(uint32_t)entry.first.length(), (uint32_t)data.length(), (int64_t)entry.second.expiry_time,
+                                     (uint16_t)etag.length(), (uint16_t)last_modified.length(), 0};
+            out.write((const char*)&record, sizeof(record));
+            out.write(entry.first.data(), entry.first.length());
+            out.write(etag.data(), etag.length());
+            out.write(last_modified.data(), last_modified.length());
+            out.write(data.data(), data.length());
+            count++;
+        }
+    }
+
+    SnapshotRecord end = {};
+    out.write((const char*)&end, sizeof(end));
+    out.write((const char*)&count, sizeof(count));
+    out.close();
+    if (!out) {
+        std::remove(tmp_path.c_str());
+        throw std::runtime_error("Failed to write cache snapshot " + tmp_path);
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        throw std::runtime_error("Failed to move cache snapshot into place at " + path);
+    }
+    return count;
+}
+
+void CacheManager::load_snapshot_async(const std::string& path) {
+    wait_for_snapshot();
+    stop_loading = false;
+    snapshot_loaded = 0;
+    snapshot_loader = std::thread(&CacheManager::load_snapshot, this, path);
+}
+
+void CacheManager::wait_for_snapshot() {
+    if (snapshot_loader.joinable()) {
+        snapshot_loader.join();
+    }
+}
+
+size_t CacheManager::get_snapshot_loaded() const {
+    return snapshot_loaded;
+}
+
+//loader thread: insert entries as they are read, so lookups find them before the whole file is done.
+//a snapshot that can't be read (bad lengths, out of memory) is given up on, whatever was loaded stays
+void CacheManager::load_snapshot(const std::string& path) {
+    try {
+        read_snapshot(path);
+    } catch (const std::exception& e) {
+        logger.log_warning(0, "cache snapshot: failed to load " + path + " (" + e.what() + "), " +
+                              std::to_string(snapshot_loaded.load()) + " entries kept, rest of it discarded");
+    }
+}
+
+void CacheManager::read_snapshot(const std::string& path) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate); //ate: tellg is the file size
+    if (!in) {
+        logger.log_note(0, "cache snapshot: no snapshot at " + path + ", starting cold");
+        return;
+    }
+    uint64_t file_size = in.tellg();
+    in.seekg(0);
+
+    SnapshotHeader header;
+    if (!in.read((char*)&header, sizeof(header)) || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+        logger.log_warning(0, "cache snapshot: " + path + " is not a cache snapshot, ignored");
+        return;
+    }
+    if (header.version != SNAPSHOT_VERSION) {
+        logger.log_warning(0, "cache snapshot: " + path + " has version " + std::to_string(header.version) + ", expected " +
+                              std::to_string(SNAPSHOT_VERSION) + ", ignored");
+        return;
+    }
+
+    size_t skipped = 0;
+    bool complete = false;
+    while (!stop_loading) {
+        SnapshotRecord record;
+        if (!in.read((char*)&record, sizeof(record))) {
+            break;
+        }
+        if (record.key_length == 0) {
+            complete = true;
+            break;
+        }
+
+        //lengths come from the file: check them before allocating anything
+        uint64_t record_size = (uint64_t)record.key_length + record.etag_length + record.last_modified_length + record.data_length;
+        if (record_size > file_size - (uint64_t)in.tellg()) {
+            logger.log_warning(0, "cache snapshot: " + path + " has a record longer than the rest of the file, rest of it discarded");
+            complete = true; //already warned
+            break;
+        }
+        if (record.key_length > max_object_size || record.data_length > max_object_size) { //couldn't be cached anyway
+            in.seekg(record_size, std::ios::cur);
+            skipped++;
+            continue;
+        }
+
+        std::string key(record.key_length, '\0');
+        std::string etag(record.etag_length, '\0');
+        std::string last_modified(record.last_modified_length, '\0');
+        std::string data(record.data_length, '\0');
+        if (!in.read(&key[0], key.length()) || !in.read(&etag[0], etag.length()) ||
+            !in.read(&last_modified[0], last_modified.length()) || !in.read(&data[0], data.length())) {
+            break;
+        }
+
+        if (record.expiry_time <= std::time(nullptr)) { //went stale while the proxy was down
+            skipped++;
+            continue;
+        }
+
+        std::shared_ptr<HttpResponse> response = std::make_shared<HttpResponse>();
+        if (!response->parse_response(data) || response->parse_error ||
+            response->get_header("ETag") != etag || response->get_header("Last-Modified") != last_modified) {
+            skipped++;
+            continue;
+        }
+
+        CacheEntry entry = make_entry(key, response, (time_t)record.expiry_time);
+        if (entry.size > max_object_size) {
+            skipped++;
+            continue;
+        }
+
+        std::vector<std::pair<std::string, CacheEntry>> evicted;
+        if (insert(key, entry, evicted, true)) {
+            snapshot_loaded++;
+        }
+        demote(evicted, key);
+    }
+
+    if (!complete && !stop_loading) {
+        logger.log_warning(0, "cache snapshot: " + path + " ends early, kept what was read");
+    }
+    logger.log_note(0, "cache snapshot: " + std::to_string(snapshot_loaded.load()) + " entries loaded from " + path + ", " +
+                       std::to_string(skipped) + " expired or unusable");
+}
@@ -1,39 +1,223 @@
 #ifndef CACHEMANAGER_H
 #define CACHEMANAGER_H
 
+#include "DiskCache.h"
+#include "EvictionPolicy.h"
+#include "HttpRequest.h"
 #include "HttpResponse.h"
 #include "Logger.h"
+#include "WorkerPool.h"
 #include <unordered_map>
-#include <list>
+#include <unordered_set>
+#include <functional>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <string>
 #include <memory>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <atomic>
 #include <ctime>
 
 struct CacheEntry {
     std::shared_ptr<HttpResponse> response;
+    //response's status line and headers as sent, built once when the entry is made and never changed,
+    //so a hit goes out as this plus response->body without serializing anything
+    std::shared_ptr<const std::string> head;
     time_t expiry_time;
+    time_t stale_until; //stale-while-revalidate: after expiry it may still be served (and refreshed in the background) until then
+    time_t stale_if_error_until; //stale-if-error: after expiry it may still stand in for a failed origin fetch until then
+    size_t size;        //bytes charged against the cache budget, see entry_size
+    uint32_t hits = 0;  //since it was stored, for refresh-ahead
 };
 
+//the cache is split into shards picked by a hash of the key. Each shard is its own small cache
+//with its own lock and EvictionPolicy, so workers looking up different urls don't wait on each
+//other. Eviction order (and capacity) is per shard, not over the whole cache.
+//capacity is a byte budget: every entry is charged for its key, status line, header fields,
+//body and bookkeeping, and a store evicts as many old entries as it takes to fit the new one.
+//with a DiskCache attached, evicted entries that are still fresh move to disk and a memory miss
+//is looked up there (and brought back into memory) before giving up.
+//responses with Vary are stored per variant: the key is the url followed by the values the request
+//had for the header fields Vary names, and the url's shard keeps which fields those are (see VaryIndex)
+//so a lookup can build the key of the variant that matches its request
 class CacheManager {
+public:
+    //fetches a cached response again for a background refresh. request is the client request that found
+    //the entry stale (or due for a refresh), cached the entry's response. Returns the response to store
+    //(cached with updated headers if the origin says it is unchanged), or null to keep what is cached
+    typedef std::function<std::shared_ptr<HttpResponse>(const HttpRequest& request, std::shared_ptr<HttpResponse> cached)> Refresher;
+
 private:
-    std::unordered_map<std::string, std::list<std::pair<std::string, CacheEntry>>::iterator> cache_map;
-    std::list<std::pair<std::string, CacheEntry>> cache_list;
-    size_t cache_capacity;
-    std::mutex cache_mutex;
+    //an origin fetch other requests for the same url are waiting on
+    struct Fetch {
+        bool done = false;
+        std::shared_ptr<HttpResponse> response; //null = nothing to share, waiters fetch themselves
+        std::condition_variable cv;
+    };
+
+    //the variants cached for one url whose response has Vary
+    struct VaryIndex {
+        std::vector<std::string> fields;  //request header fields they vary on, lowercase and sorted
+        std::deque<std::string> variants; //their keys, oldest first
+    };
+
+    //a url's variants are keyed so they land in the url's shard, see get_shard
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, CacheEntry> entries;
+        std::unique_ptr<EvictionPolicy> policy; //which entries to drop when the shard is full
+        std::unordered_map<std::string, std::shared_ptr<Fetch>> fetches; //misses being fetched right now, by url
+        std::unordered_map<std::string, VaryIndex> vary; //by url, for urls cached with Vary
+        std::unordered_set<std::string> refreshing;      //keys with a background refresh queued or running
+        size_t capacity;   //byte budget of this shard
+        size_t bytes_used; //sum of the entries' sizes
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    size_t cache_capacity;  //bytes
+    size_t max_object_size; //responses bigger than this are never cached
+    std::string policy_name;
+    size_t max_variants; //per url, the oldest variant goes when another is stored
+    DiskCache* disk; //second tier, not owned, may be null
     Logger& logger;
 
+    std::thread snapshot_loader;
+    std::atomic<bool> stop_loading;
+    std::atomic<size_t> snapshot_loaded; //entries read back from the snapshot so far
+
+    std::chrono::milliseconds coalesce_timeout; //0 = every miss fetches on its own
+    std::atomic<uint64_t> coalesced;            //misses answered with another request's fetch
+    std::atomic<uint64_t> coalesce_timeouts;    //waiters that gave up on a stalled fetch
+
+    Refresher refresher;
+    std::unique_ptr<WorkerPool> refresh_pool; //bounded: refreshes that don't fit in its queues are skipped
+    std::atomic<bool> stop_refresh;
+    std::chrono::seconds refresh_ahead; //refresh hot entries this long before they expire, 0 = off
+    uint32_t refresh_min_hits;          //hits since stored for an entry to count as hot
+    std::atomic<uint64_t> refreshes;    //background refreshes that stored a response
+    std::atomic<uint64_t> stale_served; //hits answered with a stale copy while it was refreshed
+
+    std::chrono::seconds stale_if_error_grace; //expired entries stand in for failed fetches this long, on top of stale-if-error
+    std::atomic<uint64_t> stale_if_error_served;
+
+    Shard& get_shard(const std::string& key); //by the url part of key, so a url's variants share its shard
     bool is_expired(const CacheEntry& entry) const;
     bool requires_validation(const CacheEntry& entry) const;
-    time_t get_expiry_time(const HttpResponse& response) const;
+
+    //let the policy drop entries until the shard fits its budget, shard lock held.
+    //evicted entries are handed back so they can be logged (and written to disk) after the lock is released
+    void evict_if_needed(Shard& shard, std::vector<std::pair<std::string, CacheEntry>>& evicted);
+    void erase(Shard& shard, const std::string& key, std::vector<std::pair<std::string, CacheEntry>>& evicted); //shard lock held
+    //keep the url's VaryIndex in step with an entry being stored under key, shard lock held
+    void index_variant(Shard& shard, const std::string& key, const HttpResponse& response, std::vector<std::pair<std::string, CacheEntry>>& evicted);
+    void forget_variant(Shard& shard, const std::string& key); //shard lock held
+    //returns false (and changes nothing) if only_if_absent is set and key is cached already
+    bool insert(const std::string& key, const CacheEntry& entry, std::vector<std::pair<std::string, CacheEntry>>& evicted, bool only_if_absent = false);
+    void demote(const std::vector<std::pair<std::string, CacheEntry>>& evicted, const std::string& new_key);
+    void load_snapshot(const std::string& path); //snapshot_loader thread, never throws
+    void read_snapshot(const std::string& path);
+    static CacheEntry make_entry(const std::string& key, std::shared_ptr<HttpResponse> response, time_t expiry_time);
+    //queue a background refresh of key unless one is pending, shard lock held. false if it can't be queued
+    bool schedule_refresh(Shard& shard, const std::string& key, const std::string& url, const HttpRequest& request, std::shared_ptr<HttpResponse> cached);
+
+public:
+    //capacity is the total byte budget, divided evenly between the shards. The shard count is
+    //lowered if needed so that an object of max_object_size fits in one shard.
+    //policy is an EvictionPolicy name, "lru" or "tinylfu" (throws std::runtime_error otherwise)
+    explicit CacheManager(size_t capacity = 256 * 1024 * 1024, size_t num_shards = 16, size_t max_object_size = 8 * 1024 * 1024,
+                          const std::string& policy = "tinylfu");
+    ~CacheManager(); //stops a snapshot load still in progress
+
+    //bytes an entry is charged: key, status line, header fields (parsed and serialized), body plus fixed bookkeeping
+    static size_t entry_size(const std::string& key, const HttpResponse& response);
+
+    //Vary helpers: the field names a Vary value lists (lowercase, sorted, no duplicates), and the key
+    //the variant of url selected by request's values for them is stored under. A missing request
+    //counts as one without any of the fields
+    static std::vector<std::string> vary_fields(const std::string& vary);
+    static std::string variant_key(const std::string& url, const std::vector<std::string>& fields, const HttpRequest* request);
+
+    bool is_in_cache(const std::string& url); //any variant counts
+    //request picks the variant when the url's responses have Vary.
+    //head, if given, is set to the entry's serialized status line and headers (see CacheEntry)
+    std::shared_ptr<HttpResponse> get_cached_response(int request_id, const std::string& url, const HttpRequest* request = nullptr,
+                                                      std::shared_ptr<const std::string>* head = nullptr);
+    //request is the one response answered, needed to file a response with Vary under the right variant
+    void store_response(int request_id, const std::string& url, std::shared_ptr<HttpResponse> response, const HttpRequest* request = nullptr);
+    void set_disk_cache(DiskCache* disk_cache);
+
+    //warm restarts: save_snapshot writes every fresh entry (key, expiry, validators, response bytes)
+    //to path through a temp file and returns how many; throws std::runtime_error on I/O errors.
+    //load_snapshot_async reads one back on a background thread so requests are served meanwhile;
+    //an entry that was stored again before the loader got to it is not replaced
+    size_t save_snapshot(const std::string& path);
+    void load_snapshot_async(const std::string& path);
+    void wait_for_snapshot();
+    size_t get_snapshot_loaded() const;
+
+    //miss coalescing: after a miss, begin_fetch tells the caller what to do.
+    //FETCH_LEADER: nobody is fetching url, the caller does and must call finish_fetch (see CoalescedFetch).
+    //FETCH_SHARED: response is what a concurrent fetch (or the cache, filled meanwhile) returned.
+    //FETCH_ALONE: fetch without sharing; coalescing is off, the other fetch had nothing shareable, or
+    //it didn't finish within the coalesce timeout
+    enum FetchRole { FETCH_LEADER, FETCH_SHARED, FETCH_ALONE };
+    FetchRole begin_fetch(const std::string& url, std::shared_ptr<HttpResponse>& response);
+    void finish_fetch(const std::string& url, std::shared_ptr<HttpResponse> response);
+    void set_coalesce_timeout(std::chrono::milliseconds timeout);
+    void set_max_variants(size_t max);
+
+    //background refreshes on a pool of worker threads: entries whose Cache-Control allows
+    //stale-while-revalidate are served stale after expiry while they are refetched, and with
+    //refresh_ahead > 0 entries hit again and again are refetched that long before they expire.
+    //Only lookups that pass their request can start one. Without start_refreshing neither happens
+    void start_refreshing(Refresher refresher, size_t workers, std::chrono::seconds refresh_ahead);
+    void stop_refreshing(); //waits for running refreshes, queued ones are dropped
+    uint64_t get_refreshes() const;
+    uint64_t get_stale_served() const;
+
+    //stale-if-error: after a failed origin fetch (no response, or a 5xx) the caller asks for the expired copy.
+    //It is returned while within the response's stale-if-error=N or the grace window, whichever is longer
+    std::shared_ptr<HttpResponse> get_stale_response(int request_id, const std::string& url, const HttpRequest* request = nullptr,
+                                                     std::shared_ptr<const std::string>* head = nullptr);
+    void set_stale_if_error_grace(std::chrono::seconds grace);
+    uint64_t get_stale_if_error_served() const;
+    uint64_t get_coalesced() const;
+    uint64_t get_coalesce_timeouts() const;
+
+    size_t get_shard_count() const;
+    size_t size();
+    size_t get_bytes_used();
+    size_t get_capacity() const;
+    size_t get_max_object_size() const;
+    const std::string& get_policy_name() const;
+    void print_cache_list();
+};
+
+//releases the requests waiting on a fetch even if the fetching request fails or throws:
+//finish() hands them the response, the destructor sends them off with nothing
+class CoalescedFetch {
+private:
+    CacheManager& cache;
+    std::string url;
+    bool leader;
 
 public:
-    explicit CacheManager(size_t capacity = 100);
-    bool is_in_cache(const std::string& url);
-    std::shared_ptr<HttpResponse> get_cached_response(int request_id, const std::string& url);
-    void store_response(int request_id, const std::string& url, std::shared_ptr<HttpResponse> response);
-    void evict_if_needed();
-    void print_cache_list(const std::list<std::pair<std::string, CacheEntry>>& cache_list);
+    CoalescedFetch(CacheManager& cache, const std::string& url) : cache(cache), url(url), leader(false) {}
+    ~CoalescedFetch() { finish(nullptr); }
+    CoalescedFetch(const CoalescedFetch&) = delete;
+    CoalescedFetch& operator=(const CoalescedFetch&) = delete;
+
+    void set_leader(bool is_leader) { leader = is_leader; }
+    bool is_leader() const { return leader; }
+    void finish(std::shared_ptr<HttpResponse> response) {
+        if (leader) {
+            leader = false;
+            cache.finish_fetch(url, response);
+        }
+    }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,107 @@
+#include "ChunkedDecoder.h"
+#include <cstring>
+
+//longest chunk-size or trailer line we accept, protects against an endless line
+static const size_t MAX_LINE_LENGTH = 8192;
+static const size_t MAX_TRAILERS = 100;
+
+ChunkedDecoder::ChunkedDecoder() : state(SIZE_LINE), chunk_remaining(0), decoded_size(0) {}
+
+//chunk = chunk-size [ chunk-ext ] CRLF chunk-data CRLF
+//last-chunk = 1*("0") [ chunk-ext ] CRLF, followed by trailer fields and a final CRLF
+bool ChunkedDecoder::finish_line() {
+    if (state == SIZE_LINE) {
+        std::string size_str = line.substr(0, line.find(';')); //drop chunk extensions
+        while (!size_str.empty() && (size_str.back() == ' ' || size_str.back() == '\t')) {
+            size_str.pop_back();
+        }
+        if (size_str.empty() || size_str.length() > 16 || size_str.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+            return false;
+        }
+
+        chunk_remaining = std::stoull(size_str, nullptr, 16);
+        state = (chunk_remaining == 0) ? TRAILER : DATA;
+    } else if (state == TRAILER) {
+        if (line.empty()) { //final CRLF
+            state = DONE;
+        } else if (trailers.size() == MAX_TRAILERS) {
+            return false;
+        } else {
+            trailers.push_back(line);
+        }
+    }
+
+    line.clear();
+    return true;
+}
+
+size_t ChunkedDecoder::feed(const char* data, size_t len, std::string* out) {
+    size_t pos = 0;
+
+    while (pos < len && state != DONE && state != FAILED) {
+        if (state == DATA) {
+            size_t take = (len - pos < chunk_remaining) ? len - pos : chunk_remaining;
+            if (out) {
+                out->append(data + pos, take);
+            }
+            pos += take;
+            chunk_remaining -= take;
+            decoded_size += take;
+            if (chunk_remaining == 0) {
+                state = DATA_CRLF;
+            }
+        } else if (state == DATA_CRLF) { //"\r\n" after chunk data, may be split across feeds
+            line.push_back(data[pos++]);
+            if (line.length() == 2) {
+                if (line != "\r\n") {
+                    state = FAILED;
+                    break;
+                }
+                line.clear();
+                state = SIZE_LINE;
+            }
+        } else { //SIZE_LINE or TRAILER, collect up to LF
+            const char* lf = (const char*)memchr(data + pos, '\n', len - pos);
+            size_t end = lf ? lf - data : len;
+            line.append(data + pos, end - pos);
+            pos = end;
+
+            if (line.length() > MAX_LINE_LENGTH) {
+                state = FAILED;
+                break;
+            }
+            if (!lf) {
+                break; //need more bytes
+            }
+            pos++; //consume LF
+
+            if (line.empty() || line.back() != '\r') {
+                state = FAILED;
+                break;
+            }
+            line.pop_back();
+            if (!finish_line()) {
+                state = FAILED;
+                break;
+            }
+        }
+    }
+
+    return pos;
+}
+
+bool ChunkedDecoder::done() const {
+    return state == DONE;
+}
+
+bool ChunkedDecoder::failed() const {
+    return state == FAILED;
+}
+
+uint64_t ChunkedDecoder::get_decoded_size() const {
+    return decoded_size;
+}
+
+const std::vector<std::string>& ChunkedDecoder::get_trailers() const {
+    return trailers;
+}
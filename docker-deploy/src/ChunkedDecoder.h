@@ -0,0 +1,37 @@
+#ifndef CHUNKED_DECODER_H
+#define CHUNKED_DECODER_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+//incremental decoder for a chunked message body ("Transfer-Encoding: chunked").
+//bytes can be fed in arbitrary pieces as they arrive off the socket; the decoder keeps
+//its place between calls and stops consuming at the end of the message (after the trailer)
+class ChunkedDecoder {
+private:
+    enum State { SIZE_LINE, DATA, DATA_CRLF, TRAILER, DONE, FAILED };
+
+    State state;
+    uint64_t chunk_remaining; //data bytes left in the current chunk
+    std::string line;         //partial chunk-size / trailer line carried over between feeds
+    uint64_t decoded_size;
+    std::vector<std::string> trailers; //trailer field lines after the last chunk, unparsed
+
+    bool finish_line(); //handle a complete line in `line`, false on a framing error
+
+public:
+    ChunkedDecoder();
+
+    //consume up to len bytes of framing and data, appending decoded data to out (if not null).
+    //returns how many bytes were consumed; less than len only once done() or failed()
+    size_t feed(const char* data, size_t len, std::string* out);
+
+    bool done() const;
+    bool failed() const;
+    uint64_t get_decoded_size() const;
+    const std::vector<std::string>& get_trailers() const;
+};
+
+#endif
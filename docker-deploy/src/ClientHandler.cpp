@@ -1,6 +1,8 @@
 #include "ClientHandler.h"
 #include "HttpRequest.h"
 #include "RequestHandler.h"
+#include "Metrics.h"
+#include "RequestTrace.h"
 #include <iostream>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -9,8 +11,11 @@
 #include <vector>
 #include <string>
 #include <sstream>
+#include <cerrno>
+#include <optional>
 
-ClientHandler::ClientHandler() {
+ClientHandler::ClientHandler(int client_sockfd, CacheManager& cache, std::atomic_int& curr_request_id, const std::string& client_ip)
+    : client_sockfd(client_sockfd), cache(cache), curr_request_id(curr_request_id), client_ip(client_ip) {
 
 }
 
@@ -18,69 +23,74 @@ ClientHandler::~ClientHandler() {
 
 }
 
-void ClientHandler::handle_client_requests(int client_sockfd, CacheManager& cache, std::atomic<bool>& stop_flag, std::atomic_int& curr_request_id, std::string& client_ip) {
-
-    int buffer_read_size = 4096;
-    char buffer[buffer_read_size];
-    int buffer_index = 0;
-
-    std::string curr_message;
+int ClientHandler::get_sockfd() const {
+    return client_sockfd;
+}
 
-    bool got_headers = false; //true when got all headers for a request
-    int request_total_bytes_read; //total bytes read so far for a request
+ClientHandler::ReadResult ClientHandler::read_request() {
+    //bytes that came with the previous request first
+    std::string_view data = unparsed;
+    while (!pending && !data.empty()) {
+        data.remove_prefix(parser.feed(data));
+        if (parser.done()) {
+            pending.emplace(parser.take_request());
+        }
+    }
+    unparsed.erase(0, unparsed.length() - data.length());
+    if (pending) {
+        return READ_REQUEST;
+    }
 
-    bool force_connection_close = false;
+    char buffer[4096];
+    while (true) {
+        int bytes_read = recv(client_sockfd, buffer, sizeof(buffer), 0);
 
-    while (!stop_flag && !force_connection_close) { //will stop when it sees stop flag is set to shutdown socket and thread (or forced close)
-        try{
-            int bytes_read = recv(client_sockfd, buffer, buffer_read_size, 0);
-            
-            if (bytes_read < 0) {
-                //means something (i think error)
-            } else if (bytes_read == 0) {
-                //client closed connection
-                break;
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return READ_MORE; //drained, wait until it is readable again
+            }
+            return READ_CLOSE;
+        } else if (bytes_read == 0) {
+            //client closed connection
+            return READ_CLOSE;
+        }
 
-            curr_message += std::string(buffer, bytes_read); //ensure we copy all buffer, including past any null terminators
-
-            //start parsing our buffer
-            //after first recv, 3 cases: 
-                //1: did not get a full http request in buffer
-                        //maybe didn't get header, or if you did you didn't get full payload 
-                //2: got exactly one full http request, including any payload
-                //3: got more bytes than a full http request, so could have parts (or entirety) of other requests
-
-            // HTTP-message   = start-line
-            // *( header-field CRLF )
-            // CRLF --> Carriage Return and Line Feed ("\r\n")
-            // [ message-body ]
-
-            while (true) { //could have mutliple http requests in curr_message at once
-                HttpRequest request;
-
-                //if string curr_message doesn't contain full http message yet, returns false.
-                //Returns true otherwise, even if malformed message. 
-                //if gets valid http message, parses the message fully and removes from curr_message
-                bool res = request.parse_request(curr_message);
-                if (!res) {
-                    break; //need to recv again
-                }
-
-                int request_id = curr_request_id++;
-                //if request.parse_request determined malformed request (error code 4xx)
-                //then request.client_error_code will be set and handler should send
-                //error response to client AND THEN WE SHOULD CLOSE CONNECTION (return from handle_client_requests)                       
-                RequestHandler handler(cache);
-                int cont = handler.handle_request(request, client_sockfd, curr_request_id, client_ip);
-                if (cont == -1) { //close connection now
-                    force_connection_close = true;
-                    break; //dont care about handling anything else from buffer
-                }
+        Metrics::add(METRIC_CLIENT_BYTES_IN, bytes_read);
+        std::string_view received(buffer, bytes_read);
+        received.remove_prefix(parser.feed(received));
+        if (parser.done()) {
+            pending.emplace(parser.take_request());
+            unparsed.assign(received.data(), received.length()); //pipelined requests, parsed after this one
+            return READ_REQUEST;
+        }
+    }
+}
 
-            }
-        } catch (const std::exception& e) { //catch all errors
-            
+bool ClientHandler::handle_pending(int& tunnel_remote, int& request_id) {
+    HttpRequest request = std::move(*pending);
+    pending.reset();
+    tunnel_remote = -1;
+    request_id = curr_request_id++;
+    //if the parser determined malformed request (error code 4xx)
+    //then request.client_error_code will be set and handler should send
+    //error response to client AND THEN WE SHOULD CLOSE CONNECTION (return false)
+    //with tracing on, the request's phases are timed next to its id and kept if it turns out slow
+    TraceLog& traces = TraceLog::get_instance();
+    std::optional<RequestTrace> trace;
+    if (traces.is_enabled()) {
+        trace.emplace(request_id, request.get_method() + " " + request.get_url());
+    }
+    try {
+        RequestHandler handler(cache, trace ? &*trace : nullptr, &tunnel_remote);
+        int cont = handler.handle_request(request, client_sockfd, request_id, client_ip);
+        if (trace) {
+            traces.submit(*trace);
         }
+        return cont != -1;
+    } catch (const std::exception& e) { //keep connection and wait for more data
+        return true;
     }
-}
\ No newline at end of file
+}
@@ -2,17 +2,43 @@
 #define CLIENT_HANDLER_H
 
 #include "CacheManager.h"
+#include "RequestParser.h"
+#include "HttpRequest.h"
 #include <atomic>
+#include <optional>
+#include <string>
+#include <string_view>
 
+//per-connection state for one client socket (non-blocking). read_request reads until a request is
+//complete and handle_pending serves it on a worker: in threads mode both run on the worker the
+//ConnectionPoller handed the connection to, in epoll mode the reactor reads and hands the request
+//over, so nothing that can block runs on the reactor. A CONNECT tunnel is never relayed by
+//handle_pending, the caller gets its remote socket (TunnelRelay / EventLoop relay it)
 class ClientHandler {
 private:
+    int client_sockfd;
+    CacheManager& cache;
+    std::atomic_int& curr_request_id;
+    std::string client_ip;
+
+    RequestParser parser; //holds the partially received request between recvs
+    std::string unparsed; //read_request: bytes received after the request it completed
+    std::optional<HttpRequest> pending; //read_request's complete request, until handle_pending
 
 public:
-    ClientHandler();
+    ClientHandler(int client_sockfd, CacheManager& cache, std::atomic_int& curr_request_id, const std::string& client_ip);
     ~ClientHandler();
 
-    void handle_client_requests(int client_sockfd, CacheManager& cache, std::atomic<bool>& stop_flag, std::atomic_int& curr_request_id, std::string& client_ip);
+    int get_sockfd() const;
+
+    enum ReadResult { READ_MORE, READ_REQUEST, READ_CLOSE };
+    //reads (until EAGAIN, or until a request is complete) without handling anything.
+    //READ_REQUEST: a request is pending, hand the connection to handle_pending before reading on
+    ReadResult read_request();
+    //handles the pending request, blocking. false: close the connection. A CONNECT's established
+    //tunnel is left to the caller: tunnel_remote is its remote socket (else -1), request_id its id
+    bool handle_pending(int& tunnel_remote, int& request_id);
 };
 
 
-#endif
\ No newline at end of file
+#endif
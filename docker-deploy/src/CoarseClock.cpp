@@ -0,0 +1,150 @@
+#include "CoarseClock.h"
+#include <algorithm>
+#include <cstring>
+
+static int64_t steady_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+CoarseClock& CoarseClock::get_instance() {
+    static CoarseClock instance;
+    return instance;
+}
+
+CoarseClock::CoarseClock() : wall_seconds(0), monotonic(0), sequence(0), running(false), stopping(false), tick(1000) {
+    for (int i = 0; i < DATE_WORDS; i++) {
+        http_date_words[i] = 0;
+        log_date_words[i] = 0;
+    }
+}
+
+CoarseClock::~CoarseClock() {
+    stop();
+}
+
+CoarseClock::Date CoarseClock::format_http_date(time_t time) {
+    Date date;
+    struct tm tm;
+    date.length = strftime(date.text, sizeof(date.text), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&time, &tm));
+    return date;
+}
+
+CoarseClock::Date CoarseClock::format_log_date(time_t time) {
+    Date date;
+    struct tm tm;
+    date.length = strftime(date.text, sizeof(date.text), "%a %b %d %H:%M:%S %Y", gmtime_r(&time, &tm));
+    return date;
+}
+
+//sample both clocks; the dates are only reformatted when the second changes
+void CoarseClock::update() {
+    monotonic.store(steady_now_ns(), std::memory_order_relaxed);
+    time_t now = std::time(nullptr);
+    if (now == wall_seconds.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    Date http = format_http_date(now);
+    Date log = format_log_date(now);
+    uint64_t http_words[DATE_WORDS] = {};
+    uint64_t log_words[DATE_WORDS] = {};
+    memcpy(http_words, http.text, std::min(http.length, sizeof(http_words) - 1));
+    memcpy(log_words, log.text, std::min(log.length, sizeof(log_words) - 1));
+
+    //sequence lock, single writer: odd while rewriting, readers retry if it moved under them
+    uint32_t seq = sequence.load(std::memory_order_relaxed);
+    sequence.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (int i = 0; i < DATE_WORDS; i++) {
+        http_date_words[i].store(http_words[i], std::memory_order_relaxed);
+        log_date_words[i].store(log_words[i], std::memory_order_relaxed);
+    }
+    sequence.store(seq + 2, std::memory_order_release);
+    wall_seconds.store(now, std::memory_order_release);
+}
+
+CoarseClock::Date CoarseClock::read_date(const std::atomic<uint64_t>* words) const {
+    uint64_t copy[DATE_WORDS];
+    while (true) {
+        uint32_t before = sequence.load(std::memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        for (int i = 0; i < DATE_WORDS; i++) {
+            copy[i] = words[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (sequence.load(std::memory_order_relaxed) == before) {
+            break;
+        }
+    }
+    Date date;
+    memcpy(date.text, copy, sizeof(copy));
+    date.length = strnlen(date.text, sizeof(date.text));
+    return date;
+}
+
+void CoarseClock::ticker_loop() {
+    std::unique_lock<std::mutex> lock(ticker_mutex);
+    while (!stopping) {
+        ticker_cv.wait_for(lock, tick);
+        update();
+    }
+}
+
+void CoarseClock::start(std::chrono::microseconds tick) {
+    stop();
+    update(); //readers see current values as soon as running is set
+    {
+        std::lock_guard<std::mutex> lock(ticker_mutex);
+        this->tick = tick;
+        stopping = false;
+    }
+    ticker = std::thread(&CoarseClock::ticker_loop, this);
+    running = true;
+}
+
+void CoarseClock::stop() {
+    if (!ticker.joinable()) {
+        return;
+    }
+    running = false;
+    {
+        std::lock_guard<std::mutex> lock(ticker_mutex);
+        stopping = true;
+    }
+    ticker_cv.notify_one();
+    ticker.join();
+}
+
+bool CoarseClock::is_running() const {
+    return running.load(std::memory_order_relaxed);
+}
+
+time_t CoarseClock::now() const {
+    if (!running.load(std::memory_order_relaxed)) {
+        return std::time(nullptr);
+    }
+    return wall_seconds.load(std::memory_order_acquire);
+}
+
+int64_t CoarseClock::monotonic_ns() const {
+    if (!running.load(std::memory_order_relaxed)) {
+        return steady_now_ns();
+    }
+    return monotonic.load(std::memory_order_relaxed);
+}
+
+CoarseClock::Date CoarseClock::http_date() const {
+    if (!running.load(std::memory_order_relaxed)) {
+        return format_http_date(std::time(nullptr));
+    }
+    return read_date(http_date_words);
+}
+
+CoarseClock::Date CoarseClock::log_date() const {
+    if (!running.load(std::memory_order_relaxed)) {
+        return format_log_date(std::time(nullptr));
+    }
+    return read_date(log_date_words);
+}
@@ -0,0 +1,68 @@
+#ifndef COARSE_CLOCK_H
+#define COARSE_CLOCK_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+//process-wide clock that is read from memory instead of asked of the kernel. Once started, a
+//background thread samples the wall clock and the monotonic clock every tick and, when the second
+//changes, formats the current time as an HTTP-date (for Date headers) and as a log date.
+//Readers never lock: times are atomics and the two date strings are read under a sequence lock.
+//Values are at most one tick old. Until started (tests, tools) every call reads the real clocks
+class CoarseClock {
+public:
+    //a formatted date, returned by value so nothing points into the clock's storage
+    struct Date {
+        char text[32];
+        size_t length;
+        std::string_view view() const { return std::string_view(text, length); }
+        std::string str() const { return std::string(text, length); }
+    };
+
+private:
+    static const int DATE_WORDS = 4; //32 bytes per date
+
+    std::atomic<time_t> wall_seconds;
+    std::atomic<int64_t> monotonic;   //steady_clock, nanoseconds
+    std::atomic<uint32_t> sequence;   //odd while the dates are being rewritten
+    std::atomic<uint64_t> http_date_words[DATE_WORDS]; //the dates' bytes, NUL-padded, as atomics so
+    std::atomic<uint64_t> log_date_words[DATE_WORDS];  //a reader racing the writer reads no torn value
+    std::atomic<bool> running;
+
+    std::thread ticker;
+    std::mutex ticker_mutex;
+    std::condition_variable ticker_cv;
+    bool stopping;
+    std::chrono::microseconds tick;
+
+    CoarseClock();
+    ~CoarseClock();
+
+    void update();
+    void ticker_loop();
+    Date read_date(const std::atomic<uint64_t>* words) const;
+
+public:
+    static CoarseClock& get_instance();
+
+    void start(std::chrono::microseconds tick); //restarts with the new tick if running
+    void stop();                                //back to reading the real clocks
+    bool is_running() const;
+
+    time_t now() const;            //wall clock, seconds
+    int64_t monotonic_ns() const;  //steady_clock, nanoseconds
+    Date http_date() const;        //IMF-fixdate: Sun, 06 Nov 1994 08:49:37 GMT
+    Date log_date() const;         //the log's format: Sun Nov 06 08:49:37 1994 (UTC)
+
+    static Date format_http_date(time_t time);
+    static Date format_log_date(time_t time);
+};
+
+#endif
@@ -0,0 +1,166 @@
+#include "ConnectionPoller.h"
+#include "Logger.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#define MAX_EPOLL_EVENTS 64
+#define IDLE_CHECK_MS 1000
+
+ConnectionPoller::ConnectionPoller(std::chrono::seconds idle_timeout, Callback on_ready, Callback on_close)
+    : idle_timeout(idle_timeout), on_ready(on_ready), on_close(on_close), stopping(false), parked_count(0) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        throw std::runtime_error("Failed to create connection poller epoll instance");
+    }
+
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd < 0) {
+        close(epoll_fd);
+        throw std::runtime_error("Failed to create connection poller wakeup eventfd");
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = wakeup_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev) < 0) {
+        close(wakeup_fd);
+        close(epoll_fd);
+        throw std::runtime_error("Failed to register connection poller wakeup eventfd");
+    }
+}
+
+ConnectionPoller::~ConnectionPoller() {
+    stop();
+    close(wakeup_fd);
+    close(epoll_fd);
+}
+
+void ConnectionPoller::start() {
+    poller_thread = std::thread(&ConnectionPoller::run, this);
+}
+
+bool ConnectionPoller::park(std::shared_ptr<ClientHandler> handler) {
+    int fd = handler->get_sockfd();
+    std::lock_guard<std::mutex> lock(mutex);
+    if (stopping) {
+        return false;
+    }
+    //in the map before it is armed, the event may fire right away
+    parked[fd] = Parked{handler, std::chrono::steady_clock::now()};
+
+    //one-shot: after it fires the fd stays registered but disarmed until it is parked again
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0 && (errno != ENOENT || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)) {
+        parked.erase(fd);
+        Logger::get_instance().log_error(0, "Failed to park client connection with the poller.");
+        return false;
+    }
+    parked_count.store(parked.size(), std::memory_order_relaxed);
+    return true;
+}
+
+void ConnectionPoller::stop() {
+    std::unordered_map<int, Parked> left;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    uint64_t one = 1;
+    if (write(wakeup_fd, &one, sizeof(one)) < 0) {
+        //counter already non-zero, the poller wakes up anyway
+    }
+    if (poller_thread.joinable()) {
+        poller_thread.join();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        left.swap(parked);
+        parked_count = 0;
+    }
+    for (auto& connection : left) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection.first, nullptr);
+        on_close(connection.second.handler);
+    }
+}
+
+size_t ConnectionPoller::get_parked() const {
+    return parked_count.load(std::memory_order_relaxed);
+}
+
+//parked longer than idle_timeout without a byte arriving
+void ConnectionPoller::close_idle() {
+    std::vector<std::shared_ptr<ClientHandler>> idle;
+    auto oldest = std::chrono::steady_clock::now() - idle_timeout;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = parked.begin(); it != parked.end();) {
+            if (it->second.since <= oldest) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, it->first, nullptr);
+                idle.push_back(std::move(it->second.handler));
+                it = parked.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        parked_count.store(parked.size(), std::memory_order_relaxed);
+    }
+    for (auto& handler : idle) {
+        on_close(handler);
+    }
+}
+
+void ConnectionPoller::run() {
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    auto last_check = std::chrono::steady_clock::now();
+
+    while (true) {
+        int n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, idle_timeout.count() > 0 ? IDLE_CHECK_MS : -1);
+        if (n < 0 && errno != EINTR) {
+            Logger::get_instance().log_error(0, "epoll_wait failed, connection poller exiting.");
+            return;
+        }
+
+        std::vector<std::shared_ptr<ClientHandler>> ready;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) {
+                return;
+            }
+            for (int i = 0; i < n; i++) {
+                int fd = events[i].data.fd;
+                if (fd == wakeup_fd) {
+                    uint64_t count;
+                    while (read(wakeup_fd, &count, sizeof(count)) > 0) {}
+                    continue;
+                }
+                auto it = parked.find(fd);
+                if (it == parked.end()) {
+                    continue; //closed as idle earlier in this batch
+                }
+                ready.push_back(std::move(it->second.handler));
+                parked.erase(it);
+            }
+            parked_count.store(parked.size(), std::memory_order_relaxed);
+        }
+        //readable, peer hung up, or error: whoever serves it finds out through recv
+        for (auto& handler : ready) {
+            on_ready(handler);
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (idle_timeout.count() > 0 && now - last_check >= std::chrono::milliseconds(IDLE_CHECK_MS)) {
+            close_idle();
+            last_check = now;
+        }
+    }
+}
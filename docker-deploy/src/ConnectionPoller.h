@@ -0,0 +1,59 @@
+#ifndef CONNECTION_POLLER_H
+#define CONNECTION_POLLER_H
+
+#include "ClientHandler.h"
+#include <unordered_map>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+//threads mode: where client connections wait between requests, so an idle keep-alive client holds
+//no worker. A parked connection sits in an epoll set (one-shot); once it is readable it is taken
+//out and handed to on_ready, which serves it on a worker and parks it again afterwards.
+//Connections parked for longer than idle_timeout, and those still parked at stop(), go to on_close
+class ConnectionPoller {
+public:
+    typedef std::function<void(std::shared_ptr<ClientHandler>)> Callback;
+
+private:
+    struct Parked {
+        std::shared_ptr<ClientHandler> handler;
+        std::chrono::steady_clock::time_point since;
+    };
+
+    int epoll_fd;
+    int wakeup_fd; //eventfd used to interrupt epoll_wait on stop
+    std::chrono::seconds idle_timeout; //0 = none
+    Callback on_ready;
+    Callback on_close;
+
+    std::mutex mutex; //parked and stopping
+    std::unordered_map<int, Parked> parked; //by client fd
+    bool stopping;
+    std::atomic<size_t> parked_count;
+    std::thread poller_thread;
+
+    void run();
+    void close_idle();
+
+public:
+    //throws std::runtime_error if the epoll instance can't be set up
+    ConnectionPoller(std::chrono::seconds idle_timeout, Callback on_ready, Callback on_close);
+    ~ConnectionPoller(); //stops
+
+    ConnectionPoller(const ConnectionPoller&) = delete;
+    ConnectionPoller& operator=(const ConnectionPoller&) = delete;
+
+    void start();
+    //wait for the connection's next bytes (or its close). false once stopping, the caller closes it then
+    bool park(std::shared_ptr<ClientHandler> handler);
+    //joins the poller thread and hands every parked connection to on_close. safe to call more than once
+    void stop();
+
+    size_t get_parked() const;
+};
+
+#endif
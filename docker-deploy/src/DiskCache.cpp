@@ -0,0 +1,545 @@
+#include "DiskCache.h"
+#include "CoarseClock.h"
+#include "ResponseParser.h"
+#include "Logger.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+//every record starts with this header, followed by the key and the response's wire bytes
+//(head_length bytes of status line and headers, then the body)
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t key_length;
+    uint32_t data_length;
+    uint32_t head_length;
+    int64_t expiry_time;
+};
+
+static const uint32_t RECORD_MAGIC = 0x32435850; //"PXC2", "PXC1" records had no head_length
+static const size_t MAX_PENDING_BYTES = 64 * 1024 * 1024; //queued but not yet written
+
+DiskCache::Mapping::Mapping(int fd, size_t length) : length(length) {
+    addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        throw std::runtime_error(std::string("Failed to mmap disk cache segment: ") + strerror(errno));
+    }
+}
+
+DiskCache::Mapping::~Mapping() {
+    munmap(addr, length);
+}
+
+DiskCache::DiskCache(const std::string& directory, size_t capacity, size_t segment_size)
+    : directory(directory), capacity(capacity), segment_size(segment_size), bytes_used(0), pending_bytes(0),
+      queued(0), written(0), stopping(false), hits(0), misses(0), dropped(0) {
+    if (mkdir(directory.c_str(), 0755) < 0 && errno != EEXIST) {
+        throw std::runtime_error("Failed to create disk cache directory " + directory + ": " + strerror(errno));
+    }
+
+    load_segments();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        open_segment(segments.empty() ? 0 : segments.rbegin()->first + 1);
+    }
+    writer_thread = std::thread(&DiskCache::writer_loop, this);
+}
+
+DiskCache::~DiskCache() {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        stopping = true;
+    }
+    queue_cv.notify_all();
+    if (writer_thread.joinable()) {
+        writer_thread.join();
+    }
+
+    for (auto& segment : segments) {
+        segment.second.mapping.reset();
+        close(segment.second.fd);
+    }
+}
+
+uint64_t DiskCache::hash_key(std::string_view key) {
+    return std::hash<std::string_view>()(key);
+}
+
+//the top bits, the shard's unordered_map buckets by the bottom ones
+DiskCache::IndexShard& DiskCache::get_shard(uint64_t hash) {
+    return index[(hash >> 32) % INDEX_SHARDS];
+}
+
+std::string DiskCache::segment_path(uint32_t id) const {
+    char name[32];
+    snprintf(name, sizeof(name), "segment-%08u.dat", id);
+    return directory + "/" + name;
+}
+
+//rebuild the index from the segment files left by an earlier run. Later records win over
+//earlier ones for the same key; a record cut short (crash mid-write) ends its segment
+void DiskCache::load_segments() {
+    DIR* dir = opendir(directory.c_str());
+    if (!dir) {
+        throw std::runtime_error("Failed to open disk cache directory " + directory + ": " + strerror(errno));
+    }
+    std::vector<uint32_t> ids;
+    while (struct dirent* entry = readdir(dir)) {
+        unsigned int id;
+        char tail;
+        if (sscanf(entry->d_name, "segment-%u.dat%c", &id, &tail) == 1) {
+            ids.push_back(id);
+        }
+    }
+    closedir(dir);
+    std::sort(ids.begin(), ids.end());
+
+    time_t now = CoarseClock::get_instance().now();
+    for (uint32_t id : ids) {
+        int fd = open(segment_path(id).c_str(), O_RDWR | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            Logger::get_instance().log_warning(0, "disk cache: skipping unreadable segment " + segment_path(id));
+            if (fd >= 0) {
+                close(fd);
+            }
+            continue;
+        }
+
+        std::shared_ptr<Mapping> mapping;
+        uint64_t size = st.st_size;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            Segment& segment = segments[id];
+            segment.fd = fd;
+            segment.size = size;
+            segment.live_bytes = 0;
+            if (size == 0) {
+                continue;
+            }
+            mapping = get_mapping(segment, size);
+        }
+
+        const char* base = (const char*)mapping->addr;
+        uint64_t offset = 0;
+        while (offset + sizeof(RecordHeader) <= size) {
+            RecordHeader header;
+            memcpy(&header, base + offset, sizeof(header));
+            uint64_t length = sizeof(header) + (uint64_t)header.key_length + header.data_length;
+            if (header.magic != RECORD_MAGIC || header.head_length > header.data_length || offset + length > size) {
+                break;
+            }
+
+            if (header.expiry_time > now) {
+                uint64_t hash = hash_key(std::string_view(base + offset + sizeof(header), header.key_length));
+                index_record(hash, Location{id, (uint32_t)length, offset, header.expiry_time, mapping});
+            }
+            offset += length;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        Segment& segment = segments[id];
+        if (offset < size) {
+            //records before offset stay readable through their mapping, nothing past it is indexed
+            Logger::get_instance().log_warning(0, "disk cache: truncating " + segment_path(id) + " at byte " + std::to_string(offset));
+            if (ftruncate(fd, offset) < 0) {
+                Logger::get_instance().log_warning(0, "disk cache: failed to truncate " + segment_path(id));
+            }
+            segment.size = offset;
+        }
+        bytes_used += segment.size;
+    }
+}
+
+uint32_t DiskCache::open_segment(uint32_t id) {
+    int fd = open(segment_path(id).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to create disk cache segment " + segment_path(id) + ": " + strerror(errno));
+    }
+    Segment& segment = segments[id];
+    segment.fd = fd;
+    segment.size = 0;
+    segment.live_bytes = 0;
+    return id;
+}
+
+//mutex held. A segment is mapped once, segment_size long; only a record bigger than that
+//(alone in its segment) needs it mapped again
+std::shared_ptr<DiskCache::Mapping> DiskCache::get_mapping(Segment& segment, uint64_t end) {
+    if (!segment.mapping || segment.mapping->length < end) {
+        segment.mapping = std::make_shared<Mapping>(segment.fd, std::max<uint64_t>(end, segment_size));
+    }
+    return segment.mapping;
+}
+
+void DiskCache::forget(IndexShard& shard, uint64_t hash) {
+    auto it = shard.entries.find(hash);
+    if (it == shard.entries.end()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto segment = segments.find(it->second.segment);
+        if (segment != segments.end()) {
+            segment->second.live_bytes -= it->second.length;
+        }
+    }
+    shard.entries.erase(it);
+}
+
+void DiskCache::index_record(uint64_t hash, const Location& location) {
+    IndexShard& shard = get_shard(hash);
+    std::lock_guard<std::mutex> shard_lock(shard.mutex);
+    forget(shard, hash);
+    shard.entries[hash] = location;
+    std::lock_guard<std::mutex> lock(mutex);
+    segments[location.segment].live_bytes += location.length;
+}
+
+void DiskCache::store(const std::string& key, std::shared_ptr<HttpResponse> response, time_t expiry_time) {
+    {
+        uint64_t hash = hash_key(key);
+        IndexShard& shard = get_shard(hash);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.entries.find(hash);
+        if (it != shard.entries.end() && it->second.expiry_time == expiry_time) { //this copy is on disk already
+            return;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        size_t size = key.length() + response->body_bytes().length();
+        if (stopping || pending_bytes + size > MAX_PENDING_BYTES) {
+            dropped++;
+            return;
+        }
+        pending.push_back(PendingWrite{key, response, expiry_time});
+        pending_bytes += size;
+        queued++;
+    }
+    queue_cv.notify_one();
+}
+
+bool DiskCache::lookup(const std::string& key, std::shared_ptr<HttpResponse>& response, time_t& expiry_time) {
+    uint64_t hash = hash_key(key);
+    IndexShard& shard = get_shard(hash);
+    Location location;
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.entries.find(hash);
+        if (it == shard.entries.end()) {
+            misses++;
+            return false;
+        }
+        if (it->second.expiry_time <= CoarseClock::get_instance().now()) {
+            forget(shard, hash);
+            misses++;
+            return false;
+        }
+        location = it->second;
+    }
+
+    //the record is immutable once indexed, read it without the lock
+    const char* record = (const char*)location.mapping->addr + location.offset;
+    RecordHeader header;
+    memcpy(&header, record, sizeof(header));
+    if (header.key_length != key.length() || memcmp(record + sizeof(header), key.data(), key.length()) != 0) {
+        misses++; //another key with the same hash
+        return false;
+    }
+
+    const char* data = record + sizeof(header) + header.key_length;
+    ResponseParser parser(true);
+    parser.feed(std::string_view(data, header.head_length));
+    if (!parser.head_done() || parser.failed()) {
+        misses++;
+        return false;
+    }
+
+    response = std::make_shared<HttpResponse>(std::move(parser.get_response()));
+    response->body_owner = location.mapping;
+    response->mapped_body = std::string_view(data + header.head_length, header.data_length - header.head_length);
+    expiry_time = location.expiry_time;
+    hits++;
+    return true;
+}
+
+bool DiskCache::contains(const std::string& key) {
+    uint64_t hash = hash_key(key);
+    IndexShard& shard = get_shard(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.entries.find(hash);
+    return it != shard.entries.end() && it->second.expiry_time > CoarseClock::get_instance().now();
+}
+
+void DiskCache::remove(const std::string& key) {
+    uint64_t hash = hash_key(key);
+    IndexShard& shard = get_shard(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    forget(shard, hash);
+}
+
+void DiskCache::flush() {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    uint64_t target = queued;
+    written_cv.wait(lock, [&]{ return written >= target; });
+}
+
+void DiskCache::writer_loop() {
+    while (true) {
+        std::deque<PendingWrite> batch;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_cv.wait_for(lock, std::chrono::seconds(10), [&]{ return !pending.empty() || stopping; });
+            if (pending.empty() && stopping) {
+                break;
+            }
+            batch.swap(pending);
+            pending_bytes = 0;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(write_mutex);
+            for (const PendingWrite& write : batch) {
+                write_entry(write);
+            }
+            enforce_capacity();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            written += batch.size();
+        }
+        written_cv.notify_all();
+
+        compact();
+    }
+}
+
+void DiskCache::write_entry(const PendingWrite& write) {
+    append_record(write.key, write.response->serialize_head(), write.response->body_bytes(), write.expiry_time, nullptr, nullptr);
+}
+
+//append one record to the current segment (starting a new one if it is full) and point the index
+//at it. With only_if_segment set (compaction), the index is only updated if it still points to
+//the old copy at only_if_segment/only_if_offset. write_mutex held
+bool DiskCache::append_record(std::string_view key, std::string_view head, std::string_view body, time_t expiry_time, uint32_t* only_if_segment,
+                              uint64_t* only_if_offset) {
+    uint64_t length = sizeof(RecordHeader) + key.length() + head.length() + body.length();
+    if (length > UINT32_MAX) {
+        return false;
+    }
+
+    RecordHeader header = {RECORD_MAGIC, (uint32_t)key.length(), (uint32_t)(head.length() + body.length()), (uint32_t)head.length(), (int64_t)expiry_time};
+    std::string record;
+    record.reserve(length);
+    record.append((const char*)&header, sizeof(header)).append(key).append(head).append(body);
+
+    uint32_t id;
+    int fd;
+    uint64_t offset;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Segment& current = segments.rbegin()->second;
+        if (current.size > 0 && current.size + length > segment_size) {
+            try {
+                open_segment(segments.rbegin()->first + 1);
+            } catch (const std::exception& e) { //keep appending to the full one
+                Logger::get_instance().log_error(0, e.what());
+            }
+        }
+        id = segments.rbegin()->first;
+        fd = segments.rbegin()->second.fd;
+        offset = segments.rbegin()->second.size;
+    }
+
+    size_t done = 0;
+    while (done < record.length()) {
+        ssize_t n = pwrite(fd, record.data() + done, record.length() - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            Logger::get_instance().log_error(0, "disk cache: write to " + segment_path(id) + " failed: " + strerror(errno));
+            if (ftruncate(fd, offset) < 0) { //don't leave half a record behind
+                Logger::get_instance().log_error(0, "disk cache: failed to truncate " + segment_path(id));
+            }
+            return false;
+        }
+        done += n;
+    }
+
+    std::shared_ptr<Mapping> mapping;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Segment& segment = segments[id];
+        segment.size += length;
+        bytes_used += length;
+        try {
+            mapping = get_mapping(segment, offset + length);
+        } catch (const std::exception& e) { //written but never indexed, dead space
+            Logger::get_instance().log_error(0, "disk cache: ", e.what());
+            return false;
+        }
+    }
+
+    uint64_t hash = hash_key(key);
+    IndexShard& shard = get_shard(hash);
+    std::lock_guard<std::mutex> shard_lock(shard.mutex);
+    if (only_if_segment) {
+        auto it = shard.entries.find(hash);
+        if (it == shard.entries.end() || it->second.segment != *only_if_segment || it->second.offset != *only_if_offset) {
+            return false; //replaced or removed meanwhile, the copy is dead space
+        }
+    }
+    forget(shard, hash);
+    shard.entries[hash] = Location{id, (uint32_t)length, offset, (int64_t)expiry_time, mapping};
+    std::lock_guard<std::mutex> lock(mutex);
+    segments[id].live_bytes += length;
+    return true;
+}
+
+//delete a sealed segment and everything the index has in it. write_mutex held
+void DiskCache::drop_segment(uint32_t id) {
+    for (IndexShard& shard : index) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (auto it = shard.entries.begin(); it != shard.entries.end();) {
+            if (it->second.segment == id) {
+                it = shard.entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto segment = segments.find(id);
+        if (segment == segments.end()) {
+            return;
+        }
+        bytes_used -= segment->second.size;
+        segment->second.mapping.reset(); //responses still being sent out of it keep their own reference
+        close(segment->second.fd);
+        segments.erase(segment);
+    }
+    unlink(segment_path(id).c_str());
+}
+
+//over budget: the oldest segments go first, like a FIFO over whole segments. write_mutex held
+void DiskCache::enforce_capacity() {
+    while (true) {
+        uint32_t oldest;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (bytes_used <= capacity || segments.size() <= 1) {
+                return;
+            }
+            oldest = segments.begin()->first;
+        }
+        drop_segment(oldest);
+    }
+}
+
+void DiskCache::compact() {
+    std::lock_guard<std::mutex> write_lock(write_mutex);
+
+    std::vector<uint32_t> sparse;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint32_t current = segments.rbegin()->first;
+        for (auto& segment : segments) {
+            if (segment.first != current && segment.second.live_bytes * 2 < segment.second.size) {
+                sparse.push_back(segment.first);
+            }
+        }
+    }
+
+    time_t now = CoarseClock::get_instance().now();
+    for (uint32_t id : sparse) {
+        std::shared_ptr<Mapping> mapping;
+        uint64_t size;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto segment = segments.find(id);
+            if (segment == segments.end()) {
+                continue;
+            }
+            size = segment->second.size;
+            if (size > 0) {
+                try {
+                    mapping = get_mapping(segment->second, size);
+                } catch (const std::exception& e) {
+                    Logger::get_instance().log_error(0, std::string("disk cache: ") + e.what());
+                    continue;
+                }
+            }
+        }
+
+        //copy forward the records the index still points to
+        uint64_t offset = 0;
+        while (mapping && offset + sizeof(RecordHeader) <= size) {
+            const char* record = (const char*)mapping->addr + offset;
+            RecordHeader header;
+            memcpy(&header, record, sizeof(header));
+            uint64_t length = sizeof(header) + (uint64_t)header.key_length + header.data_length;
+            std::string_view key(record + sizeof(header), header.key_length);
+
+            bool live;
+            {
+                uint64_t hash = hash_key(key);
+                IndexShard& shard = get_shard(hash);
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                auto it = shard.entries.find(hash);
+                live = it != shard.entries.end() && it->second.segment == id && it->second.offset == offset && header.expiry_time > now;
+            }
+            if (live) {
+                const char* data = record + sizeof(header) + header.key_length;
+                append_record(key, std::string_view(data, header.head_length),
+                              std::string_view(data + header.head_length, header.data_length - header.head_length), header.expiry_time, &id, &offset);
+            }
+            offset += length;
+        }
+        drop_segment(id);
+    }
+}
+
+size_t DiskCache::get_entry_count() {
+    size_t count = 0;
+    for (IndexShard& shard : index) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        count += shard.entries.size();
+    }
+    return count;
+}
+
+uint64_t DiskCache::get_bytes_used() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return bytes_used;
+}
+
+size_t DiskCache::get_segment_count() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return segments.size();
+}
+
+uint64_t DiskCache::get_hits() const {
+    return hits;
+}
+
+uint64_t DiskCache::get_misses() const {
+    return misses;
+}
+
+uint64_t DiskCache::get_dropped() const {
+    return dropped;
+}
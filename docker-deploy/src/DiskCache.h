@@ -0,0 +1,139 @@
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include "HttpResponse.h"
+#include <unordered_map>
+#include <map>
+#include <deque>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <string_view>
+
+//second cache tier on disk. Entries evicted from the memory cache are appended (by a background
+//thread) to log-structured segment files in one directory, each record holding the key, the
+//expiry time and the response's wire bytes. A hit is served straight out of an mmap of the
+//segment: only the head is parsed, the body is a view of the mapping (see HttpResponse::body_owner).
+//The index in memory is only a 64-bit key hash -> location, split into shards with a lock each;
+//the key itself is checked against the record on a hit.
+//Space is reclaimed two ways: when the directory is over its byte budget the oldest segment is
+//deleted, and sealed segments that are mostly dead (overwritten or expired records) get their
+//live records copied forward. Segments are read back at startup, so the tier survives restarts
+class DiskCache {
+private:
+    //a read-only mapping of a segment file, segment_size long so records appended later are in it
+    //too (only bytes already written are ever read). Index entries and responses served from it hold
+    //a shared_ptr, so a segment can be remapped or deleted while its records are still being sent
+    struct Mapping {
+        void* addr;
+        size_t length;
+        Mapping(int fd, size_t length);
+        ~Mapping();
+    };
+
+    struct Segment {
+        int fd;
+        uint64_t size;       //bytes written
+        uint64_t live_bytes; //bytes of records the index still points to
+        std::shared_ptr<Mapping> mapping;
+    };
+
+    struct Location {
+        uint32_t segment;
+        uint32_t length; //whole record, header included
+        uint64_t offset;
+        int64_t expiry_time;
+        std::shared_ptr<Mapping> mapping; //covers the record, so a lookup needs no other lock
+    };
+
+    struct IndexShard {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, Location> entries;
+    };
+    static const size_t INDEX_SHARDS = 16;
+
+    struct PendingWrite {
+        std::string key;
+        std::shared_ptr<HttpResponse> response;
+        time_t expiry_time;
+    };
+
+    std::string directory;
+    size_t capacity;     //bytes of segment files kept
+    size_t segment_size; //a segment is sealed once it is this big
+
+    //lock order: an index shard's mutex, then mutex
+    IndexShard index[INDEX_SHARDS]; //by hash
+    std::mutex mutex; //segments and bytes_used
+    std::map<uint32_t, Segment> segments; //by id, oldest first; the last one is written to
+    uint64_t bytes_used;
+
+    //all writing (new records, compaction, dropping segments) happens on writer_thread,
+    //or under write_mutex when compact() is called from outside
+    std::mutex write_mutex;
+    std::thread writer_thread;
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;   //new pending writes or stop
+    std::condition_variable written_cv; //a batch of pending writes is on disk
+    std::deque<PendingWrite> pending;
+    size_t pending_bytes;
+    uint64_t queued;  //writes accepted so far
+    uint64_t written; //writes finished (or failed) so far
+    bool stopping;
+
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> dropped; //writes skipped because the queue was full
+
+    static uint64_t hash_key(std::string_view key);
+    IndexShard& get_shard(uint64_t hash);
+    std::string segment_path(uint32_t id) const;
+    void load_segments();
+    uint32_t open_segment(uint32_t id); //creates an empty segment file, mutex held
+    std::shared_ptr<Mapping> get_mapping(Segment& segment, uint64_t end);
+    void writer_loop();
+    bool append_record(std::string_view key, std::string_view head, std::string_view body, time_t expiry_time, uint32_t* only_if_segment,
+                       uint64_t* only_if_offset);
+    void write_entry(const PendingWrite& write);
+    void drop_segment(uint32_t id);
+    void enforce_capacity();
+    void forget(IndexShard& shard, uint64_t hash); //shard's mutex held
+    void index_record(uint64_t hash, const Location& location); //replaces what hash had, no lock held
+
+public:
+    //uses (and creates if needed) directory, reading back any segments already there.
+    //throws std::runtime_error if the directory can't be used
+    DiskCache(const std::string& directory, size_t capacity, size_t segment_size);
+    ~DiskCache(); //finishes queued writes first
+
+    //queue an entry to be written, returns right away. Dropped if too much is already queued
+    //or if the same entry (key and expiry) is on disk already
+    void store(const std::string& key, std::shared_ptr<HttpResponse> response, time_t expiry_time);
+
+    //read an entry back: its head parsed, its body left in the segment's mapping.
+    //Expired entries are forgotten and count as a miss
+    bool lookup(const std::string& key, std::shared_ptr<HttpResponse>& response, time_t& expiry_time);
+    bool contains(const std::string& key);
+    void remove(const std::string& key);
+
+    //wait until everything queued so far has been written
+    void flush();
+
+    //copy the live records of sealed segments that are less than half live into the current
+    //segment and delete them. Runs on the writer thread after each batch of writes
+    void compact();
+
+    size_t get_entry_count();
+    uint64_t get_bytes_used();
+    size_t get_segment_count();
+    uint64_t get_hits() const;
+    uint64_t get_misses() const;
+    uint64_t get_dropped() const;
+};
+
+#endif
@@ -0,0 +1,312 @@
+#include "DnsCache.h"
+#include "Logger.h"
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#define DNS_CACHE_MAX_ENTRIES 10000
+
+DnsCache& DnsCache::get_instance() {
+    static DnsCache instance;
+    return instance;
+}
+
+DnsCache::DnsCache() : resolver(&DnsCache::system_resolve), positive_ttl(60), negative_ttl(5), refresh_ahead(10),
+                       refresh_min_hits(2), max_entries(DNS_CACHE_MAX_ENTRIES), stop_refresh(false), hits(0), misses(0), refreshes(0) {}
+
+DnsCache::~DnsCache() {
+    stop_refresher();
+}
+
+//default resolver: blocking getaddrinfo, results copied out of the addrinfo list
+int DnsCache::system_resolve(const std::string& host, const std::string& port, std::vector<ResolvedAddress>& out) {
+    struct addrinfo hints{}, *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int status = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+    if (status != 0) {
+        return status;
+    }
+
+    for (struct addrinfo* it = res; it != NULL; it = it->ai_next) {
+        ResolvedAddress address;
+        memset(&address, 0, sizeof(address));
+        address.family = it->ai_family;
+        address.socktype = it->ai_socktype;
+        address.protocol = it->ai_protocol;
+        address.addr_len = it->ai_addrlen;
+        memcpy(&address.addr, it->ai_addr, it->ai_addrlen);
+        out.push_back(address);
+    }
+
+    freeaddrinfo(res);
+    return out.empty() ? EAI_NONAME : 0;
+}
+
+void DnsCache::configure(int positive_ttl_seconds, int negative_ttl_seconds, int refresh_ahead_seconds) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    positive_ttl = std::chrono::seconds(positive_ttl_seconds);
+    negative_ttl = std::chrono::seconds(negative_ttl_seconds);
+    refresh_ahead = std::chrono::seconds(refresh_ahead_seconds);
+}
+
+void DnsCache::set_resolver(Resolver resolver) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    this->resolver = resolver;
+}
+
+void DnsCache::clear() {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    for (auto it = entries.begin(); it != entries.end();) {
+        if (it->second.resolving) { //someone is waiting on it, leave it
+            ++it;
+        } else {
+            it = entries.erase(it);
+        }
+    }
+    static_hosts.clear();
+}
+
+//hosts file format: one "address name [name...]" per line, '#' starts a comment
+bool DnsCache::load_hosts_file(const std::string& path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    std::unordered_map<std::string, std::vector<std::string>> loaded;
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t comment = line.find('#');
+        if (comment != std::string::npos) {
+            line.erase(comment);
+        }
+
+        std::istringstream line_stream(line);
+        std::string ip, name;
+        if (!(line_stream >> ip)) {
+            continue;
+        }
+
+        unsigned char buf[sizeof(struct in6_addr)];
+        if (inet_pton(AF_INET, ip.c_str(), buf) != 1 && inet_pton(AF_INET6, ip.c_str(), buf) != 1) {
+            Logger::get_instance().log_warning(0, "Ignoring bad address in hosts file: " + ip);
+            continue;
+        }
+
+        while (line_stream >> name) {
+            loaded[name].push_back(ip);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    static_hosts = loaded;
+    return true;
+}
+
+//build addresses for a hosts file entry with the requested port filled in
+bool DnsCache::static_lookup(const std::vector<std::string>& ips, const std::string& port, std::vector<ResolvedAddress>& out) {
+    int port_num = 0;
+    try {
+        port_num = std::stoi(port);
+    } catch (...) {
+        return false;
+    }
+
+    for (const auto& ip : ips) {
+        ResolvedAddress address;
+        memset(&address, 0, sizeof(address));
+        address.socktype = SOCK_STREAM;
+
+        sockaddr_in* v4 = (sockaddr_in*)&address.addr;
+        sockaddr_in6* v6 = (sockaddr_in6*)&address.addr;
+        if (inet_pton(AF_INET, ip.c_str(), &v4->sin_addr) == 1) {
+            address.family = AF_INET;
+            v4->sin_family = AF_INET;
+            v4->sin_port = htons(port_num);
+            address.addr_len = sizeof(sockaddr_in);
+        } else if (inet_pton(AF_INET6, ip.c_str(), &v6->sin6_addr) == 1) {
+            address.family = AF_INET6;
+            v6->sin6_family = AF_INET6;
+            v6->sin6_port = htons(port_num);
+            address.addr_len = sizeof(sockaddr_in6);
+        } else {
+            continue;
+        }
+        out.push_back(address);
+    }
+
+    return !out.empty();
+}
+
+//must hold cache_mutex. keeps the map bounded, only ever drops entries nobody is waiting on
+void DnsCache::evict_if_needed(Clock::time_point now) {
+    if (entries.size() < max_entries) {
+        return;
+    }
+
+    for (auto it = entries.begin(); it != entries.end();) {
+        if (!it->second.resolving && now >= it->second.expires_at) {
+            it = entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    //everything still fresh, drop arbitrary entries
+    for (auto it = entries.begin(); it != entries.end() && entries.size() >= max_entries;) {
+        if (!it->second.resolving) {
+            it = entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+//must hold cache_mutex. a failed background refresh keeps the old addresses until they expire
+void DnsCache::store(const std::string& key, int res, std::vector<ResolvedAddress>& addresses, bool is_refresh) {
+    Entry& entry = entries[key];
+    entry.resolving = false;
+
+    if (res != 0 && is_refresh && entry.valid && entry.error == 0) {
+        return;
+    }
+
+    entry.valid = true;
+    entry.error = res;
+    entry.addresses.swap(addresses);
+    entry.expires_at = Clock::now() + (res == 0 ? positive_ttl : negative_ttl);
+    entry.hits_since_refresh = 0;
+}
+
+int DnsCache::resolve(const std::string& host, const std::string& port, std::vector<ResolvedAddress>& out) {
+    std::string key = host + ":" + port;
+    Resolver resolve_fn;
+
+    {
+        std::unique_lock<std::mutex> lock(cache_mutex);
+
+        auto static_it = static_hosts.find(host);
+        if (static_it != static_hosts.end() && static_lookup(static_it->second, port, out)) {
+            hits++;
+            return 0;
+        }
+
+        while (true) {
+            auto it = entries.find(key);
+            if (it != entries.end()) {
+                Entry& entry = it->second;
+
+                if (entry.valid && Clock::now() < entry.expires_at) {
+                    entry.hits_since_refresh++;
+                    hits++;
+                    out = entry.addresses;
+                    return entry.error;
+                }
+
+                if (entry.resolving) { //someone is already looking this up, wait for their answer
+                    resolved_cv.wait(lock);
+                    continue;
+                }
+            } else {
+                evict_if_needed(Clock::now());
+            }
+
+            break;
+        }
+
+        //we are the resolving thread for this key
+        entries[key].resolving = true;
+        misses++;
+        resolve_fn = resolver;
+    }
+
+    std::vector<ResolvedAddress> addresses;
+    int res = resolve_fn(host, port, addresses);
+
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        out = addresses;
+        store(key, res, addresses, false);
+        resolved_cv.notify_all();
+    }
+
+    return res;
+}
+
+void DnsCache::start_refresher() {
+    if (refresh_thread.joinable() || refresh_ahead.count() <= 0) {
+        return;
+    }
+    stop_refresh = false;
+    refresh_thread = std::thread(&DnsCache::refresh_loop, this);
+}
+
+void DnsCache::stop_refresher() {
+    {
+        std::lock_guard<std::mutex> lock(refresh_mutex);
+        stop_refresh = true;
+        refresh_cv.notify_all();
+    }
+
+    if (refresh_thread.joinable()) {
+        refresh_thread.join();
+    }
+}
+
+//once a second, re-resolve popular positive entries that expire within refresh_ahead.
+//they stay servable (still fresh) while the refresh runs
+void DnsCache::refresh_loop() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(refresh_mutex);
+            refresh_cv.wait_for(lock, std::chrono::seconds(1), [&]{ return stop_refresh.load(); });
+            if (stop_refresh) {
+                return;
+            }
+        }
+
+        std::vector<std::string> due;
+        Resolver resolve_fn;
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            Clock::time_point now = Clock::now();
+            for (auto& item : entries) {
+                Entry& entry = item.second;
+                if (entry.valid && !entry.resolving && entry.error == 0 && entry.hits_since_refresh >= refresh_min_hits &&
+                    now < entry.expires_at && entry.expires_at - now <= refresh_ahead) {
+                    entry.resolving = true;
+                    due.push_back(item.first);
+                }
+            }
+            resolve_fn = resolver;
+        }
+
+        for (const auto& key : due) {
+            size_t colon = key.rfind(':');
+            std::vector<ResolvedAddress> addresses;
+            int res = resolve_fn(key.substr(0, colon), key.substr(colon + 1), addresses);
+
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            store(key, res, addresses, true);
+            refreshes++;
+            resolved_cv.notify_all();
+        }
+    }
+}
+
+uint64_t DnsCache::get_hits() const {
+    return hits.load();
+}
+
+uint64_t DnsCache::get_misses() const {
+    return misses.load();
+}
+
+uint64_t DnsCache::get_refreshes() const {
+    return refreshes.load();
+}
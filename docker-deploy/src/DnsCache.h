@@ -0,0 +1,96 @@
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <sys/socket.h>
+#include <unordered_map>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <chrono>
+#include <atomic>
+#include <cstdint>
+
+//one address a host resolved to, copied out of getaddrinfo's list so it can outlive it
+struct ResolvedAddress {
+    int family;
+    int socktype;
+    int protocol;
+    sockaddr_storage addr;
+    socklen_t addr_len;
+};
+
+//process-wide resolver cache keyed by "host:port". Successful lookups are kept for the positive
+//TTL, failures for the (shorter) negative TTL. Concurrent misses for the same key wait for the
+//one lookup already in flight instead of each calling the resolver, and entries that keep
+//getting hit are re-resolved by a background thread shortly before they expire so workers
+//don't block on the resolver for popular hosts.
+class DnsCache {
+public:
+    //returns 0 and fills out on success, non-zero (getaddrinfo error code) on failure
+    typedef std::function<int(const std::string& host, const std::string& port, std::vector<ResolvedAddress>& out)> Resolver;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Entry {
+        std::vector<ResolvedAddress> addresses;
+        int error = 0; //non-zero = negative entry, resolver's error code
+        Clock::time_point expires_at;
+        uint32_t hits_since_refresh = 0;
+        bool resolving = false; //a thread is calling the resolver for this key right now
+        bool valid = false;     //has completed at least one lookup
+    };
+
+    std::mutex cache_mutex;
+    std::condition_variable resolved_cv; //woken whenever an in-flight lookup finishes
+    std::unordered_map<std::string, Entry> entries;
+    std::unordered_map<std::string, std::vector<std::string>> static_hosts; //name -> addresses from hosts file, never expire
+
+    Resolver resolver;
+    std::chrono::seconds positive_ttl;
+    std::chrono::seconds negative_ttl;
+    std::chrono::seconds refresh_ahead;  //refresh popular entries this long before they expire
+    uint32_t refresh_min_hits;           //hits since last refresh for an entry to count as popular
+    size_t max_entries;
+
+    std::thread refresh_thread;
+    std::atomic<bool> stop_refresh;
+    std::mutex refresh_mutex;
+    std::condition_variable refresh_cv;
+
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> refreshes;
+
+    DnsCache();
+    ~DnsCache();
+
+    void refresh_loop();
+    void store(const std::string& key, int res, std::vector<ResolvedAddress>& addresses, bool is_refresh);
+    static bool static_lookup(const std::vector<std::string>& ips, const std::string& port, std::vector<ResolvedAddress>& out);
+    void evict_if_needed(Clock::time_point now);
+
+public:
+    static DnsCache& get_instance();
+
+    static int system_resolve(const std::string& host, const std::string& port, std::vector<ResolvedAddress>& out);
+
+    void configure(int positive_ttl_seconds, int negative_ttl_seconds, int refresh_ahead_seconds);
+    void set_resolver(Resolver resolver); //swap in a stub resolver (tests)
+    bool load_hosts_file(const std::string& path); //"address name [name...]" lines, like /etc/hosts
+    void start_refresher();
+    void stop_refresher();
+    void clear();
+
+    //returns 0 and fills out on success, resolver error code on failure (possibly cached)
+    int resolve(const std::string& host, const std::string& port, std::vector<ResolvedAddress>& out);
+
+    uint64_t get_hits() const;
+    uint64_t get_misses() const;
+    uint64_t get_refreshes() const;
+};
+
+#endif
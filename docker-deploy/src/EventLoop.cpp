@@ -0,0 +1,400 @@
+#include "EventLoop.h"
+#include "Listener.h"
+#include "Logger.h"
+#include "RequestHandler.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#define MAX_EPOLL_EVENTS 64
+#define LISTENER_PAUSE_MS 100
+
+static bool set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) >= 0;
+}
+
+EventLoop::EventLoop(int shard_id, int listening_sockfd, CacheManager& cache, WorkerPool& workers, std::atomic<bool>& stop_flag,
+                     std::atomic_int& curr_request_id)
+    : shard_id(shard_id), listening_sockfd(listening_sockfd), reserve_fd(-1), listener_paused(false), active_connections(0),
+      accepted_connections(0), cache(cache), workers(workers), stop_flag(stop_flag), curr_request_id(curr_request_id) {
+    if (!set_nonblocking(listening_sockfd)) {
+        close(listening_sockfd);
+        throw std::runtime_error("Failed to make listening socket non-blocking");
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        close(listening_sockfd);
+        throw std::runtime_error("Failed to create epoll instance");
+    }
+
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd < 0) {
+        close(epoll_fd);
+        close(listening_sockfd);
+        throw std::runtime_error("Failed to create reactor wakeup eventfd");
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = wakeup_fd;
+    int res = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev);
+
+    //level-triggered for the listener, we accept until EAGAIN anyway
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = listening_sockfd;
+    if (res < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listening_sockfd, &ev) < 0) {
+        close(wakeup_fd);
+        close(epoll_fd);
+        close(listening_sockfd);
+        throw std::runtime_error("Failed to register reactor sockets with epoll");
+    }
+    reserve_fd = open_reserve_fd();
+}
+
+EventLoop::~EventLoop() {
+    //the worker pool is shut down by now, nothing is busy and no completion is still coming
+    std::vector<int> open_fds;
+    for (auto& conn : connections) {
+        open_fds.push_back(conn.first);
+    }
+    for (int fd : open_fds) {
+        close_connection(fd);
+    }
+    for (auto& done : completions) {
+        if (done.tunnel_remote >= 0) {
+            close(done.tunnel_remote);
+        }
+    }
+
+    close(listening_sockfd);
+    close(wakeup_fd);
+    close(epoll_fd);
+    if (reserve_fd >= 0) {
+        close(reserve_fd);
+    }
+}
+
+void EventLoop::listen_for_connections(int backlog) {
+    if (listen(listening_sockfd, backlog) < 0) {
+        throw std::runtime_error("Failed to set up shard " + std::to_string(shard_id) + " socket to listen for incoming connections");
+    }
+}
+
+int EventLoop::get_shard_id() const {
+    return shard_id;
+}
+
+size_t EventLoop::get_active_connections() const {
+    return active_connections.load(std::memory_order_relaxed);
+}
+
+uint64_t EventLoop::get_accepted_connections() const {
+    return accepted_connections.load(std::memory_order_relaxed);
+}
+
+void EventLoop::wakeup() {
+    uint64_t one = 1;
+    if (write(wakeup_fd, &one, sizeof(one)) < 0) {
+        //counter already non-zero, reactor will wake up anyway
+    }
+}
+
+void EventLoop::accept_connections() {
+    size_t refused = 0;
+    while (true) {
+        sockaddr_in client_address;
+        memset(&client_address, 0, sizeof(client_address));
+        socklen_t client_address_len = sizeof(client_address);
+
+        int client_sockfd = accept4(listening_sockfd, (sockaddr*)&client_address, &client_address_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sockfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE) {
+                //the connection stays in the backlog and the level-triggered listener would report it again
+                //straight away, so refuse it, or stop listening for a bit if even that isn't possible
+                int res = refuse_connection(listening_sockfd, reserve_fd);
+                if (res > 0) {
+                    refused++;
+                    continue;
+                }
+                if (res < 0) {
+                    pause_listener();
+                }
+            }
+            break; //EAGAIN: backlog drained, or some other error, try again on next event
+        }
+        char ip_src[64];
+        inet_ntop(AF_INET, &client_address.sin_addr, ip_src, sizeof(ip_src)); //convert ip of client to string
+        std::string client_ip(ip_src);
+
+        Connection conn;
+        conn.handler = std::make_shared<ClientHandler>(client_sockfd, cache, curr_request_id, client_ip);
+        conn.busy = false;
+        conn.registered = false;
+        conn.remote_sockfd = -1;
+        conn.remote_registered = false;
+        conn.request_id = 0;
+        if (!set_interest(client_sockfd, EPOLLIN | EPOLLRDHUP | EPOLLET, conn.registered)) {
+            Logger::get_instance().log_error(0, "Failed to register client connection with reactor.");
+            close(client_sockfd);
+            continue;
+        }
+
+        connections[client_sockfd] = std::move(conn);
+        accepted_connections.fetch_add(1, std::memory_order_relaxed);
+        active_connections.store(connections.size(), std::memory_order_relaxed);
+    }
+
+    if (refused > 0) {
+        Logger::get_instance().log_warning(0, "Shard " + std::to_string(shard_id) + " is out of file descriptors, refused " +
+                                              std::to_string(refused) + " connections");
+    }
+}
+
+void EventLoop::pause_listener() {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listening_sockfd, nullptr);
+    listener_paused = true;
+    listener_resume_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(LISTENER_PAUSE_MS);
+    Logger::get_instance().log_warning(0, "Shard " + std::to_string(shard_id) + " is out of file descriptors, not accepting for " +
+                                          std::to_string(LISTENER_PAUSE_MS) + " ms");
+}
+
+void EventLoop::resume_listener() {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = listening_sockfd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listening_sockfd, &ev);
+    listener_paused = false;
+}
+
+//adds, changes or (events 0) removes fd's registration. a tunnel fd with nothing wanted must be
+//out of the set, a hung up socket would otherwise report EPOLLHUP on every wait
+bool EventLoop::set_interest(int fd, uint32_t events, bool& registered) {
+    if (events == 0) {
+        if (registered) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+            registered = false;
+        }
+        return true;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    int op = registered ? (int)EPOLL_CTL_MOD : (int)EPOLL_CTL_ADD;
+    if (epoll_ctl(epoll_fd, op, fd, &ev) < 0) {
+        return false;
+    }
+    registered = true;
+    return true;
+}
+
+//reads what the client sent; a complete request goes to a worker, with the fd out of epoll so
+//nothing else happens on the connection until the worker is done (see take_completions)
+void EventLoop::serve(int client_sockfd) {
+    Connection& conn = connections[client_sockfd];
+    ClientHandler::ReadResult result = conn.handler->read_request();
+    if (result == ClientHandler::READ_MORE) {
+        return;
+    }
+    if (result == ClientHandler::READ_CLOSE) {
+        close_connection(client_sockfd);
+        return;
+    }
+
+    set_interest(client_sockfd, 0, conn.registered);
+    std::shared_ptr<ClientHandler> handler = conn.handler;
+    bool submitted = workers.submit([this, handler, client_sockfd]() {
+        int tunnel_remote;
+        int request_id;
+        bool keep = handler->handle_pending(tunnel_remote, request_id);
+        complete({client_sockfd, keep, tunnel_remote, request_id});
+    });
+    if (!submitted) {
+        Logger::get_instance().log_warning(0, "Worker queues full, dropping a client connection");
+        close_connection(client_sockfd);
+        return;
+    }
+    conn.busy = true;
+}
+
+void EventLoop::complete(const Completion& done) {
+    {
+        std::lock_guard<std::mutex> lock(completions_lock);
+        completions.push_back(done);
+    }
+    wakeup();
+}
+
+void EventLoop::take_completions() {
+    std::vector<Completion> done;
+    {
+        std::lock_guard<std::mutex> lock(completions_lock);
+        done.swap(completions);
+    }
+
+    for (const Completion& completion : done) {
+        int fd = completion.client_sockfd;
+        auto it = connections.find(fd);
+        if (it == connections.end()) { //busy connections are never closed, this is only defensive
+            if (completion.tunnel_remote >= 0) {
+                close(completion.tunnel_remote);
+            }
+            continue;
+        }
+        Connection& conn = it->second;
+        conn.busy = false;
+        if (completion.tunnel_remote >= 0) {
+            start_tunnel(conn, completion.tunnel_remote, completion.request_id);
+            if (!relay(fd)) {
+                close_connection(fd);
+            }
+            continue;
+        }
+        if (!completion.keep || stop_flag) {
+            close_connection(fd);
+            continue;
+        }
+        //edge-triggered: whatever arrived while it was out of the set is read now
+        if (!set_interest(fd, EPOLLIN | EPOLLRDHUP | EPOLLET, conn.registered)) {
+            close_connection(fd);
+            continue;
+        }
+        serve(fd);
+    }
+}
+
+void EventLoop::start_tunnel(Connection& conn, int tunnel_remote, int request_id) {
+    conn.tunnel = std::make_unique<Tunnel>(conn.handler->get_sockfd(), tunnel_remote);
+    conn.tunnel->start();
+    conn.remote_sockfd = tunnel_remote;
+    conn.request_id = request_id;
+    tunnel_remotes[tunnel_remote] = conn.handler->get_sockfd();
+}
+
+static uint32_t epoll_events(short poll_events) {
+    uint32_t events = 0;
+    if (poll_events & POLLIN) {
+        events |= EPOLLIN;
+    }
+    if (poll_events & POLLOUT) {
+        events |= EPOLLOUT;
+    }
+    return events;
+}
+
+//moves what can be moved either way, then waits (level-triggered) for what the tunnel asks for.
+//false once the tunnel is done or broken
+bool EventLoop::relay(int client_sockfd) {
+    Connection& conn = connections[client_sockfd];
+    if (!conn.tunnel->step()) {
+        return false;
+    }
+    short client_events;
+    short remote_events;
+    conn.tunnel->wanted_events(client_events, remote_events);
+    return set_interest(client_sockfd, epoll_events(client_events), conn.registered) &&
+           set_interest(conn.remote_sockfd, epoll_events(remote_events), conn.remote_registered);
+}
+
+void EventLoop::close_connection(int client_sockfd) {
+    auto it = connections.find(client_sockfd);
+    if (it == connections.end()) {
+        return;
+    }
+    Connection& conn = it->second;
+    if (conn.registered) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_sockfd, nullptr);
+    }
+    if (conn.tunnel) {
+        if (conn.remote_registered) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn.remote_sockfd, nullptr);
+        }
+        tunnel_remotes.erase(conn.remote_sockfd);
+        conn.tunnel->finish();
+        RequestHandler::end_tunnel(*conn.tunnel, conn.remote_sockfd, conn.request_id);
+    }
+    connections.erase(it);
+    close(client_sockfd);
+    active_connections.store(connections.size(), std::memory_order_relaxed);
+}
+
+void EventLoop::run() {
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+
+    while (!stop_flag) {
+        int timeout = -1;
+        if (listener_paused) {
+            auto now = std::chrono::steady_clock::now();
+            if (now >= listener_resume_at) {
+                resume_listener();
+            } else {
+                timeout = std::chrono::duration_cast<std::chrono::milliseconds>(listener_resume_at - now).count() + 1;
+            }
+        }
+
+        int n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            Logger::get_instance().log_error(0, "epoll_wait failed, reactor exiting.");
+            break;
+        }
+
+        for (int i = 0; i < n && !stop_flag; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == wakeup_fd) {
+                uint64_t count;
+                while (read(wakeup_fd, &count, sizeof(count)) > 0) {}
+                take_completions();
+                continue;
+            }
+
+            if (fd == listening_sockfd) {
+                accept_connections();
+                continue;
+            }
+
+            auto remote = tunnel_remotes.find(fd);
+            if (remote != tunnel_remotes.end()) {
+                int client_sockfd = remote->second;
+                if (!relay(client_sockfd)) {
+                    close_connection(client_sockfd);
+                }
+                continue;
+            }
+
+            auto it = connections.find(fd);
+            if (it == connections.end() || it->second.busy) {
+                continue; //closed earlier in this batch, or handed to a worker since
+            }
+
+            //readable, peer hung up, or error: recv sees EOF/error and says to close
+            if (it->second.tunnel) {
+                if (!relay(fd)) {
+                    close_connection(fd);
+                }
+            } else {
+                serve(fd);
+            }
+        }
+    }
+}
@@ -0,0 +1,96 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "ClientHandler.h"
+#include "CacheManager.h"
+#include "Tunnel.h"
+#include "WorkerPool.h"
+#include <unordered_map>
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+//one epoll reactor (shard). Owns an epoll instance, its own SO_REUSEPORT listening socket
+//and every client connection it accepted; runs on a single thread, so connection state needs
+//no locking. The kernel spreads incoming connections across the shards' listeners.
+//The reactor never blocks: it only reads requests, and hands each complete one to the worker
+//pool with the connection out of epoll until the worker reports back (see Completion). An
+//established CONNECT tunnel comes back to the reactor and is relayed as two fds on the loop
+class EventLoop {
+private:
+    struct Connection {
+        std::shared_ptr<ClientHandler> handler;
+        bool busy;       //a worker is handling its request
+        bool registered; //client fd is in the epoll set
+        std::unique_ptr<Tunnel> tunnel; //after a CONNECT, relayed until both sides are done
+        int remote_sockfd;
+        bool remote_registered;
+        int request_id;  //the CONNECT's, for the log
+    };
+
+    //a worker done with a connection's request, handed back through wakeup_fd
+    struct Completion {
+        int client_sockfd;
+        bool keep;         //false: close the connection
+        int tunnel_remote; //established tunnel's remote socket, else -1
+        int request_id;
+    };
+
+
+    int shard_id;
+    int epoll_fd;
+    int wakeup_fd; //eventfd used to interrupt epoll_wait on shutdown
+    int listening_sockfd; //owned, closed in destructor
+    int reserve_fd;       //spare descriptor for refusing connections when out of them, see refuse_connection
+    bool listener_paused; //out of descriptors without a reserve: listener left out of epoll until listener_resume_at
+    std::chrono::steady_clock::time_point listener_resume_at;
+
+    //written only by the reactor thread, read by anyone reporting shard balance
+    std::atomic<size_t> active_connections;
+    std::atomic<uint64_t> accepted_connections;
+
+    CacheManager& cache;
+    WorkerPool& workers;
+    std::atomic<bool>& stop_flag;
+    std::atomic_int& curr_request_id;
+
+    std::unordered_map<int, Connection> connections; //client fd -> connection state
+    std::unordered_map<int, int> tunnel_remotes;     //tunnel remote fd -> client fd
+
+    std::mutex completions_lock;
+    std::vector<Completion> completions; //under completions_lock
+
+    void accept_connections();
+    void pause_listener();
+    void resume_listener();
+    void serve(int client_sockfd);
+    void complete(const Completion& done); //any thread
+    void take_completions();
+    void start_tunnel(Connection& conn, int tunnel_remote, int request_id);
+    bool relay(int client_sockfd);
+    bool set_interest(int fd, uint32_t events, bool& registered);
+    void close_connection(int client_sockfd);
+
+public:
+    //takes ownership of listening_sockfd (already bound), even if construction throws
+    //workers must outlive the loop, and be shut down (tasks done) before it is destroyed
+    EventLoop(int shard_id, int listening_sockfd, CacheManager& cache, WorkerPool& workers, std::atomic<bool>& stop_flag,
+              std::atomic_int& curr_request_id);
+    ~EventLoop();
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    void listen_for_connections(int backlog);
+    void run(); //blocking, returns once stop_flag is set and wakeup() called
+    void wakeup(); //interrupts epoll_wait, e.g. to see stop_flag
+
+    int get_shard_id() const;
+    size_t get_active_connections() const;
+    uint64_t get_accepted_connections() const;
+};
+
+#endif
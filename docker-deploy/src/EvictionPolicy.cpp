@@ -0,0 +1,225 @@
+#include "EvictionPolicy.h"
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+
+std::unique_ptr<EvictionPolicy> EvictionPolicy::create(const std::string& name, size_t capacity) {
+    if (name == "lru") {
+        return std::make_unique<LruPolicy>();
+    }
+    if (name == "tinylfu") {
+        return std::make_unique<TinyLfuPolicy>(capacity);
+    }
+    throw std::runtime_error("Unknown cache eviction policy: " + name);
+}
+
+//---------------------------------------------------------------- LRU
+
+void LruPolicy::record_access(const std::string&) {
+    //recency only changes on a hit
+}
+
+void LruPolicy::on_hit(const std::string& key) {
+    auto it = positions.find(key);
+    if (it != positions.end()) {
+        order.splice(order.begin(), order, it->second);
+    }
+}
+
+void LruPolicy::on_insert(const std::string& key, size_t size) {
+    order.emplace_front(key, size);
+    positions[key] = order.begin();
+}
+
+void LruPolicy::on_erase(const std::string& key) {
+    auto it = positions.find(key);
+    if (it != positions.end()) {
+        order.erase(it->second);
+        positions.erase(it);
+    }
+}
+
+void LruPolicy::evict(size_t bytes_used, size_t capacity, std::vector<std::string>& victims) {
+    while (bytes_used > capacity && !order.empty()) {
+        auto last = std::prev(order.end());
+        bytes_used -= last->second;
+        victims.push_back(last->first);
+        positions.erase(last->first);
+        order.pop_back();
+    }
+}
+
+std::string LruPolicy::get_name() const {
+    return "lru";
+}
+
+//---------------------------------------------------------------- count-min sketch
+
+CountMinSketch::CountMinSketch(size_t expected_entries) : width(64), increments(0) {
+    while (width < expected_entries && width < (1 << 20)) {
+        width <<= 1;
+    }
+    counters.assign(DEPTH * width, 0);
+    sample_size = 10 * width;
+}
+
+//a different mix of the key's hash for every row
+size_t CountMinSketch::index(uint64_t hash, int row) const {
+    static const uint64_t SEEDS[DEPTH] = {0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL};
+    uint64_t x = hash + SEEDS[row];
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return row * width + (x & (width - 1));
+}
+
+void CountMinSketch::increment(const std::string& key) {
+    uint64_t hash = std::hash<std::string>()(key);
+    for (int row = 0; row < DEPTH; row++) {
+        uint8_t& counter = counters[index(hash, row)];
+        if (counter < 15) {
+            counter++;
+        }
+    }
+    if (++increments >= sample_size) {
+        halve();
+    }
+}
+
+int CountMinSketch::estimate(const std::string& key) const {
+    uint64_t hash = std::hash<std::string>()(key);
+    int result = 15;
+    for (int row = 0; row < DEPTH; row++) {
+        result = std::min(result, (int)counters[index(hash, row)]);
+    }
+    return result;
+}
+
+void CountMinSketch::halve() {
+    for (uint8_t& counter : counters) {
+        counter >>= 1;
+    }
+    increments /= 2;
+}
+
+//---------------------------------------------------------------- W-TinyLFU
+
+TinyLfuPolicy::TinyLfuPolicy(size_t capacity)
+    : sketch(capacity / 4096), window_bytes(0), probation_bytes(0), protected_bytes(0) { //sized for ~4KB responses
+    window_capacity = std::max<size_t>(capacity / 100, 1);
+    protected_capacity = (capacity - std::min(capacity, window_capacity)) / 100 * 80;
+}
+
+std::list<std::string>& TinyLfuPolicy::segment_list(Segment segment) {
+    if (segment == WINDOW) {
+        return window;
+    }
+    return segment == PROBATION ? probation : protected_list;
+}
+
+size_t& TinyLfuPolicy::segment_bytes(Segment segment) {
+    if (segment == WINDOW) {
+        return window_bytes;
+    }
+    return segment == PROBATION ? probation_bytes : protected_bytes;
+}
+
+//take key out of its segment and make it the most recent entry of another one
+void TinyLfuPolicy::move_to(const std::string& key, Node& node, Segment segment) {
+    segment_list(node.segment).erase(node.position);
+    segment_bytes(node.segment) -= node.size;
+    node.segment = segment;
+    segment_list(segment).push_front(key);
+    node.position = segment_list(segment).begin();
+    segment_bytes(segment) += node.size;
+}
+
+void TinyLfuPolicy::record_access(const std::string& key) {
+    sketch.increment(key);
+}
+
+void TinyLfuPolicy::on_hit(const std::string& key) {
+    auto it = nodes.find(key);
+    if (it == nodes.end()) {
+        return;
+    }
+    Node& node = it->second;
+
+    if (node.segment == PROBATION) { //used again since it was admitted, protect it
+        move_to(key, node, PROTECTED);
+        //protected is full: its oldest entries get another chance in probation
+        while (protected_bytes > protected_capacity && protected_list.size() > 1) {
+            std::string demoted = protected_list.back();
+            move_to(demoted, nodes[demoted], PROBATION);
+        }
+    } else {
+        std::list<std::string>& list = segment_list(node.segment);
+        list.splice(list.begin(), list, node.position);
+    }
+}
+
+void TinyLfuPolicy::on_insert(const std::string& key, size_t size) {
+    window.push_front(key);
+    nodes[key] = Node{WINDOW, size, window.begin()};
+    window_bytes += size;
+}
+
+void TinyLfuPolicy::on_erase(const std::string& key) {
+    auto it = nodes.find(key);
+    if (it == nodes.end()) {
+        return;
+    }
+    segment_list(it->second.segment).erase(it->second.position);
+    segment_bytes(it->second.segment) -= it->second.size;
+    nodes.erase(it);
+}
+
+void TinyLfuPolicy::evict(size_t bytes_used, size_t capacity, std::vector<std::string>& victims) {
+    //entries pushed out of the window become candidates for the main area
+    std::vector<std::string> candidates; //oldest first
+    while (window_bytes > window_capacity && window.size() > 1) {
+        std::string key = window.back();
+        move_to(key, nodes[key], PROBATION);
+        candidates.push_back(key);
+    }
+
+    while (bytes_used > capacity && !nodes.empty()) {
+        //the main area's victim: oldest probation entry that isn't a candidate itself
+        //(candidates were just pushed to the front of probation), else oldest protected one
+        std::string victim;
+        if (probation.size() > candidates.size()) {
+            victim = probation.back();
+        } else if (!protected_list.empty()) {
+            victim = protected_list.back();
+        } else if (!candidates.empty()) {
+            victim = candidates.front();
+        } else {
+            victim = window.back();
+        }
+
+        //a candidate only gets in if it has been looked up more often than what it would replace
+        if (!candidates.empty()) {
+            std::string candidate = candidates.front();
+            if (sketch.estimate(candidate) <= sketch.estimate(victim)) {
+                victim = candidate;
+            }
+            auto it = std::find(candidates.begin(), candidates.end(), victim);
+            if (it != candidates.end()) {
+                candidates.erase(it);
+            }
+        }
+
+        Node& node = nodes[victim];
+        bytes_used -= node.size;
+        on_erase(victim);
+        victims.push_back(victim);
+    }
+}
+
+std::string TinyLfuPolicy::get_name() const {
+    return "tinylfu";
+}
+
+int TinyLfuPolicy::get_frequency(const std::string& key) const {
+    return sketch.estimate(key);
+}
@@ -0,0 +1,111 @@
+#ifndef EVICTION_POLICY_H
+#define EVICTION_POLICY_H
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//decides which cached entries a CacheManager shard keeps. The shard owns the entries and
+//their bytes; the policy only tracks keys and sizes to order them. One policy object per
+//shard, every call is made with the shard lock held
+class EvictionPolicy {
+public:
+    virtual ~EvictionPolicy() {}
+
+    //a lookup of key, whether or not it is cached (feeds frequency estimates)
+    virtual void record_access(const std::string& key) = 0;
+    virtual void on_hit(const std::string& key) = 0;
+    virtual void on_insert(const std::string& key, size_t size) = 0;
+    virtual void on_erase(const std::string& key) = 0;
+
+    //the shard holds bytes_used bytes, pick keys to drop until it fits in capacity.
+    //the picked keys are already forgotten by the policy, the caller removes the entries.
+    //may pick the key just inserted, that is how a policy refuses to admit it
+    virtual void evict(size_t bytes_used, size_t capacity, std::vector<std::string>& victims) = 0;
+
+    virtual std::string get_name() const = 0;
+
+    //"lru" or "tinylfu", throws std::runtime_error for anything else.
+    //capacity is the shard's byte budget
+    static std::unique_ptr<EvictionPolicy> create(const std::string& name, size_t capacity);
+};
+
+//least recently used first
+class LruPolicy : public EvictionPolicy {
+private:
+    std::list<std::pair<std::string, size_t>> order; //front = most recently used
+    std::unordered_map<std::string, std::list<std::pair<std::string, size_t>>::iterator> positions;
+
+public:
+    void record_access(const std::string& key) override;
+    void on_hit(const std::string& key) override;
+    void on_insert(const std::string& key, size_t size) override;
+    void on_erase(const std::string& key) override;
+    void evict(size_t bytes_used, size_t capacity, std::vector<std::string>& victims) override;
+    std::string get_name() const override;
+};
+
+//approximate access counts in fixed memory: depth rows of 4-bit counters, the estimate is the
+//smallest counter the key hashes to. All counters are halved every sample_size increments so
+//old popularity fades
+class CountMinSketch {
+private:
+    static const int DEPTH = 4;
+    std::vector<uint8_t> counters; //DEPTH rows of width counters
+    size_t width;                  //power of two
+    size_t increments;
+    size_t sample_size;
+
+    size_t index(uint64_t hash, int row) const;
+    void halve();
+
+public:
+    explicit CountMinSketch(size_t expected_entries);
+    void increment(const std::string& key);
+    int estimate(const std::string& key) const;
+};
+
+//W-TinyLFU: new entries go to a small LRU window (1% of the bytes). Entries pushed out of the
+//window compete with the main area's eviction victim and only the one looked up more often
+//(by the sketch) stays, so a one-off scan can't flush entries that are used over and over.
+//The main area is a segmented LRU: probation, and protected (80%) for entries hit again there
+class TinyLfuPolicy : public EvictionPolicy {
+private:
+    enum Segment { WINDOW, PROBATION, PROTECTED };
+    struct Node {
+        Segment segment;
+        size_t size;
+        std::list<std::string>::iterator position;
+    };
+
+    CountMinSketch sketch;
+    std::unordered_map<std::string, Node> nodes;
+    std::list<std::string> window;    //front = most recently used, same for the other two
+    std::list<std::string> probation;
+    std::list<std::string> protected_list;
+    size_t window_bytes;
+    size_t probation_bytes;
+    size_t protected_bytes;
+    size_t window_capacity;
+    size_t protected_capacity;
+
+    std::list<std::string>& segment_list(Segment segment);
+    size_t& segment_bytes(Segment segment);
+    void move_to(const std::string& key, Node& node, Segment segment);
+    void remove(const std::string& key, std::vector<std::string>& victims);
+
+public:
+    explicit TinyLfuPolicy(size_t capacity);
+    void record_access(const std::string& key) override;
+    void on_hit(const std::string& key) override;
+    void on_insert(const std::string& key, size_t size) override;
+    void on_erase(const std::string& key) override;
+    void evict(size_t bytes_used, size_t capacity, std::vector<std::string>& victims) override;
+    std::string get_name() const override;
+    int get_frequency(const std::string& key) const;
+};
+
+#endif
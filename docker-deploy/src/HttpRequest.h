@@ -5,6 +5,8 @@
 #include <unordered_map>
 
 class HttpRequest {
+    friend class RequestParser;
+
 private:
     std::string method;
     std::string url;
@@ -14,20 +16,22 @@ private:
     std::string body;
 
 public:
-    int client_error_code; //if not 0, indicates client error in request (4xx)
+    int client_error_code = 0; //if not 0, indicates client error in request (4xx)
 
     HttpRequest() = default;
     bool parse_request(std::string& request_str);
     
-    std::string get_method() const;
-    std::string get_url() const;
-    std::string get_host() const;
+    const std::string& get_method() const;
+    const std::string& get_url() const;
+    const std::string& get_host() const;
     std::string get_header(const std::string& key) const;
-    std::string get_body() const;
+    const std::string& get_body() const;
     std::string serialize() const;
-    std::string get_http_version() const;
+    const std::string& get_http_version() const;
     bool has_header(const std::string& key) const;
+    std::string get_field(const std::string& name) const; //like get_header, but the name is matched ignoring case
     void add_header(const std::string& key, const std::string& value);
+    void remove_header(const std::string& key);
 
     static bool valid_field_name(const std::string& field);
     static void trim_field_value(std::string& value);
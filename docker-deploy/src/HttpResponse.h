@@ -1,7 +1,10 @@
 #ifndef HTTPRESPONSE_H
 #define HTTPRESPONSE_H
 
+#include "CacheControl.h"
+#include <memory>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <ctime>
 
@@ -11,19 +14,27 @@ private:
 
 public:
     std::string status_line;
+    int status_code; //from the status line, parsed once by ResponseParser
     std::unordered_map<std::string, std::string> headers;
     std::string body;
-    time_t expiry_time = 86400;
-    mutable bool requires_validation;
+    //a body left where it was read (a disk cache record) instead of copied into body: mapped_body
+    //points into memory body_owner keeps alive. body_bytes() is the body either way
+    std::shared_ptr<const void> body_owner;
+    std::string_view mapped_body;
+    CacheControl cache_control; //caching header fields, parsed by parse_cache_control
     
     HttpResponse();
     explicit HttpResponse(const std::string& status);
     bool parse_response(std::string& response_str);
+    void parse_cache_control(); //again after changing headers, cache decisions only look at cache_control
+    bool is_chunked() const;
     bool is_cacheable() const;
     std::string get_header(const std::string& key) const;
     std::string get_status_line() const;
     std::string get_body() const;
+    std::string_view body_bytes() const;
     std::string serialize() const;
+    std::string serialize_head() const; //status line and header section, up to and including the blank line
     void print_headers();
 
     bool parse_error;
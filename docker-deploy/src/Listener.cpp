@@ -0,0 +1,54 @@
+#include "Listener.h"
+#include <stdexcept>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstring>
+
+int create_listening_socket(int port, bool reuse_port) {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        throw std::runtime_error("Failed to create Proxy's listener socket");
+    }
+
+    int yes = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)); //allow quick restarts while old connections are in TIME_WAIT
+    if (reuse_port && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0) {
+        close(sockfd);
+        throw std::runtime_error("Failed to set SO_REUSEPORT on listener socket");
+    }
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY; //binds socket to all available interfaces (ip addresses), not just localhost. this allows it to accept connections
+    address.sin_port = htons(port);
+
+    if (bind(sockfd, (sockaddr*)&address, sizeof(address)) < 0) { //bind socket to port PROXY_SERVER_PORT
+        close(sockfd);
+        throw std::runtime_error("Failed to bind socket to port");
+    }
+
+    return sockfd;
+}
+
+int open_reserve_fd() {
+    return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+int refuse_connection(int listening_sockfd, int& reserve_fd) {
+    if (reserve_fd < 0) {
+        reserve_fd = open_reserve_fd();
+        if (reserve_fd < 0) {
+            return -1;
+        }
+    }
+    close(reserve_fd);
+    int sockfd = accept(listening_sockfd, nullptr, nullptr);
+    if (sockfd >= 0) {
+        close(sockfd);
+    }
+    reserve_fd = open_reserve_fd();
+    return sockfd >= 0 ? 1 : 0;
+}
@@ -0,0 +1,17 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+//create a TCP socket bound to all interfaces on port (not listening yet). with reuse_port, several
+//sockets can bind the same port and the kernel load balances new connections between them (SO_REUSEPORT).
+//throws std::runtime_error if the socket can't be created or bound
+int create_listening_socket(int port, bool reuse_port);
+
+//accept() failing with EMFILE/ENFILE leaves the connection in the backlog, so the listener stays
+//readable and an accept loop spins. A descriptor kept open in reserve (open_reserve_fd) is given up
+//for a moment to take the connection off the backlog and close it, i.e. refuse it.
+//returns 1 if a connection was refused, 0 if none was pending and -1 if there is no reserve
+//descriptor (it couldn't be reopened either), then the caller has to stop accepting for a while
+int open_reserve_fd();
+int refuse_connection(int listening_sockfd, int& reserve_fd);
+
+#endif
@@ -0,0 +1,222 @@
+#include "LogRecord.h"
+#include <cstring>
+
+static const char LOG_MAGIC[8] = "ERSSLOG";
+static const uint32_t LOG_VERSION = 2; //2: fields split up and interned
+//a record longer than this is corrupt, nothing the proxy logs comes close
+static const uint32_t MAX_RECORD_LENGTH = 16 * 1024 * 1024;
+//flags in the top bits of a field length in the file, see LogStringTable
+static const uint32_t FIELD_FIRST_COPY = 0x40000000; //the string follows and gets the next number
+static const uint32_t FIELD_REFERENCE = 0x80000000;  //a uint32_t number follows instead of the string
+
+void LogRecord::encode(std::string& out, LogEvent event, int request_id, int64_t monotonic_ns, std::initializer_list<std::string_view> fields) {
+    size_t length = sizeof(LogRecordHeader);
+    for (std::string_view field : fields) {
+        length += sizeof(uint32_t) + field.length();
+    }
+
+    LogRecordHeader header = {(uint32_t)length, (uint16_t)event, (uint16_t)fields.size(), request_id, 0, monotonic_ns};
+    size_t offset = out.length();
+    out.resize(offset + length);
+    char* p = &out[offset];
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    for (std::string_view field : fields) {
+        uint32_t field_length = (uint32_t)field.length();
+        memcpy(p, &field_length, sizeof(field_length));
+        memcpy(p + sizeof(field_length), field.data(), field.length());
+        p += sizeof(field_length) + field.length();
+    }
+}
+
+size_t LogRecord::decode(const char* data, size_t length, LogRecord& record, LogStringTable* strings) {
+    LogRecordHeader header;
+    if (length < sizeof(header)) {
+        return 0;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.length < sizeof(header) || header.length > MAX_RECORD_LENGTH || header.length > length) {
+        return 0;
+    }
+
+    record.event = (LogEvent)header.event;
+    record.request_id = header.request_id;
+    record.monotonic_ns = header.monotonic_ns;
+    record.fields.clear();
+    size_t offset = sizeof(header);
+    for (uint16_t i = 0; i < header.field_count; i++) {
+        uint32_t field_length;
+        if (header.length - offset < sizeof(field_length)) {
+            return 0;
+        }
+        memcpy(&field_length, data + offset, sizeof(field_length));
+        offset += sizeof(field_length);
+
+        if (field_length & FIELD_REFERENCE) {
+            uint32_t number;
+            if (header.length - offset < sizeof(number)) {
+                return 0;
+            }
+            memcpy(&number, data + offset, sizeof(number));
+            offset += sizeof(number);
+            if (!strings || number >= strings->strings.size()) {
+                return 0;
+            }
+            record.fields.emplace_back(strings->strings[number]);
+            continue;
+        }
+
+        bool first_copy = field_length & FIELD_FIRST_COPY;
+        field_length &= ~FIELD_FIRST_COPY;
+        if (header.length - offset < field_length) {
+            return 0;
+        }
+        if (first_copy && strings) {
+            strings->strings.emplace_back(data + offset, field_length);
+        }
+        record.fields.emplace_back(data + offset, field_length);
+        offset += field_length;
+    }
+
+    if (record.event == LOG_STRINGS_RESET && strings) {
+        strings->clear();
+    }
+    return header.length;
+}
+
+static std::string format_date(time_t time) {
+    char date[100];
+    struct tm tm;
+    strftime(date, sizeof(date), "%a %b %d %H:%M:%S %Y", gmtime_r(&time, &tm));
+    return date;
+}
+
+std::string_view LogRecord::time_field(const int64_t& time) {
+    return std::string_view((const char*)&time, sizeof(time));
+}
+
+std::string LogRecord::format(LogEvent event, int request_id, const std::string_view* fields, size_t field_count, std::string_view date) {
+    //a record missing fields (written by a newer proxy, say) still prints, with them empty
+    auto field = [&](size_t i) { return i < field_count ? fields[i] : std::string_view(); };
+    auto join = [&](std::string& line) {
+        for (size_t i = 0; i < field_count; i++) {
+            line.append(fields[i]);
+        }
+    };
+
+    std::string line = std::to_string(request_id);
+    switch (event) {
+    case LOG_REQUEST:
+        line.append(": \"").append(field(0)).append(" ").append(field(1)).append(" ").append(field(2));
+        line.append("\" from ").append(field(3)).append(" @ ").append(date);
+        break;
+    case LOG_CACHE_STATUS:
+        line.append(": ");
+        join(line);
+        break;
+    case LOG_FORWARD_REQUEST:
+        line.append(": Requesting \"").append(field(0)).append(" ").append(field(1)).append(" ").append(field(2));
+        line.append("\" from ").append(field(3));
+        break;
+    case LOG_RECEIVED_RESPONSE:
+        line.append(": Received \"").append(field(0)).append("\" from ").append(field(1));
+        break;
+    case LOG_RESPONSE:
+        line.append(": Responding \"").append(field(0)).append("\"");
+        break;
+    case LOG_ERROR:
+        line.append(": ERROR ");
+        join(line);
+        break;
+    case LOG_WARNING:
+        line.append(": WARNING ");
+        join(line);
+        break;
+    case LOG_NOTE:
+        line.append(": NOTE ");
+        join(line);
+        break;
+    case LOG_TUNNEL_CLOSED:
+        line.append(": Tunnel closed");
+        break;
+    case LOG_CACHE_EXPIRY: {
+        int64_t time = 0;
+        if (field(1).length() == sizeof(time)) {
+            memcpy(&time, field(1).data(), sizeof(time));
+        }
+        line.append(": ").append(field(0)).append(format_date((time_t)time)).append(field(2));
+        break;
+    }
+    default:
+        line.append(": (unknown log event ").append(std::to_string(event)).append(")");
+        break;
+    }
+    return line;
+}
+
+std::string LogRecord::to_text(time_t wall_time) const {
+    return format(event, request_id, fields.data(), fields.size(), format_date(wall_time));
+}
+
+LogFileHeader LogRecord::make_file_header(int64_t wall_time_ns, int64_t monotonic_ns) {
+    LogFileHeader header = {};
+    memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+    header.version = LOG_VERSION;
+    header.wall_time_ns = wall_time_ns;
+    header.monotonic_ns = monotonic_ns;
+    return header;
+}
+
+bool LogRecord::check_file_header(const LogFileHeader& header) {
+    return memcmp(header.magic, LOG_MAGIC, sizeof(header.magic)) == 0 && header.version == LOG_VERSION;
+}
+
+void LogStringTable::intern(std::string_view record, std::string& out) {
+    LogRecordHeader header;
+    if (record.length() < sizeof(header)) {
+        return;
+    }
+    memcpy(&header, record.data(), sizeof(header));
+
+    if (strings.size() >= MAX_STRINGS) {
+        clear();
+        LogRecord::encode(out, LOG_STRINGS_RESET, 0, header.monotonic_ns, {});
+    }
+
+    size_t start = out.length();
+    out.append(record.data(), sizeof(header));
+    size_t offset = sizeof(header);
+    for (uint16_t i = 0; i < header.field_count; i++) {
+        uint32_t field_length;
+        memcpy(&field_length, record.data() + offset, sizeof(field_length));
+        std::string_view field = record.substr(offset + sizeof(field_length), field_length);
+        offset += sizeof(field_length) + field_length;
+
+        uint32_t flags = 0;
+        if (field.length() >= MIN_LENGTH && field.length() <= MAX_LENGTH) {
+            auto it = numbers.find(field);
+            if (it != numbers.end()) {
+                uint32_t reference = FIELD_REFERENCE;
+                out.append((const char*)&reference, sizeof(reference));
+                out.append((const char*)&it->second, sizeof(it->second));
+                continue;
+            }
+            if (strings.size() < MAX_STRINGS) {
+                strings.emplace_back(field);
+                numbers.emplace(strings.back(), (uint32_t)strings.size() - 1);
+                flags = FIELD_FIRST_COPY;
+            }
+        }
+        uint32_t length = field_length | flags;
+        out.append((const char*)&length, sizeof(length));
+        out.append(field);
+    }
+
+    uint32_t length = out.length() - start;
+    memcpy(&out[start], &length, sizeof(length)); //length is the header's first member
+}
+
+void LogStringTable::clear() {
+    numbers.clear();
+    strings.clear();
+}
@@ -0,0 +1,103 @@
+#ifndef LOG_RECORD_H
+#define LOG_RECORD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class LogStringTable;
+
+//what a log line is about, one per Logger::log_* call. Stored in binary records, never renumber.
+//callers pass the pieces of a line as they have them, the line is only put together when it is
+//written as text (or by logdecode)
+enum LogEvent : uint16_t {
+    LOG_REQUEST = 1,       //fields: method, url, http version, client ip
+    LOG_CACHE_STATUS,      //status, in pieces that are joined
+    LOG_FORWARD_REQUEST,   //method, url, http version, server
+    LOG_RECEIVED_RESPONSE, //status line, server
+    LOG_RESPONSE,          //status line
+    LOG_ERROR,             //message, in pieces that are joined
+    LOG_WARNING,           //message, in pieces that are joined
+    LOG_NOTE,              //message, in pieces that are joined
+    LOG_TUNNEL_CLOSED,     //none
+    LOG_CACHE_EXPIRY,      //status with a time in it: text before, time (int64_t seconds, see time_field), text after
+    LOG_STRINGS_RESET,     //none, the LogStringTable starts over. not a line of the log
+};
+
+//binary log (--log-format=binary): a LogFileHeader, then one record per line: a LogRecordHeader
+//followed by its fields, each a uint32_t length and that many bytes. Integers are in host byte
+//order, the file is meant to be decoded (by logdecode) on the machine that wrote it.
+//In the file fields are interned (see LogStringTable): the top bits of a field's length mark it as
+//the first copy of a string or as a reference to one.
+//Records carry a monotonic timestamp; the file header pairs one with the wall clock so the
+//decoder can print wall times
+struct LogFileHeader {
+    char magic[8]; //"ERSSLOG" and a NUL
+    uint32_t version;
+    uint32_t unused;
+    int64_t wall_time_ns;
+    int64_t monotonic_ns;
+};
+
+struct LogRecordHeader {
+    uint32_t length; //whole record, this header included
+    uint16_t event;
+    uint16_t field_count;
+    int32_t request_id;
+    uint32_t unused;
+    int64_t monotonic_ns;
+};
+
+//one line of the log, in either format. The text format is the proxy.log format:
+//ID: "REQUEST" from IPFROM @ TIME, ID: Requesting "REQUEST" from SERVER and so on
+class LogRecord {
+public:
+    LogEvent event;
+    int request_id;
+    int64_t monotonic_ns;
+    std::vector<std::string_view> fields; //point into the buffer the record was decoded from (or the string table)
+
+    //append a binary record to out, one size computation and one copy per field
+    static void encode(std::string& out, LogEvent event, int request_id, int64_t monotonic_ns, std::initializer_list<std::string_view> fields);
+    //read the record at data, returns its length, or 0 if data holds only part of it (or garbage).
+    //records read from a file need the table the file's records are passed through in order
+    static size_t decode(const char* data, size_t length, LogRecord& record, LogStringTable* strings = nullptr);
+    //the text line, without the newline. date (in the log's "%a %b %d %H:%M:%S %Y" form) is only shown for LOG_REQUEST
+    static std::string format(LogEvent event, int request_id, const std::string_view* fields, size_t field_count, std::string_view date);
+    std::string to_text(time_t wall_time) const; //formats wall_time (UTC) as the date
+    //a time as a field, the view points at time
+    static std::string_view time_field(const int64_t& time);
+
+    static LogFileHeader make_file_header(int64_t wall_time_ns, int64_t monotonic_ns);
+    static bool check_file_header(const LogFileHeader& header);
+};
+
+//interning of repeated fields (methods, hosts, client ips, urls of hot objects) in the binary log file.
+//The thread writing the file passes each record through intern(): a field it wrote before becomes a
+//reference to the first copy, a new one is marked as a first copy and numbered. decode() numbers the
+//first copies the same way as it reads the file in order. After MAX_STRINGS strings the writer starts
+//over and says so with a LOG_STRINGS_RESET record. Only ever used by one thread at a time
+class LogStringTable {
+private:
+    std::deque<std::string> strings; //by number, a deque so views of them stay valid as it grows
+    std::unordered_map<std::string_view, uint32_t> numbers; //writer side, views of strings
+
+    friend class LogRecord;
+
+public:
+    static const size_t MAX_STRINGS = 65536;
+    static const size_t MIN_LENGTH = 4;    //shorter fields take no more room than a reference
+    static const size_t MAX_LENGTH = 2048; //longer ones rarely repeat
+
+    //append record (as encoded by LogRecord::encode) to out with its fields interned
+    void intern(std::string_view record, std::string& out);
+    void clear();
+};
+
+#endif
@@ -1,7 +1,13 @@
 #include "Logger.h"
+#include "CoarseClock.h"
 #include <iostream>
 #include <ctime>
-#include <sstream>
+#include <chrono>
+
+//the writer wakes up this often to take lines out of the ring even if nobody asks it to
+static const std::chrono::milliseconds WRITER_INTERVAL(5);
+//bytes gathered before they are written out, a batch may end earlier when the ring is empty
+static const size_t WRITE_BATCH = 64 * 1024;
 
 // Singleton instance getter
 Logger& Logger::get_instance() {
@@ -10,13 +16,15 @@ Logger& Logger::get_instance() {
 }
 
 // Private constructor: Opens log file
-Logger::Logger() {
-    log_file.open("/var/log/erss/proxy.log", std::ios::trunc);
+Logger::Logger() : enabled(true), mirror_stdout(false), binary(false), wall_base_ns(0), monotonic_base_ns(0), block_when_full(true), stopping(false), flush_requests(0), flushed(0), dropped(0) {
+    log_path = "/var/log/erss/proxy.log";
+    log_file.open(log_path, std::ios::trunc);
     
     // Fallback to local log if system log fails
     if (!log_file.is_open()) {
         std::cerr << "ERROR: Failed to open /var/log/erss/proxy.log! Logging to ./proxy.log instead.\n";
-        log_file.open("proxy.log", std::ios::trunc);
+        log_path = "proxy.log";
+        log_file.open(log_path, std::ios::trunc);
     }
 
     if (!log_file.is_open()) {
@@ -26,92 +34,281 @@ Logger::Logger() {
 
 // Destructor: Closes log file
 Logger::~Logger() {
+    stop_writer();
     if (log_file.is_open()) {
         log_file.close();
     }
 }
 
-// Get current time in UTC format
-std::string Logger::get_current_time() const {
-    std::time_t now = std::time(nullptr);
-    char buf[100];
-    //strftime(buf, sizeof(buf), "%a %d %b %Y %H:%M:%S", gmtime(&now)); // Ensure GMT formatting
-    strftime(buf, sizeof(buf), "%a %b %d %H:%M:%S %Y", gmtime(&now));
-    return std::string(buf);
+void Logger::set_enabled(bool on) {
+    enabled = on;
 }
 
-// Thread-safe logging function
-void Logger::log(const std::string& message) {
+//meant to be called at startup (or shutdown), while no other thread is logging
+void Logger::configure(bool async, size_t queue_size, bool block_when_full, bool mirror_stdout, bool binary) {
+    stop_writer();
+    if (binary != this->binary) {
+        open_log_file(binary);
+    }
+    this->mirror_stdout = mirror_stdout;
+    this->block_when_full = block_when_full;
+    if (async) {
+        queue = std::make_unique<BoundedQueue<Entry>>(queue_size);
+        stopping = false;
+        writer = std::thread(&Logger::writer_loop, this);
+    }
+}
+
+//start the log file over in the other format, a binary one begins with its LogFileHeader
+void Logger::open_log_file(bool binary) {
+    this->binary = binary;
+    if (log_file.is_open()) {
+        log_file.close();
+    }
+    log_file.open(log_path, binary ? std::ios::trunc | std::ios::binary : std::ios::trunc);
+    strings.clear(); //a new file numbers its strings from 0
+    if (!log_file.is_open()) {
+        std::cerr << "ERROR: Failed to reopen " << log_path << "! Logging is disabled.\n";
+        return;
+    }
+    if (binary) {
+        wall_base_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        monotonic_base_ns = CoarseClock::get_instance().monotonic_ns();
+        LogFileHeader header = LogRecord::make_file_header(wall_base_ns, monotonic_base_ns);
+        log_file.write((const char*)&header, sizeof(header));
+        log_file.flush();
+    }
+}
+
+std::string Logger::record_text(const std::string& record) const {
+    LogRecord decoded;
+    if (LogRecord::decode(record.data(), record.length(), decoded) == 0) {
+        return "";
+    }
+    return decoded.to_text((time_t)((wall_base_ns + (decoded.monotonic_ns - monotonic_base_ns)) / 1000000000));
+}
+
+void Logger::stop_writer() {
+    if (!writer.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        stopping = true;
+    }
+    writer_cv.notify_one();
+    writer.join();
+    queue.reset();
+}
+
+void Logger::flush() {
+    if (!queue) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(writer_mutex);
+    uint64_t request = ++flush_requests;
+    writer_cv.notify_one();
+    written_cv.wait(lock, [&]{ return flushed >= request; });
+}
+
+uint64_t Logger::get_dropped() const {
+    return dropped;
+}
+
+const std::string& Logger::get_path() const {
+    return log_path;
+}
+
+//the ring's only consumer. Every pass takes out whatever is queued and writes it with one write per
+//WRITE_BATCH bytes. A flush is done once a pass that started after it was asked for found the ring empty
+void Logger::writer_loop() {
+    std::string file_batch;
+    std::string stdout_batch;
+    file_batch.reserve(WRITE_BATCH + 4096);
+    Entry entry;
+    while (true) {
+        uint64_t requests;
+        bool stop;
+        {
+            std::unique_lock<std::mutex> lock(writer_mutex);
+            if (!stopping && flushed == flush_requests) {
+                writer_cv.wait_for(lock, WRITER_INTERVAL);
+            }
+            requests = flush_requests;
+            stop = stopping;
+        }
+
+        bool more = true;
+        while (more) {
+            more = false;
+            while (queue->try_pop(entry)) {
+                if (binary) {
+                    strings.intern(entry.message, file_batch);
+                    if (entry.to_stdout && mirror_stdout) {
+                        stdout_batch.append(record_text(entry.message)).push_back('\n');
+                    }
+                } else {
+                    file_batch.append(entry.message).push_back('\n');
+                    if (entry.to_stdout && mirror_stdout) {
+                        stdout_batch.append(entry.message).push_back('\n');
+                    }
+                }
+                if (file_batch.size() >= WRITE_BATCH) {
+                    more = true;
+                    break;
+                }
+            }
+            if (!file_batch.empty() && log_file.is_open()) {
+                log_file.write(file_batch.data(), file_batch.size());
+                log_file.flush();
+            }
+            if (!stdout_batch.empty()) {
+                std::cout.write(stdout_batch.data(), stdout_batch.size());
+                std::cout.flush();
+            }
+            file_batch.clear();
+            stdout_batch.clear();
+            written_cv.notify_all(); //producers waiting for room
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(writer_mutex);
+            flushed = requests;
+        }
+        written_cv.notify_all();
+        if (stop) {
+            return;
+        }
+    }
+}
+
+//block_when_full: wait for the writer to make room, waking it up in case it is sleeping
+void Logger::enqueue(Entry& entry) {
+    while (!queue->try_push(entry)) {
+        if (!block_when_full) {
+            dropped++;
+            return;
+        }
+        std::unique_lock<std::mutex> lock(writer_mutex);
+        writer_cv.notify_one();
+        written_cv.wait_for(lock, std::chrono::milliseconds(1));
+    }
+}
+
+void Logger::write_line(std::string message, bool to_stdout) {
+    if (queue) {
+        Entry entry{std::move(message), to_stdout};
+        enqueue(entry);
+        return;
+    }
     std::lock_guard<std::mutex> lock(log_mutex);
+    if (binary) {
+        if (to_stdout && mirror_stdout) {
+            std::cout << record_text(message) << std::endl;
+        }
+        if (log_file.is_open()) {
+            std::string interned;
+            strings.intern(message, interned);
+            log_file.write(interned.data(), interned.size());
+            log_file.flush();
+        }
+        return;
+    }
 
     // Output to terminal
-    std::cout << message << std::endl;
+    if (to_stdout && mirror_stdout) {
+        std::cout << message << std::endl;
+    }
 
     if (log_file.is_open()) {
         log_file << message << std::endl;
-    } else {
+    } else if (to_stdout) {
         std::cerr << "ERROR: Log file is not open. Cannot write log entry: " << message << std::endl;
+    } else {
+        std::cerr << message << std::endl;
+    }
+}
+
+// Thread-safe logging function
+void Logger::log(LogEvent event, int id, std::initializer_list<std::string_view> fields) {
+    if (!enabled) {
+        return;
+    }
+    if (binary) {
+        std::string record;
+        LogRecord::encode(record, event, id, CoarseClock::get_instance().monotonic_ns(), fields);
+        write_line(std::move(record), event != LOG_ERROR);
+    } else if (event == LOG_REQUEST) { //the only line with a date, preformatted by the clock
+        CoarseClock::Date date = CoarseClock::get_instance().log_date();
+        write_line(LogRecord::format(event, id, fields.begin(), fields.size(), date.view()), true);
+    } else {
+        write_line(LogRecord::format(event, id, fields.begin(), fields.size(), std::string_view()), event != LOG_ERROR);
     }
 }
 
 // Log request
-void Logger::log_request(int id, const std::string& request, const std::string& client_ip) {
-    log(std::to_string(id) + ": \"" + request + "\" from " + client_ip + " @ " + get_current_time());
+void Logger::log_request(int id, std::string_view method, std::string_view url, std::string_view http_version, std::string_view client_ip) {
+    log(LOG_REQUEST, id, {method, url, http_version, client_ip});
 }
 
 // Log cache status
-void Logger::log_cache_status(int id, const std::string& status) {
-    log(std::to_string(id) + ": " + status);
-    //std::cout << "logged! cache!" << std::endl;
+void Logger::log_cache_status(int id, std::string_view status, std::string_view detail) {
+    if (detail.empty()) {
+        log(LOG_CACHE_STATUS, id, {status});
+    } else {
+        log(LOG_CACHE_STATUS, id, {status, detail});
+    }
+}
+
+// Log cache status with a time in it, e.g. an expiry. the time is formatted with the line
+void Logger::log_cache_status(int id, std::string_view before, time_t time, std::string_view after) {
+    int64_t seconds = time;
+    log(LOG_CACHE_EXPIRY, id, {before, LogRecord::time_field(seconds), after});
 }
 
 // Log request forwarding to origin server
-void Logger::log_forward_request(int id, const std::string& request, const std::string& server) {
-    std::istringstream request_stream(request);
-    std::string first_line;
-    if (std::getline(request_stream, first_line)) {
-        log(std::to_string(id) + ": Requesting \"" + first_line + "\" from " + server);
-    } else {
-        log_error(id, "Malformed request string in log_forward_request");
-    }
+void Logger::log_forward_request(int id, std::string_view method, std::string_view url, std::string_view http_version, std::string_view server) {
+    log(LOG_FORWARD_REQUEST, id, {method, url, http_version, server});
 }
 
 // Log response received from origin server
-void Logger::log_received_response(int id, const std::string& response, const std::string& server) {
-    log(std::to_string(id) + ": Received \"" + response + "\" from " + server);
+void Logger::log_received_response(int id, std::string_view response, std::string_view server) {
+    log(LOG_RECEIVED_RESPONSE, id, {response, server});
 }
 
 // Log final response sent to client
-void Logger::log_response(int id, const std::string& response) {
-    log(std::to_string(id) + ": Responding \"" + response + "\"");
+void Logger::log_response(int id, std::string_view response) {
+    log(LOG_RESPONSE, id, {response});
 }
 
-// Log errors
-void Logger::log_error(int id, const std::string& message) {
-    std::ostringstream log_entry;
-    log_entry << id << ": ERROR " << message;
-
-    {
-        std::lock_guard<std::mutex> lock(log_mutex);
-        if (log_file.is_open()) {
-            log_file << log_entry.str() << std::endl;
-        } else {
-            std::cerr << log_entry.str() << std::endl;
-        }
+// Log errors (file only)
+void Logger::log_error(int id, std::string_view message, std::string_view detail) {
+    if (detail.empty()) {
+        log(LOG_ERROR, id, {message});
+    } else {
+        log(LOG_ERROR, id, {message, detail});
     }
 }
 
 // Log warnings
-void Logger::log_warning(int id, const std::string& message) {
-    log(std::to_string(id) + ": WARNING " + message);
+void Logger::log_warning(int id, std::string_view message, std::string_view detail) {
+    if (detail.empty()) {
+        log(LOG_WARNING, id, {message});
+    } else {
+        log(LOG_WARNING, id, {message, detail});
+    }
 }
 
 // Log notes
-void Logger::log_note(int id, const std::string& message) {
-    log(std::to_string(id) + ": NOTE " + message);
+void Logger::log_note(int id, std::string_view message, std::string_view detail, std::string_view more) {
+    if (detail.empty() && more.empty()) {
+        log(LOG_NOTE, id, {message});
+    } else {
+        log(LOG_NOTE, id, {message, detail, more});
+    }
 }
 
 // Log tunnel closure
 void Logger::log_tunnel_closed(int id) {
-    log(std::to_string(id) + ": Tunnel closed");
-}
\ No newline at end of file
+    log(LOG_TUNNEL_CLOSED, id, {});
+}
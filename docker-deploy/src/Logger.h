@@ -1,37 +1,96 @@
 #ifndef LOGGER_H
 #define LOGGER_H
 
+#include "BoundedQueue.h"
+#include "LogRecord.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <fstream>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
 
+//writes the proxy log. Synchronous by default (every line written under a mutex as it is logged).
+//After configure(true, ...) lines go into a lock-free ring instead and a writer thread takes them
+//out in batches, so a worker logging a line only moves a string into a slot; the file (and stdout,
+//if mirrored) get one write per batch.
+//The log is text (proxy.log lines) or, after configure(..., binary = true), LogRecords: then logging a
+//line only copies its fields (as the caller has them: url, method, a time_t...) into a record, the text
+//is made by logdecode (or the writer, if mirroring to stdout was asked for). The file's fields are interned
+//by whoever writes it (the writer thread, or the logging thread under log_mutex in sync mode)
 class Logger {
 private:
-    std::mutex log_mutex;
+    struct Entry {
+        std::string message; //text line without the newline, or a binary record
+        bool to_stdout = true; //errors only go to the file
+    };
+
+    std::mutex log_mutex; //sync mode writes, and the writer thread's file/stdout in async mode
     std::ofstream log_file;
+    std::string log_path;
+    std::atomic<bool> enabled;
+    std::atomic<bool> mirror_stdout;
+    bool binary;
+    int64_t wall_base_ns;      //when the binary log was started, to turn record timestamps into wall times
+    int64_t monotonic_base_ns;
+    LogStringTable strings;    //binary file's interned fields
+
+    //async mode
+    std::unique_ptr<BoundedQueue<Entry>> queue; //null = synchronous
+    bool block_when_full;            //else lines that don't fit are dropped (and counted)
+    std::thread writer;
+    std::mutex writer_mutex;
+    std::condition_variable writer_cv;  //work for the writer: queue full, a flush, or stop
+    std::condition_variable written_cv; //a batch was written, room in the queue again
+    bool stopping;
+    uint64_t flush_requests; //flushes asked for so far
+    uint64_t flushed;        //flushes done: everything queued before them is written
+    std::atomic<uint64_t> dropped;
+
+    void writer_loop();
+    void stop_writer(); //writes what is queued and joins the writer
+    void enqueue(Entry& entry);
+    void write_line(std::string message, bool to_stdout);
+    void write_binary(const std::string& record); //to the file, interned
+    std::string record_text(const std::string& record) const; //a binary record as its text line
+    void open_log_file(bool binary);
 
     Logger();  // Private constructor for Singleton
     ~Logger(); // Destructor
 
-    // Helper function to format current time
-    std::string get_current_time() const;
-
-    // Helper function to log messages
-    void log(const std::string& message);
+    // Helper function to log messages: formats the line, or encodes the record in binary mode
+    void log(LogEvent event, int id, std::initializer_list<std::string_view> fields);
 
 public:
     // Singleton Accessor
     static Logger& get_instance();
 
-    // Logging functions
-    void log_request(int id, const std::string& request, const std::string& client_ip);
-    void log_cache_status(int id, const std::string& status);
-    void log_forward_request(int id, const std::string& request, const std::string& server);
-    void log_received_response(int id, const std::string& response, const std::string& server);
-    void log_response(int id, const std::string& response);
-    void log_error(int id, const std::string& message);
-    void log_warning(int id, const std::string& message);
-    void log_note(int id, const std::string& message);
+    //drop every message, used by the benchmarks so terminal output doesn't dominate the timings
+    void set_enabled(bool on);
+
+    //async: hand lines to a background writer through a ring of queue_size lines. When it is full
+    //a logging thread waits for room (block_when_full) or the line is dropped. mirror_stdout: also
+    //print every line (except errors) to the terminal, off unless asked for. binary: write LogRecords instead of text (the log
+    //file starts over when this changes). Can be called again, queued lines are written first
+    void configure(bool async, size_t queue_size, bool block_when_full, bool mirror_stdout, bool binary = false);
+    void flush(); //returns once every line logged so far is written
+    uint64_t get_dropped() const;
+    const std::string& get_path() const;
+
+    // Logging functions. a message can be passed in pieces, they are only joined when the line is
+    // made, i.e. never on the request's thread in binary mode
+    void log_request(int id, std::string_view method, std::string_view url, std::string_view http_version, std::string_view client_ip);
+    void log_cache_status(int id, std::string_view status, std::string_view detail = std::string_view());
+    void log_cache_status(int id, std::string_view before, time_t time, std::string_view after = std::string_view()); //"before TIME after"
+    void log_forward_request(int id, std::string_view method, std::string_view url, std::string_view http_version, std::string_view server);
+    void log_received_response(int id, std::string_view response, std::string_view server);
+    void log_response(int id, std::string_view response);
+    void log_error(int id, std::string_view message, std::string_view detail = std::string_view());
+    void log_warning(int id, std::string_view message, std::string_view detail = std::string_view());
+    void log_note(int id, std::string_view message, std::string_view detail = std::string_view(), std::string_view more = std::string_view());
     void log_tunnel_closed(int id);
 };
 
@@ -0,0 +1,256 @@
+#include "Metrics.h"
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+static const char* COUNTER_NAMES[METRIC_COUNTER_COUNT][2] = {
+    {"proxy_requests_total", "Requests received, CONNECT included."},
+    {"proxy_cache_hits_total", "GETs answered from the cache (memory or disk), stale copies served while refreshed included."},
+    {"proxy_cache_misses_total", "GETs not in the cache or expired there."},
+    {"proxy_cache_revalidations_total", "Conditional requests sent to origins to check a cached copy."},
+    {"proxy_cache_evictions_total", "Entries evicted from the memory cache."},
+    {"proxy_client_received_bytes_total", "Bytes received from clients, tunnels included."},
+    {"proxy_client_sent_bytes_total", "Bytes sent to clients, tunnels included."},
+    {"proxy_origin_received_bytes_total", "Bytes received from origin servers, tunnels included."},
+    {"proxy_origin_sent_bytes_total", "Bytes sent to origin servers, tunnels included."},
+};
+
+static const char* HISTOGRAM_NAMES[METRIC_HISTOGRAM_COUNT][2] = {
+    {"proxy_upstream_connect_seconds", "Time to connect to an origin server, DNS lookup not included."},
+    {"proxy_upstream_ttfb_seconds", "Time from sending a request to an origin to its first response byte."},
+    {"proxy_request_duration_seconds", "Time from a request being read to its response being sent, CONNECT not included."},
+};
+
+//exported le bounds are 2^k microseconds for k in this range (64us to about 18 minutes)
+static const int EXPORT_MIN_EXPONENT = 6;
+static const int EXPORT_MAX_EXPONENT = 30;
+
+//one thread's metrics. Only the owning thread writes (a relaxed load and store, no locked
+//instruction), the scrape reads with relaxed loads: a total may miss an update in flight, never tears
+struct alignas(64) Metrics::ThreadBlock {
+    struct AtomicHistogram {
+        std::atomic<uint64_t> buckets[BUCKETS];
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sum;
+    };
+
+    std::atomic<uint64_t> counters[METRIC_COUNTER_COUNT];
+    AtomicHistogram histograms[METRIC_HISTOGRAM_COUNT];
+};
+
+static inline void bump(std::atomic<uint64_t>& value, uint64_t amount) {
+    value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+//owns every block ever handed out. A block outlives its thread so its counts stay in the totals,
+//and goes to the next new thread instead of a fresh allocation (counts only ever add up)
+struct MetricsRegistry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Metrics::ThreadBlock>> blocks;
+    std::vector<Metrics::ThreadBlock*> free_blocks;
+
+    //a thread's claim on a block, given back when the thread exits
+    struct Lease {
+        Metrics::ThreadBlock* block;
+        Lease() : block(get_instance().acquire()) {}
+        ~Lease() { get_instance().release(block); }
+    };
+
+    static MetricsRegistry& get_instance() {
+        static MetricsRegistry instance;
+        return instance;
+    }
+
+    Metrics::ThreadBlock* acquire() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!free_blocks.empty()) {
+            Metrics::ThreadBlock* block = free_blocks.back();
+            free_blocks.pop_back();
+            return block;
+        }
+        blocks.emplace_back(new Metrics::ThreadBlock()); //value-initialized: all zero
+        return blocks.back().get();
+    }
+
+    void release(Metrics::ThreadBlock* block) {
+        std::lock_guard<std::mutex> lock(mutex);
+        free_blocks.push_back(block);
+    }
+};
+
+Metrics::ThreadBlock& Metrics::local_block() {
+    static thread_local MetricsRegistry::Lease lease;
+    return *lease.block;
+}
+
+//the layout below on value - 1: buckets end on their upper bound (1..16 exact, then 16 per power of
+//two ending on 2^k), so a power of two is the last value of its bucket and Prometheus' le can count
+//whole buckets. 0 shares the first bucket with 1
+static size_t raw_index(uint64_t value) {
+    if (value < Metrics::SUB_BUCKETS) {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzll(value); //at least 4
+    if (exponent > Metrics::MAX_EXPONENT) {
+        return Metrics::BUCKETS - 1;
+    }
+    //the 4 bits below the top one pick the sub-bucket
+    size_t sub_bucket = (value >> (exponent - 4)) & (Metrics::SUB_BUCKETS - 1);
+    return Metrics::SUB_BUCKETS + (exponent - 4) * Metrics::SUB_BUCKETS + sub_bucket;
+}
+
+static uint64_t raw_lowest(size_t index) {
+    if (index < Metrics::SUB_BUCKETS) {
+        return index;
+    }
+    int exponent = (index - Metrics::SUB_BUCKETS) / Metrics::SUB_BUCKETS + 4;
+    uint64_t sub_bucket = (index - Metrics::SUB_BUCKETS) % Metrics::SUB_BUCKETS;
+    return (Metrics::SUB_BUCKETS + sub_bucket) << (exponent - 4);
+}
+
+size_t Metrics::bucket_index(uint64_t microseconds) {
+    return microseconds == 0 ? 0 : raw_index(microseconds - 1);
+}
+
+uint64_t Metrics::bucket_lowest(size_t index) {
+    return index == 0 ? 0 : raw_lowest(index) + 1;
+}
+
+uint64_t Metrics::bucket_highest(size_t index) {
+    if (index < SUB_BUCKETS) {
+        return index + 1;
+    }
+    int exponent = (index - SUB_BUCKETS) / SUB_BUCKETS + 4;
+    return raw_lowest(index) + (uint64_t(1) << (exponent - 4));
+}
+
+void Metrics::add(MetricCounter counter, uint64_t amount) {
+    bump(local_block().counters[counter], amount);
+}
+
+void Metrics::record(MetricHistogram histogram, int64_t microseconds) {
+    uint64_t value = microseconds < 0 ? 0 : microseconds;
+    ThreadBlock::AtomicHistogram& h = local_block().histograms[histogram];
+    bump(h.buckets[bucket_index(value)], 1);
+    bump(h.count, 1);
+    bump(h.sum, value);
+}
+
+Metrics::Snapshot Metrics::collect() {
+    Snapshot snapshot = {};
+    MetricsRegistry& registry = MetricsRegistry::get_instance();
+    std::lock_guard<std::mutex> lock(registry.mutex); //only keeps blocks from being added meanwhile
+    for (const auto& block : registry.blocks) {
+        for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+            snapshot.counters[i] += block->counters[i].load(std::memory_order_relaxed);
+        }
+        for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+            Histogram& total = snapshot.histograms[i];
+            const ThreadBlock::AtomicHistogram& h = block->histograms[i];
+            for (int b = 0; b < BUCKETS; b++) {
+                total.buckets[b] += h.buckets[b].load(std::memory_order_relaxed);
+            }
+            total.count += h.count.load(std::memory_order_relaxed);
+            total.sum += h.sum.load(std::memory_order_relaxed);
+        }
+    }
+    return snapshot;
+}
+
+//values up to and including microseconds, which must be a power of two (the last value of a bucket)
+uint64_t Metrics::Histogram::count_at_most(uint64_t microseconds) const {
+    size_t last = bucket_index(microseconds);
+    uint64_t total = 0;
+    for (size_t b = 0; b <= last; b++) {
+        total += buckets[b];
+    }
+    return total;
+}
+
+uint64_t Metrics::Histogram::quantile(double q) const {
+    uint64_t total = 0;
+    for (int b = 0; b < BUCKETS; b++) {
+        total += buckets[b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * total);
+    if (rank >= total) {
+        rank = total - 1;
+    }
+    uint64_t seen = 0;
+    for (int b = 0; b < BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen > rank) {
+            return bucket_highest(b);
+        }
+    }
+    return bucket_highest(BUCKETS - 1);
+}
+
+static std::string seconds(uint64_t microseconds) {
+    char text[32];
+    snprintf(text, sizeof(text), "%.6f", microseconds / 1e6);
+    return text;
+}
+
+static void header(std::string& out, const char* name, const char* help, const char* type) {
+    out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+void Metrics::append_metric(std::string& out, const char* name, const char* type, const char* help, uint64_t value) {
+    header(out, name, help, type);
+    out.append(name).append(" ").append(std::to_string(value)).append("\n");
+}
+
+std::string Metrics::to_prometheus(const Snapshot& snapshot) {
+    std::string out;
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        append_metric(out, COUNTER_NAMES[i][0], "counter", COUNTER_NAMES[i][1], snapshot.counters[i]);
+    }
+
+    uint64_t lookups = snapshot.counters[METRIC_CACHE_HITS] + snapshot.counters[METRIC_CACHE_MISSES];
+    char ratio[32];
+    snprintf(ratio, sizeof(ratio), "%.6f", lookups ? (double)snapshot.counters[METRIC_CACHE_HITS] / lookups : 0.0);
+    header(out, "proxy_cache_hit_ratio", "Share of cache lookups that were hits, since start.", "gauge");
+    out.append("proxy_cache_hit_ratio ").append(ratio).append("\n");
+
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+        const Histogram& h = snapshot.histograms[i];
+        std::string name = HISTOGRAM_NAMES[i][0];
+        header(out, name.c_str(), HISTOGRAM_NAMES[i][1], "histogram");
+        for (int exponent = EXPORT_MIN_EXPONENT; exponent <= EXPORT_MAX_EXPONENT; exponent++) {
+            uint64_t bound = uint64_t(1) << exponent;
+            out.append(name).append("_bucket{le=\"").append(seconds(bound)).append("\"} ");
+            out.append(std::to_string(h.count_at_most(bound))).append("\n");
+        }
+        out.append(name).append("_bucket{le=\"+Inf\"} ").append(std::to_string(h.count)).append("\n");
+        out.append(name).append("_sum ").append(seconds(h.sum)).append("\n");
+        out.append(name).append("_count ").append(std::to_string(h.count)).append("\n");
+
+        std::string quantiles = name + "_quantile";
+        header(out, quantiles.c_str(), "Quantiles of the histogram above, within 1/16 of the true value.", "gauge");
+        for (const char* q : {"0.5", "0.9", "0.99", "0.999"}) {
+            out.append(quantiles).append("{quantile=\"").append(q).append("\"} ");
+            out.append(seconds(h.quantile(atof(q)))).append("\n");
+        }
+    }
+    return out;
+}
+
+MetricTimer::MetricTimer(MetricHistogram histogram) : histogram(histogram), start(std::chrono::steady_clock::now()), armed(true) {}
+
+MetricTimer::~MetricTimer() {
+    if (armed) {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        Metrics::record(histogram, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    }
+}
+
+void MetricTimer::cancel() {
+    armed = false;
+}
@@ -0,0 +1,92 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+//what is counted. Names and help texts are in Metrics.cpp, keep them in the same order
+enum MetricCounter {
+    METRIC_REQUESTS,
+    METRIC_CACHE_HITS,       //fresh or served stale while refreshed
+    METRIC_CACHE_MISSES,     //not cached, or expired
+    METRIC_REVALIDATIONS,    //conditional requests sent to an origin for a cached copy
+    METRIC_EVICTIONS,        //entries dropped from memory (possibly to the disk tier)
+    METRIC_CLIENT_BYTES_IN,
+    METRIC_CLIENT_BYTES_OUT,
+    METRIC_ORIGIN_BYTES_IN,
+    METRIC_ORIGIN_BYTES_OUT,
+    METRIC_COUNTER_COUNT
+};
+
+//what is timed, in microseconds
+enum MetricHistogram {
+    METRIC_UPSTREAM_CONNECT, //connect() to an origin, DNS not included
+    METRIC_UPSTREAM_TTFB,    //request sent to first response byte
+    METRIC_REQUEST_LATENCY,  //request parsed to response sent, tunnels not included
+    METRIC_HISTOGRAM_COUNT
+};
+
+//counters and latency histograms for the admin port's /metrics.
+//Every thread writes only to its own block (allocated on its first update, handed to a later thread
+//when it exits), so the request path never writes a cache line another thread writes; only a scrape
+//reads them all and adds them up. Histograms are HDR style: 16 linear buckets per power of two,
+//so any value is off by at most 1/16. Buckets end on (and include) their upper bound and every power
+//of two is one, so the exported le bounds are exact
+class Metrics {
+public:
+    static const int SUB_BUCKETS = 16;
+    static const int MAX_EXPONENT = 35; //values from 2^36 us (19 hours) up share the last bucket
+    static const int BUCKETS = SUB_BUCKETS + (MAX_EXPONENT - 3) * SUB_BUCKETS;
+
+    struct Histogram {
+        uint64_t buckets[BUCKETS];
+        uint64_t count;
+        uint64_t sum; //microseconds
+
+        uint64_t count_at_most(uint64_t microseconds) const; //what Prometheus' le counts
+        uint64_t quantile(double q) const; //0 if empty
+    };
+
+    //all threads' blocks added up
+    struct Snapshot {
+        uint64_t counters[METRIC_COUNTER_COUNT];
+        Histogram histograms[METRIC_HISTOGRAM_COUNT];
+    };
+
+    static void add(MetricCounter counter, uint64_t amount = 1);
+    static void record(MetricHistogram histogram, int64_t microseconds);
+
+    static Snapshot collect();
+    //Prometheus text exposition format. Histograms are exported in seconds with a bucket per power of
+    //two microseconds, plus p50/p90/p99/p999 gauges from the full resolution buckets
+    static std::string to_prometheus(const Snapshot& snapshot);
+    //one single-valued metric with its HELP and TYPE lines, for values kept elsewhere
+    static void append_metric(std::string& out, const char* name, const char* type, const char* help, uint64_t value);
+
+    static size_t bucket_index(uint64_t microseconds);
+    static uint64_t bucket_lowest(size_t index);  //smallest value counted in the bucket
+    static uint64_t bucket_highest(size_t index); //largest
+
+private:
+    struct alignas(64) ThreadBlock;
+    static ThreadBlock& local_block();
+    friend struct MetricsRegistry;
+};
+
+//records the time from construction to destruction into a histogram, unless cancelled
+class MetricTimer {
+private:
+    MetricHistogram histogram;
+    std::chrono::steady_clock::time_point start;
+    bool armed;
+
+public:
+    explicit MetricTimer(MetricHistogram histogram);
+    ~MetricTimer();
+    void cancel();
+};
+
+#endif
@@ -0,0 +1,222 @@
+#include "ProxyConfig.h"
+#include <iostream>
+#include <stdexcept>
+
+//parse an integer flag value that must be at least min_value, throw if it isn't one
+static int parse_int(const std::string& name, const std::string& value, int min_value) {
+    size_t used = 0;
+    int result = 0;
+    try {
+        result = std::stoi(value, &used);
+    } catch (...) {
+        used = 0;
+    }
+
+    if (used == 0 || used != value.length() || result < min_value) {
+        throw std::runtime_error("Invalid value for --" + name + ": " + value);
+    }
+    return result;
+}
+
+//accepts 1/0, true/false, yes/no
+static bool parse_bool(const std::string& name, const std::string& value) {
+    if (value == "1" || value == "true" || value == "yes") {
+        return true;
+    }
+    if (value == "0" || value == "false" || value == "no") {
+        return false;
+    }
+    throw std::runtime_error("Invalid value for --" + name + ": " + value);
+}
+
+//parse a byte count, optionally with a k/m/g suffix (powers of 1024)
+static size_t parse_size(const std::string& name, const std::string& value) {
+    size_t used = 0;
+    unsigned long long result = 0;
+    try {
+        result = std::stoull(value, &used);
+    } catch (...) {
+        used = 0;
+    }
+
+    unsigned long long multiplier = 1;
+    if (used > 0 && used + 1 == value.length()) {
+        char suffix = value[used];
+        if (suffix == 'k' || suffix == 'K') {
+            multiplier = 1024;
+        } else if (suffix == 'm' || suffix == 'M') {
+            multiplier = 1024 * 1024;
+        } else if (suffix == 'g' || suffix == 'G') {
+            multiplier = 1024 * 1024 * 1024;
+        }
+        if (multiplier > 1) {
+            used++;
+        }
+    }
+
+    if (used == 0 || used != value.length() || value[0] == '-') {
+        throw std::runtime_error("Invalid value for --" + name + ": " + value);
+    }
+    return result * multiplier;
+}
+
+ProxyConfig ProxyConfig::from_args(int argc, char* argv[]) {
+    ProxyConfig config;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            throw std::runtime_error("Unexpected argument: " + arg);
+        }
+
+        //split --name=value
+        size_t eq = arg.find('=');
+        std::string name = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+        std::string value = (eq == std::string::npos) ? "" : arg.substr(eq + 1);
+
+        if (name == "port") {
+            config.port = parse_int(name, value, 1);
+        } else if (name == "mode") {
+            if (value != "threads" && value != "epoll") {
+                throw std::runtime_error("Invalid value for --mode (expected threads or epoll): " + value);
+            }
+            config.mode = value;
+        } else if (name == "accept-backlog") {
+            config.accept_backlog = parse_int(name, value, 1);
+        } else if (name == "workers") {
+            config.workers = parse_int(name, value, 1);
+        } else if (name == "max-connections") {
+            config.max_connections = parse_int(name, value, 1);
+        } else if (name == "client-timeout") {
+            config.client_timeout = parse_int(name, value, 0);
+        } else if (name == "reactor-threads") {
+            config.reactor_threads = parse_int(name, value, 0);
+        } else if (name == "pin-reactors") {
+            config.pin_reactors = parse_bool(name, value);
+        } else if (name == "shard-stats-interval") {
+            config.shard_stats_interval = parse_int(name, value, 0);
+        } else if (name == "upstream-max-idle") {
+            config.upstream_max_idle = parse_int(name, value, 0);
+        } else if (name == "upstream-idle-timeout") {
+            config.upstream_idle_timeout = parse_int(name, value, 1);
+        } else if (name == "cache-shards") {
+            config.cache_shards = parse_int(name, value, 1);
+        } else if (name == "cache-size") {
+            config.cache_size = parse_size(name, value);
+        } else if (name == "cache-max-object") {
+            config.cache_max_object = parse_size(name, value);
+        } else if (name == "cache-policy") {
+            if (value != "tinylfu" && value != "lru") {
+                throw std::runtime_error("Invalid value for --cache-policy (expected tinylfu or lru): " + value);
+            }
+            config.cache_policy = value;
+        } else if (name == "cache-max-variants") {
+            config.cache_max_variants = parse_int(name, value, 1);
+        } else if (name == "disk-cache-dir") {
+            config.disk_cache_dir = value;
+        } else if (name == "disk-cache-size") {
+            config.disk_cache_size = parse_size(name, value);
+        } else if (name == "disk-cache-segment") {
+            config.disk_cache_segment = parse_size(name, value);
+        } else if (name == "cache-snapshot") {
+            config.cache_snapshot = value;
+        } else if (name == "coalesce-timeout") {
+            config.coalesce_timeout = parse_int(name, value, 0);
+        } else if (name == "refresh-workers") {
+            config.refresh_workers = parse_int(name, value, 0);
+        } else if (name == "refresh-ahead") {
+            config.refresh_ahead = parse_int(name, value, 0);
+        } else if (name == "stale-if-error") {
+            config.stale_if_error = parse_int(name, value, 0);
+        } else if (name == "dns-ttl") {
+            config.dns_ttl = parse_int(name, value, 0);
+        } else if (name == "dns-negative-ttl") {
+            config.dns_negative_ttl = parse_int(name, value, 0);
+        } else if (name == "dns-refresh-ahead") {
+            config.dns_refresh_ahead = parse_int(name, value, 0);
+        } else if (name == "hosts-file") {
+            config.hosts_file = value;
+        } else if (name == "tunnel") {
+            if (value != "splice" && value != "copy") {
+                throw std::runtime_error("Invalid value for --tunnel (expected splice or copy): " + value);
+            }
+            config.tunnel = value;
+        } else if (name == "stream") {
+            config.stream = parse_bool(name, value);
+        } else if (name == "stream-max-buffered") {
+            config.stream_max_buffered = parse_size(name, value);
+        } else if (name == "log-async") {
+            config.log_async = parse_bool(name, value);
+        } else if (name == "log-queue") {
+            config.log_queue = parse_int(name, value, 1);
+        } else if (name == "log-when-full") {
+            if (value != "block" && value != "drop") {
+                throw std::runtime_error("Invalid value for --log-when-full (expected block or drop): " + value);
+            }
+            config.log_when_full = value;
+        } else if (name == "log-stdout") {
+            config.log_stdout = parse_bool(name, value);
+        } else if (name == "log-format") {
+            if (value != "text" && value != "binary") {
+                throw std::runtime_error("Invalid value for --log-format (expected text or binary): " + value);
+            }
+            config.log_format = value;
+        } else if (name == "clock-tick") {
+            config.clock_tick_ms = parse_int(name, value, 0);
+        } else if (name == "admin-port") {
+            config.admin_port = parse_int(name, value, 0);
+        } else if (name == "trace-threshold") {
+            config.trace_threshold_ms = parse_int(name, value, 0);
+        } else if (name == "trace-file") {
+            config.trace_file = value;
+        } else {
+            throw std::runtime_error("Unknown option: --" + name);
+        }
+    }
+
+    return config;
+}
+
+void ProxyConfig::print_usage(const char* prog) {
+    std::cout << "Usage: " << prog << " [options]\n"
+              << "  --port=N               port to listen on (default 80)\n"
+              << "  --mode=threads|epoll   connection model (default threads)\n"
+              << "  --accept-backlog=N     listen() backlog (default 128)\n"
+              << "  --workers=N            worker pool size: serves connections (threads mode) or requests (epoll mode) (default 64)\n"
+              << "  --max-connections=N    threads mode cap on in-flight connections (default 1024)\n"
+              << "  --client-timeout=N     threads mode idle client (and CONNECT tunnel) timeout in seconds, 0 = none (default 30)\n"
+              << "  --reactor-threads=N    epoll reactors (SO_REUSEPORT shards), 0 = one per core (default 0)\n"
+              << "  --pin-reactors=0|1     pin each reactor thread to its own cpu (default 1)\n"
+              << "  --shard-stats-interval=N  log per-shard connection counts every N seconds, 0 = off (default 0)\n"
+              << "  --upstream-max-idle=N  idle keep-alive connections kept per origin, 0 = no pooling (default 8)\n"
+              << "  --upstream-idle-timeout=N  seconds an idle origin connection is kept (default 30)\n"
+              << "  --cache-shards=N       independently locked response cache shards (default 16)\n"
+              << "  --cache-size=N[k|m|g]  byte budget of the response cache (default 256m)\n"
+              << "  --cache-max-object=N[k|m|g]  largest response that is cached (default 8m)\n"
+              << "  --cache-policy=tinylfu|lru  response cache admission/eviction policy (default tinylfu)\n"
+              << "  --cache-max-variants=N  responses with Vary: variants cached per url (default 8)\n"
+              << "  --disk-cache-dir=PATH  keep entries evicted from memory in segment files here (default off)\n"
+              << "  --disk-cache-size=N[k|m|g]  byte budget of the disk cache (default 10g)\n"
+              << "  --disk-cache-segment=N[k|m|g]  size of one disk cache segment file (default 64m)\n"
+              << "  --cache-snapshot=PATH  save the cache here on shutdown (SIGTERM/SIGINT) and reload it on startup\n"
+              << "  --coalesce-timeout=N   seconds concurrent misses for a url wait for one origin fetch, 0 = off (default 10)\n"
+              << "  --refresh-workers=N    threads for background cache refreshes, 0 = none (default 2)\n"
+              << "  --refresh-ahead=N      refetch hot entries N seconds before they expire, 0 = off (default 0)\n"
+              << "  --stale-if-error=N     serve entries up to N seconds expired when the origin fails (default 0, Cache-Control stale-if-error still applies)\n"
+              << "  --dns-ttl=N            seconds a successful lookup is cached (default 60)\n"
+              << "  --dns-negative-ttl=N   seconds a failed lookup is cached (default 5)\n"
+              << "  --dns-refresh-ahead=N  refresh popular names N seconds before expiry, 0 = off (default 10)\n"
+              << "  --hosts-file=PATH      hosts-format file consulted before the resolver\n"
+              << "  --tunnel=splice|copy   how CONNECT tunnels move bytes (default splice)\n"
+              << "  --stream=0|1           stream GET responses to the client as they arrive (default 0)\n"
+              << "  --stream-max-buffered=N[k|m|g]  bytes of a streamed body buffered to fill the cache (default 8m)\n"
+              << "  --log-async=0|1        write the log from a background thread (default 1)\n"
+              << "  --log-queue=N          lines the async log can hold before it is full (default 65536)\n"
+              << "  --log-when-full=block|drop  wait for room in a full async log or drop the line (default block)\n"
+              << "  --log-stdout=0|1       also print the log to the terminal (default 0)\n"
+              << "  --log-format=text|binary  binary writes compact records, decode them with ./logdecode (default text)\n"
+              << "  --clock-tick=N         milliseconds between updates of the shared clock, 0 = read the system clock every time (default 1)\n"
+              << "  --admin-port=N         serve Prometheus metrics at GET /metrics on this port, 0 = off (default 0)\n"
+              << "  --trace-threshold=N    write phase traces of requests slower than N ms, 0 = off (default 0)\n"
+              << "  --trace-file=PATH      where traces go, Chrome trace / Perfetto JSON (default proxy-trace.json next to the log)\n";
+}
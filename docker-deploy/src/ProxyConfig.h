@@ -0,0 +1,89 @@
+#ifndef PROXY_CONFIG_H
+#define PROXY_CONFIG_H
+
+#include <string>
+
+//startup options for the proxy, filled from command line flags of the form --name=value
+struct ProxyConfig {
+    int port = 80;
+
+    //"threads" = a bounded worker pool serves each accepted connection on one worker
+    //"epoll"   = edge-triggered epoll reactors driving connections as state machines
+    std::string mode = "threads";
+    int accept_backlog = 128; //listen() backlog, both modes
+
+    //threads mode
+    int workers = 64;           //fixed worker pool size
+    int max_connections = 1024; //in-flight (queued + served) connections before the acceptor stops accepting
+    int client_timeout = 30;    //seconds a client connection may sit idle between requests (or a tunnel move nothing), 0 = forever
+
+    //epoll mode: each reactor is a shard with its own SO_REUSEPORT listener and connection set
+    int reactor_threads = 0;      //number of reactors, 0 = one per available core
+    bool pin_reactors = true;     //pin reactor i to the i-th allowed cpu
+    int shard_stats_interval = 0; //seconds between per-shard connection count log notes, 0 = only at shutdown
+
+    //keep-alive connections to origin servers
+    int upstream_max_idle = 8;      //idle connections kept per origin (host:port), 0 = no pooling
+    int upstream_idle_timeout = 30; //seconds an idle upstream connection is kept
+
+    //response cache: entries are spread over independently locked shards by url hash
+    int cache_shards = 16;
+    size_t cache_size = 256 * 1024 * 1024;     //byte budget for all cached responses (headers, body, bookkeeping)
+    size_t cache_max_object = 8 * 1024 * 1024; //bigger responses are not cached
+    //"tinylfu" = frequency-aware admission/eviction that keeps popular entries through scans, "lru" = least recently used first
+    std::string cache_policy = "tinylfu";
+    int cache_max_variants = 8; //responses with Vary: variants kept per url, the oldest goes first
+    //second cache tier: entries evicted from memory are kept in segment files under this directory, empty = off
+    std::string disk_cache_dir;
+    size_t disk_cache_size = 10ULL * 1024 * 1024 * 1024; //bytes of segment files kept
+    size_t disk_cache_segment = 64 * 1024 * 1024;        //size of one segment file
+    //warm restarts: the memory cache is written here on graceful shutdown and read back (in the background) on startup, empty = off
+    std::string cache_snapshot;
+    //concurrent misses for a url wait up to this many seconds for the one request fetching it, 0 = each fetches on its own
+    int coalesce_timeout = 10;
+    //background refreshes (stale-while-revalidate, refresh-ahead) run on this many threads, 0 = none
+    int refresh_workers = 2;
+    int refresh_ahead = 0; //refetch entries hit again and again this many seconds before they expire, 0 = off
+    //stale-if-error: expired entries answer for a failed origin fetch this many seconds (or their own stale-if-error=N, if longer)
+    int stale_if_error = 0;
+
+    //resolver cache
+    int dns_ttl = 60;           //seconds a successful lookup is cached
+    int dns_negative_ttl = 5;   //seconds a failed lookup is cached
+    int dns_refresh_ahead = 10; //refresh popular entries this many seconds before expiry, 0 = no background refresh
+    std::string hosts_file;     //optional hosts-format file consulted before the resolver
+
+    //CONNECT tunnels: "splice" = move bytes socket to socket inside the kernel through a pipe,
+    //"copy" = recv/send through a user-space buffer (always used if splice isn't supported)
+    std::string tunnel = "splice";
+
+    //GET responses: stream headers and body to the client as they arrive instead of buffering the whole response
+    bool stream = false;
+    size_t stream_max_buffered = 8 * 1024 * 1024; //bytes of a streamed body kept per connection to fill the cache
+
+    //logging: async = workers hand lines to a writer thread through a lock-free ring of log_queue lines,
+    //which waits for room when it is full ("block") or drops the line ("drop"). log_stdout mirrors the log to the terminal,
+    //which formats every line (binary records too), so it is off unless asked for.
+    bool log_async = true;
+    int log_queue = 65536;
+    std::string log_when_full = "block";
+    bool log_stdout = false;
+    std::string log_format = "text"; //"binary" = LogRecords, turned into text by the logdecode tool
+
+    //log dates, Date headers and cache freshness checks read a clock updated this often instead of calling time(), 0 = call it every time
+    int clock_tick_ms = 1;
+
+    //GET /metrics on this port answers with counters and latency histograms in Prometheus text format, 0 = off
+    int admin_port = 0;
+
+    //requests slower than this many milliseconds have their phases (cache lookup, dns, connect, origin wait, client writes)
+    //appended to trace_file as Chrome trace / Perfetto JSON, 0 = off. An empty trace_file puts it next to the log
+    int trace_threshold_ms = 0;
+    std::string trace_file;
+
+    //throws std::runtime_error on unknown flags or bad values
+    static ProxyConfig from_args(int argc, char* argv[]);
+    static void print_usage(const char* prog);
+};
+
+#endif
@@ -8,142 +8,454 @@
 #include <exception>
 #include <cstring>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <algorithm>
+#include "Listener.h"
+#include "Logger.h"
+#include "CoarseClock.h"
+#include "UpstreamPool.h"
+#include "DnsCache.h"
+#include "Tunnel.h"
+#include "RequestHandler.h"
+#include "Metrics.h"
+#include "RequestTrace.h"
 
 //if object construction fails (cant create socket or bind it), throw a runtime exception
-ProxyServer::ProxyServer(int proxy_server_port) : proxy_server_port(proxy_server_port), stop_flag(false), curr_request_id(0) { //im guessing cache has some default initialization that doesn't require args
-    listening_sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listening_sockfd < 0) {
-        throw std::runtime_error("Failed to create Proxy's listener socket");
+//(already created reactors are destroyed with the reactors member and close their sockets)
+ProxyServer::ProxyServer(const ProxyConfig& config) : config(config), proxy_server_port(config.port), listening_sockfd(-1), stop_flag(false), in_flight(0), cache(config.cache_size, config.cache_shards, config.cache_max_object, config.cache_policy), curr_request_id(0) {
+    if (config.clock_tick_ms > 0) {
+        CoarseClock::get_instance().start(std::chrono::milliseconds(config.clock_tick_ms));
     }
+    Logger::get_instance().configure(config.log_async, config.log_queue, config.log_when_full == "block", config.log_stdout,
+                                     config.log_format == "binary");
+    if (config.trace_threshold_ms > 0) {
+        std::string trace_file = config.trace_file;
+        if (trace_file.empty()) {
+            const std::string& log_path = Logger::get_instance().get_path();
+            size_t slash = log_path.rfind('/');
+            trace_file = (slash == std::string::npos ? "" : log_path.substr(0, slash + 1)) + "proxy-trace.json";
+        }
+        TraceLog::get_instance().configure(trace_file, config.trace_threshold_ms);
+    }
+    UpstreamPool::get_instance().configure(config.upstream_max_idle, config.upstream_idle_timeout);
 
-    sockaddr_in address;
-    memset(&address, 0, sizeof(address));
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY; //binds socket to all available interfaces (ip addresses), not just localhost. this allows it to accept connections
-    address.sin_port = htons(this->proxy_server_port);
+    DnsCache& dns = DnsCache::get_instance();
+    dns.configure(config.dns_ttl, config.dns_negative_ttl, config.dns_refresh_ahead);
+    if (!config.hosts_file.empty() && !dns.load_hosts_file(config.hosts_file)) {
+        throw std::runtime_error("Failed to read hosts file " + config.hosts_file);
+    }
+    dns.start_refresher();
+
+    Tunnel::set_splice_enabled(config.tunnel == "splice");
+    Tunnel::set_idle_timeout(std::chrono::seconds(config.client_timeout));
+    RequestHandler::configure_streaming(config.stream, config.stream_max_buffered);
+    if (!config.disk_cache_dir.empty()) {
+        disk_cache = std::make_unique<DiskCache>(config.disk_cache_dir, config.disk_cache_size, config.disk_cache_segment);
+        cache.set_disk_cache(disk_cache.get());
+        Logger::get_instance().log_note(0, "disk cache: " + std::to_string(disk_cache->get_entry_count()) + " entries read back from " +
+                                           config.disk_cache_dir);
+    }
+    if (!config.cache_snapshot.empty()) {
+        cache.load_snapshot_async(config.cache_snapshot); //requests are served while it loads
+    }
+    cache.set_coalesce_timeout(std::chrono::seconds(config.coalesce_timeout));
+    cache.set_max_variants(config.cache_max_variants);
+    cache.set_stale_if_error_grace(std::chrono::seconds(config.stale_if_error));
+    if (config.refresh_workers > 0) {
+        CacheManager& refreshed_cache = cache;
+        cache.start_refreshing([&refreshed_cache](const HttpRequest& request, std::shared_ptr<HttpResponse> cached) {
+            RequestHandler handler(refreshed_cache);
+            return handler.revalidate(request, cached);
+        }, config.refresh_workers, std::chrono::seconds(config.refresh_ahead));
+    }
+    if (cache.get_shard_count() < (size_t)config.cache_shards) {
+        Logger::get_instance().log_note(0, "response cache uses " + std::to_string(cache.get_shard_count()) +
+                                           " shards so each can hold a " + std::to_string(cache.get_max_object_size()) + " byte object");
+    }
 
-    if (bind(listening_sockfd, (sockaddr*)&address, sizeof(address)) < 0) { //bind socket to port PROXY_SERVER_PORT
-        close(listening_sockfd); //needed since ~ProxyServer() won't be called since object isn't considered fully constructed
-        throw std::runtime_error("Failed to bind socket to port");
+    if (config.admin_port > 0) {
+        admin_server = std::make_unique<AdminServer>(config.admin_port, [this]() { return collect_metrics(); });
+    }
+
+    if (config.mode != "epoll") {
+        listening_sockfd = create_listening_socket(proxy_server_port, false);
+        sockaddr_in address;
+        socklen_t length = sizeof(address);
+        if (proxy_server_port == 0 && getsockname(listening_sockfd, (sockaddr*)&address, &length) == 0) {
+            proxy_server_port = ntohs(address.sin_port); //port 0: the one the kernel picked
+        }
+        return;
+    }
+
+    //epoll mode: one shard (listener + reactor) per core unless told otherwise
+    int num_shards = config.reactor_threads;
+    if (num_shards <= 0) {
+        num_shards = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    //reactors only read requests, workers handle them (and do all the blocking: dns, origin, cache fills)
+    size_t queue_capacity = std::max(config.max_connections, 1024) / config.workers + 1;
+    worker_pool = std::make_unique<WorkerPool>(config.workers, queue_capacity);
+    for (int i = 0; i < num_shards; i++) {
+        int sockfd = create_listening_socket(proxy_server_port, true);
+        reactors.push_back(std::make_unique<EventLoop>(i, sockfd, cache, *worker_pool, stop_flag, curr_request_id));
     }
 }
 
 
 ProxyServer::~ProxyServer() { //might need to declare noexcept, idk?
-    close(listening_sockfd); //close listening socket; all client sockets should get closed by respective thread
-
-    //ensure all threads in client_threads are joined before they go out of scope (vector client_threads destructing = threads destructing b/c out of scope)
-    stop_flag = true;
+    //ensure all worker/reactor threads are joined before they go out of scope
+    stop(); //also wakes acceptor and reactors--guaranteed to see stop flag once done
 
-    //wakeup reaper thread--guaranteed to see stop flag once done
-    {
-        std::lock_guard<std::mutex> guard(reaper_q_lock);
-        reaper_q_cv.notify_one();
-    } //lock released
+    if (listening_sockfd >= 0) {
+        close(listening_sockfd); //close listening socket; all client sockets should get closed by respective thread/reactor
+    }
 
-    reaper_thread.join(); //wait for reaper thread to finish
+    for (auto& t : reactor_threads) {
+        if (t.joinable()) {
+            t.join();
+        }
+    }
 
-    {
-        std::lock_guard<std::mutex> guard(client_threads_lock); //dont need but i dont think it hurts
+    //close the idle connections, then let workers finish what they hold and join them, then end
+    //the tunnels (workers may still have handed one over)
+    if (poller) {
+        poller->stop();
+    }
+    if (worker_pool) {
+        worker_pool->shutdown();
+    }
+    if (tunnel_relay) {
+        tunnel_relay->stop();
+    }
+    reactors.clear(); //closes any connections reactors still own, once no worker holds one
+    if (admin_server) {
+        admin_server->stop();
+    }
 
-        //cleanup anyone reaper_thread did not (anyone who didn't put self in reaper queue before it did last cleanup)
-        for (auto& a : client_threads) {
-            if (a.joinable()) { //includes threads that have finished execution and those that have not
-                a.join(); //blocking, wait for thread to finish if not or immediately join if already finished
-            }
+    UpstreamPool& pool = UpstreamPool::get_instance();
+    Logger::get_instance().log_note(0, "upstream connection pool: " + std::to_string(pool.get_hits()) + " reused, " +
+                                       std::to_string(pool.get_misses()) + " new connections");
+
+    Logger::get_instance().log_note(0, "response cache: " + std::to_string(cache.size()) + " entries, " + std::to_string(cache.get_bytes_used()) +
+                                       " of " + std::to_string(cache.get_capacity()) + " bytes in " + std::to_string(cache.get_shard_count()) + " shards (" + cache.get_policy_name() + "), " +
+                                       std::to_string(cache.get_coalesced()) + " misses served by a concurrent fetch, " +
+                                       std::to_string(cache.get_coalesce_timeouts()) + " coalescing timeouts");
+
+    cache.stop_refreshing();
+    Logger::get_instance().log_note(0, "stale responses: " + std::to_string(cache.get_stale_served()) + " served while revalidating (" +
+                                       std::to_string(cache.get_refreshes()) + " background refreshes), " +
+                                       std::to_string(cache.get_stale_if_error_served()) + " served because the origin failed");
+
+    //no more requests at this point, the cache contents are final
+    if (!config.cache_snapshot.empty()) {
+        try {
+            size_t saved = cache.save_snapshot(config.cache_snapshot);
+            Logger::get_instance().log_note(0, "cache snapshot: " + std::to_string(saved) + " entries saved to " + config.cache_snapshot);
+        } catch (const std::exception& e) {
+            Logger::get_instance().log_error(0, e.what());
         }
-    } //lock released
+    }
+
+    if (disk_cache) {
+        disk_cache->flush();
+        Logger::get_instance().log_note(0, "disk cache: " + std::to_string(disk_cache->get_entry_count()) + " entries, " +
+                                           std::to_string(disk_cache->get_bytes_used()) + " bytes in " + std::to_string(disk_cache->get_segment_count()) +
+                                           " segments, " + std::to_string(disk_cache->get_hits()) + " hits");
+    }
 
-    //doesn't matter if reaper_q has some iterators in it, all threads referenced by iterators are joined
+    DnsCache& dns = DnsCache::get_instance();
+    dns.stop_refresher();
+    Logger::get_instance().log_note(0, "dns cache: " + std::to_string(dns.get_hits()) + " hits, " + std::to_string(dns.get_misses()) +
+                                       " lookups, " + std::to_string(dns.get_refreshes()) + " background refreshes");
+
+    TraceLog& traces = TraceLog::get_instance();
+    if (traces.is_enabled()) {
+        traces.stop(); //writes out what is still queued
+        Logger::get_instance().log_note(0, "traces: " + std::to_string(traces.get_written()) + " requests over " +
+                                           std::to_string(config.trace_threshold_ms) + " ms written to " + traces.get_path() +
+                                           (traces.get_dropped() > 0 ? ", " + std::to_string(traces.get_dropped()) + " dropped because the trace queue was full" : ""));
+    }
+
+    Logger& logger = Logger::get_instance();
+    if (logger.get_dropped() > 0) {
+        logger.log_note(0, "log: " + std::to_string(logger.get_dropped()) + " lines dropped because the log queue was full");
+    }
+    logger.flush(); //the shutdown notes are on disk before main returns
+    CoarseClock::get_instance().stop();
 
     std::cout << "All threads joined. Proxy server shutting down..." << std::endl;
 
 }
 
-//iterator needed so when thread finishes it can add itself to reaper queue
-void ProxyServer::handle_client(int client_sockfd, std::list<std::thread>::iterator it, std::string client_ip) {
-    //enter here with a worker thread
+//runs on a pool worker once a connection has bytes to read (or was closed): serves every request
+//they complete, then parks the connection with the poller again, so the worker is free between
+//requests. An established CONNECT tunnel goes to the tunnel relay instead, never held by a worker
+void ProxyServer::serve_ready(std::shared_ptr<ClientHandler> handler) {
+    //the socket is non-blocking, read_request returns READ_MORE once it has read all there is
+    ClientHandler::ReadResult result = ClientHandler::READ_MORE;
+    while (!stop_flag && (result = handler->read_request()) == ClientHandler::READ_REQUEST) {
+        int tunnel_remote;
+        int request_id;
+        bool keep = handler->handle_pending(tunnel_remote, request_id);
+        if (tunnel_remote >= 0) {
+            if (!tunnel_relay->add(handler, tunnel_remote, request_id)) {
+                finish_client(handler);
+            }
+            return; //the relay finishes it
+        }
+        if (!keep) {
+            finish_client(handler);
+            return;
+        }
+    }
+    if (stop_flag || result == ClientHandler::READ_CLOSE || !poller->park(handler)) {
+        finish_client(handler);
+    }
+}
 
-    ClientHandler handler; //thread creates client handler
-    handler.handle_client_requests(client_sockfd, cache, stop_flag, curr_request_id, client_ip); //returns when thread finishes (connection closed or server shutdown)
-    
+void ProxyServer::finish_client(std::shared_ptr<ClientHandler> handler) {
+    int client_sockfd = handler->get_sockfd();
+    {
+        std::lock_guard<std::mutex> guard(in_flight_lock);
+        client_sockets.erase(client_sockfd);
+    }
     close(client_sockfd);
+    release_connection_slot();
+}
 
-    //when a thread finishes, put itself in reaper queue
-    std::lock_guard<std::mutex> guard(reaper_q_lock);
-
-    reaper_q.push(it);
+//block the acceptor while max_connections connections are in flight (queued or being served).
+//further connections wait in the kernel's accept backlog instead of piling up in the process
+void ProxyServer::acquire_connection_slot() {
+    std::unique_lock<std::mutex> lk(in_flight_lock);
+    in_flight_cv.wait(lk, [&]{ return in_flight < config.max_connections || stop_flag; });
+    in_flight++;
+}
 
-    //signal reaper thread to wake up
-    reaper_q_cv.notify_one();
-    //lock guard destructed, lock released
-    //thread now finished executing
+void ProxyServer::release_connection_slot() {
+    std::lock_guard<std::mutex> guard(in_flight_lock);
+    in_flight--;
+    in_flight_cv.notify_one();
 }
 
-//reaper thread cleans up finished threads (in reaper queue) when woken up by cv signal
-void ProxyServer::cleanup_threads() {
-    
-    std::unique_lock<std::mutex> lk(reaper_q_lock, std::defer_lock); //basically same as lock guard except can actually be locked and unlocked while
-                                                                     //lock guard can only be unlocked on destruction (unlock needed for cv.wait())
-    while (!stop_flag) {
-        lk.lock();
-        reaper_q_cv.wait(lk, [&]{ return ((reaper_q.size() > 0) || (stop_flag)); }); //ensures we wait again unless elements to clean or stop flag set
+//signal shutdown: threads mode accept loop and reactors return from start().
+//safe to call more than once
+void ProxyServer::stop() {
+    stop_flag = true;
 
-        //we own lock, can clean up
-        while (!reaper_q.empty()) {
-            std::list<std::thread>::iterator it = reaper_q.front();
+    //wakeup acceptor if it is waiting for a free connection slot, and make a worker's (or a relayed
+    //tunnel's) next recv() see EOF (only the read side, a response being sent still goes out)
+    {
+        std::lock_guard<std::mutex> guard(in_flight_lock);
+        in_flight_cv.notify_all();
+        for (int sockfd : client_sockets) {
+            shutdown(sockfd, SHUT_RD);
+        }
+    } //lock released
 
-            reaper_q.pop();
+    //makes a blocked accept() in threads mode return with an error
+    if (listening_sockfd >= 0) {
+        shutdown(listening_sockfd, SHUT_RDWR);
+    }
 
-            if (it->joinable()) { //join the thread
-                it->join();
-            }
+    for (auto& reactor : reactors) {
+        reactor->wakeup();
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(stop_lock);
+        stop_cv.notify_all();
+    }
+}
 
-            //can now remove thread from client_threads (destructs it) since join called
-            std::lock_guard<std::mutex> guard(client_threads_lock);
-            client_threads.erase(it);
-        } //client threads lock guard released
+std::vector<size_t> ProxyServer::get_shard_connection_counts() const {
+    std::vector<size_t> counts;
+    for (const auto& reactor : reactors) {
+        counts.push_back(reactor->get_active_connections());
+    }
+    return counts;
+}
 
-        //done, so unlock. no need to wake up anyone else since we only one waiting
-        lk.unlock();
+void ProxyServer::log_shard_stats() {
+    Logger& logger = Logger::get_instance();
+    for (const auto& reactor : reactors) {
+        logger.log_note(0, "shard " + std::to_string(reactor->get_shard_id()) + ": " + std::to_string(reactor->get_active_connections()) +
+                           " active connections, " + std::to_string(reactor->get_accepted_connections()) + " accepted");
     }
+}
 
-    //thread now finished executing
+std::string ProxyServer::collect_metrics() {
+    std::string out;
+    Metrics::append_metric(out, "proxy_cache_entries", "gauge", "Responses in the memory cache.", cache.size());
+    Metrics::append_metric(out, "proxy_cache_bytes", "gauge", "Bytes charged to the memory cache.", cache.get_bytes_used());
+    Metrics::append_metric(out, "proxy_cache_capacity_bytes", "gauge", "Byte budget of the memory cache.", cache.get_capacity());
+    Metrics::append_metric(out, "proxy_cache_coalesced_total", "counter", "Misses answered by a concurrent request's fetch.", cache.get_coalesced());
+    Metrics::append_metric(out, "proxy_cache_stale_served_total", "counter", "Expired entries served while revalidated.", cache.get_stale_served());
+    Metrics::append_metric(out, "proxy_cache_stale_if_error_total", "counter", "Expired entries served because the origin failed.", cache.get_stale_if_error_served());
+    Metrics::append_metric(out, "proxy_cache_refreshes_total", "counter", "Background refreshes run.", cache.get_refreshes());
+    if (disk_cache) {
+        Metrics::append_metric(out, "proxy_disk_cache_entries", "gauge", "Responses in the disk cache.", disk_cache->get_entry_count());
+        Metrics::append_metric(out, "proxy_disk_cache_bytes", "gauge", "Bytes of disk cache segments.", disk_cache->get_bytes_used());
+        Metrics::append_metric(out, "proxy_disk_cache_hits_total", "counter", "Memory misses found in the disk cache.", disk_cache->get_hits());
+    }
+    UpstreamPool& pool = UpstreamPool::get_instance();
+    Metrics::append_metric(out, "proxy_upstream_reused_total", "counter", "Origin requests sent on a pooled connection.", pool.get_hits());
+    Metrics::append_metric(out, "proxy_upstream_connections_total", "counter", "Origin requests that needed a new connection.", pool.get_misses());
+    DnsCache& dns = DnsCache::get_instance();
+    Metrics::append_metric(out, "proxy_dns_hits_total", "counter", "Lookups answered by the DNS cache.", dns.get_hits());
+    Metrics::append_metric(out, "proxy_dns_lookups_total", "counter", "Lookups sent to the resolver.", dns.get_misses());
+    Metrics::append_metric(out, "proxy_log_dropped_total", "counter", "Log lines dropped because the log queue was full.", Logger::get_instance().get_dropped());
+    return out;
 }
 
 //let the proxy server start listening and accepting connections. This is a blocking function.
 void ProxyServer::start() {
-    if (listen(listening_sockfd, 128) < 0) {
+    if (config.mode == "epoll") {
+        for (auto& reactor : reactors) {
+            reactor->listen_for_connections(config.accept_backlog);
+        }
+    } else if (listen(listening_sockfd, config.accept_backlog) < 0) {
         throw std::runtime_error("Failed to set up socket to listen for incoming connections");
     }
 
-    std::cout << "Proxy server listening on port " << proxy_server_port << std::endl;
+    std::cout << "Proxy server listening on port " << proxy_server_port << " (" << config.mode << " mode";
+    if (config.mode == "epoll") {
+        std::cout << ", " << reactors.size() << " shards";
+    } else {
+        std::cout << ", " << config.workers << " workers, max " << config.max_connections << " connections";
+    }
+    std::cout << ")" << std::endl;
+
+    if (admin_server) {
+        admin_server->start();
+        std::cout << "Metrics at http://localhost:" << admin_server->get_port() << "/metrics" << std::endl;
+    }
+
+    if (config.mode == "epoll") {
+        start_reactor();
+    } else {
+        start_threaded();
+    }
+}
+
+//epoll mode: each shard's reactor runs on its own thread, optionally pinned to its own cpu
+void ProxyServer::start_reactor() {
+    //cpus this process may run on (container cpusets may exclude some)
+    std::vector<int> cpus;
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (config.pin_reactors && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+
+    for (auto& reactor : reactors) {
+        EventLoop* loop = reactor.get();
+        reactor_threads.emplace_back([loop]() { loop->run(); });
 
-    sockaddr_in client_address;
-    memset(&client_address, 0, sizeof(client_address));
-    socklen_t client_address_len = sizeof(client_address);
+        if (!cpus.empty()) {
+            cpu_set_t cpu_set;
+            CPU_ZERO(&cpu_set);
+            CPU_SET(cpus[loop->get_shard_id() % cpus.size()], &cpu_set);
+            if (pthread_setaffinity_np(reactor_threads.back().native_handle(), sizeof(cpu_set), &cpu_set) != 0) {
+                Logger::get_instance().log_warning(0, "Failed to pin shard " + std::to_string(loop->get_shard_id()) + " to a cpu");
+            }
+        }
+    }
+
+    //report shard balance periodically until shutdown
+    {
+        std::unique_lock<std::mutex> lk(stop_lock);
+        while (!stop_flag) {
+            if (config.shard_stats_interval > 0) {
+                stop_cv.wait_for(lk, std::chrono::seconds(config.shard_stats_interval), [&]{ return stop_flag.load(); });
+                if (!stop_flag) {
+                    log_shard_stats();
+                }
+            } else {
+                stop_cv.wait(lk, [&]{ return stop_flag.load(); });
+            }
+        }
+    }
+
+    for (auto& t : reactor_threads) {
+        t.join();
+    }
+
+    log_shard_stats();
+}
+
+//threads mode: a fixed pool of workers serves connections that have something to read, a poller
+//holds them in between (see ConnectionPoller); the acceptor stops accepting while max_connections
+//are in flight so a burst queues in the kernel backlog, not in threads
+void ProxyServer::start_threaded() {
+    //per-worker queues together can hold every in-flight connection, so submit only fails on shutdown
+    size_t queue_capacity = config.max_connections / config.workers + 1;
+    worker_pool = std::make_unique<WorkerPool>(config.workers, queue_capacity);
+    poller = std::make_unique<ConnectionPoller>(std::chrono::seconds(config.client_timeout),
+        [this](std::shared_ptr<ClientHandler> handler) {
+            if (!worker_pool->submit([this, handler]() { serve_ready(handler); })) {
+                Logger::get_instance().log_warning(0, "Worker queues full, dropping a client connection");
+                finish_client(handler);
+            }
+        },
+        [this](std::shared_ptr<ClientHandler> handler) { finish_client(handler); });
+    poller->start();
+    tunnel_relay = std::make_unique<TunnelRelay>([this](std::shared_ptr<ClientHandler> handler) { finish_client(handler); });
+    tunnel_relay->start();
+    int reserve_fd = open_reserve_fd(); //see refuse_connection
 
-    //initialize reaper/cleanup thread
-    reaper_thread = std::thread(&ProxyServer::cleanup_threads, this);
-    
     //start acccepting connections
-    while (true) { //accept connection requests here; creates new socket and bounds that socket to same port as listener socket
-        int client_connection_sockfd = accept(listening_sockfd, (sockaddr*)&client_address, &client_address_len);
+    while (!stop_flag) {
+        acquire_connection_slot();
+        if (stop_flag) {
+            release_connection_slot();
+            break;
+        }
+
+        sockaddr_in client_address;
+        memset(&client_address, 0, sizeof(client_address));
+        socklen_t client_address_len = sizeof(client_address);
+
+        //accept connection requests here; creates new socket and bounds that socket to same port as listener socket
+        //non-blocking: workers only read what is there and leave the waiting to the poller
+        int client_connection_sockfd = accept4(listening_sockfd, (sockaddr*)&client_address, &client_address_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
 
         if (client_connection_sockfd < 0) {
-            continue; //don't exit here, try to accept again
+            if ((errno == EMFILE || errno == ENFILE) && !stop_flag) {
+                //the connection stays in the backlog and accept would fail again right away
+                if (refuse_connection(listening_sockfd, reserve_fd) > 0) {
+                    Logger::get_instance().log_warning(0, "Out of file descriptors, refused a connection");
+                } else {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                }
+            }
+            release_connection_slot();
+            continue; //don't exit here, try to accept again (loop condition catches shutdown)
         }
 
         char ip_src[64];
-        sprintf(ip_src, "%s", inet_ntoa(client_address.sin_addr)); //convert ip of client to string
+        inet_ntop(AF_INET, &client_address.sin_addr, ip_src, sizeof(ip_src)); //convert ip of client to string
         std::string client_ip (ip_src);
 
-        //create new thread to call handle_client()
-        std::lock_guard<std::mutex> guard(client_threads_lock); //lock guard to ensure client_threads_lock is released either when guard goes out of scope or exception in creating new thread
-        client_threads.emplace_back(); //add a default-constructed thread
-        auto it = --client_threads.end(); //get iterator after insertion
-        *it = std::thread([this, client_connection_sockfd, it, client_ip]() { handle_client(client_connection_sockfd, it, client_ip); });
-        //client_threads.emplace_back(&ProxyServer::handle_client, this, client_connection_sockfd, --client_threads.end()); //add thread to list of all active threads
+        //registered so stop() can end a tunnel's wait on the client instead of waiting out the timeout
+        {
+            std::lock_guard<std::mutex> guard(in_flight_lock);
+            client_sockets.insert(client_connection_sockfd);
+        }
+        //a worker gets it once its first request arrives
+        std::shared_ptr<ClientHandler> handler = std::make_shared<ClientHandler>(client_connection_sockfd, cache, curr_request_id, client_ip);
+        if (!poller->park(handler)) {
+            finish_client(handler);
+        }
+    }
+
+    if (reserve_fd >= 0) {
+        close(reserve_fd);
     }
-    
-}
\ No newline at end of file
+}
@@ -2,13 +2,18 @@
 #define PROXY_SERVER_H
 
 #include <vector>
-#include <list>
+#include <unordered_set>
 #include "ClientHandler.h"
+#include "ConnectionPoller.h"
+#include "TunnelRelay.h"
 #include "CacheManager.h"
+#include "EventLoop.h"
+#include "ProxyConfig.h"
+#include "WorkerPool.h"
+#include "AdminServer.h"
 #include <thread>
 #include <mutex>
 #include <atomic>
-#include <queue>
 #include <condition_variable>
 
 // #define PROXY_SERVER_PORT 80
@@ -16,31 +21,48 @@
 class ProxyServer {
 private:
 
+    void start_threaded();
+    void start_reactor();
+    void log_shard_stats();
+    std::string collect_metrics(); //the admin port's gauges for totals kept outside Metrics
+
+    std::mutex stop_lock;
+    std::condition_variable stop_cv; //wakes the shard stats reporter on shutdown
+
 public:
+    ProxyConfig config;
     int proxy_server_port;
-    int listening_sockfd;
+    int listening_sockfd; //threads mode only, -1 in epoll mode (each reactor owns its own listener)
 
-    // std::vector<ClientHandler> clients; 
-    // std::mutex clients_lock;
-    std::list<std::thread> client_threads; //changed to list to avoid iterator invalidation
-    std::mutex client_threads_lock;
     std::atomic<bool> stop_flag; //flag to signal threads to shutdown
 
-    std::queue<std::list<std::thread>::iterator> reaper_q; //queue for finished threads, reaper thread will join them
-    std::mutex reaper_q_lock;
-    std::condition_variable reaper_q_cv;
-    std::thread reaper_thread;
+    std::unique_ptr<WorkerPool> worker_pool; //serves connections (threads mode) or the reactors' requests (epoll mode)
+    std::unique_ptr<ConnectionPoller> poller; //threads mode: connections between requests, see serve_ready
+    std::unique_ptr<TunnelRelay> tunnel_relay; //threads mode: established CONNECT tunnels
+    int in_flight; //accepted connections not yet finished (parked, queued or being served), threads mode
+    std::mutex in_flight_lock;
+    std::condition_variable in_flight_cv;
+    std::unordered_set<int> client_sockets; //open client connections, threads mode (under in_flight_lock)
+
+    std::vector<std::unique_ptr<EventLoop>> reactors; //only used in epoll mode, one per shard
+    std::vector<std::thread> reactor_threads;
 
+    std::unique_ptr<DiskCache> disk_cache; //second cache tier, only with --disk-cache-dir
     CacheManager cache;
+    std::unique_ptr<AdminServer> admin_server; //only with --admin-port
 
     std::atomic_int curr_request_id;
 
-    ProxyServer(int proxy_server_port);
+    explicit ProxyServer(const ProxyConfig& config);
     ~ProxyServer();
 
-    void handle_client(int client_sockfd, std::list<std::thread>::iterator it, std::string client_ip);
-    void cleanup_threads();
+    void serve_ready(std::shared_ptr<ClientHandler> handler);
+    void finish_client(std::shared_ptr<ClientHandler> handler);
+    void acquire_connection_slot();
+    void release_connection_slot();
     void start();
+    void stop();
+    std::vector<size_t> get_shard_connection_counts() const; //active connections per epoll shard
 };
 
 #endif
\ No newline at end of file
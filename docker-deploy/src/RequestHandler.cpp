@@ -1,13 +1,25 @@
 #include "RequestHandler.h"
+#include "CoarseClock.h"
 #include "Logger.h"
+#include "Metrics.h"
+#include "UpstreamPool.h"
+#include "DnsCache.h"
+#include "Tunnel.h"
+#include "ChunkedDecoder.h"
+#include "ResponseParser.h"
 #include <iostream>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <sstream>
+#include <poll.h>
+#include <cerrno>
+#include <cctype>
+#include <cstdlib>
 
-//returns 0 on success, -1 on error
-int RequestHandler::reliable_send(int sockfd, const char* message, size_t len, int request_id) {
+//send all of message, counting what was sent as counter's bytes. returns 0 on success, -1 on error
+static int send_all(int sockfd, const char* message, size_t len, int request_id, MetricCounter counter) {
     int remaining = len;
     int sent;
     const char* curr_ptr = message;
@@ -15,7 +27,21 @@ int RequestHandler::reliable_send(int sockfd, const char* message, size_t len, i
     Logger& logger = Logger::get_instance();
 
     while (remaining > 0) {
-        sent = send(sockfd, curr_ptr, remaining, 0);
+        sent = send(sockfd, curr_ptr, remaining, MSG_NOSIGNAL);
+
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            //non-blocking socket (epoll mode) with a full send buffer, wait until writable
+            struct pollfd pfd = {sockfd, POLLOUT, 0};
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                logger.log_error(request_id, "A poll for send returned -1, closing connection.");
+                return -1;
+            }
+            continue;
+        }
 
         if (sent < 0) {
             logger.log_error(request_id, "A send returned -1, closing connection.");
@@ -24,12 +50,119 @@ int RequestHandler::reliable_send(int sockfd, const char* message, size_t len, i
 
         remaining -= sent;
         curr_ptr += sent;
+        Metrics::add(counter, sent);
     }
 
     return 0;
 }
 
-RequestHandler::RequestHandler(CacheManager& cache) : cache(cache) {}
+//send to a client. returns 0 on success, -1 on error
+int RequestHandler::reliable_send(int sockfd, const char* message, size_t len, int request_id) {
+    return send_all(sockfd, message, len, request_id, METRIC_CLIENT_BYTES_OUT);
+}
+
+//send a response given as its serialized head and its body with writev, so the body is sent straight
+//from where it is stored (e.g. a cache entry) instead of being copied into one buffer with the head.
+//returns 0 on success, -1 on error
+int RequestHandler::send_response(int sockfd, const std::string& head, std::string_view body, int request_id) {
+    struct iovec parts[2] = {{(void*)head.data(), head.length()}, {(void*)body.data(), body.length()}};
+    struct iovec* curr = parts;
+    int count = body.empty() ? 1 : 2;
+
+    Logger& logger = Logger::get_instance();
+
+    while (count > 0) {
+        struct msghdr message = {};
+        message.msg_iov = curr;
+        message.msg_iovlen = count;
+        ssize_t sent = sendmsg(sockfd, &message, MSG_NOSIGNAL);
+
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            //non-blocking socket (epoll mode) with a full send buffer, wait until writable
+            struct pollfd pfd = {sockfd, POLLOUT, 0};
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                logger.log_error(request_id, "A poll for send returned -1, closing connection.");
+                return -1;
+            }
+            continue;
+        }
+
+        if (sent < 0) {
+            logger.log_error(request_id, "A send returned -1, closing connection.");
+            return -1;
+        }
+
+        Metrics::add(METRIC_CLIENT_BYTES_OUT, sent);
+
+        //skip what was sent, the rest of a partly sent part goes first next time
+        while (count > 0 && (size_t)sent >= curr->iov_len) {
+            sent -= curr->iov_len;
+            curr++;
+            count--;
+        }
+        if (count > 0) {
+            curr->iov_base = (char*)curr->iov_base + sent;
+            curr->iov_len -= sent;
+        }
+    }
+
+    return 0;
+}
+
+RequestHandler::RequestHandler(CacheManager& cache, RequestTrace* trace, int* tunnel_remote) : cache(cache), trace(trace), tunnel_remote(tunnel_remote) {
+    if (tunnel_remote) {
+        *tunnel_remote = -1;
+    }
+}
+
+int RequestHandler::send_to_client(int client_socket, const std::string& head, std::string_view body, int request_id) {
+    TraceSpan span(trace, TRACE_CLIENT_WRITE);
+    return send_response(client_socket, head, body, request_id);
+}
+
+//whether requests waiting on our fetch of the same url may be answered with this response.
+//a response that varies on request headers is only right for the request that fetched it
+static bool can_share(const HttpResponse& response) {
+    return response.is_cacheable() && response.get_header("Vary").empty();
+}
+
+//the default 502 page, dated like every response the proxy makes itself
+static HttpResponse bad_gateway_response() {
+    HttpResponse response;
+    response.headers["Date"] = CoarseClock::get_instance().http_date().str();
+    return response;
+}
+
+//the first response byte arrived at first_byte_at, the request was sent at sent_at
+static void record_ttfb(std::chrono::steady_clock::time_point sent_at, std::chrono::steady_clock::time_point first_byte_at, RequestTrace* trace) {
+    Metrics::record(METRIC_UPSTREAM_TTFB, std::chrono::duration_cast<std::chrono::microseconds>(first_byte_at - sent_at).count());
+    if (trace) {
+        trace->add_span(TRACE_ORIGIN_TTFB, sent_at, first_byte_at);
+    }
+}
+
+//stale-if-error: answer a GET whose origin fetch failed (no response, or a 5xx) with the cached copy, expired
+//or not, if it may stand in. returns false if there is none, else result is what handle_request returns
+bool RequestHandler::serve_stale(HttpRequest& request, int client_socket, int request_id, int& result) {
+    if (request.get_method() != "GET") {
+        return false;
+    }
+    std::shared_ptr<const std::string> head;
+    std::shared_ptr<HttpResponse> stale = cache.get_stale_response(request_id, request.get_url(), &request, &head);
+    if (!stale) {
+        return false;
+    }
+
+    result = send_to_client(client_socket, *head, stale->body_bytes(), request_id) < 0 ? -1 : 0;
+    if (result == 0) {
+        Logger::get_instance().log_response(request_id, stale->get_status_line());
+    }
+    return true;
+}
 
 //this function will also handle responding to malformed requests with error code.
 //will return -1 if we should close socket connection to client after handling (right now just for malformed request). 
@@ -37,51 +170,72 @@ RequestHandler::RequestHandler(CacheManager& cache) : cache(cache) {}
 int RequestHandler::handle_request(HttpRequest& request, int client_socket, int request_id, const std::string& client_ip) {
     // Use shared Logger instance
     Logger& logger = Logger::get_instance();
+    MetricTimer latency(METRIC_REQUEST_LATENCY);
+    Metrics::add(METRIC_REQUESTS);
 
     // Log initial request
-    logger.log_request(request_id, request.get_method() + " " + request.get_url() + " " + request.get_http_version(), client_ip);
+    logger.log_request(request_id, request.get_method(), request.get_url(), request.get_http_version(), client_ip);
 
     // Handle malformed request
     if (request.client_error_code != 0) {
         logger.log_error(request_id, "Malformed request received, closing connection.");
 
-        std::string error_response = "HTTP/1.1 " + std::to_string(request.client_error_code) + " Bad Request\r\nConnection: close\r\n\r\n";
-        reliable_send(client_socket, error_response.c_str(), error_response.length(), request_id); //dont need result, closing regardless
+        std::string error_response = "HTTP/1.1 " + std::to_string(request.client_error_code) + " Bad Request\r\nDate: " +
+                                     CoarseClock::get_instance().http_date().str() + "\r\nConnection: close\r\n\r\n";
+        send_to_client(client_socket, error_response, std::string(), request_id); //dont need result, closing regardless
         return -1;
     }
 
     std::string method = request.get_method();
     std::string url = request.get_url();
+    CoalescedFetch fetch(cache, url); //set if this request fetches a missed url for others too
 
     // Handle GET request and caching
     if (method == "GET") {
-        if (cache.is_in_cache(url)) {
-            std::shared_ptr<HttpResponse> cached_response = cache.get_cached_response(request_id,url);
-            if (cached_response) {
-                if (request.has_header("If-Modified-Since") || request.has_header("If-None-Match")) {
-                    logger.log_cache_status(request_id, "in cache, requires validation");
-    
-                    // Modify request to send conditional headers
-                    request.add_header("If-Modified-Since", cached_response->get_header("Last-Modified"));
-                    request.add_header("If-None-Match", cached_response->get_header("ETag"));
-    
-                    HttpResponse response = forward_request(request, request_id);
-                    if (response.get_status_line().find("304 Not Modified") != std::string::npos) {
-                        logger.log_response(request_id, "HTTP/1.1 304 Not Modified (Using cached copy)");
-                        if (reliable_send(client_socket, cached_response->serialize().c_str(), cached_response->serialize().length(), request_id) < 0) {
-                            return -1;
-                        }
-
-                        return 0;
-                    } //DO WE NEED AN ELSE??
-                } else {
-                    //logger.log_cache_status(request_id, "in cache, valid");
-                    if (reliable_send(client_socket, cached_response->serialize().c_str(), cached_response->serialize().length(), request_id) < 0) {
+        std::shared_ptr<const std::string> cached_head; //ready to send, shared with the cache entry
+        TraceSpan lookup(trace, TRACE_CACHE_LOOKUP);
+        std::shared_ptr<HttpResponse> cached_response = cache.get_cached_response(request_id, url, &request, &cached_head); //misses are looked up too, the eviction policy counts them
+        lookup.end();
+        if (!cached_response) {
+            //another request may be fetching this url already, wait for its response instead of fetching it again
+            std::shared_ptr<HttpResponse> shared_response;
+            TraceSpan wait(trace, TRACE_COALESCE_WAIT);
+            CacheManager::FetchRole role = cache.begin_fetch(url, shared_response);
+            wait.end();
+            if (role == CacheManager::FETCH_SHARED) {
+                logger.log_note(request_id, "served the response fetched by a concurrent request");
+                if (send_to_client(client_socket, shared_response->serialize_head(), shared_response->body_bytes(), request_id) < 0) {
+                    return -1;
+                }
+                logger.log_response(request_id, shared_response->get_status_line());
+                return 0;
+            }
+            fetch.set_leader(role == CacheManager::FETCH_LEADER);
+        } else {
+            if (request.has_header("If-Modified-Since") || request.has_header("If-None-Match")) {
+                logger.log_cache_status(request_id, "in cache, requires validation");
+
+                // Modify request to send conditional headers
+                request.add_header("If-Modified-Since", cached_response->get_header("Last-Modified"));
+                request.add_header("If-None-Match", cached_response->get_header("ETag"));
+                Metrics::add(METRIC_REVALIDATIONS);
+
+                HttpResponse response = forward_request(request, request_id);
+                if (response.status_code == 304) {
+                    logger.log_response(request_id, "HTTP/1.1 304 Not Modified (Using cached copy)");
+                    if (send_to_client(client_socket, *cached_head, cached_response->body_bytes(), request_id) < 0) {
                         return -1;
                     }
-                    logger.log_response(request_id, cached_response->get_status_line());
+
                     return 0;
+                } //DO WE NEED AN ELSE??
+            } else {
+                //logger.log_cache_status(request_id, "in cache, valid");
+                if (send_to_client(client_socket, *cached_head, cached_response->body_bytes(), request_id) < 0) {
+                    return -1;
                 }
+                logger.log_response(request_id, cached_response->get_status_line());
+                return 0;
             }
         }
     }
@@ -89,208 +243,625 @@ int RequestHandler::handle_request(HttpRequest& request, int client_socket, int
 
     // Handle HTTPS (CONNECT)
     if (method == "CONNECT") {
+        latency.cancel(); //a tunnel lasts as long as its client wants
+        if (trace) {
+            trace->exclude();
+        }
         handle_connect(request, client_socket, request_id);
-        return 0;
+        return -1; //after a tunnel (or a 502 without a length) the connection can't carry more requests
+    }
+
+    if (method == "GET" && streaming_enabled) {
+        return stream_request(request, client_socket, request_id, fetch);
     }
 
     // Forward other requests (including POST)
     HttpResponse response = forward_request(request, request_id);
-    std::string response_str = response.serialize();
-    if (reliable_send(client_socket, response_str.c_str(), response_str.length(), request_id) < 0) {
-        return -1;
-    }
 
-    // Log response to client
-    logger.log_response(request_id, response.get_status_line());
+    //the origin failed, a cached copy beats an error
+    int stale_result;
+    if (response.status_code >= 500 && serve_stale(request, client_socket, request_id, stale_result)) {
+        return stale_result;
+    }
 
-    // Cache only 200 OK GET responses
+    // Cache only 200 OK GET responses, before answering so requests waiting on this fetch are let go right away
     if (method == "GET" && response.is_cacheable()) {
-        //std::cout << "cacheable222222" << std::endl;
-        cache.store_response(request_id, url, std::make_shared<HttpResponse>(response));
-        //logger.log_cache_status(request_id, "cached, expires at " + response.get_header("Expires"));
-        //std::cout << "cacheable4444444" << std::endl;
+        std::shared_ptr<HttpResponse> stored = std::make_shared<HttpResponse>(response);
+        cache.store_response(request_id, url, stored, &request);
+        if (can_share(response)) {
+            fetch.finish(stored);
+        }
+    }
+    fetch.finish(nullptr);
+
+    if (send_to_client(client_socket, response.serialize_head(), response.body, request_id) < 0) {
+        return -1;
     }
 
+    // Log response to client
+    logger.log_response(request_id, response.get_status_line());
 
     return 0;
 }
 
-// Forward request to origin server
-HttpResponse RequestHandler::forward_request(HttpRequest& request, int request_id) {
-    Logger& logger = Logger::get_instance();
-    int sockfd;
-    struct addrinfo hints{}, *res;
-    std::string server = request.get_host();
-
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+//refetch a cached response in the background. The client's own validators are replaced by the cached
+//copy's, so a 304 means our copy is current: it is kept with the headers the 304 updated
+std::shared_ptr<HttpResponse> RequestHandler::revalidate(const HttpRequest& client_request, std::shared_ptr<HttpResponse> cached) {
+    HttpRequest request = client_request;
+    request.remove_header("If-None-Match");
+    request.remove_header("If-Modified-Since");
+    if (!cached->get_header("ETag").empty()) {
+        request.add_header("If-None-Match", cached->get_header("ETag"));
+    }
+    if (!cached->get_header("Last-Modified").empty()) {
+        request.add_header("If-Modified-Since", cached->get_header("Last-Modified"));
+    }
 
-    // Resolve server address
-    if (getaddrinfo(server.c_str(), "80", &hints, &res) != 0) {
-        logger.log_error(request_id, "Failed to resolve host: " + server);
-        return HttpResponse(); // 502 Bad Gateway
+    Metrics::add(METRIC_REVALIDATIONS);
+    HttpResponse response = forward_request(request, 0);
+    if (response.status_code == 304) {
+        std::shared_ptr<HttpResponse> updated = std::make_shared<HttpResponse>(*cached);
+        for (const auto& header : response.headers) {
+            if (header.first != "Content-Length" && header.first != "Transfer-Encoding") {
+                updated->headers[header.first] = header.second;
+            }
+        }
+        updated->parse_cache_control(); //the 304's Cache-Control, Date and Expires apply from now on
+        return updated;
     }
+    if (response.is_cacheable()) {
+        return std::make_shared<HttpResponse>(response);
+    }
+    return nullptr;
+}
 
-    struct addrinfo* it = NULL;
-    for (it = res; it != NULL; it = it->ai_next) {
-        sockfd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
-        if (sockfd == -1) //failed socket creation using current address structure, try next one
+//resolve host (through the DNS cache) and connect to the first address that accepts the connection.
+//returns the connected socket, or -1 with resolve_failed telling the caller which step failed
+int RequestHandler::connect_to_host(const std::string& host, const std::string& port, bool& resolve_failed, RequestTrace* trace) {
+    std::vector<ResolvedAddress> addresses;
+
+    resolve_failed = false;
+    TraceSpan dns(trace, TRACE_DNS);
+    if (DnsCache::get_instance().resolve(host, port, addresses) != 0) {
+        resolve_failed = true;
+        return -1;
+    }
+    dns.end();
+
+    int sockfd = -1;
+    MetricTimer connect_time(METRIC_UPSTREAM_CONNECT);
+    TraceSpan connecting(trace, TRACE_CONNECT);
+    for (const auto& address : addresses) {
+        sockfd = socket(address.family, address.socktype, address.protocol);
+        if (sockfd == -1) //failed socket creation using current address, try next one
             continue;
 
-        if (connect(sockfd, it->ai_addr, it->ai_addrlen) != -1) //successful connection to ringmaster
+        if (connect(sockfd, (const sockaddr*)&address.addr, address.addr_len) != -1) //successful connection
             break;
 
-        close(sockfd); //failed connect using current address structure, try next one
+        close(sockfd); //failed connect using current address, try next one
+        sockfd = -1;
     }
 
-    freeaddrinfo(res);
+    if (sockfd < 0) {
+        connect_time.cancel(); //only connections made are timed
+    }
+    return sockfd; //-1 if tried all addresses and none succeeded
+}
 
-    if (it == NULL) { //tried all addresses, none succeeded
-        logger.log_error(request_id, "Failed to connect to server: " + server);
-        return HttpResponse(); // 502 Bad Gateway
+//split a Host header value into host and port ("example.com:8080", "[::1]:8080").
+//port is default_port when the header doesn't name one
+void RequestHandler::split_host_port(const std::string& host_header, const std::string& default_port, std::string& host, std::string& port) {
+    host = host_header;
+    port = default_port;
+
+    size_t colon = host_header.rfind(':');
+    size_t bracket = host_header.rfind(']');
+    if (colon == std::string::npos || (bracket != std::string::npos && colon < bracket)) {
+        if (bracket != std::string::npos && host.size() > 2 && host[0] == '[') {
+            host = host.substr(1, bracket - 1);
+        }
+        return;
     }
 
+    std::string candidate = host_header.substr(colon + 1);
+    if (candidate.empty() || candidate.find_first_not_of("0123456789") != std::string::npos) {
+        return; //not host:port (e.g. bare IPv6 literal), use as-is
+    }
 
-    // Log only the request line (first line of serialized request)
-    // std::istringstream request_stream(request.serialize());
-    // std::string request_line;
-    // std::getline(request_stream, request_line);
+    host = host_header.substr(0, colon);
+    port = candidate;
+    if (host.size() > 2 && host[0] == '[' && host[host.size() - 1] == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+}
 
-    logger.log_forward_request(request_id, request.get_method() + " " + request.get_url() + " " + request.get_http_version(), request.get_host());
+//send request_str over sockfd and read one full response into response.
+//returns 0 on success. if retryable (a pooled connection the origin may have closed meanwhile),
+//returns 1 when the connection failed before a single response byte arrived so the caller can
+//retry on a new connection. returns -1 on any other failure (already logged)
+int RequestHandler::exchange(int sockfd, const std::string& request_str, HttpResponse& response, int request_id, bool retryable) {
+    Logger& logger = Logger::get_instance();
 
     //Send request
-    std::string request_str = request.serialize();
-    if (reliable_send(sockfd, request_str.c_str(), request_str.length(), request_id) < 0) {
+    if (send_all(sockfd, request_str.c_str(), request_str.length(), request_id, METRIC_ORIGIN_BYTES_OUT) < 0) {
+        if (retryable) {
+            return 1;
+        }
         logger.log_error(request_id, "Failed to send data to server.");
-        close(sockfd);
-        return HttpResponse(); // 502 Bad Gateway
+        return -1;
     }
 
-    //Receive response from server
+    //Receive response from server, each segment is parsed once as it arrives
     int buffer_read_size = 8192;
     char buffer[buffer_read_size];
-    std::string curr_message;
-    HttpResponse response;
+    ResponseParser parser;
+    bool received_any = false;
+    auto sent_at = std::chrono::steady_clock::now();
+    auto first_byte_at = sent_at;
 
     while (true) {
         int bytes_read = recv(sockfd, buffer, buffer_read_size, 0);
 
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes_read <= 0 && !received_any && retryable) {
+            return 1;
+        }
+
         if (bytes_read < 0) {
             logger.log_error(request_id, "Failed to receive response from server.");
-            close(sockfd);
-            return HttpResponse(); //502 Bad Gateway
-        } else if (bytes_read == 0) { //server has closed connection and on last iteration we did not have full http response
-            logger.log_error(request_id, "Failed to receive response from server.");
-            close(sockfd);
-            return HttpResponse(); //502 Bad Gateway
+            return -1; //502 Bad Gateway
+        } else if (bytes_read == 0) { //server has closed connection, only ok if that's what ends the body
+            parser.finish();
+            if (!parser.done() || parser.failed()) {
+                logger.log_error(request_id, "Failed to receive response from server.");
+                return -1; //502 Bad Gateway
+            }
+        } else {
+            if (!received_any) {
+                first_byte_at = std::chrono::steady_clock::now();
+                record_ttfb(sent_at, first_byte_at, trace);
+            }
+            received_any = true;
+            Metrics::add(METRIC_ORIGIN_BYTES_IN, bytes_read);
+            parser.feed(std::string_view(buffer, bytes_read));
         }
 
-        curr_message += std::string(buffer, bytes_read);
+        if (parser.done()) {
+            if (parser.failed()) { //if parse error, just use default 502 bad gateway
+                logger.log_error(request_id, "Received invalid response from server.");
+                return -1; //502 Bad Gateway
+            }
 
-        //try to parse a single response
-        //Returns true even if malformed response.
-        HttpResponse response2;
-        bool res = response2.parse_response(curr_message);
+            response = std::move(parser.get_response());
+            if (trace) {
+                trace->add_span(TRACE_ORIGIN_READ, first_byte_at, std::chrono::steady_clock::now());
+            }
+            return 0; //received full response, done and no need to recv again
+        }
+    }
+}
 
-        
-        if (res) {
-            if (response2.parse_error) { //if parse error, just use default 502 bad gateway
-                //std::cout << "response error" << std::endl;
-                logger.log_error(request_id, "Received invalid response from server.");
-                close(sockfd);
-                return HttpResponse(); //502 Bad Gateway
+//a connection can go back to the upstream pool only if the origin didn't ask to close it and the
+//response had explicit framing (Content-Length or chunked), so we know exactly where it ended
+bool RequestHandler::can_reuse_connection(const HttpResponse& response) {
+    if (response.get_status_line().compare(0, 8, "HTTP/1.1") != 0) {
+        return false;
+    }
+
+    std::string connection = response.get_header("Connection");
+    for (auto& c : connection) {
+        c = std::tolower(c);
+    }
+    if (connection.find("close") != std::string::npos) {
+        return false;
+    }
+
+    return response.headers.find("Content-Length") != response.headers.end() || response.is_chunked();
+}
+
+//connect to an origin for forwarding, logging which step failed. returns the socket or -1
+int RequestHandler::connect_origin(const std::string& server, const std::string& port, int request_id) {
+    Logger& logger = Logger::get_instance();
+    bool resolve_failed;
+    int sockfd = connect_to_host(server, port, resolve_failed, trace);
+    if (sockfd < 0) {
+        if (resolve_failed) {
+            logger.log_error(request_id, "Failed to resolve host: ", server);
+        } else { //tried all addresses, none succeeded
+            logger.log_error(request_id, "Failed to connect to server: ", server);
+        }
+    }
+    return sockfd;
+}
+
+// Forward request to origin server
+HttpResponse RequestHandler::forward_request(HttpRequest& request, int request_id) {
+    Logger& logger = Logger::get_instance();
+    UpstreamPool& pool = UpstreamPool::get_instance();
+    std::string server, port;
+    split_host_port(request.get_host(), "80", server, port);
+    std::string origin = server + ":" + port;
+
+    //only idempotent requests may use a pooled connection: if the origin already closed it we
+    //resend on a fresh connection, which wouldn't be safe for e.g. POST
+    int sockfd = -1;
+    if (request.get_method() == "GET") {
+        sockfd = pool.acquire(origin);
+    } else {
+        pool.record_miss();
+    }
+    bool reused = sockfd >= 0;
+
+    std::string request_str = request.serialize();
+    bool logged_request = false;
+    HttpResponse response;
+
+    while (true) {
+        if (sockfd < 0) {
+            sockfd = connect_origin(server, port, request_id);
+            if (sockfd < 0) {
+                return bad_gateway_response();
             }
+        }
+
+        if (!logged_request) {
+            logger.log_forward_request(request_id, request.get_method(), request.get_url(), request.get_http_version(), request.get_host());
+            logged_request = true;
+        }
+
+        int res = exchange(sockfd, request_str, response, request_id, reused);
+        if (res == 0) {
+            break;
+        }
 
-            response = response2;
-            break; //received full response, done and no need to recv again
+        close(sockfd);
+        sockfd = -1;
+        if (res < 0) {
+            return bad_gateway_response();
         }
+
+        //pooled connection went stale between the liveness check and our request, retry once on a new one
+        reused = false;
     }
 
     // Log received response
     logger.log_received_response(request_id, response.get_status_line(), server);
 
-    //std::cout << response.serialize() << std::endl;
-
-    close(sockfd);
+    if (can_reuse_connection(response)) {
+        pool.release(origin, sockfd);
+    } else {
+        close(sockfd);
+    }
     return response;
 }
 
-// Handle CONNECT request (HTTPS tunnel)
-void RequestHandler::handle_connect(HttpRequest& request, int client_socket, int request_id) {
+bool RequestHandler::streaming_enabled = false;
+size_t RequestHandler::stream_max_buffered = 8 * 1024 * 1024;
+
+void RequestHandler::configure_streaming(bool enabled, size_t max_buffered) {
+    streaming_enabled = enabled;
+    stream_max_buffered = max_buffered;
+}
+
+//send request_str over sockfd and receive until the response's header section is complete.
+//received holds everything read so far (head plus any body bytes that came with it), body_start
+//where the body begins. same return values as exchange()
+int RequestHandler::read_head(int sockfd, const std::string& request_str, std::string& received, HttpResponse& response, size_t& body_start, int request_id, bool retryable) {
     Logger& logger = Logger::get_instance();
-    int remote_socket;
-    struct addrinfo hints{}, *res;
-    std::string server = request.get_host();
 
-    size_t pos = server.find(':');
-    if (pos != std::string::npos) {
-        server = server.substr(0, pos); //get only hostname no port
+    if (send_all(sockfd, request_str.c_str(), request_str.length(), request_id, METRIC_ORIGIN_BYTES_OUT) < 0) {
+        if (retryable) {
+            return 1;
+        }
+        logger.log_error(request_id, "Failed to send data to server.");
+        return -1;
     }
 
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+    int buffer_read_size = 8192;
+    char buffer[buffer_read_size];
+    ResponseParser parser(true); //stop after the headers, the caller relays the body
+    received.clear();
+    auto sent_at = std::chrono::steady_clock::now();
+    auto first_byte_at = sent_at;
 
-    // Resolve server address
-    if (getaddrinfo(server.c_str(), "443", &hints, &res) != 0) {
-        std::string error_response = "HTTP/1.1 502 Bad Gateway\r\n\r\n";
-        reliable_send(client_socket, error_response.c_str(), error_response.length(), request_id);
-        logger.log_error(request_id, "Failed to resolve HTTPS host: " + server);
-        return;
-    }
+    while (true) {
+        int bytes_read = recv(sockfd, buffer, buffer_read_size, 0);
 
-    struct addrinfo* it = NULL;
-    for (it = res; it != NULL; it = it->ai_next) {
-        remote_socket = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
-        if (remote_socket == -1) //failed socket creation using current address structure, try next one
+        if (bytes_read < 0 && errno == EINTR) {
             continue;
+        }
+        if (bytes_read <= 0 && received.empty() && retryable) {
+            return 1;
+        }
+        if (bytes_read <= 0) {
+            logger.log_error(request_id, "Failed to receive response from server.");
+            return -1; //502 Bad Gateway
+        }
 
-        if (connect(remote_socket, it->ai_addr, it->ai_addrlen) != -1) //successful connection to ringmaster
-            break;
+        if (received.empty()) {
+            first_byte_at = std::chrono::steady_clock::now();
+            record_ttfb(sent_at, first_byte_at, trace);
+        }
+        Metrics::add(METRIC_ORIGIN_BYTES_IN, bytes_read);
+        received.append(buffer, bytes_read);
+        parser.feed(std::string_view(buffer, bytes_read));
 
-        close(remote_socket); //failed connect using current address structure, try next one
+        if (parser.failed()) {
+            logger.log_error(request_id, "Received invalid response from server.");
+            return -1; //502 Bad Gateway
+        }
+        if (parser.head_done()) {
+            if (trace) {
+                trace->add_span(TRACE_ORIGIN_READ, first_byte_at, std::chrono::steady_clock::now());
+            }
+            response = std::move(parser.get_response());
+            body_start = parser.get_head_size();
+            return 0;
+        }
     }
+}
 
-    freeaddrinfo(res);
+//how a streamed response body is delimited
+enum BodyFraming { NO_BODY, CONTENT_LENGTH, CHUNKED, UNTIL_CLOSE };
+
+//forwards body bytes to the client as they arrive and keeps a decoded copy for the cache
+//while it fits in the per-connection budget
+struct BodyRelay {
+    BodyFraming framing;
+    uint64_t remaining = 0; //CONTENT_LENGTH: body bytes still expected
+    ChunkedDecoder decoder; //CHUNKED: tracks where the last chunk ends
+    bool complete = false;
+    bool framing_error = false;
+    bool extra_bytes = false; //origin sent more than the response, connection can't be reused
+
+    bool fill_cache = false;
+    size_t max_buffered = 0;
+    std::string cache_body;
+    CoalescedFetch* fetch = nullptr; //requests waiting for the copy kept in cache_body
+
+    RequestTrace* trace = nullptr;
+
+    //returns false if sending to the client failed
+    bool relay(int client_socket, const char* data, size_t len, int request_id) {
+        size_t forward = len;
+
+        if (framing == CONTENT_LENGTH) {
+            forward = (len < remaining) ? len : remaining;
+            remaining -= forward;
+            complete = remaining == 0;
+            if (fill_cache) {
+                cache_body.append(data, forward);
+            }
+        } else if (framing == CHUNKED) {
+            forward = decoder.feed(data, len, fill_cache ? &cache_body : nullptr);
+            complete = decoder.done();
+            framing_error = decoder.failed();
+        } else if (fill_cache) { //UNTIL_CLOSE
+            cache_body.append(data, len);
+        }
 
-    if (it == NULL) { //tried all addresses, none succeeded
-        std::string error_response = "HTTP/1.1 502 Bad Gateway\r\n\r\n";
-        reliable_send(client_socket, error_response.c_str(), error_response.length(), 0);
-        logger.log_error(request_id, "Failed to establish HTTPS tunnel to " + server);
-        return;
+        if (fill_cache && cache_body.length() > max_buffered) { //too big to keep a copy of, just stream it
+            fill_cache = false;
+            std::string().swap(cache_body);
+            fetch->finish(nullptr); //no copy is coming, waiting requests fetch for themselves now
+            Logger::get_instance().log_note(request_id, "response larger than stream buffer limit, not cached");
+        }
+
+        if (forward < len && !framing_error) {
+            extra_bytes = true;
+        }
+        TraceSpan span(forward > 0 ? trace : nullptr, TRACE_CLIENT_WRITE);
+        return forward == 0 || RequestHandler::reliable_send(client_socket, data, forward, request_id) == 0;
     }
+};
+
+//cut-through variant of forward_request for GET: the status line and headers are sent to the
+//client as soon as they arrive and body bytes follow as they are read from the origin, so the
+//client's first byte doesn't wait for the whole download and only one read buffer (plus the
+//bounded copy kept for the cache) is held per connection.
+//requests waiting on fetch get the cached copy once the whole body is in, they aren't streamed to.
+//returns like handle_request: 0 keep client connection open, -1 close it
+int RequestHandler::stream_request(HttpRequest& request, int client_socket, int request_id, CoalescedFetch& fetch) {
+    Logger& logger = Logger::get_instance();
+    UpstreamPool& pool = UpstreamPool::get_instance();
+    std::string server, port;
+    split_host_port(request.get_host(), "80", server, port);
+    std::string origin = server + ":" + port;
 
+    int sockfd = pool.acquire(origin);
+    bool reused = sockfd >= 0;
 
-    // Send 200 OK to client for tunnel establishment
-    std::string success_response = "HTTP/1.1 200 Connection Established\r\n\r\n";
-    send(client_socket, success_response.c_str(), success_response.length(), 0);
-
-    // Tunnel communication
-    fd_set read_fds;
-    char buffer[8192];
+    std::string request_str = request.serialize();
+    bool logged_request = false;
+    std::string received;
+    HttpResponse response;
+    size_t body_start = 0;
 
     while (true) {
-        FD_ZERO(&read_fds);
-        FD_SET(client_socket, &read_fds);
-        FD_SET(remote_socket, &read_fds);
-        int max_fd = std::max(client_socket, remote_socket) + 1;
+        if (sockfd < 0) {
+            sockfd = connect_origin(server, port, request_id);
+        }
 
-        if (select(max_fd, &read_fds, nullptr, nullptr, nullptr) < 0) {
+        int res = -1;
+        if (sockfd >= 0) {
+            if (!logged_request) {
+                logger.log_forward_request(request_id, request.get_method(), request.get_url(), request.get_http_version(), request.get_host());
+                logged_request = true;
+            }
+            res = read_head(sockfd, request_str, received, response, body_start, request_id, reused);
+        }
+        if (res == 0) {
             break;
         }
 
-        if (FD_ISSET(client_socket, &read_fds)) {
-            int bytes_received = recv(client_socket, buffer, sizeof(buffer), 0);
-            if (bytes_received <= 0) break;
-            send(remote_socket, buffer, bytes_received, 0);
+        if (sockfd >= 0) {
+            close(sockfd);
+            sockfd = -1;
+        }
+        if (res < 0) { //nothing sent to the client yet, can still answer with a cached copy or a 502
+            int stale_result;
+            if (serve_stale(request, client_socket, request_id, stale_result)) {
+                return stale_result;
+            }
+            HttpResponse bad_gateway = bad_gateway_response();
+            send_to_client(client_socket, bad_gateway.serialize_head(), bad_gateway.body, request_id);
+            logger.log_response(request_id, bad_gateway.get_status_line());
+            return -1; //502 body has no length, it ends when the connection does
+        }
+
+        //pooled connection went stale between the liveness check and our request, retry once on a new one
+        reused = false;
+    }
+
+    logger.log_received_response(request_id, response.get_status_line(), server);
+
+    int code = response.status_code;
+    int stale_result;
+    if (code >= 500 && serve_stale(request, client_socket, request_id, stale_result)) {
+        close(sockfd); //the error's body is still unread
+        return stale_result;
+    }
+
+    BodyRelay body;
+    body.fetch = &fetch;
+    body.trace = trace;
+    if ((code >= 100 && code < 200) || code == 204 || code == 304) {
+        body.framing = NO_BODY;
+        body.complete = true;
+    } else if (response.is_chunked()) {
+        body.framing = CHUNKED;
+    } else if (response.headers.find("Content-Length") != response.headers.end()) {
+        body.framing = CONTENT_LENGTH;
+        try {
+            body.remaining = std::stoull(response.get_header("Content-Length"));
+        } catch (...) {
+            body.framing = UNTIL_CLOSE; //unusable length, fall back to reading until the origin closes
         }
+        body.complete = body.framing == CONTENT_LENGTH && body.remaining == 0;
+    } else {
+        body.framing = UNTIL_CLOSE;
+    }
+
+    body.max_buffered = stream_max_buffered;
+    body.fill_cache = response.is_cacheable() && (body.framing != CONTENT_LENGTH || body.remaining <= stream_max_buffered);
+    if (!body.fill_cache || !can_share(response)) {
+        fetch.finish(nullptr); //nothing to hand to waiting requests, don't make them wait for the body
+    }
+
+    //headers go out as soon as we have them
+    TraceSpan head_write(trace, TRACE_CLIENT_WRITE);
+    bool client_ok = reliable_send(client_socket, received.c_str(), body_start, request_id) == 0;
+    head_write.end();
+    if (client_ok) {
+        logger.log_response(request_id, response.get_status_line());
+    }
+
+    //body bytes that arrived together with the headers
+    if (client_ok && !body.complete && received.length() > body_start) {
+        client_ok = body.relay(client_socket, received.c_str() + body_start, received.length() - body_start, request_id);
+    }
+    std::string().swap(received);
+
+    int buffer_read_size = 8192;
+    char buffer[buffer_read_size];
+
+    while (client_ok && !body.complete && !body.framing_error) {
+        int bytes_read = recv(sockfd, buffer, buffer_read_size, 0);
+
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read == 0 && body.framing == UNTIL_CLOSE) {
+            body.complete = true;
+            break;
+        }
+        if (bytes_read <= 0) {
+            logger.log_error(request_id, "Connection to server failed in the middle of the response.");
+            break;
+        }
+
+        Metrics::add(METRIC_ORIGIN_BYTES_IN, bytes_read);
+        client_ok = body.relay(client_socket, buffer, bytes_read, request_id);
+    }
+
+    if (body.framing_error) {
+        logger.log_error(request_id, "Received invalid chunked body from server.");
+    }
+
+    if (!body.complete || !client_ok) {
+        //the client already has part of the response, closing is the only way to tell it the rest isn't coming
+        close(sockfd);
+        return -1;
+    }
+
+    if (body.framing != UNTIL_CLOSE && !body.extra_bytes && can_reuse_connection(response)) {
+        pool.release(origin, sockfd);
+    } else {
+        close(sockfd);
+    }
+
+    if (body.fill_cache) {
+        //cache a framed copy: decoded body with an explicit length
+        std::shared_ptr<HttpResponse> cached = std::make_shared<HttpResponse>(response);
+        cached->body = std::move(body.cache_body);
+        cached->headers.erase("Transfer-Encoding");
+        cached->headers.erase("Trailer");
+        cached->headers["Content-Length"] = std::to_string(cached->body.length());
+        cache.store_response(request_id, request.get_url(), cached, &request);
+        fetch.finish(cached);
+    }
 
-        if (FD_ISSET(remote_socket, &read_fds)) {
-            int bytes_received = recv(remote_socket, buffer, sizeof(buffer), 0);
-            if (bytes_received <= 0) break;
-            send(client_socket, buffer, bytes_received, 0);
+    return body.framing == UNTIL_CLOSE ? -1 : 0; //body ended with the origin's close, so must ours
+}
+
+// Handle CONNECT request (HTTPS tunnel)
+void RequestHandler::handle_connect(HttpRequest& request, int client_socket, int request_id) {
+    Logger& logger = Logger::get_instance();
+    std::string server, port;
+    split_host_port(request.get_host(), "443", server, port);
+
+    // Resolve server address and connect
+    bool resolve_failed;
+    int remote_socket = connect_to_host(server, port, resolve_failed);
+
+    if (remote_socket < 0 && resolve_failed) {
+        std::string error_response = "HTTP/1.1 502 Bad Gateway\r\nDate: " + CoarseClock::get_instance().http_date().str() + "\r\n\r\n";
+        reliable_send(client_socket, error_response.c_str(), error_response.length(), request_id);
+        logger.log_error(request_id, "Failed to resolve HTTPS host: ", server);
+        return;
+    }
+
+    if (remote_socket < 0) { //tried all addresses, none succeeded
+        std::string error_response = "HTTP/1.1 502 Bad Gateway\r\nDate: " + CoarseClock::get_instance().http_date().str() + "\r\n\r\n";
+        reliable_send(client_socket, error_response.c_str(), error_response.length(), 0);
+        logger.log_error(request_id, "Failed to establish HTTPS tunnel to ", server);
+        return;
+    }
+
+
+    // Send 200 OK to client for tunnel establishment
+    std::string success_response = "HTTP/1.1 200 Connection Established\r\n\r\n";
+    Tunnel tunnel(client_socket, remote_socket);
+    if (reliable_send(client_socket, success_response.c_str(), success_response.length(), request_id) == 0) {
+        if (tunnel_remote) { //the caller relays it
+            *tunnel_remote = remote_socket;
+            return;
         }
+        //relay until both sides are done, each direction half-closes independently
+        tunnel.run();
     }
+    end_tunnel(tunnel, remote_socket, request_id);
+}
 
+void RequestHandler::end_tunnel(const Tunnel& tunnel, int remote_socket, int request_id) {
+    Metrics::add(METRIC_CLIENT_BYTES_IN, tunnel.bytes_client_to_remote);
+    Metrics::add(METRIC_ORIGIN_BYTES_OUT, tunnel.bytes_client_to_remote);
+    Metrics::add(METRIC_ORIGIN_BYTES_IN, tunnel.bytes_remote_to_client);
+    Metrics::add(METRIC_CLIENT_BYTES_OUT, tunnel.bytes_remote_to_client);
     close(remote_socket);
-    logger.log_tunnel_closed(request_id);
+    Logger::get_instance().log_tunnel_closed(request_id);
 }
\ No newline at end of file
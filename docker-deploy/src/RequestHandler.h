@@ -4,18 +4,45 @@
 #include "HttpRequest.h"
 #include "HttpResponse.h"
 #include "CacheManager.h"
+#include "RequestTrace.h"
+#include "Tunnel.h"
 
 class RequestHandler {
 private:
     CacheManager& cache;
+    RequestTrace* trace; //phases of the request being handled, nullptr when not tracing
+    int* tunnel_remote;  //see the constructor
 
     HttpResponse forward_request(HttpRequest& request, int request_id);
     void handle_connect(HttpRequest& request, int client_socket, int request_id);
 
+    int exchange(int sockfd, const std::string& request_str, HttpResponse& response, int request_id, bool retryable);
+    static int connect_to_host(const std::string& host, const std::string& port, bool& resolve_failed, RequestTrace* trace = nullptr);
+    static bool can_reuse_connection(const HttpResponse& response);
+    int connect_origin(const std::string& server, const std::string& port, int request_id);
+    int send_to_client(int client_socket, const std::string& head, std::string_view body, int request_id); //send_response, traced
+
+    //cut-through forwarding of GET responses (--stream)
+    static bool streaming_enabled;
+    static size_t stream_max_buffered; //cap on the body copy kept per connection to fill the cache
+    int stream_request(HttpRequest& request, int client_socket, int request_id, CoalescedFetch& fetch);
+    bool serve_stale(HttpRequest& request, int client_socket, int request_id, int& result);
+    int read_head(int sockfd, const std::string& request_str, std::string& received, HttpResponse& response, size_t& body_start, int request_id, bool retryable);
+
 public:
-    explicit RequestHandler(CacheManager& cache);
+    //with tunnel_remote set, a CONNECT returns as soon as the tunnel is established and leaves the
+    //remote socket there (else -1) for the caller to relay and end with end_tunnel (ClientHandler
+    //always does, see TunnelRelay and EventLoop); without it the tunnel is relayed on this thread
+    //(Tunnel::run) before handle_request returns
+    explicit RequestHandler(CacheManager& cache, RequestTrace* trace = nullptr, int* tunnel_remote = nullptr);
     int handle_request(HttpRequest& request, int client_socket, int request_id, const std::string& client_ip);
+    //CacheManager::Refresher for background refreshes: a conditional GET with cached's validators
+    std::shared_ptr<HttpResponse> revalidate(const HttpRequest& client_request, std::shared_ptr<HttpResponse> cached);
+    static void end_tunnel(const Tunnel& tunnel, int remote_socket, int request_id); //counts its bytes, closes the remote socket
     static int reliable_send(int sockfd, const char* message, size_t len, int request_id);
+    static int send_response(int sockfd, const std::string& head, std::string_view body, int request_id);
+    static void configure_streaming(bool enabled, size_t max_buffered);
+    static void split_host_port(const std::string& host_header, const std::string& default_port, std::string& host, std::string& port);
 };
 
 #endif
\ No newline at end of file
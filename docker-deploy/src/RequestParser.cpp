@@ -0,0 +1,287 @@
+#include "RequestParser.h"
+#include <cstring>
+
+//request line + header fields larger than this get a 400 instead of growing without bound
+static const size_t MAX_HEAD_SIZE = 65536;
+
+//Transfer-Encoding with chunked as the final coding
+static bool ends_with_chunked(const std::string& value) {
+    return value.length() >= 7 && value.compare(value.length() - 7, 7, "chunked") == 0;
+}
+
+RequestParser::RequestParser() {
+    reset();
+}
+
+void RequestParser::reset() {
+    state = REQUEST_LINE;
+    request = HttpRequest();
+    partial_line.clear();
+    head_size = 0;
+    body_remaining = 0;
+    chunked = ChunkedDecoder();
+}
+
+bool RequestParser::done() const {
+    return state == DONE;
+}
+
+HttpRequest RequestParser::take_request() {
+    HttpRequest finished = std::move(request);
+    reset();
+    return finished;
+}
+
+void RequestParser::fail() {
+    request.client_error_code = 400;
+    state = DONE;
+}
+
+// HTTP-message   = start-line
+// *( header-field CRLF )
+// CRLF --> Carriage Return and Line Feed ("\r\n")
+// [ message-body ]
+size_t RequestParser::feed(std::string_view data) {
+    size_t pos = 0;
+
+    while (pos < data.size() && state != DONE) {
+        if (state == REQUEST_LINE || state == HEADERS) {
+            pos += feed_lines(data.substr(pos));
+        } else if (state == BODY) {
+            size_t take = (data.size() - pos < body_remaining) ? data.size() - pos : body_remaining;
+            request.body.append(data.data() + pos, take);
+            pos += take;
+            body_remaining -= take;
+            if (body_remaining == 0) {
+                state = DONE;
+            }
+        } else { //CHUNKED_BODY
+            pos += chunked.feed(data.data() + pos, data.size() - pos, &request.body);
+            if (chunked.failed() || (chunked.done() && !finish_chunked_body())) {
+                fail();
+            }
+        }
+    }
+
+    if (state == DONE && request.client_error_code != 0) {
+        return data.size(); //connection gets closed after the 400, the rest is garbage
+    }
+    return pos;
+}
+
+//consume whole lines of the request line / header section. a line without its LF yet is
+//kept in partial_line and completed by the next feed
+size_t RequestParser::feed_lines(std::string_view data) {
+    size_t pos = 0;
+
+    while (pos < data.size() && (state == REQUEST_LINE || state == HEADERS)) {
+        const char* start = data.data() + pos;
+        const char* lf = (const char*)memchr(start, '\n', data.size() - pos);
+        size_t len = lf ? lf - start : data.size() - pos;
+
+        if (head_size + partial_line.length() + len > MAX_HEAD_SIZE) {
+            fail();
+            return data.size();
+        }
+
+        if (!lf) {
+            partial_line.append(start, len);
+            return data.size();
+        }
+        pos += len + 1;
+
+        bool ok;
+        if (partial_line.empty()) { //whole line is in this slice, no copy
+            head_size += len + 1;
+            ok = handle_line(std::string_view(start, len));
+        } else {
+            partial_line.append(start, len);
+            head_size += partial_line.length() + 1;
+            ok = handle_line(partial_line);
+            partial_line.clear();
+        }
+
+        if (!ok) {
+            fail();
+            return data.size();
+        }
+    }
+
+    return pos;
+}
+
+//one line of the head without its LF. returns false if the request is malformed
+bool RequestParser::handle_line(std::string_view line) {
+    //every line has to end with CRLF
+    if (line.empty() || line.back() != '\r') {
+        return false;
+    }
+    line.remove_suffix(1);
+
+    if (state == REQUEST_LINE) {
+        if (line.empty()) { //empty lines before the request line are ignored (RFC 7230 3.5)
+            return true;
+        }
+        return parse_request_line(line);
+    }
+
+    if (line.empty()) { //CRLF on its own ends the header section
+        return finish_headers();
+    }
+    return parse_header_line(line);
+}
+
+// request-line = method SP request-target SP HTTP-version CRLF
+bool RequestParser::parse_request_line(std::string_view line) {
+    //no whitespace is allowed in the three components, so exactly two single spaces
+    size_t first_space = line.find(' ');
+    if (first_space == std::string_view::npos) {
+        return false;
+    }
+    size_t second_space = line.find(' ', first_space + 1);
+    if (second_space == std::string_view::npos) {
+        return false;
+    }
+
+    request.method = std::string(line.substr(0, first_space));
+    request.url = std::string(line.substr(first_space + 1, second_space - first_space - 1));
+    request.http_version = std::string(line.substr(second_space + 1));
+
+    if (request.method.empty() || request.url.empty() || request.http_version.empty()) {
+        return false;
+    }
+
+    if (!((request.method == "GET") || (request.method == "POST") || (request.method == "CONNECT"))) {
+        return false;
+    }
+
+    //also catches leading/trailing whitespace in http_version
+    if (request.http_version != "HTTP/1.1") {
+        return false;
+    }
+
+    state = HEADERS;
+    return true;
+}
+
+//header-field   = field-name ":" OWS field-value OWS
+bool RequestParser::parse_header_line(std::string_view line) {
+    size_t pos = line.find(':');
+    if (pos == std::string_view::npos) { //no colon in a header field, bad. 400 response
+        return false;
+    }
+
+    std::string key(line.substr(0, pos));
+    std::string value(line.substr(pos + 1)); //remainder after colon
+
+    //A server MUST reject any received request message that contains
+    //whitespace between a header field-name and colon with a response code of 400
+    //also ensure field-name is valid token
+    if (!HttpRequest::valid_field_name(key)) {
+        return false;
+    }
+
+    HttpRequest::trim_field_value(value);
+    return add_field(key, value);
+}
+
+bool RequestParser::add_field(const std::string& key, const std::string& value) {
+    auto it = request.headers.find(key);
+    if (it == request.headers.end()) {
+        request.headers[key] = value;
+        return true;
+    }
+
+    std::string name = key;
+    if (!HttpRequest::can_duplicate_field_name(name)) { //error, cant have multiple of this header field name
+        return false;
+    }
+    if (key != "Set-Cookie" && !value.empty()) { //cant combine set-cookie but exception, just move on and use 1st val
+        it->second += ", " + value;
+    }
+    return true;
+}
+
+//header section complete, decide how the body is delimited
+bool RequestParser::finish_headers() {
+    std::unordered_map<std::string, std::string>& headers = request.headers;
+
+    //a host header field must be sent in all HTTP/1.1 request messages
+    auto host = headers.find("Host");
+    if (host == headers.end()) {
+        return false;
+    }
+    request.host = host->second;
+
+    //If a message is received with both a Transfer-Encoding and a
+    // Content-Length header field, the Transfer-Encoding overrides the
+    // Content-Length.
+    if (headers.find("Content-Length") != headers.end() && headers.find("Transfer-Encoding") != headers.end()) {
+        headers.erase("Content-Length");
+    }
+
+    if (headers.find("Content-Length") != headers.end()) {
+        const std::string& length = headers["Content-Length"];
+        if (length.empty() || length.length() > 18 || length.find_first_not_of("0123456789") != std::string::npos) {
+            return false;
+        }
+        body_remaining = std::stoull(length);
+        request.body.reserve(body_remaining < MAX_HEAD_SIZE ? body_remaining : MAX_HEAD_SIZE);
+        state = (body_remaining == 0) ? DONE : BODY;
+    } else if (headers.find("Transfer-Encoding") != headers.end()) {
+        //According to RFC:
+        //    If a Transfer-Encoding header field
+        //    is present in a request and the chunked transfer coding is not
+        //    the final encoding, the message body length cannot be determined
+        //    reliably; the server MUST respond with the 400 (Bad Request)
+        //    status code and then close the connection.
+        if (!ends_with_chunked(headers["Transfer-Encoding"])) {
+            return false;
+        }
+        state = CHUNKED_BODY;
+    } else { //message body length = 0 since none of above 2 headers
+        state = DONE;
+    }
+
+    return true;
+}
+
+//last chunk and trailer received: merge the trailer fields and make the request look like
+//it was sent with a Content-Length, since that's how it gets forwarded
+bool RequestParser::finish_chunked_body() {
+    for (const std::string& line : chunked.get_trailers()) {
+        size_t pos = line.find(':');
+        if (pos == std::string::npos) {
+            return false;
+        }
+
+        std::string key = line.substr(0, pos);
+        std::string value = line.substr(pos + 1);
+        if (!HttpRequest::valid_field_name(key)) {
+            return false;
+        }
+        HttpRequest::trim_field_value(value);
+
+        // A sender MUST NOT generate a trailer that contains a field necessary
+        // for message framing (e.g., Transfer-Encoding and Content-Length),
+        // routing (e.g., Host), request modifiers, authentication, response control
+        // data, or determining how to process the payload (e.g.,
+        // Content-Encoding, Content-Type, Content-Range, and Trailer).
+        if (key == "Transfer-Encoding" || key == "Content-Length" || key == "Host" || key == "Content-Encoding" ||
+            key == "Content-Type" || key == "Content-Range" || key == "Trailer") {
+            return false;
+        }
+
+        if (!add_field(key, value)) {
+            return false;
+        }
+    }
+
+    //Content-Length := length, remove "chunked" from Transfer-Encoding and the Trailer field
+    request.headers["Content-Length"] = std::to_string(request.body.length());
+    request.headers.erase("Transfer-Encoding");
+    request.headers.erase("Trailer");
+
+    state = DONE;
+    return true;
+}
@@ -0,0 +1,51 @@
+#ifndef REQUEST_PARSER_H
+#define REQUEST_PARSER_H
+
+#include "HttpRequest.h"
+#include "ChunkedDecoder.h"
+#include <string>
+#include <string_view>
+#include <cstdint>
+
+//resumable HTTP request parser. Bytes are fed as string_view slices of whatever was just
+//received; the parser remembers where it is (request line, headers, body, chunked body) and
+//only ever looks at the new bytes, so a request that trickles in over many recvs costs the
+//same as one that arrives at once. Only a line split across two feeds is copied.
+class RequestParser {
+private:
+    enum State { REQUEST_LINE, HEADERS, BODY, CHUNKED_BODY, DONE };
+
+    State state;
+    HttpRequest request;
+    std::string partial_line; //start of a line whose LF hasn't arrived yet
+    size_t head_size;         //bytes of request line + headers consumed so far
+    uint64_t body_remaining;  //BODY: Content-Length bytes still expected
+    ChunkedDecoder chunked;
+
+    bool parse_request_line(std::string_view line);
+    bool parse_header_line(std::string_view line);
+    bool add_field(const std::string& key, const std::string& value);
+    bool finish_headers();
+    bool finish_chunked_body();
+    void fail(); //malformed request: mark it with 400 and stop consuming
+
+    bool handle_line(std::string_view line);
+    size_t feed_lines(std::string_view data);
+
+public:
+    RequestParser();
+
+    //consume the bytes of data that belong to the current request and return how many were used.
+    //all of data is used unless the request completed part way through it, in which case the
+    //remaining bytes are the start of the next request
+    size_t feed(std::string_view data);
+
+    //a full request (or a malformed one, client_error_code set) is ready to take
+    bool done() const;
+
+    //hand over the finished request and start over for the next one on the connection
+    HttpRequest take_request();
+    void reset();
+};
+
+#endif
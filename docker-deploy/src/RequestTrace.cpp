@@ -0,0 +1,235 @@
+#include "RequestTrace.h"
+#include <cstdio>
+#include <stdexcept>
+
+static const char* PHASE_NAMES[TRACE_PHASE_COUNT] = {
+    "cache_lookup", "coalesce_wait", "dns", "connect", "origin_ttfb", "origin_read", "client_write",
+};
+
+static int64_t to_us(std::chrono::steady_clock::duration duration) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+}
+
+//the trace's timestamps: microseconds of the steady clock, the same in every trace of a run
+static int64_t timestamp_us(RequestTrace::TimePoint time) {
+    return to_us(time.time_since_epoch());
+}
+
+//a JSON string literal, quotes included
+static std::string json_string(const std::string& text) {
+    std::string out = "\"";
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            out.push_back('\\');
+            out.push_back(c);
+        } else if (c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out.append(escaped);
+        } else {
+            out.push_back(c);
+        }
+    }
+    out.push_back('"');
+    return out;
+}
+
+RequestTrace::RequestTrace(int request_id, const std::string& label)
+    : request_id(request_id), label(label), start(std::chrono::steady_clock::now()), end(start), excluded(false), span_count(0),
+      phase_totals(), phase_counts() {}
+
+void RequestTrace::add_span(TracePhase phase, TimePoint start, TimePoint end) {
+    phase_totals[phase] += to_us(end - start);
+    phase_counts[phase]++;
+    if (span_count < MAX_SPANS) {
+        spans[span_count++] = {phase, start, end};
+    }
+}
+
+void RequestTrace::finish() {
+    end = std::chrono::steady_clock::now();
+}
+
+void RequestTrace::exclude() {
+    excluded = true;
+}
+
+bool RequestTrace::is_excluded() const {
+    return excluded;
+}
+
+int RequestTrace::get_span_count() const {
+    return span_count;
+}
+
+int64_t RequestTrace::duration_us() const {
+    return to_us(end - start);
+}
+
+int64_t RequestTrace::phase_total_us(TracePhase phase) const {
+    return phase_totals[phase];
+}
+
+const char* RequestTrace::phase_name(TracePhase phase) {
+    return PHASE_NAMES[phase];
+}
+
+std::string RequestTrace::to_json() const {
+    std::string id = std::to_string(request_id);
+    std::string track = "\"pid\":1,\"tid\":" + id;
+
+    //name the track after the request so viewers don't just show a number
+    std::string out = "{\"name\":\"thread_name\",\"ph\":\"M\"," + track + ",\"args\":{\"name\":\"request " + id + "\"}},\n";
+
+    //root span, with the per-phase totals (spans past MAX_SPANS only show up here)
+    out += "{\"name\":" + json_string(label) + ",\"cat\":\"request\",\"ph\":\"X\",\"ts\":" + std::to_string(timestamp_us(start)) +
+           ",\"dur\":" + std::to_string(duration_us()) + "," + track + ",\"args\":{\"request_id\":" + id;
+    for (int phase = 0; phase < TRACE_PHASE_COUNT; phase++) {
+        if (phase_counts[phase] > 0) {
+            out += ",\"" + std::string(PHASE_NAMES[phase]) + "_us\":" + std::to_string(phase_totals[phase]);
+            if (phase_counts[phase] > 1) {
+                out += ",\"" + std::string(PHASE_NAMES[phase]) + "_count\":" + std::to_string(phase_counts[phase]);
+            }
+        }
+    }
+    out += "}},\n";
+
+    for (int i = 0; i < span_count; i++) {
+        const Span& span = spans[i];
+        out += "{\"name\":\"" + std::string(PHASE_NAMES[span.phase]) + "\",\"cat\":\"phase\",\"ph\":\"X\",\"ts\":" +
+               std::to_string(timestamp_us(span.start)) + ",\"dur\":" + std::to_string(to_us(span.end - span.start)) + "," + track + "},\n";
+    }
+    return out;
+}
+
+TraceSpan::TraceSpan(RequestTrace* trace, TracePhase phase) : trace(trace), phase(phase) {
+    if (trace) {
+        start = std::chrono::steady_clock::now();
+    }
+}
+
+TraceSpan::~TraceSpan() {
+    end();
+}
+
+void TraceSpan::end() {
+    if (trace) {
+        trace->add_span(phase, start, std::chrono::steady_clock::now());
+        trace = nullptr;
+    }
+}
+
+//the writer wakes up this often to take traces out of the ring
+static const std::chrono::milliseconds TRACE_WRITER_INTERVAL(50);
+
+TraceLog::TraceLog() : threshold_us(0), stopping(false), written(0), dropped(0) {}
+
+TraceLog::~TraceLog() {
+    stop();
+}
+
+TraceLog& TraceLog::get_instance() {
+    static TraceLog instance;
+    return instance;
+}
+
+//meant to be called at startup (or shutdown), while no request is being traced
+void TraceLog::configure(const std::string& path, int threshold_ms) {
+    stop();
+    std::lock_guard<std::mutex> lock(mutex);
+    this->path = path;
+    if (threshold_ms <= 0) {
+        return;
+    }
+
+    file.open(path, std::ios::app | std::ios::ate); //ate: tellp is the current size
+    if (!file) {
+        throw std::runtime_error("Failed to open trace file " + path);
+    }
+    if (file.tellp() == 0) {
+        file << "[\n"; //the array is left open, see RequestTrace::to_json
+        file.flush();
+    }
+    queue = std::make_unique<BoundedQueue<QueuedTrace>>(QUEUE_SIZE);
+    stopping = false;
+    writer = std::thread(&TraceLog::writer_loop, this);
+    threshold_us = (int64_t)threshold_ms * 1000;
+}
+
+void TraceLog::stop() {
+    threshold_us = 0; //no new traces, a submit already past the check still finds the queue
+    if (!writer.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    writer_cv.notify_one();
+    writer.join();
+    file.close();
+}
+
+//the ring's only consumer: formats whatever is queued and writes it in one go. A batch is flushed
+//so the traces are complete on disk even if the proxy is killed
+void TraceLog::writer_loop() {
+    QueuedTrace trace;
+    std::string batch;
+    while (true) {
+        bool stop;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!stopping) {
+                writer_cv.wait_for(lock, TRACE_WRITER_INTERVAL);
+            }
+            stop = stopping;
+        }
+
+        uint64_t count = 0;
+        while (queue->try_pop(trace)) {
+            batch += trace->to_json();
+            trace.reset();
+            count++;
+        }
+        if (!batch.empty()) {
+            file << batch;
+            file.flush();
+            batch.clear();
+            written += count;
+        }
+        if (stop) {
+            return;
+        }
+    }
+}
+
+bool TraceLog::is_enabled() const {
+    return threshold_us.load(std::memory_order_relaxed) > 0;
+}
+
+bool TraceLog::submit(RequestTrace& trace) {
+    trace.finish();
+    int64_t threshold = threshold_us.load(std::memory_order_relaxed);
+    if (threshold <= 0 || trace.is_excluded() || trace.duration_us() < threshold) {
+        return false;
+    }
+
+    QueuedTrace copy(new RequestTrace(trace));
+    if (!queue->try_push(copy)) {
+        dropped++;
+        return false;
+    }
+    return true;
+}
+
+uint64_t TraceLog::get_written() const {
+    return written;
+}
+
+uint64_t TraceLog::get_dropped() const {
+    return dropped;
+}
+
+const std::string& TraceLog::get_path() const {
+    return path;
+}
@@ -0,0 +1,124 @@
+#ifndef REQUEST_TRACE_H
+#define REQUEST_TRACE_H
+
+#include "BoundedQueue.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+//where a request's time goes. Names are in RequestTrace.cpp, keep them in the same order
+enum TracePhase {
+    TRACE_CACHE_LOOKUP,
+    TRACE_COALESCE_WAIT, //waiting for a concurrent request's fetch of the same url
+    TRACE_DNS,
+    TRACE_CONNECT,
+    TRACE_ORIGIN_TTFB,   //request sent to first response byte
+    TRACE_ORIGIN_READ,   //first response byte to the end of what was read in one go
+    TRACE_CLIENT_WRITE,
+    TRACE_PHASE_COUNT
+};
+
+//the phases of one request, timestamped as it is served. ClientHandler makes one next to the
+//request id when tracing is on and RequestHandler fills it in; TraceLog writes it out if the
+//request was slow. Only the first MAX_SPANS spans are kept (a streamed response has a client
+//write per read), per-phase totals cover all of them
+class RequestTrace {
+public:
+    using TimePoint = std::chrono::steady_clock::time_point;
+
+    struct Span {
+        TracePhase phase;
+        TimePoint start;
+        TimePoint end;
+    };
+    static const int MAX_SPANS = 64;
+
+private:
+    int request_id;
+    std::string label; //method and url
+    TimePoint start;
+    TimePoint end;
+    bool excluded;     //never written, e.g. a CONNECT tunnel, which lasts as long as the client likes
+    Span spans[MAX_SPANS];
+    int span_count;
+    int64_t phase_totals[TRACE_PHASE_COUNT]; //microseconds
+    int phase_counts[TRACE_PHASE_COUNT];
+
+public:
+    RequestTrace(int request_id, const std::string& label);
+
+    void add_span(TracePhase phase, TimePoint start, TimePoint end);
+    void finish();  //the request is done, ends the root span
+    void exclude();
+    bool is_excluded() const;
+    int get_span_count() const;
+    int64_t duration_us() const; //start to finish()
+    int64_t phase_total_us(TracePhase phase) const;
+
+    //Chrome trace event format (also read by Perfetto): the request as a complete event on a
+    //track of its own (tid = request id) with its phases nested in it. Each event ends with ",\n"
+    //so traces can be appended to a JSON array that is never closed, which both viewers accept
+    std::string to_json() const;
+    static const char* phase_name(TracePhase phase);
+};
+
+//times a phase from construction to end() or destruction. Does nothing without a trace
+class TraceSpan {
+private:
+    RequestTrace* trace;
+    TracePhase phase;
+    RequestTrace::TimePoint start;
+
+public:
+    TraceSpan(RequestTrace* trace, TracePhase phase);
+    ~TraceSpan();
+    void end();
+};
+
+//tail sampling: finished traces of requests slower than the threshold are appended to the trace
+//file, faster ones are dropped. A slow trace is copied into a ring and a writer thread formats and
+//writes it, so the request's thread (maybe a reactor) never waits for the file. Traces that find
+//the ring full are dropped and counted
+class TraceLog {
+private:
+    typedef std::unique_ptr<RequestTrace> QueuedTrace;
+
+    std::mutex mutex; //configure/stop, and the writer's sleep
+    std::condition_variable writer_cv;
+    std::ofstream file; //writer thread's while it runs
+    std::string path;
+    std::atomic<int64_t> threshold_us; //0 = off
+    std::unique_ptr<BoundedQueue<QueuedTrace>> queue;
+    std::thread writer;
+    bool stopping;
+    std::atomic<uint64_t> written;
+    std::atomic<uint64_t> dropped;
+
+    TraceLog();
+    ~TraceLog();
+    void writer_loop();
+
+public:
+    static const size_t QUEUE_SIZE = 1024; //traces waiting for the writer
+
+    static TraceLog& get_instance();
+
+    //threshold_ms 0 turns tracing off. throws std::runtime_error if path can't be opened
+    void configure(const std::string& path, int threshold_ms);
+    //writes what is queued, then turns tracing off
+    void stop();
+    bool is_enabled() const;
+    //finishes trace, queues a copy for the writer if it was slow enough. returns whether it was queued
+    bool submit(RequestTrace& trace);
+    uint64_t get_written() const;
+    uint64_t get_dropped() const;
+    const std::string& get_path() const;
+};
+
+#endif
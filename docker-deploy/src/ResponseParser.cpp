@@ -0,0 +1,267 @@
+#include "ResponseParser.h"
+#include "HttpRequest.h"
+#include <cstring>
+
+//status line + header fields larger than this are treated as an invalid response
+static const size_t MAX_HEAD_SIZE = 65536;
+
+ResponseParser::ResponseParser(bool stop_after_head) : state(STATUS_LINE), stop_after_head(stop_after_head), head_size(0), body_remaining(0) {
+    //start from an empty response instead of the default 502 page
+    response.status_line.clear();
+    response.status_code = 0;
+    response.headers.clear();
+    response.body.clear();
+}
+
+bool ResponseParser::head_done() const {
+    return state != STATUS_LINE && state != HEADERS;
+}
+
+bool ResponseParser::done() const {
+    return state == DONE;
+}
+
+bool ResponseParser::failed() const {
+    return response.parse_error;
+}
+
+size_t ResponseParser::get_head_size() const {
+    return head_size;
+}
+
+HttpResponse& ResponseParser::get_response() {
+    return response;
+}
+
+void ResponseParser::fail() {
+    response.parse_error = true;
+    state = DONE;
+}
+
+size_t ResponseParser::feed(std::string_view data) {
+    size_t pos = 0;
+
+    while (pos < data.size() && state != DONE && !(stop_after_head && head_done())) {
+        if (state == STATUS_LINE || state == HEADERS) {
+            pos += feed_lines(data.substr(pos));
+        } else if (state == BODY) {
+            size_t take = (data.size() - pos < body_remaining) ? data.size() - pos : body_remaining;
+            response.body.append(data.data() + pos, take);
+            pos += take;
+            body_remaining -= take;
+            if (body_remaining == 0) {
+                state = DONE;
+            }
+        } else if (state == CHUNKED_BODY) {
+            pos += chunked.feed(data.data() + pos, data.size() - pos, &response.body);
+            if (chunked.failed() || (chunked.done() && !finish_chunked_body())) {
+                fail();
+            }
+        } else { //UNTIL_CLOSE, everything up to the origin closing the connection is body
+            response.body.append(data.data() + pos, data.size() - pos);
+            pos = data.size();
+        }
+    }
+
+    return pos;
+}
+
+void ResponseParser::finish() {
+    if (state == UNTIL_CLOSE) {
+        //cached copies get an explicit length so they can be served over keep-alive connections
+        response.headers["Content-Length"] = std::to_string(response.body.length());
+        state = DONE;
+    }
+}
+
+//consume whole lines of the status line / header section. a line without its LF yet is
+//kept in partial_line and completed by the next feed
+size_t ResponseParser::feed_lines(std::string_view data) {
+    size_t pos = 0;
+
+    while (pos < data.size() && (state == STATUS_LINE || state == HEADERS)) {
+        const char* start = data.data() + pos;
+        const char* lf = (const char*)memchr(start, '\n', data.size() - pos);
+        size_t len = lf ? lf - start : data.size() - pos;
+
+        if (head_size + partial_line.length() + len > MAX_HEAD_SIZE) {
+            fail();
+            return data.size();
+        }
+
+        if (!lf) {
+            partial_line.append(start, len);
+            return data.size();
+        }
+        pos += len + 1;
+
+        bool ok;
+        if (partial_line.empty()) {
+            head_size += len + 1;
+            ok = handle_line(std::string_view(start, len));
+        } else {
+            partial_line.append(start, len);
+            head_size += partial_line.length() + 1;
+            ok = handle_line(partial_line);
+            partial_line.clear();
+        }
+
+        if (!ok) {
+            fail();
+            return data.size();
+        }
+    }
+
+    return pos;
+}
+
+bool ResponseParser::handle_line(std::string_view line) {
+    //every line has to end with CRLF
+    if (line.empty() || line.back() != '\r') {
+        return false;
+    }
+    line.remove_suffix(1);
+
+    if (state == STATUS_LINE) {
+        if (line.empty()) { //tolerate empty lines before the status line
+            return true;
+        }
+        return parse_status_line(line);
+    }
+
+    if (line.empty()) { //CRLF on its own ends the header section
+        return finish_headers();
+    }
+    return parse_header_line(line);
+}
+
+// status-line = HTTP-version SP status-code SP reason-phrase CRLF
+bool ResponseParser::parse_status_line(std::string_view line) {
+    if (line.substr(0, 5) != "HTTP/") {
+        return false;
+    }
+
+    size_t first_space = line.find(' ');
+    if (first_space == std::string_view::npos || line.length() < first_space + 4) {
+        return false;
+    }
+    std::string_view status_code = line.substr(first_space + 1, 3);
+    int code = 0;
+    for (char c : status_code) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        code = code * 10 + (c - '0');
+    }
+
+    response.status_line = std::string(line);
+    response.status_code = code;
+    state = HEADERS;
+    return true;
+}
+
+//header-field   = field-name ":" OWS field-value OWS
+bool ResponseParser::parse_header_line(std::string_view line) {
+    size_t pos = line.find(':');
+    if (pos == std::string_view::npos) { //no colon in a header field, bad.
+        return false;
+    }
+
+    std::string key(line.substr(0, pos));
+    std::string value(line.substr(pos + 1)); //remainder after colon
+
+    //parse field-value to remove any leading or trailing OWS (optional whitespace)
+    HttpRequest::trim_field_value(value);
+    return add_field(key, value);
+}
+
+bool ResponseParser::add_field(const std::string& key, const std::string& value) {
+    auto it = response.headers.find(key);
+    if (it == response.headers.end()) {
+        response.headers[key] = value;
+        return true;
+    }
+
+    std::string name = key;
+    if (!HttpRequest::can_duplicate_field_name(name)) { //error, cant have multiple of this header field name
+        return false;
+    }
+    if (key != "Set-Cookie" && !value.empty()) { //cant combine set-cookie but exception, just move on and use 1st val
+        it->second += ", " + value;
+    }
+    return true;
+}
+
+//header section complete, decide how the body is delimited
+bool ResponseParser::finish_headers() {
+    std::unordered_map<std::string, std::string>& headers = response.headers;
+
+    //If a message is received with both a Transfer-Encoding and a
+    // Content-Length header field, the Transfer-Encoding overrides the
+    // Content-Length.
+    if (headers.find("Content-Length") != headers.end() && headers.find("Transfer-Encoding") != headers.end()) {
+        headers.erase("Content-Length");
+    }
+
+    response.parse_cache_control();
+
+    //1xx, 204 and 304 responses never have a body, whatever the headers say
+    int status_code = response.status_code;
+    if ((status_code >= 100 && status_code < 200) || status_code == 204 || status_code == 304) {
+        state = DONE;
+    } else if (headers.find("Transfer-Encoding") != headers.end()) {
+        if (!response.is_chunked()) { //has transfer encoding but chunked isnt the final one
+            return false;
+        }
+        state = CHUNKED_BODY;
+    } else if (headers.find("Content-Length") != headers.end()) {
+        const std::string& length = headers["Content-Length"];
+        if (length.empty() || length.length() > 18 || length.find_first_not_of("0123456789") != std::string::npos) {
+            return false;
+        }
+        body_remaining = std::stoull(length);
+        response.body.reserve(body_remaining < (1 << 20) ? body_remaining : (1 << 20));
+        state = (body_remaining == 0) ? DONE : BODY;
+    } else { //no framing, body runs until the origin closes the connection
+        state = UNTIL_CLOSE;
+    }
+
+    return true;
+}
+
+//last chunk and trailer received: merge the trailer fields and give the decoded body
+//an explicit length, which is how it is sent on and cached
+bool ResponseParser::finish_chunked_body() {
+    for (const std::string& line : chunked.get_trailers()) {
+        size_t pos = line.find(':');
+        if (pos == std::string::npos) { //no colon in a header field, bad.
+            return false;
+        }
+
+        std::string key = line.substr(0, pos);
+        std::string value = line.substr(pos + 1);
+        HttpRequest::trim_field_value(value);
+
+        // A sender MUST NOT generate a trailer that contains a field necessary
+        // for message framing (e.g., Transfer-Encoding and Content-Length),
+        // routing (e.g., Host), request modifiers, authentication, response control
+        // data, or determining how to process the payload (e.g.,
+        // Content-Encoding, Content-Type, Content-Range, and Trailer).
+        if (key == "Transfer-Encoding" || key == "Content-Length" || key == "Host" || key == "Content-Encoding" ||
+            key == "Content-Type" || key == "Content-Range" || key == "Trailer") {
+            return false;
+        }
+
+        if (!add_field(key, value)) {
+            return false;
+        }
+    }
+
+    //Content-Length := length, remove "chunked" from Transfer-Encoding and the Trailer field
+    response.headers["Content-Length"] = std::to_string(response.body.length());
+    response.headers.erase("Transfer-Encoding");
+    response.headers.erase("Trailer");
+
+    state = DONE;
+    return true;
+}
@@ -0,0 +1,53 @@
+#ifndef RESPONSE_PARSER_H
+#define RESPONSE_PARSER_H
+
+#include "HttpResponse.h"
+#include "ChunkedDecoder.h"
+#include <string>
+#include <string_view>
+#include <cstdint>
+
+//push-style parser for a response from an origin server. Each segment read off the socket is
+//fed once; the parser keeps its place (status line, headers, body) between calls, so header
+//parsing happens once and a chunked body is decoded in a single pass no matter how many recvs
+//it takes. Counterpart of RequestParser.
+class ResponseParser {
+private:
+    enum State { STATUS_LINE, HEADERS, BODY, CHUNKED_BODY, UNTIL_CLOSE, DONE };
+
+    State state;
+    HttpResponse response;
+    bool stop_after_head;     //leave the body to the caller (streaming)
+    std::string partial_line; //start of a line whose LF hasn't arrived yet
+    size_t head_size;         //bytes of status line + headers consumed so far
+    uint64_t body_remaining;  //BODY: Content-Length bytes still expected
+    ChunkedDecoder chunked;
+
+    bool handle_line(std::string_view line);
+    bool parse_status_line(std::string_view line);
+    bool parse_header_line(std::string_view line);
+    bool add_field(const std::string& key, const std::string& value);
+    bool finish_headers();
+    bool finish_chunked_body();
+    void fail(); //malformed response: parse_error set, nothing more is consumed
+    size_t feed_lines(std::string_view data);
+
+public:
+    explicit ResponseParser(bool stop_after_head = false);
+
+    //consume the bytes of data that belong to this response and return how many were used.
+    //less than all of data only once the response (or, with stop_after_head, its head) is complete
+    size_t feed(std::string_view data);
+
+    //the origin closed the connection: completes a body delimited by the close
+    void finish();
+
+    bool head_done() const; //status line and header fields parsed
+    bool done() const;      //whole response parsed (or failed)
+    bool failed() const;
+    size_t get_head_size() const;
+
+    HttpResponse& get_response();
+};
+
+#endif
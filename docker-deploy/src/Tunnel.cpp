@@ -0,0 +1,249 @@
+#include "Tunnel.h"
+#include <sys/socket.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+//upper bound on bytes in flight per direction. 64KB is the default pipe capacity,
+//copy mode uses the same so both modes apply the same backpressure
+static const size_t MAX_IN_FLIGHT = 65536;
+
+bool Tunnel::splice_enabled = true;
+std::chrono::seconds Tunnel::idle_timeout(0);
+
+void Tunnel::set_splice_enabled(bool enabled) {
+    splice_enabled = enabled;
+}
+
+void Tunnel::set_idle_timeout(std::chrono::seconds timeout) {
+    idle_timeout = timeout;
+}
+
+Tunnel::Tunnel(int client_sockfd, int remote_sockfd) : client_sockfd(client_sockfd), remote_sockfd(remote_sockfd),
+                                                       use_splice(splice_enabled), client_flags(-1), upstream_buffer(nullptr), downstream_buffer(nullptr),
+                                                       bytes_client_to_remote(0), bytes_remote_to_client(0) {
+    init_direction(upstream, client_sockfd, remote_sockfd, nullptr);
+    init_direction(downstream, remote_sockfd, client_sockfd, nullptr);
+}
+
+Tunnel::~Tunnel() {
+    finish();
+}
+
+void Tunnel::init_direction(Direction& dir, int from, int to, char* buffer) {
+    dir.from = from;
+    dir.to = to;
+    dir.pipe_fds[0] = -1;
+    dir.pipe_fds[1] = -1;
+    dir.buffer = buffer;
+    dir.offset = 0;
+    dir.pending = 0;
+    dir.read_closed = false;
+    dir.write_shut = false;
+}
+
+void Tunnel::release_pipes(Direction& a, Direction& b) {
+    Direction* dirs[2] = {&a, &b};
+    for (Direction* dir : dirs) {
+        for (int i = 0; i < 2; i++) {
+            if (dir->pipe_fds[i] >= 0) {
+                close(dir->pipe_fds[i]);
+                dir->pipe_fds[i] = -1;
+            }
+        }
+    }
+}
+
+//pull whatever from has ready into the direction's pipe/buffer.
+//returns false on a fatal error (connection reset etc), EOF just marks read_closed.
+//splice_unsupported is set if the kernel refused splice before anything was moved
+bool Tunnel::read_side(Direction& dir, bool& splice_unsupported) {
+    while (!dir.read_closed && dir.pending < MAX_IN_FLIGHT) {
+        ssize_t res;
+        if (use_splice) {
+            res = splice(dir.from, nullptr, dir.pipe_fds[1], nullptr, MAX_IN_FLIGHT - dir.pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } else {
+            if (dir.offset > 0 && dir.offset + dir.pending == MAX_IN_FLIGHT) { //partial write left a gap at the front
+                memmove(dir.buffer, dir.buffer + dir.offset, dir.pending);
+                dir.offset = 0;
+            } else if (dir.pending == 0) {
+                dir.offset = 0;
+            }
+            size_t tail = dir.offset + dir.pending;
+            res = recv(dir.from, dir.buffer + tail, MAX_IN_FLIGHT - tail, 0);
+        }
+
+        if (res > 0) {
+            dir.pending += res;
+            if (dir.from == client_sockfd) {
+                bytes_client_to_remote += res;
+            } else {
+                bytes_remote_to_client += res;
+            }
+        } else if (res == 0) {
+            dir.read_closed = true;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return true;
+        } else if (use_splice && (errno == EINVAL || errno == ENOSYS) &&
+                   bytes_client_to_remote == 0 && bytes_remote_to_client == 0) {
+            splice_unsupported = true;
+            return true;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+//push pending bytes to the other side, partial writes just leave the rest pending.
+//returns false on a fatal error (peer went away)
+bool Tunnel::write_side(Direction& dir) {
+    while (dir.pending > 0) {
+        ssize_t res;
+        if (use_splice) {
+            res = splice(dir.pipe_fds[0], nullptr, dir.to, nullptr, dir.pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } else {
+            res = send(dir.to, dir.buffer + dir.offset, dir.pending, MSG_NOSIGNAL);
+        }
+
+        if (res > 0) {
+            dir.pending -= res;
+            dir.offset += res;
+        } else if (res < 0 && errno == EINTR) {
+            continue;
+        } else if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+//a pipe can fill up (one slot per socket buffer fragment) well before MAX_IN_FLIGHT bytes, and
+//splice then says EAGAIN while the socket is still readable. so in splice mode only wait for
+//readability once the pipe is empty, otherwise wait for the writer to make room
+bool Tunnel::wants_read(const Direction& dir) const {
+    if (dir.read_closed) {
+        return false;
+    }
+    return use_splice ? dir.pending == 0 : dir.pending < MAX_IN_FLIGHT;
+}
+
+//once from has sent EOF and everything it sent has been delivered, pass the EOF on
+void Tunnel::finish_if_drained(Direction& dir) {
+    if (dir.read_closed && dir.pending == 0 && !dir.write_shut) {
+        shutdown(dir.to, SHUT_WR);
+        dir.write_shut = true;
+    }
+}
+
+void Tunnel::use_buffers() {
+    use_splice = false;
+    upstream_buffer = new char[MAX_IN_FLIGHT];
+    downstream_buffer = new char[MAX_IN_FLIGHT];
+    init_direction(upstream, client_sockfd, remote_sockfd, upstream_buffer);
+    init_direction(downstream, remote_sockfd, client_sockfd, downstream_buffer);
+}
+
+void Tunnel::start() {
+    //both sockets are driven non-blocking for the lifetime of the tunnel, the client socket's
+    //flags (and with them its recv timeout semantics) are restored afterwards
+    client_flags = fcntl(client_sockfd, F_GETFL, 0);
+    int remote_flags = fcntl(remote_sockfd, F_GETFL, 0);
+    fcntl(client_sockfd, F_SETFL, client_flags | O_NONBLOCK);
+    fcntl(remote_sockfd, F_SETFL, remote_flags | O_NONBLOCK);
+
+    if (use_splice && (pipe2(upstream.pipe_fds, O_NONBLOCK) < 0 || pipe2(downstream.pipe_fds, O_NONBLOCK) < 0)) {
+        release_pipes(upstream, downstream);
+        use_splice = false;
+    }
+    if (!use_splice) {
+        use_buffers();
+    }
+    last_active = std::chrono::steady_clock::now();
+}
+
+bool Tunnel::step() {
+    Direction* dirs[2] = {&upstream, &downstream};
+    uint64_t moved = bytes_client_to_remote + bytes_remote_to_client;
+    while (true) {
+        bool ok = true;
+        bool splice_unsupported = false;
+        for (Direction* dir : dirs) {
+            ok = ok && read_side(*dir, splice_unsupported) && write_side(*dir);
+            finish_if_drained(*dir);
+        }
+        if (!ok || (upstream.write_shut && downstream.write_shut)) {
+            return false;
+        }
+        if (!splice_unsupported) {
+            if (bytes_client_to_remote + bytes_remote_to_client != moved) {
+                last_active = std::chrono::steady_clock::now();
+            }
+            return true;
+        }
+        //e.g. socket type without splice support, nothing moved yet
+        release_pipes(upstream, downstream);
+        use_buffers();
+    }
+}
+
+//readable if we still want to read from it, writable if we have bytes pending for it
+void Tunnel::wanted_events(short& client_events, short& remote_events) const {
+    client_events = 0;
+    remote_events = 0;
+    if (wants_read(upstream)) client_events |= POLLIN;
+    if (downstream.pending > 0) client_events |= POLLOUT;
+    if (wants_read(downstream)) remote_events |= POLLIN;
+    if (upstream.pending > 0) remote_events |= POLLOUT;
+}
+
+void Tunnel::finish() {
+    release_pipes(upstream, downstream);
+    delete[] upstream_buffer;
+    delete[] downstream_buffer;
+    upstream_buffer = nullptr;
+    downstream_buffer = nullptr;
+    if (client_flags >= 0) {
+        fcntl(client_sockfd, F_SETFL, client_flags);
+        client_flags = -1;
+    }
+}
+
+bool Tunnel::is_idle(std::chrono::steady_clock::time_point now) const {
+    return idle_timeout.count() > 0 && now - last_active >= idle_timeout;
+}
+
+void Tunnel::run() {
+    start();
+    while (step()) {
+        pollfd fds[2];
+        fds[0].fd = client_sockfd;
+        fds[1].fd = remote_sockfd;
+        wanted_events(fds[0].events, fds[1].events);
+
+        //an fd we want nothing from would otherwise keep reporting POLLHUP
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].events == 0) {
+                fds[i].fd = -1;
+            }
+        }
+
+        int timeout = -1;
+        if (idle_timeout.count() > 0) {
+            auto left = last_active + idle_timeout - std::chrono::steady_clock::now();
+            timeout = std::max<long>(0, std::chrono::duration_cast<std::chrono::milliseconds>(left).count() + 1);
+        }
+        int res = poll(fds, 2, timeout);
+        if ((res < 0 && errno != EINTR) || is_idle(std::chrono::steady_clock::now())) {
+            break;
+        }
+    }
+    finish();
+}
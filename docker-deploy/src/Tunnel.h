@@ -0,0 +1,78 @@
+#ifndef TUNNEL_H
+#define TUNNEL_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+//relays bytes both ways between an established CONNECT client and the remote server until both
+//sides have finished. Each direction is half-closed on its own: when one peer stops sending, the
+//other peer's write side is shut down once everything in flight was delivered, and the opposite
+//direction keeps running. By default data moves socket->pipe->socket inside the kernel with
+//splice(); if splice isn't available it falls back to copying through a user-space buffer.
+//run() relays on the calling thread; an event loop drives it with start/step/finish instead.
+//A tunnel that moves no bytes for the idle timeout (if one is set) is given up on
+class Tunnel {
+private:
+    //one direction of the tunnel (from -> to) and the bytes read but not yet written
+    struct Direction {
+        int from;
+        int to;
+        int pipe_fds[2];   //splice mode: bytes in flight live in this pipe
+        char* buffer;      //copy mode: bytes in flight live in buffer[offset, offset+pending)
+        size_t offset;
+        size_t pending;
+        bool read_closed;  //from sent EOF (or errored)
+        bool write_shut;   //we shut down to's write side
+    };
+
+    int client_sockfd;
+    int remote_sockfd;
+    bool use_splice;
+    int client_flags; //restored by finish()
+    Direction upstream;   //client -> remote
+    Direction downstream; //remote -> client
+    char* upstream_buffer;
+    char* downstream_buffer;
+    std::chrono::steady_clock::time_point last_active; //start(), or the last step() that moved bytes
+
+    static bool splice_enabled;
+    static std::chrono::seconds idle_timeout;
+
+    static void init_direction(Direction& dir, int from, int to, char* buffer);
+    bool read_side(Direction& dir, bool& splice_unsupported);
+    bool write_side(Direction& dir);
+    bool wants_read(const Direction& dir) const;
+    void finish_if_drained(Direction& dir);
+    void release_pipes(Direction& a, Direction& b);
+    void use_buffers(); //copy mode
+
+public:
+    Tunnel(int client_sockfd, int remote_sockfd);
+    ~Tunnel(); //finishes
+
+    Tunnel(const Tunnel&) = delete;
+    Tunnel& operator=(const Tunnel&) = delete;
+
+    //blocking, returns once both directions are closed, either side errors or it was idle for the
+    //idle timeout. neither socket is closed
+    void run();
+
+    //non-blocking use: start() makes both sockets non-blocking, then step() moves whatever can be
+    //moved each time a socket is ready for what wanted_events() asks (POLLIN/POLLOUT, 0 = nothing),
+    //until it returns false: both directions closed, or an error. finish() restores the client
+    //socket's flags and frees the pipes/buffers, neither socket is closed
+    void start();
+    bool step();
+    void wanted_events(short& client_events, short& remote_events) const;
+    void finish();
+    bool is_idle(std::chrono::steady_clock::time_point now) const; //nothing moved for the idle timeout
+
+    uint64_t bytes_client_to_remote;
+    uint64_t bytes_remote_to_client;
+
+    static void set_splice_enabled(bool enabled);
+    static void set_idle_timeout(std::chrono::seconds timeout); //0 = none (the default)
+};
+
+#endif
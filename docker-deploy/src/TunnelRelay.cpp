@@ -0,0 +1,233 @@
+#include "TunnelRelay.h"
+#include "Logger.h"
+#include "RequestHandler.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#define MAX_EPOLL_EVENTS 64
+#define IDLE_CHECK_MS 1000
+
+TunnelRelay::TunnelRelay(Callback on_close) : on_close(on_close), stopping(false), tunnel_count(0) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        throw std::runtime_error("Failed to create tunnel relay epoll instance");
+    }
+
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd < 0) {
+        close(epoll_fd);
+        throw std::runtime_error("Failed to create tunnel relay wakeup eventfd");
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = wakeup_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev) < 0) {
+        close(wakeup_fd);
+        close(epoll_fd);
+        throw std::runtime_error("Failed to register tunnel relay wakeup eventfd");
+    }
+}
+
+TunnelRelay::~TunnelRelay() {
+    stop();
+    close(wakeup_fd);
+    close(epoll_fd);
+}
+
+void TunnelRelay::start() {
+    relay_thread = std::thread(&TunnelRelay::run, this);
+}
+
+bool TunnelRelay::add(std::shared_ptr<ClientHandler> handler, int remote_sockfd, int request_id) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping) {
+            close(remote_sockfd);
+            Logger::get_instance().log_tunnel_closed(request_id);
+            return false;
+        }
+        //started by the relay thread, so tunnels and the epoll registrations need no locking
+        Relayed relayed;
+        relayed.handler = handler;
+        relayed.remote_sockfd = remote_sockfd;
+        relayed.request_id = request_id;
+        relayed.client_registered = false;
+        relayed.remote_registered = false;
+        added.push_back(std::move(relayed));
+        tunnel_count++;
+    }
+
+    uint64_t one = 1;
+    if (write(wakeup_fd, &one, sizeof(one)) < 0) {
+        //counter already non-zero, the relay wakes up anyway
+    }
+    return true;
+}
+
+void TunnelRelay::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    uint64_t one = 1;
+    if (write(wakeup_fd, &one, sizeof(one)) < 0) {
+        //counter already non-zero, the relay wakes up anyway
+    }
+    if (relay_thread.joinable()) {
+        relay_thread.join();
+    }
+
+    //whatever was added but never started, then every running tunnel
+    take_added();
+    std::vector<int> open_fds;
+    for (auto& relayed : tunnels) {
+        open_fds.push_back(relayed.first);
+    }
+    for (int fd : open_fds) {
+        end(fd);
+    }
+}
+
+size_t TunnelRelay::get_tunnels() const {
+    return tunnel_count.load(std::memory_order_relaxed);
+}
+
+//adds, changes or (events 0) removes fd's registration, see EventLoop::set_interest
+bool TunnelRelay::set_interest(int fd, short poll_events, bool& registered) {
+    uint32_t events = 0;
+    if (poll_events & POLLIN) {
+        events |= EPOLLIN;
+    }
+    if (poll_events & POLLOUT) {
+        events |= EPOLLOUT;
+    }
+    if (events == 0) {
+        if (registered) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+            registered = false;
+        }
+        return true;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    int op = registered ? (int)EPOLL_CTL_MOD : (int)EPOLL_CTL_ADD;
+    if (epoll_ctl(epoll_fd, op, fd, &ev) < 0) {
+        return false;
+    }
+    registered = true;
+    return true;
+}
+
+//moves what can be moved either way, then waits for what the tunnel asks for. false once done or broken
+bool TunnelRelay::relay(Relayed& relayed) {
+    if (!relayed.tunnel->step()) {
+        return false;
+    }
+    short client_events;
+    short remote_events;
+    relayed.tunnel->wanted_events(client_events, remote_events);
+    return set_interest(relayed.handler->get_sockfd(), client_events, relayed.client_registered) &&
+           set_interest(relayed.remote_sockfd, remote_events, relayed.remote_registered);
+}
+
+void TunnelRelay::take_added() {
+    std::vector<Relayed> taken;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        taken.swap(added);
+    }
+    for (Relayed& relayed : taken) {
+        int client_sockfd = relayed.handler->get_sockfd();
+        relayed.tunnel = std::make_unique<Tunnel>(client_sockfd, relayed.remote_sockfd);
+        relayed.tunnel->start();
+        remotes[relayed.remote_sockfd] = client_sockfd;
+        Relayed& running = tunnels[client_sockfd] = std::move(relayed);
+        if (!relay(running)) {
+            end(client_sockfd);
+        }
+    }
+}
+
+void TunnelRelay::end(int client_sockfd) {
+    auto it = tunnels.find(client_sockfd);
+    if (it == tunnels.end()) {
+        return;
+    }
+    Relayed relayed = std::move(it->second);
+    tunnels.erase(it);
+    remotes.erase(relayed.remote_sockfd);
+    tunnel_count--;
+
+    if (relayed.client_registered) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_sockfd, nullptr);
+    }
+    if (relayed.remote_registered) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, relayed.remote_sockfd, nullptr);
+    }
+    relayed.tunnel->finish();
+    RequestHandler::end_tunnel(*relayed.tunnel, relayed.remote_sockfd, relayed.request_id);
+    on_close(relayed.handler);
+}
+
+void TunnelRelay::run() {
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    auto last_check = std::chrono::steady_clock::now();
+
+    while (true) {
+        int n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, IDLE_CHECK_MS);
+        if (n < 0 && errno != EINTR) {
+            Logger::get_instance().log_error(0, "epoll_wait failed, tunnel relay exiting.");
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) {
+                return;
+            }
+        }
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == wakeup_fd) {
+                uint64_t count;
+                while (read(wakeup_fd, &count, sizeof(count)) > 0) {}
+                take_added();
+                continue;
+            }
+
+            auto remote = remotes.find(fd);
+            int client_sockfd = remote != remotes.end() ? remote->second : fd;
+            auto it = tunnels.find(client_sockfd);
+            if (it == tunnels.end()) {
+                continue; //ended earlier in this batch
+            }
+            if (!relay(it->second)) {
+                end(client_sockfd);
+            }
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_check >= std::chrono::milliseconds(IDLE_CHECK_MS)) {
+            std::vector<int> idle;
+            for (auto& relayed : tunnels) {
+                if (relayed.second.tunnel->is_idle(now)) {
+                    idle.push_back(relayed.first);
+                }
+            }
+            for (int fd : idle) {
+                end(fd);
+            }
+            last_check = now;
+        }
+    }
+}
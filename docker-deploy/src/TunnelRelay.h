@@ -0,0 +1,70 @@
+#ifndef TUNNEL_RELAY_H
+#define TUNNEL_RELAY_H
+
+#include "ClientHandler.h"
+#include "Tunnel.h"
+#include <unordered_map>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+
+//threads mode: relays established CONNECT tunnels on one epoll thread, so a tunnel never holds a
+//pool worker for as long as the client keeps it open. A worker that set one up hands it over with
+//add(); both sockets then sit in the relay's epoll set (level-triggered, as Tunnel::wanted_events
+//asks) and Tunnel::step runs whenever either is ready. Tunnels that are done, broken or idle for
+//Tunnel's idle timeout are ended (RequestHandler::end_tunnel) and their client goes to on_close
+class TunnelRelay {
+public:
+    typedef std::function<void(std::shared_ptr<ClientHandler>)> Callback;
+
+private:
+    struct Relayed {
+        std::shared_ptr<ClientHandler> handler;
+        std::unique_ptr<Tunnel> tunnel; //started on the relay thread
+        int remote_sockfd;
+        int request_id;
+        bool client_registered;
+        bool remote_registered;
+    };
+
+    int epoll_fd;
+    int wakeup_fd; //eventfd: a tunnel was added, or stop
+    Callback on_close;
+
+    std::mutex mutex; //added and stopping
+    std::vector<Relayed> added; //handed over, not yet taken by the relay thread
+    bool stopping;
+
+    std::unordered_map<int, Relayed> tunnels; //by client fd, relay thread only
+    std::unordered_map<int, int> remotes;     //remote fd -> client fd, relay thread only
+    std::atomic<size_t> tunnel_count;
+    std::thread relay_thread;
+
+    void run();
+    void take_added();
+    bool relay(Relayed& relayed);
+    bool set_interest(int fd, short poll_events, bool& registered);
+    void end(int client_sockfd);
+
+public:
+    //throws std::runtime_error if the epoll instance can't be set up
+    explicit TunnelRelay(Callback on_close);
+    ~TunnelRelay(); //stops
+
+    TunnelRelay(const TunnelRelay&) = delete;
+    TunnelRelay& operator=(const TunnelRelay&) = delete;
+
+    void start();
+    //relay the tunnel from now on. false once stopping: the remote socket is closed then, the
+    //caller closes the client
+    bool add(std::shared_ptr<ClientHandler> handler, int remote_sockfd, int request_id);
+    //joins the relay thread and ends every tunnel. safe to call more than once
+    void stop();
+
+    size_t get_tunnels() const;
+};
+
+#endif
@@ -0,0 +1,125 @@
+#include "UpstreamPool.h"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+
+UpstreamPool& UpstreamPool::get_instance() {
+    static UpstreamPool instance;
+    return instance;
+}
+
+UpstreamPool::UpstreamPool() : max_idle_per_origin(8), idle_timeout(30), last_sweep(std::chrono::steady_clock::now()), hits(0), misses(0) {}
+
+UpstreamPool::~UpstreamPool() {
+    for (auto& origin : idle) {
+        for (auto& conn : origin.second) {
+            close(conn.sockfd);
+        }
+    }
+}
+
+void UpstreamPool::configure(size_t max_idle_per_origin, int idle_timeout_seconds) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    this->max_idle_per_origin = max_idle_per_origin;
+    this->idle_timeout = std::chrono::seconds(idle_timeout_seconds);
+}
+
+//an idle connection should have nothing to read. EOF means the origin closed it, data means
+//the origin sent something we can't attribute to a request; either way it can't be reused
+bool UpstreamPool::is_stale(int sockfd) {
+    char byte;
+    ssize_t res = recv(sockfd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return false;
+    }
+    return true;
+}
+
+//drop connections that have been idle longer than idle_timeout (oldest are at the front)
+void UpstreamPool::prune_expired(std::deque<IdleConnection>& conns, std::chrono::steady_clock::time_point now) {
+    while (!conns.empty() && now - conns.front().idle_since > idle_timeout) {
+        close(conns.front().sockfd);
+        conns.pop_front();
+    }
+}
+
+//origins that are never asked for again would otherwise keep their idle sockets forever,
+//so once per idle_timeout prune every origin
+void UpstreamPool::sweep_if_due(std::chrono::steady_clock::time_point now) {
+    if (now - last_sweep < idle_timeout) {
+        return;
+    }
+    last_sweep = now;
+
+    for (auto it = idle.begin(); it != idle.end();) {
+        prune_expired(it->second, now);
+        if (it->second.empty()) {
+            it = idle.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+int UpstreamPool::acquire(const std::string& origin) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    auto now = std::chrono::steady_clock::now();
+    sweep_if_due(now);
+
+    auto it = idle.find(origin);
+    if (it != idle.end()) {
+        std::deque<IdleConnection>& conns = it->second;
+        prune_expired(conns, now);
+
+        //most recently used first, it is the least likely to have been closed by the origin
+        while (!conns.empty()) {
+            int sockfd = conns.back().sockfd;
+            conns.pop_back();
+
+            if (!is_stale(sockfd)) {
+                hits++;
+                return sockfd;
+            }
+            close(sockfd);
+        }
+
+        idle.erase(it);
+    }
+
+    misses++;
+    return -1;
+}
+
+void UpstreamPool::record_miss() {
+    misses++;
+}
+
+void UpstreamPool::release(const std::string& origin, int sockfd) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+
+    if (max_idle_per_origin == 0) {
+        close(sockfd);
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    sweep_if_due(now);
+
+    std::deque<IdleConnection>& conns = idle[origin];
+    prune_expired(conns, now);
+
+    if (conns.size() >= max_idle_per_origin) { //origin full, keep the newer connection
+        close(conns.front().sockfd);
+        conns.pop_front();
+    }
+
+    conns.push_back(IdleConnection{sockfd, now});
+}
+
+uint64_t UpstreamPool::get_hits() const {
+    return hits.load();
+}
+
+uint64_t UpstreamPool::get_misses() const {
+    return misses.load();
+}
@@ -0,0 +1,55 @@
+#ifndef UPSTREAM_POOL_H
+#define UPSTREAM_POOL_H
+
+#include <unordered_map>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <chrono>
+#include <cstdint>
+
+//process-wide pool of idle persistent connections to origin servers, keyed by "host:port".
+//forward_request takes a connection from here before paying for a fresh TCP handshake and
+//gives it back once a complete, properly framed response has been read from it
+class UpstreamPool {
+private:
+    struct IdleConnection {
+        int sockfd;
+        std::chrono::steady_clock::time_point idle_since;
+    };
+
+    std::mutex pool_mutex;
+    std::unordered_map<std::string, std::deque<IdleConnection>> idle; //newest at the back
+    size_t max_idle_per_origin;
+    std::chrono::seconds idle_timeout;
+    std::chrono::steady_clock::time_point last_sweep; //last time every origin was pruned
+
+    std::atomic<uint64_t> hits;   //requests that reused a pooled connection
+    std::atomic<uint64_t> misses; //requests that had to open a new connection
+
+    UpstreamPool();
+    ~UpstreamPool();
+
+    void prune_expired(std::deque<IdleConnection>& conns, std::chrono::steady_clock::time_point now);
+    void sweep_if_due(std::chrono::steady_clock::time_point now);
+    static bool is_stale(int sockfd);
+
+public:
+    static UpstreamPool& get_instance();
+
+    //max_idle_per_origin = 0 disables pooling
+    void configure(size_t max_idle_per_origin, int idle_timeout_seconds);
+
+    //returns a live idle connection to origin, or -1 if none (counted as hit/miss)
+    int acquire(const std::string& origin);
+    //count a request that didn't try the pool (e.g. non-idempotent method) as a miss
+    void record_miss();
+    //hand a connection back for reuse; closes it instead if pooling is off or origin is full
+    void release(const std::string& origin, int sockfd);
+
+    uint64_t get_hits() const;
+    uint64_t get_misses() const;
+};
+
+#endif
@@ -0,0 +1,108 @@
+#include "WorkerPool.h"
+#include "Logger.h"
+#include <exception>
+
+WorkerPool::WorkerPool(size_t num_workers, size_t queue_capacity) : next_queue(0), pending(0), idle_workers(0), stopping(false) {
+    if (num_workers == 0) {
+        num_workers = 1;
+    }
+
+    for (size_t i = 0; i < num_workers; i++) {
+        queues.push_back(std::make_unique<BoundedQueue<Task>>(queue_capacity));
+    }
+
+    //create all queues before starting any worker since workers steal from every queue
+    for (size_t i = 0; i < num_workers; i++) {
+        workers.emplace_back(&WorkerPool::worker_loop, this, i);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    shutdown();
+}
+
+size_t WorkerPool::size() const {
+    return workers.size();
+}
+
+size_t WorkerPool::queued() const {
+    long count = pending.load();
+    return count > 0 ? (size_t)count : 0;
+}
+
+bool WorkerPool::submit(Task task) {
+    if (stopping) {
+        return false;
+    }
+
+    //start at the round-robin queue, fall over to the next ones if it is full
+    size_t start = next_queue.fetch_add(1, std::memory_order_relaxed);
+    bool pushed = false;
+    for (size_t i = 0; i < queues.size() && !pushed; i++) {
+        pushed = queues[(start + i) % queues.size()]->try_push(task);
+    }
+
+    if (!pushed) {
+        return false;
+    }
+
+    pending++;
+
+    //only pay for the mutex when a worker might be asleep. a worker increments idle_workers
+    //before re-checking pending under sleep_lock, so it either sees our task or gets notified
+    if (idle_workers > 0) {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        sleep_cv.notify_one();
+    }
+    return true;
+}
+
+//take from our own queue first, otherwise steal from the other workers' queues
+bool WorkerPool::try_take(size_t worker_index, Task& task) {
+    for (size_t i = 0; i < queues.size(); i++) {
+        if (queues[(worker_index + i) % queues.size()]->try_pop(task)) {
+            pending--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkerPool::worker_loop(size_t worker_index) {
+    Task task;
+
+    while (true) {
+        if (try_take(worker_index, task)) {
+            try {
+                task();
+            } catch (const std::exception& e) { //a task must never take its worker down with it
+                Logger::get_instance().log_error(0, std::string("Worker task threw: ") + e.what());
+            }
+            task = nullptr; //release captured state before possibly sleeping
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lk(sleep_lock);
+        idle_workers++;
+        sleep_cv.wait(lk, [&]{ return pending > 0 || stopping; });
+        idle_workers--;
+
+        if (stopping && pending <= 0) {
+            return; //drained, done
+        }
+    }
+}
+
+void WorkerPool::shutdown() {
+    {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        stopping = true;
+        sleep_cv.notify_all();
+    }
+
+    for (auto& worker : workers) {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+}
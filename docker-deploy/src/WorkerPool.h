@@ -0,0 +1,54 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include "BoundedQueue.h"
+#include <vector>
+#include <thread>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+//fixed-size pool of worker threads. Each worker has its own bounded lock-free queue; submit()
+//spreads tasks round-robin over the queues and a worker that runs out of its own work steals
+//from the others, so one long-running task doesn't strand everything queued behind it.
+//Idle workers sleep on a condition variable that is only touched when someone is sleeping.
+class WorkerPool {
+public:
+    typedef std::function<void()> Task;
+
+private:
+    std::vector<std::unique_ptr<BoundedQueue<Task>>> queues; //one per worker
+    std::vector<std::thread> workers;
+
+    std::atomic<size_t> next_queue; //round-robin cursor for submit()
+    std::atomic<long> pending;      //tasks queued but not yet taken by a worker (can dip below 0 briefly
+                                    //when a task is taken before submit() counts it)
+    std::atomic<int> idle_workers;
+    std::atomic<bool> stopping;
+
+    std::mutex sleep_lock;
+    std::condition_variable sleep_cv;
+
+    bool try_take(size_t worker_index, Task& task);
+    void worker_loop(size_t worker_index);
+
+public:
+    WorkerPool(size_t num_workers, size_t queue_capacity);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    //returns false if every worker queue is full or the pool is shutting down
+    bool submit(Task task);
+
+    //finish every queued task, then join all workers. called by destructor
+    void shutdown();
+
+    size_t size() const;
+    size_t queued() const;
+};
+
+#endif
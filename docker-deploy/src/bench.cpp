@@ -0,0 +1,448 @@
+#include "CoarseClock.h"
+#include "Metrics.h"
+#include "CacheManager.h"
+#include "HttpRequest.h"
+#include "RequestHandler.h"
+#include "RequestParser.h"
+#include "ResponseParser.h"
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <memory>
+#include <cassert>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <sys/socket.h>
+#include <unistd.h>
+
+//microbenchmarks for the proxy's hot paths, run with `make bench`.
+//each case prints the time per operation for the old and new way of doing the same work
+
+typedef std::chrono::steady_clock Clock;
+
+//every allocation in the process goes through here, so a case can report allocations per operation
+static std::atomic<size_t> allocations(0);
+
+void* operator new(size_t size) {
+    allocations++;
+    void* p = malloc(size);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+//runs fn iterations times and returns microseconds per iteration
+static double time_per_op(int iterations, const std::function<void()>& fn) {
+    auto start = Clock::now();
+    for (int i = 0; i < iterations; i++) {
+        fn();
+    }
+    std::chrono::duration<double, std::micro> elapsed = Clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+static void report(const std::string& name, double before_us, double after_us) {
+    std::cout << std::left << std::setw(44) << name
+              << std::right << std::fixed << std::setprecision(1)
+              << std::setw(10) << before_us << " us"
+              << std::setw(10) << after_us << " us"
+              << std::setw(8) << before_us / after_us << "x" << std::endl;
+}
+
+//split a request into recv-sized fragments, like a slow client or a lossy link delivers it
+static std::vector<std::string_view> fragment(const std::string& wire, size_t fragment_size) {
+    std::vector<std::string_view> fragments;
+    for (size_t pos = 0; pos < wire.length(); pos += fragment_size) {
+        fragments.push_back(std::string_view(wire).substr(pos, fragment_size));
+    }
+    return fragments;
+}
+
+//the old driver: append every recv to a buffer and parse it again from the start
+static void parse_by_reparsing(const std::vector<std::string_view>& fragments) {
+    std::string buffer;
+    for (std::string_view piece : fragments) {
+        buffer.append(piece.data(), piece.size());
+        HttpRequest request;
+        if (request.parse_request(buffer)) {
+            assert(request.client_error_code == 0);
+            return;
+        }
+    }
+    assert(false);
+}
+
+//the resumable parser: every byte is looked at once
+static void parse_incrementally(const std::vector<std::string_view>& fragments) {
+    RequestParser parser;
+    for (std::string_view piece : fragments) {
+        parser.feed(piece);
+        if (parser.done()) {
+            HttpRequest request = parser.take_request();
+            assert(request.client_error_code == 0);
+            return;
+        }
+    }
+    assert(false);
+}
+
+static void bench_request_parser() {
+    std::cout << "\nrequest parsing (reparse on every recv vs RequestParser)\n";
+
+    //large header section: 200 header fields, ~12KB
+    std::string big_head = "GET http://example.com/index.html HTTP/1.1\r\nHost: example.com\r\n";
+    for (int i = 0; i < 200; i++) {
+        big_head += "X-Header-" + std::to_string(i) + ": " + std::string(40, 'v') + "\r\n";
+    }
+    big_head += "\r\n";
+
+    //chunked upload: 256KB body in 1KB chunks
+    std::string chunked_post = "POST http://example.com/upload HTTP/1.1\r\nHost: example.com\r\nTransfer-Encoding: chunked\r\n\r\n";
+    for (int i = 0; i < 256; i++) {
+        chunked_post += "400\r\n" + std::string(1024, 'b') + "\r\n";
+    }
+    chunked_post += "0\r\n\r\n";
+
+    struct Case {
+        std::string name;
+        const std::string& wire;
+        size_t fragment_size;
+        int iterations;
+    };
+    std::vector<Case> cases = {
+        {"12KB header, one recv", big_head, big_head.length(), 2000},
+        {"12KB header, 64B fragments", big_head, 64, 20},
+        {"12KB header, 1KB fragments", big_head, 1024, 200},
+        {"256KB chunked body, 1460B fragments", chunked_post, 1460, 3},
+        {"256KB chunked body, 16KB fragments", chunked_post, 16384, 30},
+    };
+
+    for (const Case& c : cases) {
+        std::vector<std::string_view> fragments = fragment(c.wire, c.fragment_size);
+        double before = time_per_op(c.iterations, [&]() { parse_by_reparsing(fragments); });
+        double after = time_per_op(c.iterations * 10, [&]() { parse_incrementally(fragments); });
+        report(c.name, before, after);
+    }
+}
+
+//the old forward_request loop: parse the whole accumulated response again after every recv
+static void parse_response_by_reparsing(const std::vector<std::string_view>& fragments) {
+    std::string buffer;
+    for (std::string_view piece : fragments) {
+        buffer.append(piece.data(), piece.size());
+        ResponseParser parser; //a fresh parse over everything received so far
+        parser.feed(buffer);
+        if (parser.done()) {
+            assert(!parser.failed());
+            return;
+        }
+    }
+    assert(false);
+}
+
+static void parse_response_incrementally(const std::vector<std::string_view>& fragments) {
+    ResponseParser parser;
+    for (std::string_view piece : fragments) {
+        parser.feed(piece);
+        if (parser.done()) {
+            assert(!parser.failed());
+            return;
+        }
+    }
+    assert(false);
+}
+
+static void bench_response_parser() {
+    std::cout << "\nresponse parsing (reparse on every recv vs ResponseParser)\n";
+
+    //1MB chunked response in 4KB chunks, read 8KB at a time like forward_request does
+    std::string chunked_response = "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\nTransfer-Encoding: chunked\r\n\r\n";
+    for (int i = 0; i < 256; i++) {
+        chunked_response += "1000\r\n" + std::string(4096, 'r') + "\r\n";
+    }
+    chunked_response += "0\r\n\r\n";
+
+    std::string length_response = "HTTP/1.1 200 OK\r\nContent-Length: 1048576\r\n\r\n" + std::string(1048576, 'r');
+
+    std::vector<std::string_view> chunked_fragments = fragment(chunked_response, 8192);
+    double before = time_per_op(2, [&]() { parse_response_by_reparsing(chunked_fragments); });
+    double after = time_per_op(100, [&]() { parse_response_incrementally(chunked_fragments); });
+    report("1MB chunked response, 8KB recvs", before, after);
+
+    std::vector<std::string_view> length_fragments = fragment(length_response, 8192);
+    before = time_per_op(2, [&]() { parse_response_by_reparsing(length_fragments); });
+    after = time_per_op(100, [&]() { parse_response_incrementally(length_fragments); });
+    report("1MB Content-Length response, 8KB recvs", before, after);
+}
+
+//threads hammering one cache with lookups of popular urls and the odd store. returns
+//microseconds of wall time per operation over all threads
+static double cache_ops(size_t num_shards, int num_threads, int ops_per_thread) {
+    const int num_urls = 1024;
+    CacheManager cache(64 * 1024 * 1024, num_shards, 64 * 1024);
+
+    std::string raw = "HTTP/1.1 200 OK\r\nCache-Control: max-age=3600\r\nContent-Length: 5\r\n\r\nhello";
+    std::shared_ptr<HttpResponse> response = std::make_shared<HttpResponse>();
+    response->parse_response(raw);
+
+    std::vector<std::string> urls;
+    for (int i = 0; i < num_urls; i++) {
+        urls.push_back("http://example.com/page/" + std::to_string(i));
+        cache.store_response(0, urls.back(), response);
+    }
+
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t]() {
+            unsigned int seed = t * 7919 + 1;
+            for (int i = 0; i < ops_per_thread; i++) {
+                seed = seed * 1103515245 + 12345;
+                const std::string& url = urls[(seed >> 8) % num_urls];
+                if (i % 10 == 0) {
+                    cache.store_response(t, url, response);
+                } else {
+                    assert(cache.get_cached_response(t, url) != nullptr);
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    std::chrono::duration<double, std::micro> elapsed = Clock::now() - start;
+    return elapsed.count() / ((double)num_threads * ops_per_thread);
+}
+
+static void bench_cache_contention() {
+    int num_threads = std::max(8u, std::thread::hardware_concurrency());
+    std::cout << "\ncache contention (" << num_threads << " threads, 90% hits / 10% stores, 1 shard vs 16 shards)\n";
+
+    Logger::get_instance().set_enabled(false); //log calls still build their strings, but nothing is written
+    double before = cache_ops(1, num_threads, 200000);
+    double after = cache_ops(16, num_threads, 200000);
+    Logger::get_instance().set_enabled(true);
+    report("get/store, shared cache", before, after);
+}
+
+//hit ratio of a workload that mostly asks for a popular set of pages, with a crawler pass of
+//one-off urls every so often. The cache holds about a third of the popular set
+static double hit_ratio(const std::string& policy) {
+    std::string raw = "HTTP/1.1 200 OK\r\nCache-Control: max-age=3600\r\nContent-Length: 5\r\n\r\nhello";
+    std::shared_ptr<HttpResponse> response = std::make_shared<HttpResponse>();
+    response->parse_response(raw);
+    size_t entry = CacheManager::entry_size("http://example.com/page/000", *response);
+    CacheManager cache(1000 * entry, 4, 2 * entry, policy);
+
+    unsigned int seed = 42;
+    int hits = 0, lookups = 0, scanned = 0;
+    for (int i = 0; i < 300000; i++) {
+        seed = seed * 1103515245 + 12345;
+        std::string url;
+        if (i % 20000 < 4000) { //crawler pass
+            url = "http://example.com/crawl/" + std::to_string(scanned++);
+        } else { //skewed: low page numbers are much more popular
+            unsigned int r = (seed >> 8) % 3000;
+            url = "http://example.com/page/" + std::to_string(r * r / 3000);
+        }
+        lookups++;
+        if (cache.get_cached_response(0, url)) {
+            hits++;
+        } else {
+            cache.store_response(0, url, response);
+        }
+    }
+    return 100.0 * hits / lookups;
+}
+
+static void bench_eviction_policy() {
+    Logger::get_instance().set_enabled(false);
+    double lru = hit_ratio("lru");
+    double tinylfu = hit_ratio("tinylfu");
+    Logger::get_instance().set_enabled(true);
+    std::cout << "\ncache hit ratio (skewed lookups + crawler scans)\n"
+              << std::left << std::setw(44) << "lru vs tinylfu" << std::right << std::fixed << std::setprecision(1)
+              << std::setw(10) << lru << " %" << std::setw(11) << tinylfu << " %" << std::endl;
+}
+
+//cache hits sent to a client socket: looked up, then either serialized into one buffer (twice,
+//as the hit path used to) and sent, or sent straight from the entry's head and body with writev
+static void bench_cache_hit() {
+    std::cout << "\ncache hit, lookup + send to a socket (allocations per hit in brackets)\n";
+
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0) {
+        std::cout << "socketpair failed, skipped" << std::endl;
+        return;
+    }
+    std::thread client([&]() { //reads and drops everything, like a fast client
+        char buffer[65536];
+        while (read(sockets[1], buffer, sizeof(buffer)) > 0) {
+        }
+    });
+
+    Logger::get_instance().set_enabled(false);
+    for (size_t body_size : {512, 16 * 1024, 256 * 1024}) {
+        CacheManager cache(64 * 1024 * 1024, 16, 1024 * 1024);
+        std::string raw = "HTTP/1.1 200 OK\r\nCache-Control: max-age=3600\r\nContent-Type: text/html\r\nETag: \"abc\"\r\n"
+                          "Content-Length: " + std::to_string(body_size) + "\r\n\r\n" + std::string(body_size, 'x');
+        std::shared_ptr<HttpResponse> response = std::make_shared<HttpResponse>();
+        response->parse_response(raw);
+        std::string url = "http://example.com/hit";
+        cache.store_response(0, url, response);
+
+        int iterations = body_size > 64 * 1024 ? 2000 : 20000;
+        size_t allocations_before = allocations;
+        double before = time_per_op(iterations, [&]() {
+            std::shared_ptr<HttpResponse> cached = cache.get_cached_response(0, url);
+            RequestHandler::reliable_send(sockets[0], cached->serialize().c_str(), cached->serialize().length(), 0);
+        });
+        double before_allocations = (double)(allocations - allocations_before) / iterations;
+
+        allocations_before = allocations;
+        double after = time_per_op(iterations, [&]() {
+            std::shared_ptr<const std::string> head;
+            std::shared_ptr<HttpResponse> cached = cache.get_cached_response(0, url, nullptr, &head);
+            RequestHandler::send_response(sockets[0], *head, cached->body_bytes(), 0);
+        });
+        double after_allocations = (double)(allocations - allocations_before) / iterations;
+
+        std::ostringstream name;
+        name << std::fixed << std::setprecision(1) << (body_size < 1024 ? std::to_string(body_size) + "B" : std::to_string(body_size / 1024) + "KB")
+             << " body [" << before_allocations << " -> " << after_allocations << "]";
+        report(name.str(), before, after);
+    }
+    Logger::get_instance().set_enabled(true);
+
+    shutdown(sockets[0], SHUT_WR);
+    client.join();
+    close(sockets[0]);
+    close(sockets[1]);
+}
+
+//per-line cost of logging from many threads at once, terminal mirroring off in both cases
+static double log_lines(int num_threads, int lines_per_thread, bool requests = false) {
+    Logger& logger = Logger::get_instance();
+    std::vector<std::thread> threads;
+    auto start = Clock::now();
+    for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&logger, t, lines_per_thread, requests]() {
+            for (int i = 0; i < lines_per_thread; i++) {
+                if (requests) {
+                    logger.log_request(t, "GET", "http://www.example.com/index.html", "HTTP/1.1", "127.0.0.1");
+                } else {
+                    logger.log_cache_status(t, "in cache, valid");
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    logger.flush(); //async: everything is written, so the writer's work counts too
+    std::chrono::duration<double, std::micro> elapsed = Clock::now() - start;
+    return elapsed.count() / ((double)num_threads * lines_per_thread);
+}
+
+static void bench_logger() {
+    int num_threads = std::max(8u, std::thread::hardware_concurrency());
+    std::cout << "\nlogger (" << num_threads << " threads, mutex + write per line vs lock-free ring + batched writes)\n";
+
+    Logger& logger = Logger::get_instance();
+    logger.configure(false, 0, true, false);
+    double before = log_lines(num_threads, 20000);
+    logger.configure(true, 65536, true, false);
+    double after = log_lines(num_threads, 20000);
+    report("log line", before, after);
+
+    //both async, one thread logging request lines (with their timestamp): text vs binary records
+    logger.configure(true, 65536, true, false);
+    double text = log_lines(1, 200000, true);
+    logger.configure(true, 65536, true, false, true);
+    double binary = log_lines(1, 200000, true);
+    logger.configure(false, 0, true, true);
+    report("request line, text vs binary", text, binary);
+}
+
+static void bench_clock() {
+    std::cout << "\nclock (system clock + strftime per call vs CoarseClock ticking every 1ms)\n";
+    CoarseClock& coarse = CoarseClock::get_instance();
+    volatile size_t sink = 0;
+
+    double before = time_per_op(1000000, [&]() { sink = sink + (size_t)std::time(nullptr); });
+    coarse.start(std::chrono::milliseconds(1));
+    double after = time_per_op(1000000, [&]() { sink = sink + (size_t)coarse.now(); });
+    report("current time, seconds", before, after);
+
+    coarse.stop();
+    before = time_per_op(1000000, [&]() { sink = sink + coarse.log_date().length; }); //not running: time + gmtime_r + strftime
+    coarse.start(std::chrono::milliseconds(1));
+    after = time_per_op(1000000, [&]() { sink = sink + coarse.log_date().length; });
+    coarse.stop();
+    report("log date string", before, after);
+}
+
+//microseconds per 1000 updates (a counter add and a histogram record) per thread, all threads at once
+static double metric_updates(int num_threads, const std::function<void(uint64_t)>& update) {
+    const int batches = 2000;
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&update]() {
+            for (uint64_t i = 0; i < batches * 1000; i++) {
+                update(i);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    std::chrono::duration<double, std::micro> elapsed = Clock::now() - start;
+    return elapsed.count() / batches;
+}
+
+static void bench_metrics() {
+    int num_threads = std::max(8u, std::thread::hardware_concurrency());
+    std::cout << "\nmetrics (" << num_threads << " threads, shared atomic counters vs per-thread Metrics blocks)\n";
+    std::atomic<uint64_t> shared_count(0), shared_sum(0);
+    std::vector<std::atomic<uint64_t>> shared_buckets(Metrics::BUCKETS);
+    double before = metric_updates(num_threads, [&](uint64_t i) {
+        shared_count.fetch_add(1, std::memory_order_relaxed);
+        shared_buckets[Metrics::bucket_index(i & 1023)].fetch_add(1, std::memory_order_relaxed);
+        shared_sum.fetch_add(i & 1023, std::memory_order_relaxed);
+    });
+    double after = metric_updates(num_threads, [](uint64_t i) {
+        Metrics::add(METRIC_REQUESTS);
+        Metrics::record(METRIC_REQUEST_LATENCY, i & 1023);
+    });
+    report("1000 counter + histogram updates", before, after);
+}
+
+int main() {
+    std::cout << std::left << std::setw(44) << "case" << std::right << std::setw(13) << "before" << std::setw(13) << "after" << std::setw(9) << "speedup" << std::endl;
+    bench_request_parser();
+    bench_response_parser();
+    bench_cache_contention();
+    bench_eviction_policy();
+    bench_cache_hit();
+    bench_logger();
+    bench_clock();
+    bench_metrics();
+    return 0;
+}
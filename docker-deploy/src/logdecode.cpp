@@ -0,0 +1,64 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <ctime>
+#include "LogRecord.h"
+
+//turns a binary log (--log-format=binary) back into proxy.log text:
+//  ./logdecode /var/log/erss/proxy.log > proxy.txt
+//reads the file in blocks so a large log needn't fit in memory
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " BINARY_LOG\n";
+        return 1;
+    }
+    std::ifstream file(argv[1], std::ios::binary);
+    if (!file) {
+        std::cerr << "Failed to open " << argv[1] << "\n";
+        return 1;
+    }
+
+    LogFileHeader header;
+    if (!file.read((char*)&header, sizeof(header)) || !LogRecord::check_file_header(header)) {
+        std::cerr << argv[1] << " is not a binary proxy log\n";
+        return 1;
+    }
+
+    std::string buffer;
+    std::vector<char> block(1024 * 1024);
+    size_t records = 0;
+    LogRecord record;
+    LogStringTable strings; //the file's interned fields, filled in as it is read
+    while (true) {
+        file.read(block.data(), block.size());
+        size_t got = file.gcount();
+        if (got == 0) {
+            break;
+        }
+        buffer.append(block.data(), got);
+
+        size_t offset = 0;
+        std::string out;
+        while (size_t length = LogRecord::decode(buffer.data() + offset, buffer.length() - offset, record, &strings)) {
+            offset += length;
+            if (record.event == LOG_STRINGS_RESET) {
+                continue;
+            }
+            time_t wall_time = (time_t)((header.wall_time_ns + (record.monotonic_ns - header.monotonic_ns)) / 1000000000);
+            out.append(record.to_text(wall_time)).push_back('\n');
+            records++;
+        }
+        std::cout << out;
+        buffer.erase(0, offset);
+        if (buffer.length() > 2 * block.size() + 16 * 1024 * 1024) { //longer than any record: not a record
+            break;
+        }
+    }
+
+    if (!buffer.empty()) { //the proxy was killed mid-write, or the file is damaged from here on
+        std::cerr << "warning: " << buffer.length() << " bytes after record " << records << " could not be decoded\n";
+        return 1;
+    }
+    return 0;
+}
@@ -1,16 +1,55 @@
 #include <iostream>
 #include <exception>
+#include <csignal>
+#include <thread>
+#include <pthread.h>
 #include "ProxyServer.h"
+#include "ProxyConfig.h"
 
-#define PROXY_SERVER_PORT 80
+int main(int argc, char* argv[]) {
+    ProxyConfig config; //defaults to port 80, threads mode
 
-int main() {
     try {
-        ProxyServer proxy(PROXY_SERVER_PORT);
-        proxy.start(); //blocking call
+        config = ProxyConfig::from_args(argc, argv);
+    } catch (const std::exception& e) {
+        std::cout << e.what() << std::endl;
+        ProxyConfig::print_usage(argv[0]);
+        return 1;
+    }
+
+    //a peer that disappears mid-send should fail that send with EPIPE, not kill the proxy
+    //(splice() into a socket has no MSG_NOSIGNAL equivalent)
+    signal(SIGPIPE, SIG_IGN);
+
+    //SIGTERM/SIGINT shut down gracefully: blocked here (and so in every thread started later) and
+    //taken by a thread that stops the server, so start() returns and ~ProxyServer cleans up
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+
+    try {
+        ProxyServer proxy(config);
+        std::thread signal_thread([&]() {
+            int sig = 0;
+            sigwait(&stop_signals, &sig);
+            proxy.stop();
+        });
+
+        try {
+            proxy.start(); //blocking call
+        } catch (...) {
+            pthread_kill(signal_thread.native_handle(), SIGTERM); //wake the signal thread so it can be joined
+            signal_thread.join();
+            throw;
+        }
+        pthread_kill(signal_thread.native_handle(), SIGTERM);
+        signal_thread.join();
+        std::cout << "Proxy server stopped, shutting down..." << std::endl;
     } catch (const std::exception& e) { //catch all errors
         std::cout << "Exception caught: " << e.what() << std::endl << "Shutting down proxy server..." << std::endl;
     }
 
     return 0;
-}
\ No newline at end of file
+}
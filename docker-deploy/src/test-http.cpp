@@ -1,10 +1,37 @@
 #include "HttpRequest.h"
 #include "HttpResponse.h"
+#include "CacheControl.h"
 #include "Logger.h"
+#include "CoarseClock.h"
+#include "LogRecord.h"
 #include "CacheManager.h"
 #include "RequestHandler.h"
+#include "DnsCache.h"
+#include "ChunkedDecoder.h"
+#include "RequestParser.h"
+#include "ResponseParser.h"
+#include "EvictionPolicy.h"
+#include "DiskCache.h"
+#include "Metrics.h"
+#include "AdminServer.h"
+#include "RequestTrace.h"
+#include "WorkerPool.h"
+#include "ConnectionPoller.h"
+#include "ProxyServer.h"
 #include <cassert>
+#include <cstring>
+#include <iterator>
 #include <iostream>
+#include <fstream>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstdlib>
 
 void test_http_request_parsing() {
     std::string raw_request =
@@ -62,7 +89,7 @@ void test_logger() {
     int request_id = 1;
 
     // Simulate a normal request logging
-    logger.log_request(request_id, "GET /index.html HTTP/1.1", "127.0.0.1");
+    logger.log_request(request_id, "GET", "/index.html", "HTTP/1.1", "127.0.0.1");
 
     logger.log_cache_status(request_id, "not in cache");
 
@@ -71,22 +98,1273 @@ void test_logger() {
 
     // Simulate a normal response log
     logger.log_response(request_id, "HTTP/1.1 200 OK");
+
+    //async: lines from many threads all reach the file once flushed
+    auto count_lines = [&](const std::string& marker) {
+        std::ifstream file(logger.get_path());
+        std::string line;
+        int count = 0;
+        while (std::getline(file, line)) {
+            count += line.find(marker) != std::string::npos;
+        }
+        return count;
+    };
+    logger.configure(true, 64, true, false);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&logger, t]() {
+            for (int i = 0; i < 500; i++) {
+                logger.log_note(t, "async logger test line " + std::to_string(i));
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    logger.flush();
+    assert(count_lines("async logger test line") == 2000);
+
+    //drop when full: a tiny ring can't keep up with a burst, whatever fits is still written
+    logger.configure(true, 2, false, false);
+    for (int i = 0; i < 10000; i++) {
+        logger.log_note(1, "async logger drop line");
+    }
+    logger.flush();
+    assert(logger.get_dropped() > 0 && count_lines("async logger drop line") == 10000 - (int)logger.get_dropped());
+
+    //binary: records decode back to the text lines
+    std::string wire;
+    LogRecord::encode(wire, LOG_FORWARD_REQUEST, 7, 123, {"GET", "http://a.example/", "HTTP/1.1", "a.example"});
+    LogRecord::encode(wire, LOG_TUNNEL_CLOSED, 8, 124, {});
+    LogRecord record;
+    size_t length = LogRecord::decode(wire.data(), wire.length(), record);
+    assert(length > 0 && record.to_text(0) == "7: Requesting \"GET http://a.example/ HTTP/1.1\" from a.example");
+    assert(LogRecord::decode(wire.data() + length, wire.length() - length, record) == wire.length() - length);
+    assert(record.event == LOG_TUNNEL_CLOSED && record.to_text(0) == "8: Tunnel closed");
+    assert(LogRecord::decode(wire.data(), length - 1, record) == 0); //cut short
+    int64_t expires = 784111777;
+    wire.clear();
+    LogRecord::encode(wire, LOG_CACHE_EXPIRY, 9, 125, {"cached, expires at ", LogRecord::time_field(expires)});
+    assert(LogRecord::decode(wire.data(), wire.length(), record) == wire.length());
+    assert(record.to_text(0) == "9: cached, expires at Sun Nov 06 08:49:37 1994");
+
+    //interned: a field seen before is written as a reference, which only decodes with the table
+    LogStringTable writer_strings;
+    std::string raw;
+    std::string interned;
+    LogRecord::encode(raw, LOG_RECEIVED_RESPONSE, 10, 126, {"HTTP/1.1 200 OK", "c.example"});
+    writer_strings.intern(raw, interned);
+    size_t first_length = interned.length();
+    writer_strings.intern(raw, interned);
+    assert(first_length == raw.length() && interned.length() - first_length < raw.length());
+    LogStringTable reader_strings;
+    assert(LogRecord::decode(interned.data(), interned.length(), record, &reader_strings) == first_length);
+    assert(LogRecord::decode(interned.data() + first_length, interned.length() - first_length, record) == 0);
+    assert(LogRecord::decode(interned.data() + first_length, interned.length() - first_length, record, &reader_strings) > 0);
+    assert(record.to_text(0) == "10: Received \"HTTP/1.1 200 OK\" from c.example");
+
+    logger.configure(true, 1024, true, false, true);
+    logger.log_request(3, "GET", "http://b.example/", "HTTP/1.1", "10.0.0.1");
+    logger.log_forward_request(3, "GET", "http://b.example/", "HTTP/1.1", "b.example");
+    logger.log_error(3, "binary ", "error");
+    logger.flush();
+    std::ifstream file(logger.get_path(), std::ios::binary);
+    std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    LogFileHeader file_header;
+    assert(contents.length() > sizeof(file_header));
+    memcpy(&file_header, contents.data(), sizeof(file_header));
+    assert(LogRecord::check_file_header(file_header));
+    std::vector<std::string> lines;
+    LogStringTable file_strings;
+    for (size_t offset = sizeof(file_header); offset < contents.length(); offset += length) {
+        length = LogRecord::decode(contents.data() + offset, contents.length() - offset, record, &file_strings);
+        assert(length > 0);
+        lines.push_back(record.to_text(0));
+    }
+    assert(lines.size() == 3 && lines[0].rfind("3: \"GET http://b.example/ HTTP/1.1\" from 10.0.0.1 @ ", 0) == 0);
+    assert(lines[1] == "3: Requesting \"GET http://b.example/ HTTP/1.1\" from b.example" && lines[2] == "3: ERROR binary error");
+    logger.configure(false, 0, true, false);
     std::cout << "✅ Logger Test Passed! (Check logs in /var/log/erss/proxy.log)" << std::endl;
 }
 
+void test_coarse_clock() {
+    CoarseClock& clock = CoarseClock::get_instance();
+
+    //not started: straight from the system clock
+    assert(!clock.is_running());
+    time_t before = std::time(nullptr);
+    time_t now = clock.now();
+    assert(now >= before && now <= std::time(nullptr));
+    assert(CacheControl::parse_http_date(CoarseClock::format_http_date(784111777).str()) == 784111777);
+    assert(CoarseClock::format_log_date(784111777).str() == "Sun Nov 06 08:49:37 1994");
+
+    //started: values come from the ticker, at most a tick (plus scheduling) behind
+    clock.start(std::chrono::milliseconds(1));
+    int64_t first = clock.monotonic_ns();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    assert(clock.monotonic_ns() > first);
+    std::atomic<bool> torn(false);
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; t++) {
+        readers.emplace_back([&clock, &torn]() {
+            for (int i = 0; i < 20000; i++) {
+                CoarseClock::Date date = clock.http_date();
+                time_t parsed = CacheControl::parse_http_date(date.str());
+                if (parsed == -1 || std::abs(parsed - std::time(nullptr)) > 2 || clock.log_date().length != 24) {
+                    torn = true;
+                }
+            }
+        });
+    }
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    assert(!torn);
+    assert(std::abs(clock.now() - std::time(nullptr)) <= 1);
+    clock.stop();
+    assert(!clock.is_running());
+    std::cout << "✅ CoarseClock Test Passed!" << std::endl;
+}
+
+void test_cache_control() {
+    auto parse = [](const std::string& header_fields) {
+        HttpResponse response;
+        std::string raw = "HTTP/1.1 200 OK\r\n" + header_fields + "Content-Length: 0\r\n\r\n";
+        response.parse_response(raw);
+        return response;
+    };
+
+    //directives are parsed once, case-insensitively, quoted values and unknown directives are fine
+    HttpResponse response = parse("cache-control: Public, MAX-AGE=\"60\", no-cache=\"Set-Cookie, X\", stale-while-revalidate=30\r\n"
+                                  "Cache-Control-Extra: no-store\r\nETag: \"v1\"\r\n");
+    const CacheControl& cc = response.cache_control;
+    assert(cc.max_age == 60 && cc.stale_while_revalidate == 30 && cc.stale_if_error == -1);
+    assert(cc.no_cache && !cc.no_store && !cc.is_private && cc.has_etag && !cc.has_last_modified);
+    assert(cc.freshness_lifetime(0) == 0); //no-cache: revalidate every time
+    assert(response.is_cacheable());
+
+    assert(!parse("Cache-Control: private, max-age=60\r\n").is_cacheable());
+    assert(!parse("Cache-Control: no-store\r\n").is_cacheable());
+    assert(parse("Cache-Control: max-age=abc\r\n").cache_control.max_age == 0); //invalid means stale
+
+    //s-maxage beats max-age beats Expires - Date, minus the age the response already has
+    time_t now = CacheControl::parse_http_date("Sun, 06 Nov 1994 08:49:37 GMT");
+    assert(now == 784111777);
+    assert(CacheControl::parse_http_date("Sunday, 06-Nov-94 08:49:37 GMT") == now);
+    assert(CacheControl::parse_http_date("Sun Nov  6 08:49:37 1994") == now);
+    assert(CacheControl::parse_http_date("yesterday") == -1);
+    assert(parse("Cache-Control: max-age=60, s-maxage=10\r\n").cache_control.expiry_time(now) == now + 10);
+    assert(parse("Cache-Control: max-age=60\r\nAge: 15\r\n").cache_control.expiry_time(now) == now + 45);
+    assert(parse("Date: Sun, 06 Nov 1994 08:49:37 GMT\r\nExpires: Sun, 06 Nov 1994 09:49:37 GMT\r\n").cache_control.expiry_time(now) == now + 3600);
+    assert(parse("Date: Sun, 06 Nov 1994 08:48:37 GMT\r\nCache-Control: max-age=120\r\n").cache_control.expiry_time(now) == now + 60);
+    assert(parse("Expires: 0\r\n").cache_control.expiry_time(now) == now);
+    assert(parse("Pragma: no-cache\r\n").cache_control.no_cache);
+    assert(!parse("Pragma: no-cache\r\nCache-Control: max-age=5\r\n").cache_control.no_cache);
+    assert(parse("Last-Modified: Sun, 06 Nov 1994 08:49:37 GMT\r\n").cache_control.expiry_time(now) == now + 86400);
+
+    //must-revalidate: nothing is served once stale, neither while refreshing nor for a failed fetch
+    CacheManager cache(1024 * 1024, 4);
+    cache.set_stale_if_error_grace(std::chrono::seconds(60));
+    std::shared_ptr<HttpResponse> strict = std::make_shared<HttpResponse>(parse("Cache-Control: max-age=0, must-revalidate, stale-if-error=60\r\n"));
+    cache.store_response(1, "http://cc.example/a", strict);
+    assert(!cache.get_stale_response(1, "http://cc.example/a"));
+    std::cout << "✅ Cache Control Test Passed!" << std::endl;
+}
+
+void test_metrics() {
+    //buckets: exact below 16, then 16 per power of two, each value within 1/16
+    assert(Metrics::bucket_index(0) == 0 && Metrics::bucket_index(1) == 0 && Metrics::bucket_index(16) == 15 && Metrics::bucket_index(17) == 16);
+    for (uint64_t value : {17ULL, 100ULL, 1000ULL, 123456ULL, 1ULL << 30, (1ULL << 36) - 1}) {
+        size_t index = Metrics::bucket_index(value);
+        assert(Metrics::bucket_lowest(index) <= value && value <= Metrics::bucket_highest(index));
+        assert(Metrics::bucket_highest(index) - Metrics::bucket_lowest(index) <= value / 16);
+    }
+    assert(Metrics::bucket_index(1ULL << 40) == Metrics::BUCKETS - 1);
+    for (int exponent = 4; exponent <= 30; exponent++) { //le bounds are whole buckets
+        assert(Metrics::bucket_highest(Metrics::bucket_index(1ULL << exponent)) == 1ULL << exponent);
+    }
+    Metrics::Histogram edge = {};
+    edge.buckets[Metrics::bucket_index(128)]++;
+    assert(edge.count_at_most(128) == 1 && edge.count_at_most(64) == 0);
+
+    //threads count into blocks of their own, a scrape adds them up, exited threads' counts stay
+    Metrics::Snapshot before = Metrics::collect();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([]() {
+            for (int i = 0; i < 1000; i++) {
+                Metrics::add(METRIC_CACHE_HITS);
+                Metrics::add(METRIC_CLIENT_BYTES_OUT, 10);
+                Metrics::record(METRIC_UPSTREAM_TTFB, i < 990 ? 100 : 50000);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    Metrics::Snapshot after = Metrics::collect();
+    assert(after.counters[METRIC_CACHE_HITS] - before.counters[METRIC_CACHE_HITS] == 4000);
+    assert(after.counters[METRIC_CLIENT_BYTES_OUT] - before.counters[METRIC_CLIENT_BYTES_OUT] == 40000);
+    const Metrics::Histogram& ttfb = after.histograms[METRIC_UPSTREAM_TTFB];
+    assert(ttfb.count - before.histograms[METRIC_UPSTREAM_TTFB].count == 4000);
+    if (before.histograms[METRIC_UPSTREAM_TTFB].count == 0) {
+        assert(ttfb.sum == 4 * (990 * 100 + 10 * 50000));
+        assert(ttfb.quantile(0.5) >= 100 && ttfb.quantile(0.5) < 107);
+        assert(ttfb.quantile(0.999) >= 50000 && ttfb.quantile(0.999) < 53125);
+        assert(ttfb.count_at_most(128) == 3960);
+    }
+
+    std::string text = Metrics::to_prometheus(after);
+    assert(text.find("# TYPE proxy_cache_hits_total counter\nproxy_cache_hits_total " +
+                     std::to_string(after.counters[METRIC_CACHE_HITS]) + "\n") != std::string::npos);
+    assert(text.find("# TYPE proxy_upstream_ttfb_seconds histogram\n") != std::string::npos);
+    assert(text.find("proxy_upstream_ttfb_seconds_bucket{le=\"0.000128\"} ") != std::string::npos);
+    assert(text.find("proxy_upstream_ttfb_seconds_bucket{le=\"+Inf\"} " + std::to_string(ttfb.count) + "\n") != std::string::npos);
+    assert(text.find("proxy_request_duration_seconds_quantile{quantile=\"0.99\"} ") != std::string::npos);
+
+    //admin port: scrape over a real connection
+    AdminServer admin(0, []() { return std::string("extra_gauge 1\n"); });
+    admin.start();
+    auto fetch = [&admin](const std::string& request) {
+        int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(admin.get_port());
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        assert(connect(sockfd, (sockaddr*)&address, sizeof(address)) == 0);
+        send(sockfd, request.data(), request.length(), 0);
+        std::string response;
+        char buffer[4096];
+        int bytes_read;
+        while ((bytes_read = recv(sockfd, buffer, sizeof(buffer), 0)) > 0) {
+            response.append(buffer, bytes_read);
+        }
+        close(sockfd);
+        return response;
+    };
+    std::string scrape = fetch("GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    assert(scrape.compare(0, 15, "HTTP/1.1 200 OK") == 0);
+    assert(scrape.find("proxy_cache_hits_total ") != std::string::npos);
+    assert(scrape.find("\r\n\r\n") + 4 + std::stoul(scrape.substr(scrape.find("Content-Length: ") + 16)) == scrape.length());
+    assert(scrape.substr(scrape.length() - 14) == "extra_gauge 1\n");
+    assert(fetch("GET / HTTP/1.1\r\n\r\n").compare(0, 22, "HTTP/1.1 404 Not Found") == 0);
+    admin.stop();
+    std::cout << "✅ Metrics Test Passed!" << std::endl;
+}
+
+void test_request_trace() {
+    //spans and totals; past MAX_SPANS only the totals grow
+    RequestTrace trace(42, "GET http://trace.example/\"q\"");
+    auto t0 = std::chrono::steady_clock::now();
+    trace.add_span(TRACE_DNS, t0, t0 + std::chrono::microseconds(300));
+    trace.add_span(TRACE_CONNECT, t0 + std::chrono::microseconds(300), t0 + std::chrono::microseconds(1000));
+    for (int i = 0; i < RequestTrace::MAX_SPANS; i++) {
+        trace.add_span(TRACE_CLIENT_WRITE, t0, t0 + std::chrono::microseconds(10));
+    }
+    assert(trace.get_span_count() == RequestTrace::MAX_SPANS);
+    assert(trace.phase_total_us(TRACE_CONNECT) == 700);
+    assert(trace.phase_total_us(TRACE_CLIENT_WRITE) == 10 * RequestTrace::MAX_SPANS);
+    {
+        TraceSpan span(&trace, TRACE_ORIGIN_TTFB);
+    }
+    TraceSpan untraced(nullptr, TRACE_ORIGIN_TTFB); //no trace: nothing to do
+    untraced.end();
+
+    trace.finish();
+    std::string json = trace.to_json();
+    assert(json.find("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":42,\"args\":{\"name\":\"request 42\"}},\n") == 0);
+    assert(json.find("\"name\":\"GET http://trace.example/\\\"q\\\"\",\"cat\":\"request\",\"ph\":\"X\"") != std::string::npos);
+    assert(json.find("\"dns_us\":300,\"connect_us\":700,") != std::string::npos);
+    assert(json.find("\"client_write_count\":64") != std::string::npos);
+    assert(json.find("{\"name\":\"connect\",\"cat\":\"phase\",\"ph\":\"X\",\"ts\":") != std::string::npos);
+    assert(json.find(",\"dur\":700,\"pid\":1,\"tid\":42},\n") != std::string::npos);
+    assert(json.substr(json.length() - 2) == ",\n");
+
+    //tail sampling: only requests over the threshold are written
+    std::string path = "/tmp/test-trace-" + std::to_string(getpid()) + ".json";
+    unlink(path.c_str());
+    TraceLog& traces = TraceLog::get_instance();
+    traces.configure(path, 5);
+    assert(traces.is_enabled());
+    RequestTrace fast(1, "GET http://fast.example/");
+    assert(!traces.submit(fast));
+    RequestTrace slow(2, "GET http://slow.example/");
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    assert(traces.submit(slow) && slow.duration_us() >= 5000);
+    RequestTrace tunnel(3, "CONNECT tunnel.example:443");
+    tunnel.exclude();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    assert(!traces.submit(tunnel));
+    traces.stop(); //the writer writes what is queued first
+    assert(!traces.is_enabled());
+    assert(traces.get_written() >= 1 && traces.get_dropped() == 0);
+
+    std::ifstream file(path);
+    std::string written((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    assert(written.compare(0, 2, "[\n") == 0);
+    assert(written.find("slow.example") != std::string::npos);
+    assert(written.find("fast.example") == std::string::npos && written.find("tunnel.example") == std::string::npos);
+    //reopening appends to the open array instead of starting a second one
+    traces.configure(path, 5);
+    traces.configure(path, 0);
+    std::ifstream reopened(path);
+    std::string again((std::istreambuf_iterator<char>(reopened)), std::istreambuf_iterator<char>());
+    assert(again == written);
+    unlink(path.c_str());
+    std::cout << "✅ RequestTrace Test Passed!" << std::endl;
+}
+
 void test_cache_manager() {
-    CacheManager cache(5);
+    CacheManager cache(64 * 1024, 4, 16 * 1024);
     std::shared_ptr<HttpResponse> response = std::make_shared<HttpResponse>("HTTP/1.1 200 OK");
-    response->parse_response("HTTP/1.1 200 OK\r\nCache-Control: max-age=3600\r\n\r\n");
+    std::string raw_response = "HTTP/1.1 200 OK\r\nCache-Control: max-age=3600\r\n\r\n";
+    response->parse_response(raw_response);
     int test_request_id = 42;  // Use a sample request ID for testing
     cache.store_response(test_request_id, "http://example.com", response);
     assert(cache.is_in_cache("http://example.com"));
-    std::shared_ptr<HttpResponse> cached_response = cache.get_cached_response("http://example.com");
+    std::shared_ptr<HttpResponse> cached_response = cache.get_cached_response(test_request_id, "http://example.com");
     assert(cached_response != nullptr);
     assert(cached_response->get_status_line() == "HTTP/1.1 200 OK");
+
+    //a hit also hands out the entry's ready-to-send head, head + body is the whole response
+    std::shared_ptr<const std::string> head;
+    cached_response = cache.get_cached_response(test_request_id, "http://example.com", nullptr, &head);
+    assert(head && *head == cached_response->serialize_head());
+    assert(*head + cached_response->body == cached_response->serialize());
+
+    //storing the same url again replaces the entry, and its bytes
+    size_t one_entry = cache.get_bytes_used();
+    assert(one_entry == CacheManager::entry_size("http://example.com", *response));
+    cache.store_response(test_request_id, "http://example.com", response);
+    assert(cache.size() == 1 && cache.get_bytes_used() == one_entry);
+
+    //bigger than the per-object cap: not cached
+    std::shared_ptr<HttpResponse> big = std::make_shared<HttpResponse>(*response);
+    big->body = std::string(20 * 1024, 'b');
+    cache.store_response(test_request_id, "http://example.com/big", big);
+    assert(!cache.is_in_cache("http://example.com/big"));
+
+    //byte budget: many 4KB responses never take more than the capacity, the newest stays
+    std::shared_ptr<HttpResponse> medium = std::make_shared<HttpResponse>(*response);
+    medium->body = std::string(4096, 'm');
+    for (int i = 0; i < 100; i++) {
+        cache.store_response(test_request_id, "http://example.com/" + std::to_string(i), medium);
+    }
+    assert(cache.get_bytes_used() <= cache.get_capacity());
+    assert(cache.size() < 16);
+    assert(cache.is_in_cache("http://example.com/99"));
+
+    //shards are reduced so each one can hold a max size object
+    assert(CacheManager(64 * 1024, 16, 16 * 1024).get_shard_count() == 4);
     std::cout << "✅ CacheManager Test Passed!" << std::endl;
 }
 
+//a hot set looked up over and over, then a scan of one-off urls bigger than the cache
+static int hot_entries_after_scan(const std::string& policy) {
+    std::shared_ptr<HttpResponse> response = std::make_shared<HttpResponse>();
+    std::string raw = "HTTP/1.1 200 OK\r\nCache-Control: max-age=3600\r\nContent-Length: 4\r\n\r\nbody";
+    response->parse_response(raw);
+    size_t entry = CacheManager::entry_size("http://hot.example/0", *response);
+    CacheManager cache(20 * entry, 1, 2 * entry, policy); //room for ~20 entries
+
+    for (int round = 0; round < 5; round++) {
+        for (int i = 0; i < 10; i++) {
+            std::string url = "http://hot.example/" + std::to_string(i);
+            if (!cache.get_cached_response(1, url)) {
+                cache.store_response(1, url, response);
+            }
+        }
+    }
+    for (int i = 0; i < 200; i++) {
+        std::string url = "http://scan.example/" + std::to_string(i);
+        if (!cache.get_cached_response(1, url)) {
+            cache.store_response(1, url, response);
+        }
+    }
+    assert(cache.get_bytes_used() <= cache.get_capacity());
+
+    int hot = 0;
+    for (int i = 0; i < 10; i++) {
+        hot += cache.is_in_cache("http://hot.example/" + std::to_string(i)) ? 1 : 0;
+    }
+    return hot;
+}
+
+void test_cache_vary() {
+    CacheManager cache(1024 * 1024, 4);
+    cache.set_max_variants(3);
+    std::string url = "http://api.example/items";
+
+    auto variant = [](const std::string& encoding, const std::string& body) {
+        std::shared_ptr<HttpResponse> response = std::make_shared<HttpResponse>();
+        std::string raw = "HTTP/1.1 200 OK\r\nCache-Control: max-age=3600\r\nVary: Accept-Encoding\r\nContent-Length: " +
+                          std::to_string(body.length()) + "\r\n\r\n" + body;
+        response->parse_response(raw);
+        HttpRequest request;
+        if (!encoding.empty()) {
+            request.add_header("Accept-Encoding", encoding);
+        }
+        return std::make_pair(response, request);
+    };
+
+    auto gzip = variant("gzip, br", "zipped");
+    auto plain = variant("", "plain");
+    cache.store_response(1, url, gzip.first, &gzip.second);
+    cache.store_response(1, url, plain.first, &plain.second);
+    assert(cache.is_in_cache(url) && cache.size() == 2);
+
+    //same field values hit their own variant, whatever the name's case or the spacing
+    HttpRequest lookup;
+    lookup.add_header("accept-encoding", "gzip,br ");
+    std::shared_ptr<HttpResponse> hit = cache.get_cached_response(1, url, &lookup);
+    assert(hit && hit->get_body() == "zipped");
+    assert(cache.get_cached_response(1, url)->get_body() == "plain");
+    HttpRequest other;
+    other.add_header("Accept-Encoding", "identity");
+    assert(!cache.get_cached_response(1, url, &other));
+    assert(CacheManager::vary_fields(" Accept-Language,accept-encoding ,Accept-Language") ==
+           std::vector<std::string>({"accept-encoding", "accept-language"}));
+
+    //per url cap: the oldest variant goes
+    auto br = variant("br", "brotli");
+    auto deflate = variant("deflate", "deflated");
+    cache.store_response(1, url, br.first, &br.second);
+    cache.store_response(1, url, deflate.first, &deflate.second);
+    assert(cache.size() == 3);
+    assert(!cache.get_cached_response(1, url, &gzip.second));
+    assert(cache.get_cached_response(1, url, &deflate.second)->get_body() == "deflated");
+
+    //the origin stops varying: the variants are dropped for the plain response
+    std::shared_ptr<HttpResponse> single = std::make_shared<HttpResponse>();
+    std::string raw = "HTTP/1.1 200 OK\r\nCache-Control: max-age=3600\r\nContent-Length: 3\r\n\r\none";
+    single->parse_response(raw);
+    cache.store_response(1, url, single, &gzip.second);
+    assert(cache.size() == 1 && cache.get_cached_response(1, url, &deflate.second)->get_body() == "one");
+
+    //Vary: * can't be matched by any request
+    std::shared_ptr<HttpResponse> star = std::make_shared<HttpResponse>(*single);
+    star->headers["Vary"] = "*";
+    cache.store_response(1, "http://api.example/star", star);
+    assert(!cache.is_in_cache("http://api.example/star"));
+    std::cout << "✅ Cache Vary Test Passed!" << std::endl;
+}
+
+void test_eviction_policy() {
+    //lru: the scan flushes the hot set, tinylfu: the scanned urls aren't admitted over it
+    assert(hot_entries_after_scan("lru") == 0);
+    assert(hot_entries_after_scan("tinylfu") == 10);
+
+    CountMinSketch sketch(1024);
+    for (int i = 0; i < 5; i++) {
+        sketch.increment("a");
+    }
+    sketch.increment("b");
+    assert(sketch.estimate("a") == 5 && sketch.estimate("b") == 1 && sketch.estimate("c") == 0);
+
+    //policies pick victims on their own, but never more than needed
+    std::unique_ptr<EvictionPolicy> lru = EvictionPolicy::create("lru", 300);
+    lru->on_insert("x", 100);
+    lru->on_insert("y", 100);
+    lru->on_insert("z", 100);
+    lru->on_hit("x");
+    std::vector<std::string> victims;
+    lru->evict(350, 300, victims);
+    assert(victims.size() == 1 && victims[0] == "y");
+
+    bool threw = false;
+    try {
+        EvictionPolicy::create("random", 100);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+    std::cout << "✅ EvictionPolicy Test Passed!" << std::endl;
+}
+
+void test_cache_snapshot() {
+    char path_template[] = "/tmp/proxy-snapshot-XXXXXX";
+    int fd = mkstemp(path_template);
+    close(fd);
+    std::string path = path_template;
+
+    std::shared_ptr<HttpResponse> response = std::make_shared<HttpResponse>();
+    std::string raw = "HTTP/1.1 200 OK\r\nCache-Control: max-age=3600\r\nETag: \"v1\"\r\nContent-Length: 5\r\n\r\nhello";
+    response->parse_response(raw);
+
+    {
+        CacheManager cache(1024 * 1024, 4);
+        for (int i = 0; i < 20; i++) {
+            cache.store_response(1, "http://snap.example/" + std::to_string(i), response);
+        }
+        assert(cache.save_snapshot(path) == 20);
+    }
+
+    CacheManager restarted(1024 * 1024, 4);
+    //stored again before the loader gets to it: the newer copy stays
+    std::shared_ptr<HttpResponse> newer = std::make_shared<HttpResponse>(*response);
+    newer->body = "newer";
+    restarted.store_response(1, "http://snap.example/0", newer);
+
+    restarted.load_snapshot_async(path);
+    restarted.wait_for_snapshot();
+    assert(restarted.get_snapshot_loaded() == 19);
+    assert(restarted.size() == 20);
+    std::shared_ptr<HttpResponse> loaded = restarted.get_cached_response(1, "http://snap.example/7");
+    assert(loaded && loaded->get_body() == "hello" && loaded->get_header("ETag") == "\"v1\"");
+    assert(restarted.get_cached_response(1, "http://snap.example/0")->get_body() == "newer");
+
+    //a snapshot cut short keeps what was read, a missing one is a cold start
+    truncate(path.c_str(), 200);
+    CacheManager partial(1024 * 1024, 4);
+    partial.load_snapshot_async(path);
+    partial.wait_for_snapshot();
+    assert(partial.get_snapshot_loaded() < 20);
+    unlink(path.c_str());
+    partial.load_snapshot_async(path);
+    partial.wait_for_snapshot();
+    assert(partial.get_snapshot_loaded() == 0);
+
+    //a record claiming more bytes than the file has is not allocated, the rest is discarded
+    assert(restarted.save_snapshot(path) == 20);
+    int patch_fd = open(path.c_str(), O_WRONLY);
+    uint32_t huge = 0xfffffff0;
+    assert(pwrite(patch_fd, &huge, sizeof(huge), 28) == sizeof(huge)); //first record's data_length, after the 24 byte header
+    close(patch_fd);
+    CacheManager corrupt(1024 * 1024, 4);
+    corrupt.load_snapshot_async(path);
+    corrupt.wait_for_snapshot();
+    assert(corrupt.get_snapshot_loaded() == 0 && corrupt.size() == 0);
+    unlink(path.c_str());
+    std::cout << "✅ Cache Snapshot Test Passed!" << std::endl;
+}
+
+void test_cache_refresh() {
+    auto make_response = [](const std::string& cache_control, const std::string& expires, const std::string& body) {
+        std::shared_ptr<HttpResponse> response = std::make_shared<HttpResponse>();
+        std::string raw = "HTTP/1.1 200 OK\r\nCache-Control: " + cache_control + "\r\n" + (expires.empty() ? "" : "Expires: " + expires + "\r\n") +
+                          "Content-Length: " + std::to_string(body.length()) + "\r\n\r\n" + body;
+        response->parse_response(raw);
+        return response;
+    };
+    std::atomic<int> fetches(0);
+    CacheManager::Refresher refresher = [&](const HttpRequest&, std::shared_ptr<HttpResponse>) {
+        fetches++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100)); //a slow origin
+        return make_response("max-age=3600", "", "new");
+    };
+    auto wait_for_refreshes = [](CacheManager& cache, uint64_t count) {
+        for (int i = 0; i < 200 && cache.get_refreshes() < count; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return cache.get_refreshes() == count;
+    };
+    HttpRequest request;
+    request.add_header("Host", "swr.example");
+
+    //expired, but stale-while-revalidate: served stale right away, refetched once in the background
+    CacheManager cache(1024 * 1024, 4);
+    cache.start_refreshing(refresher, 2, std::chrono::seconds(0));
+    std::string url = "http://swr.example/a";
+    cache.store_response(1, url, make_response("max-age=0, stale-while-revalidate=60", "Thu Jan 01 00:00:00 2015", "old"));
+    for (int i = 0; i < 5; i++) {
+        std::shared_ptr<HttpResponse> stale = cache.get_cached_response(1, url, &request);
+        assert(stale && stale->get_body() == "old");
+    }
+    assert(!cache.get_cached_response(1, url)); //no request to refetch with: a plain miss
+    assert(wait_for_refreshes(cache, 1) && fetches == 1);
+    assert(cache.get_cached_response(1, url, &request)->get_body() == "new");
+    assert(cache.get_stale_served() == 5);
+
+    //past the stale window it is a miss again
+    cache.store_response(1, "http://swr.example/b", make_response("max-age=0", "Thu Jan 01 00:00:00 2015", "old"));
+    assert(!cache.get_cached_response(1, "http://swr.example/b", &request));
+
+    //refresh-ahead: a fresh entry hit twice within the window is refetched before it expires
+    CacheManager ahead(1024 * 1024, 4);
+    ahead.start_refreshing(refresher, 1, std::chrono::seconds(3 * 86400));
+    ahead.store_response(1, url, make_response("max-age=60", "", "old"));
+    assert(ahead.get_cached_response(1, url, &request)->get_body() == "old");
+    assert(ahead.get_cached_response(1, url, &request)->get_body() == "old");
+    assert(wait_for_refreshes(ahead, 1) && fetches == 2);
+    assert(ahead.get_cached_response(1, url, &request)->get_body() == "new");
+    ahead.stop_refreshing();
+
+    //stale-if-error: an expired copy stands in for a failed fetch within its own window or the grace window
+    CacheManager fallback(1024 * 1024, 4);
+    fallback.store_response(1, "http://sie.example/a", make_response("max-age=0, stale-if-error=60", "Thu Jan 01 00:00:00 2015", "old"));
+    fallback.store_response(1, "http://sie.example/b", make_response("max-age=0", "Thu Jan 01 00:00:00 2015", "old"));
+    assert(!fallback.get_cached_response(1, "http://sie.example/a"));
+    assert(fallback.get_stale_response(1, "http://sie.example/a")->get_body() == "old");
+    assert(!fallback.get_stale_response(1, "http://sie.example/b"));
+    fallback.set_stale_if_error_grace(std::chrono::seconds(60));
+    assert(fallback.get_stale_response(1, "http://sie.example/b"));
+    assert(!fallback.get_stale_response(1, "http://sie.example/none"));
+    assert(fallback.get_stale_if_error_served() == 2);
+    std::cout << "✅ Cache Refresh Test Passed!" << std::endl;
+}
+
+void test_miss_coalescing() {
+    CacheManager cache(1024 * 1024, 4);
+    cache.set_coalesce_timeout(std::chrono::milliseconds(2000));
+    std::shared_ptr<HttpResponse> response = std::make_shared<HttpResponse>();
+    std::string raw = "HTTP/1.1 200 OK\r\nCache-Control: max-age=3600\r\nContent-Length: 5\r\n\r\nhello";
+    response->parse_response(raw);
+
+    //the first miss fetches, the ones arriving meanwhile all get its response
+    std::string url = "http://coalesce.example/a";
+    std::shared_ptr<HttpResponse> unused;
+    assert(cache.begin_fetch(url, unused) == CacheManager::FETCH_LEADER);
+    std::vector<std::thread> waiters;
+    std::atomic<int> shared(0);
+    for (int i = 0; i < 9; i++) {
+        waiters.emplace_back([&]() {
+            std::shared_ptr<HttpResponse> result;
+            if (cache.begin_fetch(url, result) == CacheManager::FETCH_SHARED && result == response) {
+                shared++;
+            }
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    cache.finish_fetch(url, response);
+    for (auto& t : waiters) {
+        t.join();
+    }
+    assert(shared == 9 && cache.get_coalesced() == 9);
+
+    //stored by the fetcher in the meantime: served from the cache, no new fetch
+    cache.store_response(1, url, response);
+    std::shared_ptr<HttpResponse> result;
+    assert(cache.begin_fetch(url, result) == CacheManager::FETCH_SHARED && result == response);
+
+    //nothing to share: waiters fetch on their own
+    std::string other = "http://coalesce.example/b";
+    assert(cache.begin_fetch(other, unused) == CacheManager::FETCH_LEADER);
+    std::thread waiter([&]() { assert(cache.begin_fetch(other, result) == CacheManager::FETCH_ALONE); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    cache.finish_fetch(other, nullptr);
+    waiter.join();
+    assert(cache.begin_fetch(other, unused) == CacheManager::FETCH_LEADER); //the finished fetch is forgotten
+
+    //a stalled fetcher only holds the others up until the timeout
+    cache.set_coalesce_timeout(std::chrono::milliseconds(50));
+    assert(cache.begin_fetch(other, unused) == CacheManager::FETCH_ALONE);
+    assert(cache.get_coalesce_timeouts() == 1);
+    {
+        CoalescedFetch fetch(cache, other); //released without a response, e.g. the fetch threw
+        fetch.set_leader(true);
+    }
+    assert(cache.begin_fetch(other, unused) == CacheManager::FETCH_LEADER);
+    cache.finish_fetch(other, nullptr);
+
+    cache.set_coalesce_timeout(std::chrono::milliseconds(0));
+    assert(cache.begin_fetch("http://coalesce.example/c", unused) == CacheManager::FETCH_ALONE);
+    std::cout << "✅ Miss Coalescing Test Passed!" << std::endl;
+}
+
+void test_disk_cache() {
+    char dir_template[] = "/tmp/proxy-disk-cache-XXXXXX";
+    std::string dir = mkdtemp(dir_template);
+    time_t expiry = std::time(nullptr) + 3600;
+
+    std::shared_ptr<HttpResponse> response = std::make_shared<HttpResponse>();
+    std::string raw = "HTTP/1.1 200 OK\r\nCache-Control: max-age=3600\r\nContent-Length: 1000\r\n\r\n" + std::string(1000, 'd');
+    response->parse_response(raw);
+
+    {
+        DiskCache disk(dir, 1024 * 1024, 16 * 1024);
+        for (int i = 0; i < 50; i++) {
+            disk.store("http://disk.example/" + std::to_string(i), response, expiry);
+        }
+        disk.flush();
+        assert(disk.get_entry_count() == 50);
+        assert(disk.get_segment_count() > 1); //~50KB over 16KB segments
+
+        std::shared_ptr<HttpResponse> read;
+        time_t read_expiry = 0;
+        assert(disk.lookup("http://disk.example/7", read, read_expiry));
+        assert(read->get_body() == response->get_body() && read_expiry == expiry);
+        assert(read->get_header("Content-Length") == "1000");
+        assert(read->body.empty() && read->body_owner && read->body_bytes() == response->body); //served from the mapping
+        std::shared_ptr<HttpResponse> held = read;
+        assert(!disk.lookup("http://disk.example/none", read, read_expiry));
+        disk.remove("http://disk.example/8");
+        assert(!disk.contains("http://disk.example/8") && disk.get_entry_count() == 49);
+        disk.store("http://disk.example/8", response, expiry);
+
+        //overwriting leaves the old segments mostly dead, compaction drops them
+        for (int round = 0; round < 3; round++) {
+            for (int i = 0; i < 50; i++) {
+                disk.store("http://disk.example/" + std::to_string(i), response, expiry + round + 1);
+            }
+            disk.flush();
+        }
+        disk.compact();
+        assert(disk.get_entry_count() == 50);
+        assert(disk.get_bytes_used() < 2 * 50 * 1200);
+        assert(held->body_bytes() == response->body); //its segment is deleted, the mapping outlives it
+    }
+
+    {
+        //a restart reads the segments back, a byte budget drops the oldest ones
+        DiskCache disk(dir, 40 * 1024, 16 * 1024);
+        std::shared_ptr<HttpResponse> read;
+        time_t read_expiry = 0;
+        assert(disk.get_entry_count() == 50);
+        assert(disk.lookup("http://disk.example/49", read, read_expiry) && read->get_body() == response->get_body());
+
+        disk.store("http://disk.example/new", response, expiry);
+        disk.flush();
+        assert(disk.get_bytes_used() <= 40 * 1024 + 16 * 1024);
+        assert(disk.get_entry_count() < 50);
+        assert(disk.contains("http://disk.example/new"));
+    }
+
+    {
+        //memory cache with a disk tier: what doesn't fit in memory is found on disk
+        DiskCache disk(dir, 1024 * 1024, 16 * 1024);
+        size_t entry = CacheManager::entry_size("http://tier.example/0", *response);
+        CacheManager cache(4 * entry, 1, 2 * entry, "lru");
+        cache.set_disk_cache(&disk);
+        for (int i = 0; i < 10; i++) {
+            cache.store_response(1, "http://tier.example/" + std::to_string(i), response);
+        }
+        disk.flush();
+        assert(cache.size() <= 4);
+        std::shared_ptr<HttpResponse> first = cache.get_cached_response(1, "http://tier.example/0");
+        assert(first && first->get_body() == response->get_body());
+        assert(disk.get_hits() == 1);
+    }
+
+    system(("rm -rf " + dir).c_str());
+    std::cout << "✅ DiskCache Test Passed!" << std::endl;
+}
+
+void test_dns_cache() {
+    DnsCache& dns = DnsCache::get_instance();
+    dns.clear();
+    dns.configure(60, 60, 0);
+
+    //stub resolver: slow enough that concurrent lookups overlap, knows one name
+    std::atomic<int> calls(0);
+    dns.set_resolver([&](const std::string& host, const std::string& port, std::vector<ResolvedAddress>& out) {
+        calls++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        if (host != "origin.test") {
+            return EAI_NONAME;
+        }
+        ResolvedAddress address{};
+        sockaddr_in* v4 = (sockaddr_in*)&address.addr;
+        address.family = AF_INET;
+        address.socktype = SOCK_STREAM;
+        address.addr_len = sizeof(sockaddr_in);
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons(std::stoi(port));
+        inet_pton(AF_INET, "127.0.0.2", &v4->sin_addr);
+        out.push_back(address);
+        return 0;
+    });
+
+    //concurrent misses for the same name share one lookup
+    std::vector<std::thread> threads;
+    std::atomic<int> ok(0);
+    for (int i = 0; i < 8; i++) {
+        threads.emplace_back([&]() {
+            std::vector<ResolvedAddress> out;
+            if (dns.resolve("origin.test", "80", out) == 0 && out.size() == 1) {
+                ok++;
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    assert(ok == 8);
+    assert(calls == 1);
+
+    //positive and negative answers are served from cache
+    std::vector<ResolvedAddress> out;
+    assert(dns.resolve("origin.test", "80", out) == 0);
+    assert(dns.resolve("missing.test", "80", out) != 0);
+    assert(dns.resolve("missing.test", "80", out) != 0);
+    assert(calls == 2);
+
+    //different port is a different key
+    out.clear();
+    assert(dns.resolve("origin.test", "8080", out) == 0);
+    assert(ntohs(((sockaddr_in*)&out[0].addr)->sin_port) == 8080);
+    assert(calls == 3);
+
+    //hosts file entries win over the resolver
+    std::string hosts_path = "/tmp/proxy-test-hosts";
+    std::ofstream hosts(hosts_path);
+    hosts << "# comment\n10.1.2.3   static.test alias.test\n";
+    hosts.close();
+    assert(dns.load_hosts_file(hosts_path));
+    out.clear();
+    assert(dns.resolve("alias.test", "81", out) == 0);
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &((sockaddr_in*)&out[0].addr)->sin_addr, ip, sizeof(ip));
+    assert(std::string(ip) == "10.1.2.3");
+    assert(calls == 3);
+    std::remove(hosts_path.c_str());
+
+    dns.set_resolver(&DnsCache::system_resolve);
+    dns.clear();
+    std::cout << "✅ DnsCache Test Passed!" << std::endl;
+}
+
+void test_chunked_decoder() {
+    std::string wire = "4;ext=1\r\nWiki\r\n6\r\npedia \r\nE\r\nin \r\n\r\nchunks.\r\n0\r\nExpires: never\r\n\r\nNEXT";
+    std::string expected = "Wikipedia in \r\n\r\nchunks.";
+
+    //whole message at once: stops right before the bytes of the next message
+    ChunkedDecoder whole;
+    std::string out;
+    size_t consumed = whole.feed(wire.data(), wire.length(), &out);
+    assert(whole.done());
+    assert(out == expected);
+    assert(consumed == wire.length() - 4);
+
+    //one byte at a time, every split point has to resume correctly
+    ChunkedDecoder bytewise;
+    out.clear();
+    size_t pos = 0;
+    while (!bytewise.done()) {
+        pos += bytewise.feed(wire.data() + pos, 1, &out);
+    }
+    assert(out == expected);
+    assert(pos == consumed);
+    assert(bytewise.get_decoded_size() == expected.length());
+
+    //bad size line and missing CRLF after data
+    ChunkedDecoder bad_size;
+    bad_size.feed("zz\r\n", 4, nullptr);
+    assert(bad_size.failed());
+    ChunkedDecoder bad_crlf;
+    bad_crlf.feed("2\r\nabXY", 8, nullptr);
+    assert(bad_crlf.failed());
+
+    std::cout << "✅ ChunkedDecoder Test Passed!" << std::endl;
+}
+
+void test_request_parser() {
+    std::string wire =
+        "GET http://example.com/a HTTP/1.1\r\nHost: example.com\r\nAccept: text/html\r\nAccept: */*\r\n\r\n"
+        "POST http://example.com/b HTTP/1.1\r\nHost: example.com\r\nTransfer-Encoding: chunked\r\n\r\n"
+        "3\r\nabc\r\n2\r\nde\r\n0\r\nX-Checksum: 42\r\n\r\n"
+        "GET /c HTTP/1.1\r\nHost: example.com\r\nContent-Length: 4\r\n\r\nbody";
+
+    //byte at a time: requests come out in order, each exactly once
+    RequestParser parser;
+    std::vector<HttpRequest> requests;
+    for (char c : wire) {
+        std::string_view piece(&c, 1);
+        while (!piece.empty()) {
+            piece.remove_prefix(parser.feed(piece));
+            if (parser.done()) {
+                requests.push_back(parser.take_request());
+            }
+        }
+    }
+    assert(requests.size() == 3);
+    assert(requests[0].get_url() == "http://example.com/a");
+    assert(requests[0].get_header("Accept") == "text/html, */*");
+    assert(requests[1].get_body() == "abcde");
+    assert(requests[1].get_header("Content-Length") == "5");
+    assert(requests[1].get_header("X-Checksum") == "42");
+    assert(!requests[1].has_header("Transfer-Encoding"));
+    assert(requests[2].get_body() == "body");
+    for (const HttpRequest& request : requests) {
+        assert(request.client_error_code == 0);
+    }
+
+    //all at once: first request ends exactly where the second begins
+    RequestParser whole;
+    size_t consumed = whole.feed(wire);
+    assert(whole.done());
+    assert(wire.compare(consumed, 4, "POST") == 0);
+
+    //malformed request line and missing Host get a 400
+    RequestParser bad;
+    bad.feed("GET /x HTTP/1.0\r\nHost: a\r\n\r\n");
+    assert(bad.done() && bad.take_request().client_error_code == 400);
+    bad.feed("GET /x HTTP/1.1\r\n\r\n");
+    assert(bad.done() && bad.take_request().client_error_code == 400);
+
+    std::cout << "✅ RequestParser Test Passed!" << std::endl;
+}
+
+void test_response_parser() {
+    std::string wire = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nCache-Control: max-age=60\r\n\r\n"
+                       "5\r\nHello\r\n8\r\n, World!\r\n0\r\nX-Checksum: 1\r\n\r\n";
+
+    //one byte per segment, progress is reported as it goes
+    ResponseParser parser;
+    size_t consumed = 0;
+    for (size_t i = 0; i < wire.length(); i++) {
+        assert(!parser.done());
+        consumed += parser.feed(std::string_view(wire).substr(i, 1));
+        if (i + 1 < wire.find("5\r\n")) {
+            assert(!parser.head_done());
+        } else {
+            assert(parser.head_done());
+        }
+    }
+    assert(parser.done() && !parser.failed());
+    assert(consumed == wire.length());
+    HttpResponse& response = parser.get_response();
+    assert(response.status_code == 200);
+    assert(response.get_body() == "Hello, World!");
+    assert(response.get_header("Content-Length") == "13");
+    assert(response.get_header("X-Checksum") == "1");
+    assert(!response.is_chunked());
+
+    //no framing: body ends when the origin closes
+    ResponseParser until_close;
+    until_close.feed("HTTP/1.1 200 OK\r\n\r\nabc");
+    until_close.feed("def");
+    assert(!until_close.done());
+    until_close.finish();
+    assert(until_close.done() && until_close.get_response().get_body() == "abcdef");
+
+    //304 has no body even with a Content-Length, and the next bytes aren't consumed
+    ResponseParser not_modified;
+    std::string two = "HTTP/1.1 304 Not Modified\r\nContent-Length: 10\r\n\r\nHTTP/1.1 200 OK\r\n";
+    assert(not_modified.feed(two) == two.find("HTTP/1.1 200"));
+    assert(not_modified.done());
+
+    ResponseParser bad;
+    bad.feed("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n");
+    assert(bad.done() && bad.failed());
+
+    std::cout << "✅ ResponseParser Test Passed!" << std::endl;
+}
+
+void test_bounded_queue() {
+    BoundedQueue<int> small(3);
+    assert(small.capacity() == 4);
+    for (int i = 0; i < 4; i++) {
+        assert(small.try_push(i));
+    }
+    int value = 42;
+    assert(!small.try_push(value) && value == 42); //full, value left alone
+    assert(small.try_pop(value) && value == 0);
+    assert(small.try_push(value));
+
+    //producers and consumers at once: every item comes out exactly once
+    const int producers = 4, consumers = 4, per_producer = 50000;
+    BoundedQueue<int> queue(64);
+    std::vector<std::atomic<int>> seen(producers * per_producer);
+    std::atomic<int> popped(0);
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.emplace_back([&queue, p]() {
+            for (int i = 0; i < per_producer; i++) {
+                int item = p * per_producer + i;
+                while (!queue.try_push(item)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (int c = 0; c < consumers; c++) {
+        threads.emplace_back([&]() {
+            int item;
+            while (popped < producers * per_producer) {
+                if (queue.try_pop(item)) {
+                    seen[item]++;
+                    popped++;
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (const auto& count : seen) {
+        assert(count == 1);
+    }
+    assert(!queue.try_pop(value));
+    std::cout << "✅ BoundedQueue Test Passed!" << std::endl;
+}
+
+void test_worker_pool() {
+    //every task runs exactly once, queued ones are finished by shutdown
+    std::vector<std::atomic<int>> runs(10000);
+    {
+        WorkerPool pool(8, 2048);
+        for (size_t i = 0; i < runs.size(); i++) {
+            while (!pool.submit([&runs, i]() { runs[i]++; })) {
+                std::this_thread::yield();
+            }
+        }
+        pool.shutdown();
+    }
+    for (const auto& count : runs) {
+        assert(count == 1);
+    }
+
+    //one worker busy and its queue full: submit says no instead of blocking
+    std::atomic<bool> started(false), release(false);
+    std::atomic<int> done(0);
+    auto blocker = [&]() {
+        started = true;
+        while (!release) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        done++;
+    };
+    auto quick = [&done]() { done++; };
+    WorkerPool pool(1, 2);
+    assert(pool.submit(blocker));
+    while (!started) {
+        std::this_thread::yield();
+    }
+    assert(pool.submit(quick) && pool.submit(quick));
+    assert(pool.queued() == 2);
+    assert(!pool.submit(quick));
+
+    //shutdown while the worker is stuck in a task: new work is refused, queued work still runs
+    std::thread stopper([&pool]() { pool.shutdown(); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    assert(!pool.submit(quick));
+    release = true;
+    stopper.join();
+    assert(done == 3 && pool.queued() == 0);
+
+    //and with every worker asleep on an empty queue, shutdown wakes them up
+    WorkerPool idle(4, 4);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    idle.shutdown();
+    assert(!idle.submit(quick));
+    std::cout << "✅ WorkerPool Test Passed!" << std::endl;
+}
+
+void test_connection_poller() {
+    CacheManager cache(1024 * 1024);
+    std::atomic_int request_id(0);
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<int> ready;
+    std::vector<int> closed;
+    ConnectionPoller poller(std::chrono::seconds(1),
+        [&](std::shared_ptr<ClientHandler> handler) {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready.push_back(handler->get_sockfd());
+            cv.notify_all();
+        },
+        [&](std::shared_ptr<ClientHandler> handler) {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed.push_back(handler->get_sockfd());
+            cv.notify_all();
+        });
+    poller.start();
+
+    int busy[2], idle[2], left[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, busy) == 0 && socketpair(AF_UNIX, SOCK_STREAM, 0, idle) == 0 &&
+           socketpair(AF_UNIX, SOCK_STREAM, 0, left) == 0);
+    std::shared_ptr<ClientHandler> busy_handler = std::make_shared<ClientHandler>(busy[0], cache, request_id, "127.0.0.1");
+    assert(poller.park(busy_handler));
+    assert(poller.park(std::make_shared<ClientHandler>(idle[0], cache, request_id, "127.0.0.1")));
+    assert(poller.get_parked() == 2);
+
+    //a readable connection is handed out once per park. busy keeps sending (and being parked again)
+    //until idle, which never sends, is closed for being parked past the timeout
+    std::unique_lock<std::mutex> lock(mutex);
+    auto start = std::chrono::steady_clock::now();
+    while (closed.empty() && std::chrono::steady_clock::now() - start < std::chrono::seconds(4)) {
+        size_t handed_out = ready.size();
+        assert(write(busy[1], "x", 1) == 1);
+        assert(cv.wait_for(lock, std::chrono::seconds(2), [&]{ return ready.size() == handed_out + 1; }));
+        assert(ready.back() == busy[0]);
+        char byte;
+        assert(read(busy[0], &byte, 1) == 1);
+        lock.unlock();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        assert(poller.park(busy_handler));
+        lock.lock();
+    }
+    assert(closed.size() == 1 && closed[0] == idle[0] && ready.size() > 50);
+    lock.unlock();
+
+    //stop hands over whatever is still parked, and refuses more
+    poller.stop();
+    assert(closed.size() == 2 && closed[1] == busy[0] && poller.get_parked() == 0);
+    assert(!poller.park(std::make_shared<ClientHandler>(left[0], cache, request_id, "127.0.0.1")));
+    for (int fd : {busy[0], busy[1], idle[0], idle[1], left[0], left[1]}) {
+        close(fd);
+    }
+    std::cout << "✅ ConnectionPoller Test Passed!" << std::endl;
+}
+
+void test_client_read_request() {
+    CacheManager cache(1024 * 1024);
+    std::atomic_int request_id(0);
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+    ClientHandler handler(fds[0], cache, request_id, "127.0.0.1");
+
+    //nothing there yet, then half a request
+    assert(handler.read_request() == ClientHandler::READ_MORE);
+    //cached, so handling them goes nowhere
+    for (std::string url : {"http://a.test/1", "http://a.test/2"}) {
+        std::shared_ptr<HttpResponse> cached = std::make_shared<HttpResponse>("HTTP/1.1 200 OK");
+        std::string raw = "HTTP/1.1 200 OK\r\nCache-Control: max-age=3600\r\nContent-Length: 2\r\n\r\nok";
+        cached->parse_response(raw);
+        cache.store_response(0, url, cached);
+    }
+    std::string first = "GET http://a.test/1 HTTP/1.1\r\nHost: a.test\r\n\r\n";
+    std::string second = "GET http://a.test/2 HTTP/1.1\r\nHost: a.test\r\n\r\n";
+    assert(write(fds[1], first.data(), 10) == 10);
+    assert(handler.read_request() == ClientHandler::READ_MORE);
+
+    //the rest and a pipelined request in one go: one request at a time, the second one kept for
+    //after the first is handled
+    std::string rest = first.substr(10) + second;
+    assert(write(fds[1], rest.data(), rest.length()) == (ssize_t)rest.length());
+    char response[256];
+    int tunnel_remote;
+    int handled_id;
+    for (int i = 0; i < 2; i++) {
+        assert(handler.read_request() == ClientHandler::READ_REQUEST);
+        assert(handler.handle_pending(tunnel_remote, handled_id));
+        assert(tunnel_remote == -1 && handled_id == i);
+        ssize_t length = read(fds[1], response, sizeof(response));
+        assert(length > 0 && std::string(response, length).find("200 OK") != std::string::npos);
+    }
+    assert(handler.read_request() == ClientHandler::READ_MORE);
+
+    close(fds[1]);
+    assert(handler.read_request() == ClientHandler::READ_CLOSE);
+    close(fds[0]);
+    std::cout << "✅ ClientHandler read_request Test Passed!" << std::endl;
+}
+
+//reads from fd until what was read contains needle (or the receive timeout hits)
+static std::string read_until(int fd, const std::string& needle) {
+    std::string received;
+    char buffer[1024];
+    while (received.find(needle) == std::string::npos) {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n <= 0) {
+            break;
+        }
+        received.append(buffer, n);
+    }
+    return received;
+}
+
+void test_tunnels_free_workers() {
+    const int TUNNELS = 4;
+
+    //what the tunnels lead to: echoes whatever it gets until EOF
+    int echo_fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    assert(bind(echo_fd, (sockaddr*)&address, sizeof(address)) == 0 && listen(echo_fd, TUNNELS) == 0 &&
+           getsockname(echo_fd, (sockaddr*)&address, &length) == 0);
+    int echo_port = ntohs(address.sin_port);
+    std::vector<std::thread> echoes;
+    std::thread echo_acceptor([&]() {
+        for (int i = 0; i < TUNNELS; i++) {
+            int fd = accept(echo_fd, nullptr, nullptr);
+            if (fd < 0) {
+                return;
+            }
+            echoes.emplace_back([fd]() {
+                char buffer[256];
+                ssize_t n;
+                while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+                    send(fd, buffer, n, MSG_NOSIGNAL);
+                }
+                close(fd);
+            });
+        }
+    });
+
+    //fewer workers than tunnels
+    ProxyConfig config;
+    config.port = 0;
+    config.workers = 2;
+    config.max_connections = 64;
+    config.clock_tick_ms = 0;
+    config.refresh_workers = 0;
+    config.log_async = false;
+    ProxyServer server(config);
+    std::shared_ptr<HttpResponse> cached = std::make_shared<HttpResponse>("HTTP/1.1 200 OK");
+    std::string raw = "HTTP/1.1 200 OK\r\nCache-Control: max-age=3600\r\nContent-Length: 2\r\n\r\nok";
+    cached->parse_response(raw);
+    server.cache.store_response(0, "http://tunnel-test.example/", cached);
+    std::thread serving([&]() { server.start(); });
+
+    auto connect_proxy = [&]() {
+        sockaddr_in proxy;
+        memset(&proxy, 0, sizeof(proxy));
+        proxy.sin_family = AF_INET;
+        proxy.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        proxy.sin_port = htons(server.proxy_server_port);
+        for (int attempt = 0; attempt < 200; attempt++) { //start() may not be listening yet
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (connect(fd, (sockaddr*)&proxy, sizeof(proxy)) == 0) {
+                struct timeval tv = {5, 0};
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+                return fd;
+            }
+            close(fd);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        assert(false);
+        return -1;
+    };
+
+    //every tunnel stays open (and working) at once, none of them holding a worker
+    std::vector<int> tunnels;
+    std::string target = "127.0.0.1:" + std::to_string(echo_port);
+    for (int i = 0; i < TUNNELS; i++) {
+        int fd = connect_proxy();
+        std::string connect_request = "CONNECT " + target + " HTTP/1.1\r\nHost: " + target + "\r\n\r\n";
+        assert(send(fd, connect_request.data(), connect_request.length(), 0) == (ssize_t)connect_request.length());
+        assert(read_until(fd, "\r\n\r\n").find("200 Connection Established") != std::string::npos);
+        tunnels.push_back(fd);
+    }
+    for (int fd : tunnels) {
+        assert(send(fd, "ping", 4, 0) == 4);
+        assert(read_until(fd, "ping") == "ping");
+    }
+    assert(server.tunnel_relay->get_tunnels() == TUNNELS);
+
+    //and a plain request is still served
+    int client = connect_proxy();
+    std::string get = "GET http://tunnel-test.example/ HTTP/1.1\r\nHost: tunnel-test.example\r\n\r\n";
+    assert(send(client, get.data(), get.length(), 0) == (ssize_t)get.length());
+    std::string response = read_until(client, "\r\n\r\nok");
+    assert(response.find("200 OK") != std::string::npos && response.find("\r\n\r\nok") != std::string::npos);
+    close(client);
+
+    //closing the clients ends the tunnels
+    for (int fd : tunnels) {
+        close(fd);
+    }
+    for (int i = 0; i < 200 && server.tunnel_relay->get_tunnels() > 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    assert(server.tunnel_relay->get_tunnels() == 0);
+
+    server.stop();
+    serving.join();
+    echo_acceptor.join();
+    for (auto& echo : echoes) {
+        echo.join();
+    }
+    close(echo_fd);
+    std::cout << "✅ Tunnels Free Workers Test Passed!" << std::endl;
+}
+
 void test_request_handler_get() {
     CacheManager cache(5);
     RequestHandler handler(cache);
@@ -104,11 +1382,43 @@ void test_request_handler_get() {
     std::cout << "✅ RequestHandler GET Test Passed!" << std::endl;
 }
 
-int main() {
-    test_http_request_parsing();
-    test_http_response_parsing();
-    test_logger();
-    test_cache_manager();
-    test_request_handler_get();
+int main(int argc, char* argv[]) {
+    //run every test, or only the ones named on the command line
+    std::vector<std::pair<std::string, void (*)()>> tests = {
+        {"http_request_parsing", test_http_request_parsing},
+        {"http_response_parsing", test_http_response_parsing},
+        {"logger", test_logger},
+        {"coarse_clock", test_coarse_clock},
+        {"cache_control", test_cache_control},
+        {"metrics", test_metrics},
+        {"request_trace", test_request_trace},
+        {"cache_manager", test_cache_manager},
+        {"cache_vary", test_cache_vary},
+        {"eviction_policy", test_eviction_policy},
+        {"cache_snapshot", test_cache_snapshot},
+        {"cache_refresh", test_cache_refresh},
+        {"miss_coalescing", test_miss_coalescing},
+        {"disk_cache", test_disk_cache},
+        {"dns_cache", test_dns_cache},
+        {"chunked_decoder", test_chunked_decoder},
+        {"request_parser", test_request_parser},
+        {"response_parser", test_response_parser},
+        {"bounded_queue", test_bounded_queue},
+        {"worker_pool", test_worker_pool},
+        {"connection_poller", test_connection_poller},
+        {"client_read_request", test_client_read_request},
+        {"tunnels_free_workers", test_tunnels_free_workers},
+        {"request_handler_get", test_request_handler_get},
+    };
+
+    for (const auto& test : tests) {
+        bool selected = (argc == 1);
+        for (int i = 1; i < argc; i++) {
+            selected = selected || test.first == argv[i];
+        }
+        if (selected) {
+            test.second();
+        }
+    }
     return 0;
 }